@@ -0,0 +1,562 @@
+/**
+ * @file load_gen.cc
+ * @brief 基于协程的压测客户端, 用于TcpServer/HttpServer的回环基准测试
+ * @details 每个连接一个发送协程和一个接收协程, 发送协程维持最多depth个未完成请求(流水线)。
+ *          闭环(-r 0): 收到响应即补发, 延迟从实际发送时刻算起;
+ *          开环(-r 总请求速率): 请求按固定间隔排期, 延迟从排期时刻算起, 服务端变慢时排队时间
+ *          也计入延迟(不产生coordinated omission)。延迟记录在对数分桶的直方图中, 相对误差小于1%。
+ *          -S 在同一进程中用单独的IOManager启动内置服务端, 不依赖外部程序
+ */
+#include "../src/tcp_server.h"
+#include "../src/http/http_server.h"
+#include "../src/http/http_parser.h"
+#include "../src/iomanager.h"
+#include "../src/mutex.h"
+#include "../src/log.h"
+#include "../src/util.h"
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <strings.h>
+#include <math.h>
+#include <atomic>
+#include <deque>
+#include <iomanip>
+#include <sstream>
+
+static sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+static std::string s_target = "127.0.0.1:8020";
+static std::string s_mode = "echo";
+static std::string s_path = "/";
+static std::string s_builtin;
+static int s_connections = 64;
+static int s_depth = 1;
+static uint64_t s_rate = 0;
+static int s_duration = 10;
+static int s_warmup = 1;
+static int s_threads = 2;
+static int s_serverThreads = 2;
+static int s_size = 64;
+static uint64_t s_timeout = 2000;
+
+static uint64_t NowNS() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief 对数分桶的延迟直方图(纳秒)
+ * @details 小于128的值每个值一个桶; 之后每个2的幂区间分为64个桶, 相对误差小于1/64
+ */
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKETS = 64;
+    static const int MAX_SHIFT = 40;
+
+    LatencyHistogram()
+        :m_counts(2 * SUB_BUCKETS + MAX_SHIFT * SUB_BUCKETS, 0) {
+    }
+
+    void record(uint64_t v) {
+        ++m_counts[Index(v)];
+        ++m_total;
+        m_sum += v;
+        m_max = std::max(m_max, v);
+        m_min = std::min(m_min, v);
+    }
+
+    void merge(const LatencyHistogram& o) {
+        for(size_t i = 0; i < m_counts.size(); ++i) {
+            m_counts[i] += o.m_counts[i];
+        }
+        m_total += o.m_total;
+        m_sum += o.m_sum;
+        m_max = std::max(m_max, o.m_max);
+        m_min = std::min(m_min, o.m_min);
+    }
+
+    /**
+     * @brief 百分位数, 返回所在桶的上界
+     */
+    uint64_t percentile(double p) const {
+        if(m_total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max((uint64_t)ceil(p / 100.0 * m_total), (uint64_t)1);
+        uint64_t seen = 0;
+        for(size_t i = 0; i < m_counts.size(); ++i) {
+            seen += m_counts[i];
+            if(seen >= rank) {
+                return std::min(UpperBound(i), m_max);
+            }
+        }
+        return m_max;
+    }
+
+    uint64_t getTotal() const { return m_total;}
+    uint64_t getMax() const { return m_max;}
+    uint64_t getMin() const { return m_total ? m_min : 0;}
+    uint64_t getMean() const { return m_total ? m_sum / m_total : 0;}
+private:
+    static size_t Index(uint64_t v) {
+        if(v < 2 * SUB_BUCKETS) {
+            return v;
+        }
+        int shift = 63 - __builtin_clzll(v) - 6;
+        if(shift > MAX_SHIFT) {
+            shift = MAX_SHIFT;
+            v = (2ull * SUB_BUCKETS << MAX_SHIFT) - 1;
+        }
+        return 2 * SUB_BUCKETS + (shift - 1) * SUB_BUCKETS + ((v >> shift) - SUB_BUCKETS);
+    }
+
+    static uint64_t UpperBound(size_t idx) {
+        if(idx < 2 * SUB_BUCKETS) {
+            return idx;
+        }
+        size_t shift = (idx - 2 * SUB_BUCKETS) / SUB_BUCKETS + 1;
+        uint64_t m = (idx - 2 * SUB_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+        return ((m + 1) << shift) - 1;
+    }
+private:
+    std::vector<uint64_t> m_counts;
+    uint64_t m_total = 0;
+    uint64_t m_sum = 0;
+    uint64_t m_max = 0;
+    uint64_t m_min = ~0ull;
+};
+
+/**
+ * @brief 一个连接位置的统计, 断开后重连仍累计在同一位置
+ */
+struct Slot {
+    LatencyHistogram latency;
+    /// 测量窗口内完成的请求数
+    uint64_t completed = 0;
+    /// 收到的字节数
+    uint64_t bytes = 0;
+    /// 连接断开或出错时未完成的请求数
+    uint64_t errors = 0;
+    /// 超时未收到响应的请求数
+    uint64_t timeouts = 0;
+    uint64_t connects = 0;
+    uint64_t connectErrors = 0;
+};
+
+/**
+ * @brief 一次连接上发送协程和接收协程共享的状态
+ */
+struct Conn {
+    typedef std::shared_ptr<Conn> ptr;
+    sylar::Socket::ptr sock;
+    sylar::Mutex mutex;
+    /// 未完成请求的计时起点(纳秒), 按发送顺序
+    std::deque<uint64_t> inflight;
+    bool closed = false;
+    /// 窗口满时挂起的发送协程
+    sylar::Fiber::ptr waiter;
+    sylar::Scheduler* scheduler = nullptr;
+};
+
+static std::vector<Slot> s_slots;
+static std::string s_request;
+/// 一次最多发送depth个请求
+static std::string s_batch;
+static uint64_t s_start = 0;
+static uint64_t s_measureStart = 0;
+static uint64_t s_end = 0;
+/// 开环时每个连接的请求间隔(纳秒)
+static uint64_t s_interval = 0;
+static std::atomic<int> s_running = {0};
+static sylar::TcpServer::ptr s_server;
+
+static bool IsStop() {
+    return NowNS() >= s_end;
+}
+
+/**
+ * @brief 发送协程
+ * @param[in] next 开环时第一个请求的排期时刻
+ */
+static void writer(Conn::ptr conn, uint64_t next) {
+    size_t len = s_request.size();
+    while(!IsStop()) {
+        uint64_t now = NowNS();
+        size_t n = 0;
+        {
+            sylar::Mutex::Lock lock(conn->mutex);
+            if(conn->closed) {
+                return;
+            }
+            size_t room = s_depth - conn->inflight.size();
+            if(s_rate) {
+                size_t due = next <= now ? (now - next) / s_interval + 1 : 0;
+                n = std::min(due, room);
+                if(n == 0 && due == 0) {
+                    lock.unlock();
+                    usleep((next - now) / 1000 + 1);
+                    continue;
+                }
+            } else {
+                n = room;
+            }
+            if(n == 0) {
+                // 窗口已满, 等接收协程腾出位置
+                conn->waiter = sylar::Fiber::GetThis();
+                conn->scheduler = sylar::Scheduler::GetThis();
+                lock.unlock();
+                sylar::Fiber::YieldToHold();
+                continue;
+            }
+            // 先登记再发送, 响应可能在send返回之前到达
+            for(size_t i = 0; i < n; ++i) {
+                conn->inflight.push_back(s_rate ? next : now);
+                next += s_interval;
+            }
+        }
+        size_t total = n * len;
+        size_t sent = 0;
+        while(sent < total) {
+            int rt = conn->sock->send(&s_batch[sent], total - sent);
+            if(rt <= 0) {
+                ::shutdown(conn->sock->getSocket(), SHUT_RDWR);
+                return;
+            }
+            sent += rt;
+        }
+    }
+}
+
+/**
+ * @brief 在接收的数据中切分响应, echo按请求长度, http按响应头和Content-Length
+ */
+class ResponseReader {
+public:
+    ResponseReader()
+        :m_buf(64 * 1024) {
+        reset();
+    }
+
+    char* space() { return &m_buf[m_len];}
+    /// 是否收到了Connection: close的响应
+    bool isClose() const { return m_close;}
+    /// 留一个字节放结尾的'\0', 响应解析器要求数据以它结尾
+    size_t spaceSize() const { return m_buf.size() - m_len - 1;}
+
+    /**
+     * @brief 处理新收到的n字节
+     * @return 新完成的响应数, 响应格式错误返回-1
+     */
+    int onRecv(size_t n) {
+        if(s_mode == "echo") {
+            m_pending += n;
+            int done = m_pending / s_request.size();
+            m_pending %= s_request.size();
+            return done;
+        }
+        m_len += n;
+        int done = 0;
+        while(m_len) {
+            if(m_header) {
+                m_buf[m_len] = '\0';
+                size_t nparse = m_parser->execute(&m_buf[0], m_len);
+                m_len -= nparse;
+                if(m_parser->hasError()) {
+                    return -1;
+                }
+                if(!m_parser->isFinished()) {
+                    if(m_len == m_buf.size() - 1) {
+                        return -1;
+                    }
+                    break;
+                }
+                m_header = false;
+                m_body = m_parser->getContentLength();
+                m_close = m_close || !strcasecmp(m_parser->getData()
+                                ->getHeader("connection").c_str(), "close");
+            }
+            size_t skip = std::min((size_t)m_body, m_len);
+            memmove(&m_buf[0], &m_buf[skip], m_len - skip);
+            m_len -= skip;
+            m_body -= skip;
+            if(m_body) {
+                break;
+            }
+            ++done;
+            reset();
+        }
+        return done;
+    }
+private:
+    void reset() {
+        m_parser.reset(new sylar::http::HttpResponseParser);
+        m_header = true;
+        m_body = 0;
+    }
+private:
+    std::vector<char> m_buf;
+    size_t m_len = 0;
+    size_t m_pending = 0;
+    sylar::http::HttpResponseParser::ptr m_parser;
+    bool m_header = true;
+    uint64_t m_body = 0;
+    bool m_close = false;
+};
+
+/**
+ * @brief 接收协程, 连接断开后重连, 直到测试结束
+ */
+static void client(int idx, sylar::Address::ptr addr) {
+    Slot& slot = s_slots[idx];
+    // 开环时各连接的排期错开, 合起来是均匀的总速率
+    uint64_t next = s_start + s_interval * idx / s_connections;
+    while(!IsStop()) {
+        Conn::ptr conn(new Conn);
+        conn->sock = sylar::Socket::CreateTCP(addr);
+        ++slot.connects;
+        if(!conn->sock->connect(addr, s_timeout)) {
+            ++slot.connectErrors;
+            usleep(10 * 1000);
+            continue;
+        }
+        conn->sock->setRecvTimeout(s_timeout);
+        if(s_rate) {
+            // 重连期间错过的排期不再补发
+            uint64_t now = NowNS();
+            if(next < now) {
+                next += (now - next) / s_interval * s_interval;
+            }
+        }
+        sylar::IOManager::GetThis()->schedule(std::bind(writer, conn, next));
+
+        ResponseReader reader;
+        bool timeout = false;
+        while(true) {
+            {
+                sylar::Mutex::Lock lock(conn->mutex);
+                if(IsStop() && conn->inflight.empty()) {
+                    break;
+                }
+            }
+            int rt = conn->sock->recv(reader.space(), reader.spaceSize());
+            if(rt <= 0) {
+                timeout = rt < 0 && (errno == EAGAIN || errno == ETIMEDOUT);
+                break;
+            }
+            uint64_t now = NowNS();
+            slot.bytes += rt;
+            int done = reader.onRecv(rt);
+            if(done < 0) {
+                __LOG_ERROR(g_logger) << "invalid response from " << addr->toString();
+                break;
+            }
+            sylar::Mutex::Lock lock(conn->mutex);
+            for(int i = 0; i < done && !conn->inflight.empty(); ++i) {
+                uint64_t begin = conn->inflight.front();
+                conn->inflight.pop_front();
+                if(begin >= s_measureStart && begin < s_end) {
+                    slot.latency.record(now - begin);
+                    ++slot.completed;
+                }
+            }
+            if(reader.isClose()) {
+                // 服务端将关闭连接, 持有锁时标记关闭, 发送协程不会再发出请求
+                conn->closed = true;
+                break;
+            }
+            if(conn->waiter && done > 0) {
+                conn->scheduler->schedule(&conn->waiter);
+            }
+        }
+
+        sylar::Mutex::Lock lock(conn->mutex);
+        conn->closed = true;
+        (timeout ? slot.timeouts : slot.errors) += conn->inflight.size();
+        conn->inflight.clear();
+        ::shutdown(conn->sock->getSocket(), SHUT_RDWR);
+        if(conn->waiter) {
+            conn->scheduler->schedule(&conn->waiter);
+        }
+        // 套接字在两个协程都释放Conn后关闭
+    }
+    if(--s_running == 0) {
+        sylar::IOManager::GetThis()->schedule([](){
+            LatencyHistogram latency;
+            Slot total;
+            for(auto& i : s_slots) {
+                latency.merge(i.latency);
+                total.completed += i.completed;
+                total.bytes += i.bytes;
+                total.errors += i.errors;
+                total.timeouts += i.timeouts;
+                total.connects += i.connects;
+                total.connectErrors += i.connectErrors;
+            }
+            double seconds = (s_end - s_measureStart) / 1e9;
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(1);
+            ss << "requests=" << total.completed
+               << " throughput=" << total.completed / seconds << "req/s"
+               << " transfer=" << total.bytes / seconds / 1024 / 1024 << "MB/s"
+               << " errors=" << total.errors << " timeouts=" << total.timeouts
+               << " connects=" << total.connects
+               << " connect_errors=" << total.connectErrors;
+            __LOG_INFO(g_logger) << ss.str();
+            ss.str("");
+            ss << "latency(us) min=" << latency.getMin() / 1e3
+               << " mean=" << latency.getMean() / 1e3;
+            static const std::pair<const char*, double> s_percentiles[] = {
+                {"p50", 50}, {"p90", 90}, {"p99", 99}, {"p99.9", 99.9}, {"p99.99", 99.99}
+            };
+            for(auto& i : s_percentiles) {
+                ss << " " << i.first << "=" << latency.percentile(i.second) / 1e3;
+            }
+            ss << " max=" << latency.getMax() / 1e3;
+            __LOG_INFO(g_logger) << ss.str();
+            if(s_server) {
+                s_server->drain(1000);
+                s_server.reset();
+            }
+        });
+    }
+}
+
+/**
+ * @brief 内置回显服务
+ */
+class EchoServer : public sylar::TcpServer {
+public:
+    EchoServer(sylar::IOManager* iom)
+        :sylar::TcpServer(iom, iom) {
+    }
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        std::vector<char> buf(64 * 1024);
+        while(true) {
+            int rt = client->recv(&buf[0], buf.size());
+            if(rt <= 0) {
+                break;
+            }
+            int sent = 0;
+            while(sent < rt) {
+                int n = client->send(&buf[sent], rt - sent);
+                if(n <= 0) {
+                    break;
+                }
+                sent += n;
+            }
+            if(sent < rt) {
+                break;
+            }
+        }
+        client->close();
+    }
+};
+
+static void usage(const char* prog) {
+    __LOG_INFO(g_logger) << "usage: " << prog << " [options] [host:port]\n"
+        << "  -m echo|http  protocol, default echo\n"
+        << "  -c N          connections, default 64\n"
+        << "  -d N          pipelining depth (max in-flight requests per connection), default 1\n"
+        << "  -r N          open loop total requests/s, 0 means closed loop, default 0\n"
+        << "  -t N          duration in seconds, default 10\n"
+        << "  -w N          warmup seconds excluded from results, default 1\n"
+        << "  -n N          client IOManager threads, default 2\n"
+        << "  -s N          echo payload bytes, default 64\n"
+        << "  -p PATH       http request path, default /\n"
+        << "  -T MS         connect/response timeout, default 2000\n"
+        << "  -S echo|http  start a built-in server on the target address\n"
+        << "  -N N          built-in server IOManager threads, default 2";
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "m:c:d:r:t:w:n:s:p:T:S:N:h")) != -1) {
+        switch(opt) {
+            case 'm': s_mode = optarg; break;
+            case 'c': s_connections = std::max(atoi(optarg), 1); break;
+            case 'd': s_depth = std::max(atoi(optarg), 1); break;
+            case 'r': s_rate = strtoull(optarg, nullptr, 10); break;
+            case 't': s_duration = std::max(atoi(optarg), 1); break;
+            case 'w': s_warmup = std::max(atoi(optarg), 0); break;
+            case 'n': s_threads = std::max(atoi(optarg), 1); break;
+            case 's': s_size = std::max(atoi(optarg), 1); break;
+            case 'p': s_path = optarg; break;
+            case 'T': s_timeout = strtoull(optarg, nullptr, 10); break;
+            case 'S': s_builtin = optarg; break;
+            case 'N': s_serverThreads = std::max(atoi(optarg), 1); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+    if(optind < argc) {
+        s_target = argv[optind];
+    }
+    if(s_mode != "echo" && s_mode != "http") {
+        usage(argv[0]);
+        return 0;
+    }
+    sylar::LoggerMgr::GetInstance()->getLogger("system")->setLevel(sylar::LogLevel::ERROR);
+
+    sylar::Address::ptr addr = sylar::Address::LookupAny(s_target);
+    if(!addr) {
+        __LOG_ERROR(g_logger) << "invalid address " << s_target;
+        return 1;
+    }
+    if(s_mode == "echo") {
+        s_request.assign(s_size, 'x');
+    } else {
+        s_request = "GET " + s_path + " HTTP/1.1\r\nHost: " + s_target
+            + "\r\nConnection: keep-alive\r\n\r\n";
+    }
+    for(int i = 0; i < s_depth; ++i) {
+        s_batch += s_request;
+    }
+    s_slots.resize(s_connections);
+
+    sylar::IOManager* server_iom = nullptr;
+    if(!s_builtin.empty()) {
+        server_iom = new sylar::IOManager(s_serverThreads, false, "server");
+        sylar::Semaphore sem;
+        server_iom->schedule([server_iom, addr, &sem](){
+            if(s_builtin == "http") {
+                s_server.reset(new sylar::http::HttpServer(true, server_iom, server_iom));
+            } else {
+                s_server.reset(new EchoServer(server_iom));
+            }
+            if(!s_server->bind(addr)) {
+                s_server.reset();
+            } else {
+                s_server->start();
+            }
+            sem.notify();
+        });
+        sem.wait();
+        if(!s_server) {
+            delete server_iom;
+            return 1;
+        }
+    }
+
+    __LOG_INFO(g_logger) << "target=" << addr->toString() << " mode=" << s_mode
+        << " connections=" << s_connections << " depth=" << s_depth
+        << " rate=" << (s_rate ? std::to_string(s_rate) + "req/s" : std::string("closed"))
+        << " duration=" << s_duration << "s warmup=" << s_warmup << "s threads=" << s_threads
+        << (s_builtin.empty() ? "" : " builtin=" + s_builtin);
+    s_start = NowNS();
+    s_measureStart = s_start + s_warmup * 1000000000ull;
+    s_end = s_measureStart + s_duration * 1000000000ull;
+    if(s_rate) {
+        s_interval = std::max(1000000000ull * s_connections / s_rate, 1ull);
+    }
+    {
+        sylar::IOManager iom(s_threads, false, "client");
+        s_running = s_connections;
+        for(int i = 0; i < s_connections; ++i) {
+            iom.schedule(std::bind(client, i, addr));
+        }
+    }
+    delete server_iom;
+    return 0;
+}
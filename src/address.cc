@@ -1,4 +1,5 @@
 #include "address.h"
+#include "resolver.h"
 #include "log.h"
 #include <sstream>
 #include <netdb.h>
@@ -93,6 +94,36 @@ bool Address::Lookup(std::vector<Address::ptr>& result, const std::string& host,
     if(node.empty()) {
         node = host;
     }
+
+    // 协程中getaddrinfo会阻塞整个调度线程, 域名交给Resolver解析,
+    // 再按数字地址调用getaddrinfo以保留service/socktype的处理
+    std::vector<IPAddress::ptr> ips;
+    if(Resolver::CanResolve(node)) {
+        if(!ResolverMgr::GetInstance()->resolve(node, family, ips)) {
+            __LOG_DEBUG(g_logger) << "Address::Lookup resolve(" << host << ", "
+                << family << ") fail";
+            return false;
+        }
+        hints.ai_flags |= AI_NUMERICHOST;
+        for(auto& ip : ips) {
+            char buf[INET6_ADDRSTRLEN] = {0};
+            const void* src = ip->getFamily() == AF_INET
+                        ? (const void*)&((const sockaddr_in*)ip->getAddr())->sin_addr
+                        : (const void*)&((const sockaddr_in6*)ip->getAddr())->sin6_addr;
+            if(!inet_ntop(ip->getFamily(), src, buf, sizeof(buf))) {
+                continue;
+            }
+            if(getaddrinfo(buf, service, &hints, &results)) {
+                continue;
+            }
+            for(next = results; next; next = next->ai_next) {
+                result.push_back(Create(next->ai_addr, (socklen_t)next->ai_addrlen));
+            }
+            freeaddrinfo(results);
+        }
+        return !result.empty();
+    }
+
     int error = getaddrinfo(node.c_str(), service, &hints, &results);
     if(error) {
         __LOG_DEBUG(g_logger) << "Address::Lookup getaddress(" << host << ", "
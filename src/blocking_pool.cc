@@ -0,0 +1,126 @@
+#include "blocking_pool.h"
+#include "scheduler.h"
+#include "config.h"
+#include "log.h"
+#include "macro.h"
+#include "hook.h"
+
+namespace sylar {
+
+    static Logger::ptr g_logger = __LOG_NAME("system");
+
+    static ConfigVar<uint32_t>::ptr g_blocking_io_threads =
+        Config::Lookup<uint32_t>("blocking_io.threads", 4, "blocking io pool thread count");
+
+    static ConfigVar<uint32_t>::ptr g_blocking_io_max_queue =
+        Config::Lookup<uint32_t>("blocking_io.max_queue", 1024, "blocking io pool max queued tasks");
+
+    BlockingPool::BlockingPool()
+        :BlockingPool(g_blocking_io_threads->getValue()
+                ,g_blocking_io_max_queue->getValue()) {
+    }
+
+    BlockingPool::BlockingPool(size_t threads, size_t max_queue, const std::string& name)
+        :m_threadCount(threads)
+        ,m_maxQueue(max_queue)
+        ,m_name(name) {
+    }
+
+    BlockingPool::~BlockingPool() {
+        stop();
+    }
+
+    void BlockingPool::startNoLock() {
+        m_threads.resize(m_threadCount);
+        for(size_t i = 0; i < m_threadCount; ++i) {
+            m_threads[i].reset(new Thread(std::bind(&BlockingPool::worker, this)
+                                ,m_name + "_" + std::to_string(i)));
+        }
+    }
+
+    bool BlockingPool::run(std::function<void()> cb) {
+        Scheduler* scheduler = Scheduler::GetThis();
+        Fiber::ptr fiber = Fiber::GetThis();
+        // 只有调度器工作线程中的任务协程可以挂起, 调度器主协程(run/idle所在)不能
+        if(!scheduler || !is_hook_enable() || m_threadCount == 0
+                || fiber.get() == Scheduler::GetMainFiber()) {
+            cb();
+            return false;
+        }
+
+        {
+            MutexType::Lock lock(m_mutex);
+            if(m_stopping || m_tasks.size() >= m_maxQueue) {
+                lock.unlock();
+                // 队列已满, 由调用线程自己承担阻塞, 不丢弃也不报错
+                cb();
+                return false;
+            }
+            if(m_threads.empty()) {
+                startNoLock();
+            }
+            m_tasks.push_back(Task());
+            Task& task = m_tasks.back();
+            task.cb.swap(cb);
+            task.fiber = fiber;
+            task.scheduler = scheduler;
+        }
+        fiber.reset();
+        m_sem.notify();
+
+        // 任务可能在切出前就已完成并被调度, 调度器会等到协程切出后再执行它
+        Fiber::YieldToHold();
+        return true;
+    }
+
+    void BlockingPool::worker() {
+        while(true) {
+            m_sem.wait();
+            Task task;
+            {
+                MutexType::Lock lock(m_mutex);
+                if(m_tasks.empty()) {
+                    if(m_stopping) {
+                        break;
+                    }
+                    continue;
+                }
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            try {
+                task.cb();
+            } catch (std::exception& ex) {
+                __LOG_ERROR(g_logger) << "BlockingPool task except: " << ex.what();
+            } catch (...) {
+                __LOG_ERROR(g_logger) << "BlockingPool task except";
+            }
+            task.cb = nullptr;
+            task.scheduler->schedule(&task.fiber);
+        }
+    }
+
+    void BlockingPool::stop() {
+        std::vector<Thread::ptr> thrs;
+        {
+            MutexType::Lock lock(m_mutex);
+            if(m_stopping) {
+                return;
+            }
+            m_stopping = true;
+            thrs.swap(m_threads);
+        }
+        for(size_t i = 0; i < thrs.size(); ++i) {
+            m_sem.notify();
+        }
+        for(auto& i : thrs) {
+            i->join();
+        }
+    }
+
+    size_t BlockingPool::getQueueSize() {
+        MutexType::Lock lock(m_mutex);
+        return m_tasks.size();
+    }
+
+}
@@ -0,0 +1,109 @@
+/**
+ * @file blocking_pool.h
+ * @brief 阻塞IO线程池
+ */
+#ifndef __BLOCKING_POOL_H__
+#define __BLOCKING_POOL_H__
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <memory>
+#include "thread.h"
+#include "fiber.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+class Scheduler;
+
+/**
+ * @brief 阻塞IO线程池
+ * @details 普通文件的读写、open、stat等调用无法用epoll等待, 会阻塞整个调度线程。
+ *          hook把这些调用转交给线程池执行, 调用协程挂起, 执行完成后再调度回原调度器。
+ *          线程在第一次使用时创建, 数量和队列长度由配置 blocking_io.threads
+ *          和 blocking_io.max_queue 决定
+ */
+class BlockingPool : Noncopyable {
+public:
+    typedef std::shared_ptr<BlockingPool> ptr;
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 使用配置中的线程数和队列长度构造
+     */
+    BlockingPool();
+
+    /**
+     * @brief 构造函数
+     * @param[in] threads 线程数量
+     * @param[in] max_queue 队列中最多等待的任务数
+     * @param[in] name 线程名称前缀
+     */
+    BlockingPool(size_t threads, size_t max_queue, const std::string& name = "blocking_io");
+
+    /**
+     * @brief 析构函数, 等待已提交的任务执行完成
+     */
+    ~BlockingPool();
+
+    /**
+     * @brief 在线程池中执行cb, 当前协程挂起直到cb执行完成
+     * @details 不在协程调度器的工作协程中, 或者队列已满时, 直接在当前线程执行
+     * @param[in] cb 阻塞调用
+     * @return 是否由线程池执行
+     */
+    bool run(std::function<void()> cb);
+
+    /**
+     * @brief 停止线程池, 执行完队列中的任务后返回
+     */
+    void stop();
+
+    /**
+     * @brief 当前排队的任务数
+     */
+    size_t getQueueSize();
+
+    size_t getThreadCount() const { return m_threadCount;}
+    size_t getMaxQueue() const { return m_maxQueue;}
+private:
+    /**
+     * @brief 任务
+     */
+    struct Task {
+        /// 阻塞调用
+        std::function<void()> cb;
+        /// 执行完成后恢复的协程
+        Fiber::ptr fiber;
+        /// 协程所属的调度器
+        Scheduler* scheduler = nullptr;
+    };
+
+    /**
+     * @brief 工作线程主循环
+     */
+    void worker();
+
+    /**
+     * @brief 创建工作线程, 调用前需持有m_mutex
+     */
+    void startNoLock();
+private:
+    MutexType m_mutex;
+    /// 任务计数, 每个任务和每个停止通知各一次
+    Semaphore m_sem;
+    std::deque<Task> m_tasks;
+    std::vector<Thread::ptr> m_threads;
+    size_t m_threadCount;
+    size_t m_maxQueue;
+    std::string m_name;
+    bool m_stopping = false;
+};
+
+typedef Singleton<BlockingPool> BlockingPoolMgr;
+
+}
+
+#endif
@@ -0,0 +1,167 @@
+#include "buffered_stream.h"
+#include "config.h"
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+namespace sylar {
+    static sylar::ConfigVar<uint32_t>::ptr g_stream_buffer_size =
+        sylar::Config::Lookup("stream.buffer_size", (uint32_t)(16 * 1024),
+        "buffered stream read buffer size");
+
+    BufferedStream::BufferedStream(Stream::ptr stream, size_t buffer_size)
+        :m_stream(stream)
+        ,m_buffer(buffer_size ? buffer_size : g_stream_buffer_size->getValue())
+        ,m_begin(0)
+        ,m_end(0) {
+    }
+
+    void BufferedStream::compact() {
+        if(m_begin == m_end) {
+            m_begin = m_end = 0;
+        } else if(m_begin > 0 && m_end == m_buffer.size()) {
+            memmove(&m_buffer[0], &m_buffer[m_begin], m_end - m_begin);
+            m_end -= m_begin;
+            m_begin = 0;
+        }
+    }
+
+    int BufferedStream::fill() {
+        compact();
+        if(m_end == m_buffer.size()) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        int rt = m_stream->read(&m_buffer[m_end], m_buffer.size() - m_end);
+        if(rt > 0) {
+            m_end += rt;
+        }
+        return rt;
+    }
+
+    int BufferedStream::ensure(size_t length) {
+        if(length > m_buffer.size()) {
+            compact();
+            m_buffer.resize(length);
+        }
+        while(getBufferedSize() < length) {
+            if(m_begin + length > m_buffer.size()) {
+                // 尾部空间不够, 先挪到开头
+                memmove(&m_buffer[0], &m_buffer[m_begin], m_end - m_begin);
+                m_end -= m_begin;
+                m_begin = 0;
+            }
+            int rt = fill();
+            if(rt <= 0) {
+                return rt;
+            }
+        }
+        return getBufferedSize();
+    }
+
+    int BufferedStream::peek(void* buffer, size_t length) {
+        int rt = ensure(length);
+        if(rt <= 0) {
+            return rt;
+        }
+        memcpy(buffer, data(), length);
+        return length;
+    }
+
+    int BufferedStream::find(const std::string& delimiter) {
+        if(delimiter.empty()) {
+            return 0;
+        }
+        // 已经查找过的部分不再重复查找
+        size_t searched = 0;
+        while(true) {
+            size_t size = getBufferedSize();
+            if(size >= delimiter.size()) {
+                const char* begin = data();
+                const char* end = begin + size;
+                const char* it = std::search(begin + searched, end
+                                    ,delimiter.begin(), delimiter.end());
+                if(it != end) {
+                    return it - begin + delimiter.size();
+                }
+                searched = size - delimiter.size() + 1;
+            }
+            int rt = fill();
+            if(rt <= 0) {
+                return rt;
+            }
+        }
+    }
+
+    int BufferedStream::readUntil(const std::string& delimiter, std::string& out) {
+        int rt = find(delimiter);
+        if(rt <= 0) {
+            return rt;
+        }
+        out.assign(data(), rt - delimiter.size());
+        consume(rt);
+        return rt;
+    }
+
+    void BufferedStream::consume(size_t length) {
+        m_begin += std::min(length, getBufferedSize());
+        if(m_begin == m_end) {
+            m_begin = m_end = 0;
+        }
+    }
+
+    void BufferedStream::truncate(size_t length) {
+        m_end = m_begin + std::min(length, getBufferedSize());
+    }
+
+    int BufferedStream::read(void* buffer, size_t length) {
+        if(length == 0) {
+            return 0;
+        }
+        if(getBufferedSize() == 0) {
+            if(length >= m_buffer.size()) {
+                return m_stream->read(buffer, length);
+            }
+            int rt = fill();
+            if(rt <= 0) {
+                return rt;
+            }
+        }
+        size_t n = std::min(length, getBufferedSize());
+        memcpy(buffer, data(), n);
+        consume(n);
+        return n;
+    }
+
+    int BufferedStream::read(ByteArray::ptr ba, size_t length) {
+        if(length == 0) {
+            return 0;
+        }
+        if(getBufferedSize() == 0) {
+            if(length >= m_buffer.size()) {
+                return m_stream->read(ba, length);
+            }
+            int rt = fill();
+            if(rt <= 0) {
+                return rt;
+            }
+        }
+        size_t n = std::min(length, getBufferedSize());
+        ba->write(data(), n);
+        consume(n);
+        return n;
+    }
+
+    int BufferedStream::write(const void* buffer, size_t length) {
+        return m_stream->write(buffer, length);
+    }
+
+    int BufferedStream::write(ByteArray::ptr ba, size_t length) {
+        return m_stream->write(ba, length);
+    }
+
+    void BufferedStream::close() {
+        m_begin = m_end = 0;
+        m_stream->close();
+    }
+}
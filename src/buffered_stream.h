@@ -0,0 +1,115 @@
+/**
+ * @file buffered_stream.h
+ * @brief 带读缓冲的流
+ */
+#ifndef __BUFFERED_STREAM_H__
+#define __BUFFERED_STREAM_H__
+
+#include <string>
+#include <vector>
+#include "stream.h"
+
+namespace sylar {
+    /**
+     * @brief 带读缓冲的流
+     * @details 包装任意Stream, 每次从底层流读取一大块数据到缓冲区, 小块的读取和协议解析
+     *          直接从缓冲区取, 减少系统调用。缓冲区是连续内存, data()可以直接交给解析器,
+     *          不需要再拷贝一次; 请求长度不小于缓冲区时read绕过缓冲区直接读入调用者的内存。
+     *          写操作和close直接转发给底层流
+     */
+    class BufferedStream : public Stream {
+        public:
+            typedef std::shared_ptr<BufferedStream> ptr;
+
+            /**
+             * @brief 构造函数
+             * @param[in] stream 底层流
+             * @param[in] buffer_size 缓冲区大小, 0表示使用配置 stream.buffer_size
+             */
+            BufferedStream(Stream::ptr stream, size_t buffer_size = 0);
+
+            virtual int read(void* buffer, size_t length) override;
+            virtual int read(ByteArray::ptr ba, size_t length) override;
+
+            virtual int write(const void* buffer, size_t length) override;
+            virtual int write(ByteArray::ptr ba, size_t length) override;
+
+            virtual void close() override;
+
+            /**
+             * @brief 从底层流读取一次, 追加到缓冲区
+             * @return
+             *      @retval >0 读到的字节数
+             *      @retval =0 对端关闭
+             *      @retval <0 出错, 缓冲区已满时errno为ENOBUFS
+             */
+            int fill();
+
+            /**
+             * @brief 读取直到缓冲区中至少有length字节
+             * @details length超过缓冲区大小时扩大缓冲区
+             * @return 缓冲的字节数(>=length), 不足length时对端关闭返回0, 出错返回<0
+             */
+            int ensure(size_t length);
+
+            /**
+             * @brief 拷贝前length字节, 不移动读位置
+             * @return 同ensure, 成功时返回length
+             */
+            int peek(void* buffer, size_t length);
+
+            /**
+             * @brief 在缓冲区中查找delimiter, 找不到时继续读取
+             * @return 分隔符结束位置相对data()的偏移(含分隔符);
+             *      缓冲区满仍未找到时返回-1且errno为ENOBUFS, 对端关闭返回0, 出错返回<0
+             */
+            int find(const std::string& delimiter);
+
+            /**
+             * @brief 读取到delimiter为止
+             * @param[out] out delimiter之前的数据, 不含delimiter
+             * @return 消耗的字节数(含delimiter), 其他返回值同find
+             */
+            int readUntil(const std::string& delimiter, std::string& out);
+
+            /**
+             * @brief 已缓冲数据的起始地址
+             * @details 在下一次fill/ensure/read之前有效; 可以原地修改, 如交给会移动数据的解析器
+             */
+            char* data() { return &m_buffer[m_begin];}
+            const char* data() const { return &m_buffer[m_begin];}
+
+            /**
+             * @brief 已缓冲的字节数
+             */
+            size_t getBufferedSize() const { return m_end - m_begin;}
+
+            /**
+             * @brief 丢弃开头的length字节
+             */
+            void consume(size_t length);
+
+            /**
+             * @brief 只保留开头的length字节
+             * @details 用于解析器把未解析的数据移到了data()开头的情况
+             */
+            void truncate(size_t length);
+
+            size_t getBufferSize() const { return m_buffer.size();}
+            Stream::ptr getStream() const { return m_stream;}
+        private:
+            /**
+             * @brief 把未读数据移到缓冲区开头, 给fill腾出尾部空间
+             */
+            void compact();
+        private:
+            Stream::ptr m_stream;
+            std::vector<char> m_buffer;
+            /// 未读数据的起始位置
+            size_t m_begin;
+            /// 未读数据的结束位置
+            size_t m_end;
+    };
+}
+
+#endif
@@ -289,7 +289,7 @@ namespace sylar {
     }
     double ByteArray::readDouble() {
         uint64_t v = readFuint64();
-        float value;
+        double value;
         memcpy(&value, &v, sizeof(v));
         return value;
     }
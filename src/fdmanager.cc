@@ -3,10 +3,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sched.h>
 namespace sylar {
-    FdCtx::FdCtx(int fd) 
+    FdCtx::FdCtx(int fd, bool nonblock_socket) 
         :m_isInit(false)
         ,m_isSocket(false)
+        ,m_isFile(false)
         ,m_sysNonblock(false)
         ,m_userNonblock(false)
         ,m_isClosed(false)
@@ -14,7 +16,11 @@ namespace sylar {
         ,m_recvTimeout(-1)
         ,m_sendTimeout(-1)
         {
+        if(nonblock_socket) {
+            initNonblockSocket();
+        } else {
             init();
+        }
     }
     FdCtx::~FdCtx() {
 
@@ -30,9 +36,11 @@ namespace sylar {
         if(-1 == fstat(m_fd, &fd_stat)) {
             m_isInit = false;
             m_isSocket = false;
+            m_isFile = false;
         } else {
             m_isInit = true;
             m_isSocket = S_ISSOCK(fd_stat.st_mode);
+            m_isFile = S_ISREG(fd_stat.st_mode);
         }
         if(m_isSocket) {
             int flags = fcntl_f(m_fd, F_GETFL, 0);
@@ -48,6 +56,16 @@ namespace sylar {
         m_isClosed = false;
         return m_isInit;
     }
+    void FdCtx::initNonblockSocket() {
+        m_recvTimeout = -1;
+        m_sendTimeout = -1;
+        m_isInit = true;
+        m_isSocket = true;
+        m_isFile = false;
+        m_sysNonblock = true;
+        m_userNonblock = false;
+        m_isClosed = false;
+    }
     void FdCtx::setTimeout(int type, uint64_t v) {
         if(type == SO_RCVTIMEO) {
             m_recvTimeout = v;
@@ -63,38 +81,94 @@ namespace sylar {
         }
     }
     FdManager::FdManager() {
-        m_datas.resize(64);
+        m_datas.getOrCreate(0);
     }
     FdCtx::ptr FdManager::get(int fd, bool auto_create) {
-        if(fd == -1) {
+        if(fd < 0) {
             return nullptr;
         }
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_datas.size() <= fd) {
-            if(auto_create == false) {
-                return nullptr;
-            }
-        } else {
-            if(m_datas[fd] || !auto_create) {
-                return m_datas[fd];
-            }
+        if(!auto_create) {
+            Slot* slot = m_datas.get(fd);
+            return slot ? loadCtx(slot) : nullptr;
+        }
+        return create(fd, false);
+    }
+
+    FdCtx::ptr FdManager::addSocket(int fd) {
+        if(fd < 0) {
+            return nullptr;
         }
-        lock.unlock();
+        return create(fd, true);
+    }
 
-        RWMutexType::WriteLock lock2(m_mutex);
-        FdCtx::ptr ctx(new FdCtx(fd));
-        if(fd >= (int)m_datas.size()){
-            m_datas.resize(fd * 1.5);
+    FdCtx::ptr FdManager::create(int fd, bool nonblock_socket) {
+        Slot* slot = m_datas.getOrCreate(fd);
+        if(!slot) {
+            return nullptr;
+        }
+        if(slot->state.load(std::memory_order_acquire) == Slot::LIVE) {
+            return loadCtx(slot);
         }
-        m_datas[fd] = ctx;
+
+        int expected = Slot::EMPTY;
+        if(slot->state.compare_exchange_strong(expected, Slot::INITING
+                    ,std::memory_order_acquire)) {
+            // 不复用上一次登记的上下文: 仍持有它的协程依赖其关闭标记
+            FdCtx::ptr ctx(new FdCtx(fd, nonblock_socket));
+            slot->file.store(ctx->isFile(), std::memory_order_relaxed);
+            slot->ctx = ctx;
+            slot->state.store(Slot::LIVE, std::memory_order_release);
+            return ctx;
+        }
+        // 其他线程正在创建, 等待其完成
+        while(slot->state.load(std::memory_order_acquire) == Slot::INITING) {
+            sched_yield();
+        }
+        return loadCtx(slot);
+    }
+
+    FdCtx::ptr FdManager::loadCtx(Slot* slot) {
+        FdCtx::ptr ctx;
+        slot->readers.fetch_add(1);
+        if(slot->state.load() == Slot::LIVE) {
+            ctx = slot->ctx;
+        }
+        slot->readers.fetch_sub(1, std::memory_order_release);
         return ctx;
     }
+    bool FdManager::isFile(int fd) {
+        if(fd < 0) {
+            return false;
+        }
+        Slot* slot = m_datas.get(fd);
+        if(!slot || slot->state.load(std::memory_order_acquire) != Slot::LIVE) {
+            return false;
+        }
+        return slot->file.load(std::memory_order_relaxed);
+    }
+
     void FdManager::del(int fd) {
-        RWMutexType::WriteLock lock(m_mutex);
-        if((int)m_datas.size() <= fd) {
+        if(fd < 0) {
             return;
         }
-        m_datas[fd].reset();
-
+        Slot* slot = m_datas.get(fd);
+        if(!slot) {
+            return;
+        }
+        int expected = Slot::LIVE;
+        if(slot->state.compare_exchange_strong(expected, Slot::INITING)) {
+            // 等已经看到LIVE的读者复制完, 它们只持有几条指令的时间
+            while(slot->readers.load(std::memory_order_acquire) != 0) {
+                sched_yield();
+            }
+            // 槽位不再引用旧上下文, 仍持有它的使用者可以看到fd已关闭
+            FdCtx::ptr ctx;
+            ctx.swap(slot->ctx);
+            if(ctx) {
+                ctx->m_isClosed.store(true, std::memory_order_release);
+            }
+            slot->file.store(false, std::memory_order_relaxed);
+            slot->state.store(Slot::EMPTY, std::memory_order_release);
+        }
     }
 }
\ No newline at end of file
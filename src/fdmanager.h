@@ -5,17 +5,25 @@
 #include "mutex.h"
 #include "iomanager.h"
 #include "singleton.h"
+#include "segment_table.h"
 namespace sylar{
     class FdCtx : public std::enable_shared_from_this<FdCtx> {
+        friend class FdManager;
         public:
             typedef std::shared_ptr<FdCtx> ptr;
-            FdCtx(int fd);
+            /**
+             * @param[in] fd 句柄
+             * @param[in] nonblock_socket 已知是非阻塞socket(如accept4(SOCK_NONBLOCK)的返回值),
+             *            跳过init中的fstat和fcntl
+             */
+            FdCtx(int fd, bool nonblock_socket = false);
             ~FdCtx();
 
             bool init();
             bool isInit() const { return m_isInit;}
             bool isSocket() const { return m_isSocket;}
-            bool isClosed() const { return m_isClosed;}
+            bool isFile() const { return m_isFile;}
+            bool isClosed() const { return m_isClosed.load(std::memory_order_acquire);}
             
             void setUserNonblock(bool v) { m_userNonblock = v;}
             bool getUserNonblock() const {return m_userNonblock;}
@@ -25,12 +33,19 @@ namespace sylar{
 
             void setTimeout(int type, uint64_t v);
             uint64_t getTimeout(int type);
+        private:
+            /**
+             * @brief 按已知的非阻塞socket初始化, 不做系统调用
+             */
+            void initNonblockSocket();
         private:
             bool m_isInit: 1;
             bool m_isSocket: 1;
+            bool m_isFile: 1;
             bool m_sysNonblock: 1;
             bool m_userNonblock: 1;
-            bool m_isClosed: 1;
+            /// 由close所在线程设置, 其他线程上挂起的协程唤醒后读取
+            std::atomic<bool> m_isClosed;
             int m_fd;
 
             uint64_t m_recvTimeout;
@@ -42,14 +57,60 @@ namespace sylar{
 
     class FdManager {
         public:
-            typedef RWMutex RWMutexType;
-
             FdManager();
+            /**
+             * @brief 获取fd对应的上下文
+             * @details 查询不加锁; fd号每次登记都创建新的FdCtx, close前取得旧上下文的
+             *          协程唤醒后仍能看到它已关闭, 不会误用复用了该fd号的新连接
+             */
             FdCtx::ptr get(int fd, bool auto_create = false);
+            /**
+             * @brief fd是否是已登记的普通文件
+             * @details 不复制智能指针, 用于hook快速判断是否转交阻塞IO线程池
+             */
+            bool isFile(int fd);
+            /**
+             * @brief 登记已知为非阻塞的socket
+             * @details 用于accept4(SOCK_NONBLOCK)等返回的fd, 省去fstat和fcntl;
+             *          fd已登记时返回已有的上下文
+             */
+            FdCtx::ptr addSocket(int fd);
             void del(int fd);
         private:
-            RWMutexType m_mutex;
-            std::vector<FdCtx::ptr> m_datas;
+            /**
+             * @brief 获取或创建fd对应的上下文
+             */
+            FdCtx::ptr create(int fd, bool nonblock_socket);
+            /**
+             * @brief fd槽位
+             */
+            struct Slot {
+                enum State {
+                    /// 没有对应的fd
+                    EMPTY = 0,
+                    /// 正在创建/重新初始化
+                    INITING = 1,
+                    /// 有效
+                    LIVE = 2
+                };
+                /// 槽位状态
+                std::atomic<int> state = {EMPTY};
+                /// 正在复制ctx的读者数, del()在清空ctx前等待其归零
+                std::atomic<uint32_t> readers = {0};
+                /// 上下文, 只在INITING状态下修改, 读者通过loadCtx()复制
+                FdCtx::ptr ctx;
+                /// 是否是普通文件, 供isFile()不复制智能指针地查询
+                std::atomic<bool> file = {false};
+            };
+            /**
+             * @brief 复制槽位中的上下文
+             * @details 读者先登记再检查状态, del()先改状态再等读者归零,
+             *      两边都是seq_cst, 至少一方能看到对方. 只涉及本槽位的原子量,
+             *      不同fd之间不竞争
+             * @return 槽位不是LIVE时返回nullptr
+             */
+            FdCtx::ptr loadCtx(Slot* slot);
+            SegmentTable<Slot> m_datas;
     };
 
     typedef Singleton<FdManager> FdMgr;
@@ -13,6 +13,12 @@ namespace sylar {
     static thread_local Fiber* t_fiber = nullptr;           // 当前协程
     static thread_local Fiber::ptr t_threadFiber = nullptr; // 线程的主协程
 
+    /// SetSignalMask的版本号, 0表示从未设置
+    static std::atomic<uint64_t> s_sigmask_gen {0};
+    static Mutex s_sigmask_mutex;
+    static sigset_t s_sigmask_block;
+    static sigset_t s_sigmask_unblock;
+
     static ConfigVar<uint32_t>::ptr g_fiber_stack_size = 
         Config::Lookup<uint32_t>("fiber.stack_size", 1024 * 1024, "fiber stack size");
 
@@ -57,8 +63,9 @@ namespace sylar {
     
     void Fiber::YieldToHold() {
         // 协程切换到后台，并设置为Hold状态
+        // 这里不能先置为HOLD: 协程可能已被事件唤醒放入调度队列, 其他线程看到HOLD后会在
+        // 上下文保存完成之前切入。状态保持EXEC, 由调度器在swapIn返回后设置为HOLD
         Fiber::ptr cur = GetThis();
-        cur->m_state = HOLD;
         cur->swapOut();
 
     }
@@ -201,8 +208,32 @@ namespace sylar {
         
     }
 
+    void Fiber::SetSignalMask(const sigset_t& block, const sigset_t& unblock) {
+        Mutex::Lock lock(s_sigmask_mutex);
+        s_sigmask_block = block;
+        s_sigmask_unblock = unblock;
+        ++s_sigmask_gen;
+    }
+
+    void Fiber::syncSignalMask() {
+        uint64_t gen = s_sigmask_gen.load(std::memory_order_acquire);
+        if(__LIKELY(gen == m_sigmaskGen)) {
+            return;
+        }
+        Mutex::Lock lock(s_sigmask_mutex);
+        for(int i = 1; i < NSIG; ++i) {
+            if(sigismember(&s_sigmask_block, i) == 1) {
+                sigaddset(&m_ctx.uc_sigmask, i);
+            } else if(sigismember(&s_sigmask_unblock, i) == 1) {
+                sigdelset(&m_ctx.uc_sigmask, i);
+            }
+        }
+        m_sigmaskGen = s_sigmask_gen;
+    }
+
     void Fiber::back() {
         SetThis(t_threadFiber.get());   // 调入主协程
+        t_threadFiber->syncSignalMask();
         if(swapcontext(&m_ctx, &t_threadFiber->m_ctx)){     // 切出本协程，将状态量保存在本协程中
             __ASSERT2(false, "swapcontext");
         }
@@ -211,6 +242,7 @@ namespace sylar {
     void Fiber::call() {
         SetThis(this);  // 调入当前协程
         m_state = EXEC;
+        syncSignalMask();
         if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {    // 切换进本协程，将状态量保存到主协程中
             __ASSERT2(false, "swapcontext");
         }
@@ -224,6 +256,7 @@ namespace sylar {
 
         // 将当前协程设为执行态
         m_state = EXEC;
+        syncSignalMask();
         // 采用调度器的方法，切入本协程，将状态量保存到调度器主协程中
         if(swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
             __ASSERT2(false, "swapcontext");
@@ -233,6 +266,7 @@ namespace sylar {
     void Fiber::swapOut() {
 
         SetThis(Scheduler::GetMainFiber()); // 返回调度器主协程
+        Scheduler::GetMainFiber()->syncSignalMask();
         if(swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)){ //这里Scheduler主协程跟自己切换了
             __ASSERT2(false, "swapcontext");
         }
@@ -9,8 +9,10 @@
 #ifndef __FIBER_H__
 #define __FIBER_H__
 #include <ucontext.h>
+#include <signal.h>
 #include <memory>
 #include <functional>
+#include <atomic>
 #include "thread.h"
 namespace sylar{
     class Scheduler;
@@ -48,6 +50,10 @@ namespace sylar{
             uint64_t getId() const {return m_id;}
 
             Fiber::State getState() const { return m_state;}
+
+            // 协程私有的IO定时状态，由hook在多次do_io间复用，避免每次阻塞都重新分配
+            const std::shared_ptr<void>& getIoTimerState() const { return m_ioTimerState;}
+            void setIoTimerState(std::shared_ptr<void> v) { m_ioTimerState.swap(v);}
         public:
             // 设置当前协程
             static void SetThis(Fiber* f);
@@ -65,13 +71,25 @@ namespace sylar{
             static void CallerMainFunc();
 
             static uint64_t GetFiberId();
+
+            // 设置所有协程统一屏蔽和解除屏蔽的信号
+            // swapcontext会恢复目标协程保存的信号屏蔽字, 线程级的设置在切换后失效,
+            // 因此在切入前把这里的设置同步到目标协程的上下文中
+            static void SetSignalMask(const sigset_t& block, const sigset_t& unblock);
+        private:
+            // 按SetSignalMask的设置更新本协程上下文中保存的屏蔽字
+            void syncSignalMask();
         private:
             uint64_t m_id = 0;
             uint32_t m_stacksize = 0;
-            State m_state = INIT;
+            // 其他线程的调度器会读取该状态判断协程能否被切入, 因此为原子量
+            std::atomic<State> m_state = {INIT};
             ucontext_t m_ctx;
             void* m_stack = nullptr;
             std::function<void()> m_cb;
+            std::shared_ptr<void> m_ioTimerState;
+            // 上下文中屏蔽字对应的SetSignalMask版本
+            uint64_t m_sigmaskGen = 0;
     };
 }
 
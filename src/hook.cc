@@ -4,8 +4,13 @@
 #include "log.h"
 #include "fdmanager.h"
 #include "config.h"
+#include "macro.h"
+#include "blocking_pool.h"
 #include <dlfcn.h>
+#include <sys/sendfile.h>
+#include <poll.h>
 #include <memory>
+#include <atomic>
 #include <stdarg.h>
 
 
@@ -24,21 +29,32 @@ namespace sylar {
     XX(socket) \
     XX(connect) \
     XX(accept) \
+    XX(accept4) \
     XX(read) \
     XX(readv) \
     XX(recv) \
     XX(recvfrom) \
     XX(recvmsg) \
+    XX(recvmmsg) \
     XX(write) \
     XX(writev) \
     XX(send) \
     XX(sendto) \
     XX(sendmsg) \
+    XX(sendmmsg) \
     XX(close) \
     XX(fcntl) \
     XX(ioctl) \
     XX(getsockopt) \
-    XX(setsockopt) 
+    XX(setsockopt) \
+    XX(sendfile) \
+    XX(splice) \
+    XX(tee) \
+    XX(open) \
+    XX(pread) \
+    XX(pwrite) \
+    XX(fsync) \
+    XX(stat)
 
     void hook_init() {
         static bool is_inited = false;
@@ -73,10 +89,66 @@ namespace sylar {
         t_hook_enable = flag;
     }
 
+    /**
+     * @brief 协程私有的IO超时状态
+     * @details 每个协程只分配一次，挂在Fiber上跨do_io调用复用。
+     *          每次阻塞等待都会递增seq，超时回调只对自己那一轮的seq生效，
+     *          因此上一轮遗留的定时器回调不会误伤后续的IO。
+     */
     struct timer_info {
-        int cancelled = 0;
+        std::atomic<uint64_t> seq = {0};
+        std::atomic<uint64_t> timedout = {0};
     };
-    
+
+    static std::shared_ptr<timer_info> GetTimerInfo() {
+        sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
+        std::shared_ptr<timer_info> tinfo =
+            std::static_pointer_cast<timer_info>(fiber->getIoTimerState());
+        if(!tinfo) {
+            tinfo.reset(new timer_info);
+            fiber->setIoTimerState(tinfo);
+        }
+        return tinfo;
+    }
+
+    /**
+     * @brief 为当前这轮等待添加超时定时器，超时后取消fd上的事件
+     * @return 本轮等待的序号，用于判断是否超时
+     */
+    static uint64_t AddIoTimeout(const std::shared_ptr<timer_info>& tinfo, uint64_t to
+            ,int fd, sylar::IOManager* iom, uint32_t event, sylar::Timer::ptr& timer) {
+        uint64_t seq = ++tinfo->seq;
+        if(to == (uint64_t)-1) {
+            return seq;
+        }
+        std::weak_ptr<timer_info> winfo(tinfo);
+        timer = iom->addTimer(to, [winfo, seq, fd, iom, event](){
+            auto t = winfo.lock();      // 协程已销毁
+            if(!t || t->seq != seq) {   // 不是本轮等待的定时器
+                return;
+            }
+            t->timedout = seq;
+            iom->cancelEvent(fd, (sylar::IOManager::Event)(event));
+        });
+        return seq;
+    }
+
+    /**
+     * @brief 在阻塞IO线程池中执行一次系统调用, 当前协程挂起直到完成
+     * @details 普通文件总是"就绪"的, epoll无法等待磁盘IO
+     */
+    template<typename OriginFun, typename ... Args>
+    static auto do_blocking(OriginFun fun, Args&&... args) -> decltype(fun(args...)) {
+        decltype(fun(args...)) rt = -1;
+        int err = 0;
+        sylar::BlockingPoolMgr::GetInstance()->run([&](){
+            rt = fun(args...);
+            err = errno;
+        });
+        errno = err;
+        return rt;
+    }
+
     template<typename OriginFun, typename ... Args>
     static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name
             ,uint32_t event, int timeout_so, Args&&... args) {
@@ -84,11 +156,26 @@ namespace sylar {
             return fun(fd, std::forward<Args>(args)...);
         }
 
-        __LOG_DEBUG(g_logger) << "do_io<" << hook_fun_name << ">";
+        if(__UNLIKELY(sylar::FdMgr::GetInstance()->isFile(fd))) {
+            return do_blocking(fun, fd, std::forward<Args>(args)...);
+        }
+
+        // 快速路径：socket已被设为非阻塞，先直接尝试系统调用，
+        // 只有在EAGAIN时才需要查询FdCtx、分配定时器并挂起协程
+        ssize_t n = fun(fd, std::forward<Args>(args)...);
+        while(n == -1 && errno == EINTR) {              // 信号中断，读或者写失败，重试
+            n = fun(fd, std::forward<Args>(args)...);
+        }
+        if(__LIKELY(n != -1 || errno != EAGAIN)) {
+            return n;
+        }
+
+        __LOG_DEBUG(g_logger) << "do_io<" << hook_fun_name << "> EAGAIN";
 
         sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);   //fd是非阻塞的
         if(!ctx) {
-            return fun(fd, std::forward<Args>(args)...);
+            errno = EAGAIN;
+            return -1;
         }
 
         if(ctx->isClosed()) {
@@ -96,36 +183,19 @@ namespace sylar {
             return -1;
         }
 
-        if(!ctx->isSocket() || ctx->getUserNonblock()) {   // 如非socket或者用户设定的非阻塞态，就什么也不做
-            return fun(fd, std::forward<Args>(args)...);
+        if(!ctx->isSocket() || ctx->getUserNonblock()) {   // 如非socket或者用户设定的非阻塞态，直接把EAGAIN交给用户
+            errno = EAGAIN;
+            return -1;
         }
 
         uint64_t to = ctx->getTimeout(timeout_so);
-        std::shared_ptr<timer_info> tinfo(new timer_info);
-
-    retry:
-        ssize_t n = fun(fd, std::forward<Args>(args)...);
+        std::shared_ptr<timer_info> tinfo = GetTimerInfo();
 
-        while(n == -1 && errno == EINTR) {              // 信号中断，读或者写失败，重试
-            n = fun(fd, std::forward<Args>(args)...);
-        }
-
-        if(n == -1 && errno == EAGAIN) {                // 非阻塞error，提示没读到数据，稍后重试
+        do {                                            // 非阻塞error，提示没读到数据，等待可读写后重试
             sylar::IOManager* iom = sylar::IOManager::GetThis();
             sylar::Timer::ptr timer;
-            std::weak_ptr<timer_info> winfo(tinfo);     
+            uint64_t seq = AddIoTimeout(tinfo, to, fd, iom, event, timer);
 
-            if(to != (uint64_t) -1) {   // 有设定超时时间
-                timer = iom->addConditionTimer(to, [winfo, fd, iom, event](){
-                    auto t = winfo.lock();      // 取出shared_ptr
-                    if(!t || t->cancelled) {    // 若t不存在，或者t已经被取消掉了，则不再执行后续
-                        return;
-                    }
-                    t->cancelled = ETIMEDOUT;
-                    iom->cancelEvent(fd, (sylar::IOManager::Event)(event));
-                }, winfo);
-            }
-            // 上次的错误，括号写错了，将后面重试的方法写在了超时情况下，导致其不能切出协程，进行Goto重试
             int rt = iom->addEvent(fd, (sylar::IOManager::Event)(event));
             if(rt) {
                 __LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
@@ -134,22 +204,101 @@ namespace sylar {
                     timer->cancel();
                 }
                 return -1;
-            } else {
-                sylar::Fiber::YieldToHold();
+            }
+            // fd在重试与addEvent之间被关闭, 关闭时的cancelAll已经错过了这次等待
+            if(ctx->isClosed() && iom->delEvent(fd, (sylar::IOManager::Event)(event))) {
                 if(timer) {
                     timer->cancel();
                 }
-                if(tinfo->cancelled) {
-                    errno = tinfo->cancelled;
-                    return -1;
-                }
-                goto retry;
+                errno = EBADF;
+                return -1;
             }
-        }
+            sylar::Fiber::YieldToHold();
+            if(timer) {
+                timer->cancel();
+            }
+            if(tinfo->timedout == seq) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if(ctx->isClosed()) {
+                errno = EBADF;
+                return -1;
+            }
+
+            n = fun(fd, std::forward<Args>(args)...);
+            while(n == -1 && errno == EINTR) {
+                n = fun(fd, std::forward<Args>(args)...);
+            }
+        } while(n == -1 && errno == EAGAIN);
         return n;
     }
 }
 
+namespace sylar {
+    /**
+     * @brief 在没有FdCtx的fd(管道)上等待就绪后重试
+     * @details 管道不经过FdManager登记, 没有超时设置。EAGAIN可能来自任一端,
+     *          在输入端可读和输出端可写之间交替等待
+     * @param[in] in_fd 输入端, -1表示不可等待(如普通文件)
+     * @param[in] out_fd 输出端, -1表示不可等待
+     */
+    template<typename Fn>
+    static ssize_t do_pipe_io(const char* hook_fun_name, Fn fun, int in_fd, int out_fd) {
+        bool wait_in = in_fd >= 0;
+        while(true) {
+            ssize_t n = fun();
+            while(n == -1 && errno == EINTR) {
+                n = fun();
+            }
+            if(n != -1 || errno != EAGAIN) {
+                return n;
+            }
+            int fd = wait_in ? in_fd : out_fd;
+            sylar::IOManager* iom = sylar::IOManager::GetThis();
+            if(fd < 0 || !iom) {
+                errno = EAGAIN;
+                return -1;
+            }
+            if(iom->addEvent(fd, wait_in ? sylar::IOManager::READ : sylar::IOManager::WRITE)) {
+                __LOG_ERROR(g_logger) << hook_fun_name << " addEvent(" << fd << ")";
+                errno = EAGAIN;
+                return -1;
+            }
+            sylar::Fiber::YieldToHold();
+            if(in_fd >= 0 && out_fd >= 0) {
+                wait_in = !wait_in;
+            }
+        }
+    }
+
+    /**
+     * @brief splice在socket和管道之间搬运返回EAGAIN时, 管道一端未就绪则在管道上等待
+     * @details 管道满(socket->管道)或空(管道->socket)时splice同样返回EAGAIN,
+     *          此时在socket上等待不会被唤醒
+     * @param[in] pipe_fd 管道fd
+     * @param[in] event 管道一端需要的事件
+     * @return 在管道上等待过返回true; 管道已就绪(EAGAIN来自socket一端)返回false
+     */
+    static bool wait_pipe_ready(int pipe_fd, IOManager::Event event) {
+        struct pollfd pfd;
+        pfd.fd = pipe_fd;
+        pfd.events = event == IOManager::READ ? POLLIN : POLLOUT;
+        pfd.revents = 0;
+        // 就绪、出错或对端关闭都交给下一次splice报告
+        if(::poll(&pfd, 1, 0) != 0) {
+            return false;
+        }
+        IOManager* iom = IOManager::GetThis();
+        if(!iom || iom->addEvent(pipe_fd, event)) {
+            __LOG_ERROR(g_logger) << "splice addEvent(" << pipe_fd << ")";
+            return false;
+        }
+        Fiber::YieldToHold();
+        return true;
+    }
+}
+
 extern "C" {
 #define XX(name) name ## _fun name ## _f = nullptr; //sleep_fun sleep_f = nullptr;
     HOOK_FUN(XX);           
@@ -177,7 +326,7 @@ extern "C" {
 
         sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
         sylar::IOManager* iom = sylar::IOManager::GetThis();
-        iom->addTimer(usec / 1000, [iom, fiber](){
+        iom->addTimer(std::chrono::microseconds(usec), [iom, fiber](){
             iom->schedule(fiber);
         });
         sylar::Fiber::YieldToHold();
@@ -188,10 +337,11 @@ extern "C" {
         if(!sylar::t_hook_enable) {
             return nanosleep_f(rqtp, rmtp);
         }
-        int timeout_ms = rqtp->tv_sec * 1000 + rqtp->tv_nsec / 1000 / 1000;
+        std::chrono::nanoseconds timeout = std::chrono::seconds(rqtp->tv_sec)
+                                         + std::chrono::nanoseconds(rqtp->tv_nsec);
         sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
         sylar::IOManager* iom = sylar::IOManager::GetThis();
-        iom->addTimer(timeout_ms, [iom, fiber](){
+        iom->addTimer(timeout, [iom, fiber](){
             iom->schedule(fiber);
         });
         sylar::Fiber::YieldToHold();
@@ -231,19 +381,9 @@ extern "C" {
         // 设置定时器
         sylar::IOManager* iom = sylar::IOManager::GetThis();
         sylar::Timer::ptr timer;
-        std::shared_ptr<sylar::timer_info> tinfo(new sylar::timer_info);
-        std::weak_ptr<sylar::timer_info> winfo(tinfo);
-        
-        if(timeout_ms != (uint64_t)-1) {    // 如设定了时间
-            timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom](){ // 添加条件定时器，若winfo存在则执行条件回调函数
-                auto t = winfo.lock();
-                if(!t || t->cancelled) {    // 确保定时器结束时，timer销毁，同时设定t被取消，也就是说timer超时了
-                    return;
-                }
-                t->cancelled = ETIMEDOUT;   // 确认t销毁
-                iom->cancelEvent(fd, sylar::IOManager::WRITE);  // 取消connect的写事件
-            }, winfo);
-        }
+        std::shared_ptr<sylar::timer_info> tinfo = sylar::GetTimerInfo();
+        // 添加条件定时器，超时后取消connect的写事件
+        uint64_t seq = sylar::AddIoTimeout(tinfo, timeout_ms, fd, iom, sylar::IOManager::WRITE, timer);
 
         int rt = iom->addEvent(fd, sylar::IOManager::WRITE);    // 添加写事件
         if(rt == 0) {   // 添加成功
@@ -251,8 +391,8 @@ extern "C" {
             if(timer) {                     // 如果timer存在，调用cancel取消定时器
                 timer->cancel();
             }
-            if(tinfo->cancelled) {          // 如果取消被设定
-                errno = tinfo->cancelled;   // errno会报超时错误
+            if(tinfo->timedout == seq) {    // 本轮等待超时
+                errno = ETIMEDOUT;          // errno会报超时错误
                 return -1;
             }
         } else {
@@ -285,6 +425,19 @@ extern "C" {
         }
         return fd;
     }
+    int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+        // 与accept一样总是以系统非阻塞方式创建, 省去登记时的fcntl; 用户要求的非阻塞记为用户态
+        int fd = do_io(sockfd, accept4_f, "accept4", sylar::IOManager::READ, SO_RCVTIMEO
+                        ,addr, addrlen, flags | SOCK_NONBLOCK);
+        if(fd >= 0) {
+            sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->addSocket(fd);
+            if(ctx && (flags & SOCK_NONBLOCK)) {
+                ctx->setUserNonblock(true);
+            }
+        }
+        return fd;
+    }
+
     //read
     ssize_t read(int fd, void *buf, size_t count) {
         return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO,buf, count);
@@ -308,6 +461,10 @@ extern "C" {
         return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
     }
 
+    int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout) {
+        return do_io(sockfd, recvmmsg_f, "recvmmsg", sylar::IOManager::READ, SO_RCVTIMEO, msgvec, vlen, flags, timeout);
+    }
+
     // write
     ssize_t write(int fd, const void *buf, size_t count) {
         return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
@@ -329,18 +486,128 @@ extern "C" {
         return do_io(sockfd, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
     }
 
-    int close(int fd) {
+    int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+        return do_io(sockfd, sendmmsg_f, "sendmmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msgvec, vlen, flags);
+    }
+
+    // zero copy
+    ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+        return do_io(out_fd, sendfile_f, "sendfile", sylar::IOManager::WRITE, SO_SNDTIMEO, in_fd, offset, count);
+    }
+
+    ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+        if(!sylar::t_hook_enable || (flags & SPLICE_F_NONBLOCK)) {
+            return splice_f(fd_in, off_in, fd_out, off_out, len, flags);
+        }
+        // 管道一端总是非阻塞操作; 一端是socket时, 管道满/空引起的EAGAIN先在管道上等待,
+        // 管道就绪后仍然EAGAIN才由do_io在socket一端等待
+        flags |= SPLICE_F_NONBLOCK;
+        auto fun = [=](int) {
+            return splice_f(fd_in, off_in, fd_out, off_out, len, flags);
+        };
+        sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd_in);
+        if(ctx && ctx->isSocket()) {
+            return do_io(fd_in, [=](int) {
+                ssize_t n = fun(0);
+                while(n == -1 && errno == EAGAIN) {
+                    if(!sylar::wait_pipe_ready(fd_out, sylar::IOManager::WRITE)) {
+                        errno = EAGAIN;
+                        break;
+                    }
+                    n = fun(0);
+                }
+                return n;
+            }, "splice", sylar::IOManager::READ, SO_RCVTIMEO);
+        }
+        bool in_is_file = ctx && ctx->isFile();
+        ctx = sylar::FdMgr::GetInstance()->get(fd_out);
+        if(ctx && ctx->isSocket()) {
+            return do_io(fd_out, [=](int) {
+                ssize_t n = fun(0);
+                while(n == -1 && errno == EAGAIN) {
+                    if(!sylar::wait_pipe_ready(fd_in, sylar::IOManager::READ)) {
+                        errno = EAGAIN;
+                        break;
+                    }
+                    n = fun(0);
+                }
+                return n;
+            }, "splice", sylar::IOManager::WRITE, SO_SNDTIMEO);
+        }
+        return sylar::do_pipe_io("splice", std::bind(fun, 0), in_is_file ? -1 : fd_in, fd_out);
+    }
+
+    ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+        if(!sylar::t_hook_enable || (flags & SPLICE_F_NONBLOCK)) {
+            return tee_f(fd_in, fd_out, len, flags);
+        }
+        flags |= SPLICE_F_NONBLOCK;
+        return sylar::do_pipe_io("tee", [=]() {
+            return tee_f(fd_in, fd_out, len, flags);
+        }, fd_in, fd_out);
+    }
+
+    // file
+    int open(const char *pathname, int flags, ... /* mode_t mode */) {
+        mode_t mode = 0;
+        if((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+            va_list va;
+            va_start(va, flags);
+            mode = va_arg(va, mode_t);
+            va_end(va);
+        }
+        if(__UNLIKELY(!open_f)) {
+            // 其他库的静态初始化可能早于hook_init
+            sylar::hook_init();
+        }
         if(!sylar::t_hook_enable) {
-            return close_f(fd);
+            return open_f(pathname, flags, mode);
         }
-        sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
-        if(ctx) {
-            auto iom = sylar::IOManager::GetThis();
-            if(iom) {
-                iom->cancelAll(fd);
-            }
-            sylar::FdMgr::GetInstance()->del(fd);
+        int fd = sylar::do_blocking(open_f, pathname, flags, mode);
+        if(fd >= 0) {
+            // 登记fd类型, 之后对普通文件的read/write转交阻塞IO线程池
+            sylar::FdMgr::GetInstance()->get(fd, true);
+        }
+        return fd;
+    }
+
+    ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+        if(!sylar::t_hook_enable) {
+            return pread_f(fd, buf, count, offset);
+        }
+        return sylar::do_blocking(pread_f, fd, buf, count, offset);
+    }
+
+    ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+        if(!sylar::t_hook_enable) {
+            return pwrite_f(fd, buf, count, offset);
+        }
+        return sylar::do_blocking(pwrite_f, fd, buf, count, offset);
+    }
+
+    int fsync(int fd) {
+        if(!sylar::t_hook_enable) {
+            return fsync_f(fd);
         }
+        return sylar::do_blocking(fsync_f, fd);
+    }
+
+    int stat(const char *pathname, struct stat *statbuf) {
+        if(__UNLIKELY(!stat_f)) {
+            sylar::hook_init();
+        }
+        if(!sylar::t_hook_enable) {
+            return stat_f(pathname, statbuf);
+        }
+        return sylar::do_blocking(stat_f, pathname, statbuf);
+    }
+
+    int close(int fd) {
+        // fd常驻注册在epoll中, 无论是否开启hook、在哪个线程关闭, 都要先注销;
+        // 管道等没有FdCtx的fd也可能被splice/tee注册过
+        // 先标记关闭, 被唤醒的等待者据此返回EBADF而不是重新等待
+        sylar::FdMgr::GetInstance()->del(fd);
+        sylar::IOManager::NotifyFdClosed(fd);
         return close_f(fd);
     }
 
@@ -6,6 +6,7 @@
 #include <sys/ioctl.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <stdint.h>
 namespace sylar
@@ -36,6 +37,9 @@ extern "C"{
     typedef int (*accept_fun) (int sockfd, struct sockaddr *addr, socklen_t *addrlen);
     extern accept_fun accept_f;
 
+    typedef int (*accept4_fun) (int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+    extern accept4_fun accept4_f;
+
     // read
     typedef ssize_t (*read_fun) (int fd, void *buf, size_t count);
     extern read_fun read_f;
@@ -52,6 +56,9 @@ extern "C"{
     typedef ssize_t (*recvmsg_fun)(int sockfd, struct msghdr *msg, int flags);
     extern recvmsg_fun recvmsg_f;
 
+    typedef int (*recvmmsg_fun)(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+    extern recvmmsg_fun recvmmsg_f;
+
     // write
     typedef ssize_t (*write_fun)(int fd, const void *buf, size_t count);
     extern write_fun write_f;
@@ -68,6 +75,9 @@ extern "C"{
     typedef ssize_t (*sendmsg_fun) (int sockfd, const struct msghdr *msg, int flags);
     extern sendmsg_fun sendmsg_f;
 
+    typedef int (*sendmmsg_fun) (int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+    extern sendmmsg_fun sendmmsg_f;
+
     // close
     typedef int (*close_fun) (int fd);
     extern close_fun close_f;
@@ -85,6 +95,32 @@ extern "C"{
     typedef int (*setsockopt_fun) (int sockfd, int level, int optname, const void *optval, socklen_t optlen);
     extern setsockopt_fun setsockopt_f;
 
+    // zero copy
+    typedef ssize_t (*sendfile_fun) (int out_fd, int in_fd, off_t *offset, size_t count);
+    extern sendfile_fun sendfile_f;
+
+    typedef ssize_t (*splice_fun) (int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags);
+    extern splice_fun splice_f;
+
+    typedef ssize_t (*tee_fun) (int fd_in, int fd_out, size_t len, unsigned int flags);
+    extern tee_fun tee_f;
+
+    // file, 在阻塞IO线程池中执行
+    typedef int (*open_fun) (const char *pathname, int flags, ... /* mode_t mode */);
+    extern open_fun open_f;
+
+    typedef ssize_t (*pread_fun) (int fd, void *buf, size_t count, off_t offset);
+    extern pread_fun pread_f;
+
+    typedef ssize_t (*pwrite_fun) (int fd, const void *buf, size_t count, off_t offset);
+    extern pwrite_fun pwrite_f;
+
+    typedef int (*fsync_fun) (int fd);
+    extern fsync_fun fsync_f;
+
+    typedef int (*stat_fun) (const char *pathname, struct stat *statbuf);
+    extern stat_fun stat_f;
+
     extern int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen, uint64_t timeout_ms);
 }
 
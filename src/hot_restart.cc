@@ -0,0 +1,265 @@
+#include "hot_restart.h"
+#include "config.h"
+#include "log.h"
+#include "iomanager.h"
+#include <sys/socket.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace sylar {
+
+    static sylar::ConfigVar<std::string>::ptr g_hot_restart_path =
+        sylar::Config::Lookup("hot_restart.path", std::string(""),
+        "hot restart unix socket path, empty disables listener inheritance");
+
+    static sylar::ConfigVar<uint64_t>::ptr g_hot_restart_timeout =
+        sylar::Config::Lookup("hot_restart.timeout", (uint64_t)(10 * 1000),
+        "hot restart handoff timeout in ms");
+
+    static sylar::Logger::ptr g_logger = __LOG_NAME("system");
+
+    /// 新进程启动完成后发送的确认
+    static const char s_ready[] = "ready";
+
+    /**
+     * @brief 发送一个消息, 附带fd(fd为-1时不附带)
+     */
+    static bool SendFd(Socket::ptr sock, const std::string& data, int fd) {
+        iovec iov;
+        iov.iov_base = (void*)data.c_str();
+        iov.iov_len = data.size();
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        char control[CMSG_SPACE(sizeof(int))];
+        if(fd != -1) {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+        return ::sendmsg(sock->getSocket(), &msg, MSG_NOSIGNAL) == (ssize_t)data.size();
+    }
+
+    /**
+     * @brief 接收一个消息和它附带的fd
+     * @param[out] fd 附带的fd, 没有时为-1
+     */
+    static bool RecvFd(Socket::ptr sock, std::string& data, int& fd) {
+        char buf[256];
+        iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        char control[CMSG_SPACE(sizeof(int))];
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        fd = -1;
+        ssize_t rt = ::recvmsg(sock->getSocket(), &msg, MSG_CMSG_CLOEXEC);
+        if(rt <= 0) {
+            return false;
+        }
+        for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        if(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+            __LOG_ERROR(g_logger) << "hot restart message truncated";
+            if(fd != -1) {
+                ::close(fd);
+                fd = -1;
+            }
+            return false;
+        }
+        data.assign(buf, rt);
+        return true;
+    }
+
+    HotRestart::HotRestart()
+        :m_inherited(false) {
+    }
+
+    HotRestart::~HotRestart() {
+        for(auto& i : m_fds) {
+            for(auto& fd : i.second) {
+                ::close(fd);
+            }
+        }
+    }
+
+    bool HotRestart::inherit(const std::string& path) {
+        MutexType::Lock lock(m_mutex);
+        m_inherited = true;
+        return inheritNoLock(path.empty() ? g_hot_restart_path->getValue() : path);
+    }
+
+    bool HotRestart::inheritNoLock(const std::string& path) {
+        if(path.empty() || access(path.c_str(), F_OK)) {
+            // 没有上一代进程
+            return false;
+        }
+        Socket::ptr sock(new Socket(AF_UNIX, SOCK_SEQPACKET, 0));
+        uint64_t timeout = g_hot_restart_timeout->getValue();
+        if(!sock->connect(UnixAddress::ptr(new UnixAddress(path)), timeout)) {
+            return false;
+        }
+        sock->setRecvTimeout(timeout);
+
+        std::string data;
+        int fd = -1;
+        if(!RecvFd(sock, data, fd)) {
+            __LOG_ERROR(g_logger) << "hot restart recv header from " << path
+                << " fail errno=" << errno << " errstr=" << strerror(errno);
+            return false;
+        }
+        size_t count = strtoul(data.c_str(), nullptr, 10);
+        for(size_t i = 0; i < count; ++i) {
+            if(!RecvFd(sock, data, fd) || fd == -1) {
+                __LOG_ERROR(g_logger) << "hot restart recv listener " << i << "/" << count
+                    << " from " << path << " fail errno=" << errno
+                    << " errstr=" << strerror(errno);
+                return false;
+            }
+            __LOG_INFO(g_logger) << "hot restart inherit fd=" << fd << " addr=" << data;
+            m_fds[data].push_back(fd);
+        }
+        m_parent = sock;
+        return true;
+    }
+
+    int HotRestart::take(Address::ptr addr) {
+        MutexType::Lock lock(m_mutex);
+        if(!m_inherited) {
+            m_inherited = true;
+            inheritNoLock(g_hot_restart_path->getValue());
+        }
+        auto it = m_fds.find(addr->toString());
+        if(it == m_fds.end()) {
+            return -1;
+        }
+        int fd = it->second.front();
+        it->second.pop_front();
+        if(it->second.empty()) {
+            m_fds.erase(it);
+        }
+        return fd;
+    }
+
+    void HotRestart::ready() {
+        MutexType::Lock lock(m_mutex);
+        for(auto& i : m_fds) {
+            // 同一个监听队列还被本进程之外引用, 关闭不影响其中的连接; SO_REUSEPORT组中的
+            // socket被关闭时, 其队列中的连接会被重置, 两代进程的acceptors配置应保持一致
+            __LOG_WARN(g_logger) << "hot restart close " << i.second.size()
+                << " unused listener(s) addr=" << i.first;
+            for(auto& fd : i.second) {
+                ::close(fd);
+            }
+        }
+        m_fds.clear();
+        if(m_parent) {
+            SendFd(m_parent, s_ready, -1);
+            m_parent->close();
+            m_parent.reset();
+        }
+    }
+
+    bool HotRestart::serve(const std::vector<TcpServer::ptr>& servers
+                           ,std::function<void()> cb, const std::string& path) {
+        IOManager* iom = IOManager::GetThis();
+        std::string p = path.empty() ? g_hot_restart_path->getValue() : path;
+        if(!iom || p.empty()) {
+            __LOG_ERROR(g_logger) << "hot restart serve need IOManager and path, path=" << p;
+            return false;
+        }
+        Socket::ptr listener(new Socket(AF_UNIX, SOCK_SEQPACKET, 0));
+        // 地址被上一代进程占用时, 流式探测连接不上, bind会先删除旧地址
+        if(!listener->bind(UnixAddress::ptr(new UnixAddress(p))) || !listener->listen()) {
+            return false;
+        }
+        __LOG_INFO(g_logger) << "hot restart serve on " << p;
+        iom->schedule([this, listener, servers, cb](){
+            // EMFILE等持续的错误时退避, 避免空转刷日志; 在协程中usleep只挂起当前协程
+            static const uint64_t s_backoff_us = 100 * 1000;
+            bool handed = false;
+            while(true) {
+                Socket::ptr peer = listener->accept();
+                if(!peer) {
+                    int err = errno;
+                    __LOG_ERROR(g_logger) << "hot restart accept errno=" << err
+                        << " errstr=" << strerror(err);
+                    if(!listener->isValid() || err == EBADF) {
+                        break;
+                    }
+                    usleep(s_backoff_us);
+                    continue;
+                }
+                if(handoff(peer, servers)) {
+                    handed = true;
+                    break;
+                }
+            }
+            // 地址此时可能已被下一代进程重新bind, 只关闭不删除
+            listener->close();
+            if(!handed) {
+                // 监听socket失效, 不再接受交接, 当前进程继续服务
+                __LOG_ERROR(g_logger) << "hot restart listener closed, stop serving handoff";
+                return;
+            }
+            for(auto& i : servers) {
+                i->stop();
+            }
+            for(auto& i : servers) {
+                i->drain();
+            }
+            __LOG_INFO(g_logger) << "hot restart drained";
+            if(cb) {
+                cb();
+            }
+        });
+        return true;
+    }
+
+    bool HotRestart::handoff(Socket::ptr peer, const std::vector<TcpServer::ptr>& servers) {
+        std::vector<Socket::ptr> socks;
+        for(auto& i : servers) {
+            std::vector<Socket::ptr> v = i->getSocks();
+            socks.insert(socks.end(), v.begin(), v.end());
+        }
+        if(!SendFd(peer, std::to_string(socks.size()), -1)) {
+            __LOG_ERROR(g_logger) << "hot restart send header errno=" << errno
+                << " errstr=" << strerror(errno);
+            return false;
+        }
+        for(auto& sock : socks) {
+            if(!SendFd(peer, sock->getLocalAddress()->toString(), sock->getSocket())) {
+                __LOG_ERROR(g_logger) << "hot restart send " << *sock << " errno=" << errno
+                    << " errstr=" << strerror(errno);
+                return false;
+            }
+        }
+        __LOG_INFO(g_logger) << "hot restart sent " << socks.size() << " listener(s), wait ready";
+
+        peer->setRecvTimeout(g_hot_restart_timeout->getValue());
+        std::string data;
+        int fd = -1;
+        if(!RecvFd(peer, data, fd) || data != s_ready) {
+            if(fd != -1) {
+                ::close(fd);
+            }
+            __LOG_WARN(g_logger) << "hot restart peer not ready errno=" << errno
+                << " errstr=" << strerror(errno) << ", keep serving";
+            return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,90 @@
+/**
+ * @file hot_restart.h
+ * @brief 进程热重启: 在新旧两代进程之间交接监听socket
+ */
+#ifndef __HOT_RESTART_H__
+#define __HOT_RESTART_H__
+
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "tcp_server.h"
+#include "mutex.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief 监听socket交接
+ * @details 旧进程调用serve在Unix域地址(SOCK_SEQPACKET)上等待下一代进程。
+ *          新进程连接该地址, 旧进程把所有监听socket的fd通过SCM_RIGHTS发送过去,
+ *          每个消息携带一个fd和它的本地地址。新进程的TcpServer::bind按地址取用继承的fd,
+ *          不再重新bind/listen, 两代进程共享同一个监听队列, 已在队列中的连接不会丢失。
+ *          新进程启动服务后调用ready通知旧进程, 旧进程停止accept并drain已有连接;
+ *          ready之前两代进程同时accept。交接失败(新进程退出或超时未ready)时旧进程继续服务
+ */
+class HotRestart : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    HotRestart();
+    ~HotRestart();
+
+    /**
+     * @brief 新进程: 连接上一代进程, 接收它的全部监听socket
+     * @param[in] path 交接地址, 为空时使用配置 hot_restart.path
+     * @return 是否收到; 没有上一代进程时返回false
+     */
+    bool inherit(const std::string& path = "");
+
+    /**
+     * @brief 取出一个继承的、本地地址为addr的监听socket
+     * @details 配置了 hot_restart.path 且尚未inherit时先inherit一次, 由TcpServer::bind调用
+     * @return fd, 没有时返回-1; 取出的fd由调用者负责关闭
+     */
+    int take(Address::ptr addr);
+
+    /**
+     * @brief 新进程: 服务已启动, 关闭没有被取用的继承fd并通知上一代进程退出
+     */
+    void ready();
+
+    /**
+     * @brief 旧进程: 在交接地址上等待下一代进程, 在当前IOManager的协程中后台运行
+     * @details 交接成功后对所有servers先stop再drain, 最后调用cb(通常用来退出进程)。
+     *          交接地址已存在时会被替换, 旧进程在交接后不删除它, 下一代进程可以直接在同一地址上serve
+     * @param[in] servers 要交接的服务, 需已bind
+     * @param[in] cb drain结束后的回调
+     * @param[in] path 交接地址, 为空时使用配置 hot_restart.path
+     * @return 是否开始等待
+     */
+    bool serve(const std::vector<TcpServer::ptr>& servers
+               ,std::function<void()> cb, const std::string& path = "");
+private:
+    /**
+     * @brief 把servers的监听socket发送给peer并等待ready
+     */
+    bool handoff(Socket::ptr peer, const std::vector<TcpServer::ptr>& servers);
+
+    /**
+     * @brief 接收fd, 调用前需持有m_mutex
+     */
+    bool inheritNoLock(const std::string& path);
+private:
+    MutexType m_mutex;
+    /// 是否尝试过inherit
+    bool m_inherited;
+    /// 本地地址 -> 继承的fd
+    std::map<std::string, std::list<int> > m_fds;
+    /// 与上一代进程的连接, ready时通知后关闭
+    Socket::ptr m_parent;
+};
+
+typedef Singleton<HotRestart> HotRestartMgr;
+
+}
+
+#endif
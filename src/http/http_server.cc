@@ -18,14 +18,16 @@ namespace http {
                     << *client;
                     break;
             }
-            HttpResponse::ptr rsp(new HttpResponse(req->getVersion(), req->isClose() || !m_isKeepalive));
+            // 停止(drain)后处理完当前请求即关闭连接
+            HttpResponse::ptr rsp(new HttpResponse(req->getVersion()
+                        , req->isClose() || !m_isKeepalive || isStop()));
             rsp->setBody("hello sylar");
             __LOG_INFO(g_logger) << "request:" << std::endl
                 << *req;
             __LOG_INFO(g_logger) << "response:" << std::endl
                 << *rsp;
             session->sendReponse(rsp);
-        } while(m_isKeepalive);
+        } while(m_isKeepalive && !isStop());
     }
 }
 }
\ No newline at end of file
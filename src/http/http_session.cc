@@ -5,58 +5,41 @@ namespace http {
 
     HttpSession::HttpSession(Socket::ptr sock, bool owner) 
         :SocketStream(sock, owner){
-
+        m_buffer.reset(new BufferedStream(Stream::ptr(new SocketStream(sock, false))
+                    ,HttpRequestParser::GetHttpRequestBufferSize()));
+        setWriteBuffer(true);
     }
     HttpRequest::ptr HttpSession::recvRequest() {
         HttpRequestParser::ptr parser(new HttpRequestParser);
-        uint64_t buff_size = HttpRequestParser::GetHttpRequestBufferSize();
-        //uint64_t buff_size = 100;
-        std::shared_ptr<char> buffer(
-                new char[buff_size], [](char* ptr){
-                    delete[] ptr;
-                });
-        char* data = buffer.get();
-        int offset = 0;
-        do {
-            int len = read(data + offset, buff_size - offset);
-            if(len <= 0) {
-                close();
-                return nullptr;
-            }
-            len += offset;
-            size_t nparse = parser->execute(data, len);
-            if(parser->hasError()) {
-                close();
-                return nullptr;
+        // 头部在读缓冲区中原地解析, 缓冲区大小即头部长度上限
+        while(true) {
+            size_t len = m_buffer->getBufferedSize();
+            if(len > 0) {
+                size_t nparse = parser->execute(m_buffer->data(), len);
+                if(parser->hasError()) {
+                    close();
+                    return nullptr;
+                }
+                // execute把未解析的数据移到了开头
+                m_buffer->truncate(len - nparse);
+                if(parser->isFinished()) {
+                    break;
+                }
             }
-            offset = len - nparse;
-            if(offset == (int)buff_size) {
+            // 等待下一个请求之前发出合并的响应
+            if(flush() < 0 || m_buffer->fill() <= 0) {
                 close();
                 return nullptr;
             }
-            if(parser->isFinished()) {
-                break;
-            }
-        } while(true);  // offset最后指向偏移位置
+        }
         int64_t length = parser->getContentLength();    // 整个http消息的长度
         if(length > 0) {
             std::string body;
             body.resize(length);
-
-            int len = 0;
-            if(length >= offset) {
-                memcpy(&body[0], data, offset);
-                len = offset;
-            } else {
-                memcpy(&body[0], data, length);
-                len = length;
-            }
-            length -= offset;
-            if(length > 0) {    // 表明有些消息未读还需要读取length个长度个字节
-                if(readFixSize(&body[len], length) <= 0) {
-                    close();
-                    return nullptr;
-                }
+            // 先取缓冲区中的部分, 剩余的大块数据直接读入body
+            if(readFixSize(&body[0], length) <= 0) {
+                close();
+                return nullptr;
             }
             parser->getData()->setBody(body);
         }
@@ -64,11 +47,28 @@ namespace http {
         parser->getData()->init();
         return parser->getData();
     }
+    int HttpSession::read(void* buffer, size_t length) {
+        if(flush() < 0) {
+            return -1;
+        }
+        return m_buffer->read(buffer, length);
+    }
+    int HttpSession::read(ByteArray::ptr ba, size_t length) {
+        if(flush() < 0) {
+            return -1;
+        }
+        return m_buffer->read(ba, length);
+    }
     int HttpSession::sendReponse(HttpResponse::ptr rsp) {
         std::stringstream ss;
         ss << *rsp;
         std::string data = ss.str();
-        return writeFixSize(data.c_str(), data.size());
+        int rt = writeFixSize(data.c_str(), data.size());
+        // pipeline中已经收到下一个请求时, 响应留在写缓冲区里和下一个响应一起发送
+        if(rt > 0 && m_buffer->getBufferedSize() == 0 && flush() < 0) {
+            return -1;
+        }
+        return rt;
     }
 
 }
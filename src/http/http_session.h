@@ -1,6 +1,7 @@
 #ifndef __HTTP_SESSION_H__
 #define __HTTP_SESSION_H__
 #include "../socket_stream.h"
+#include "../buffered_stream.h"
 #include "http.h"
 #include <memory>
 
@@ -11,8 +12,20 @@ namespace http{
             typedef std::shared_ptr<HttpSession> ptr;
             HttpSession(Socket::ptr sock, bool owner = true);
             HttpRequest::ptr recvRequest();
+            /**
+             * @brief 发送响应
+             * @details 经写缓冲区发送; pipeline中下一个请求已到达时推迟到读下一个请求前再写出
+             */
             int sendReponse(HttpResponse::ptr rsp);
-        
+
+            /**
+             * @brief 读取数据, 先取走读缓冲区中未被请求解析消耗的数据
+             */
+            virtual int read(void* buffer, size_t length) override;
+            virtual int read(ByteArray::ptr ba, size_t length) override;
+        private:
+            /// 读缓冲区, 一个请求之后多读到的数据(如pipeline的下一个请求)留给下一次recvRequest
+            BufferedStream::ptr m_buffer;
     };
 }
 }
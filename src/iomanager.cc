@@ -1,18 +1,140 @@
 #include "iomanager.h"
 #include "macro.h"
 #include "log.h"
+#include "config.h"
+#include "hook.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
+#include <set>
+#include <sstream>
+#include <algorithm>
 
 namespace sylar {
 
     static sylar::Logger::ptr g_logger = __LOG_NAME("system");
 
+    static ConfigVar<bool>::ptr g_iomanager_timerfd =
+        Config::Lookup<bool>("iomanager.timerfd", true, "use timerfd for microsecond timer wakeup");
 
+    static ConfigVar<uint32_t>::ptr g_iomanager_epoll_events_min =
+        Config::Lookup<uint32_t>("iomanager.epoll_events.min", 32, "min events per epoll_wait");
+
+    static ConfigVar<uint32_t>::ptr g_iomanager_epoll_events_max =
+        Config::Lookup<uint32_t>("iomanager.epoll_events.max", 4096, "max events per epoll_wait");
+
+
+
+    /// 所有存活的IOManager, 用于fd关闭时统一注销
+    static RWMutex s_iomanagers_mutex;
+    static std::set<IOManager*> s_iomanagers;
+
+    /**
+     * @brief 每个fd当前被多少个IOManager注册在epoll中
+     * @details close时先查这里, 为0时不加全局锁也不遍历IOManager。
+     *          表不释放, 进程退出阶段的close仍可安全访问
+     */
+    static SegmentTable<std::atomic<uint32_t> >& FdRegistrations() {
+        static SegmentTable<std::atomic<uint32_t> >* s_table = new SegmentTable<std::atomic<uint32_t> >;
+        return *s_table;
+    }
+
+    /// 保护下面的信号集合
+    static Mutex s_signal_mutex;
+    /// 信号 -> 接管它的IOManager
+    static std::map<int, IOManager*> s_signal_owners;
+    /// 被接管的信号, 各线程需要屏蔽(静态零初始化即空集)
+    static sigset_t s_blocked_signals;
+    /// 曾被接管后又释放的信号, 各线程需要解除屏蔽
+    static sigset_t s_released_signals;
+
+    /// 接管的信号每变化一次加一
+    static std::atomic<uint64_t> s_signal_gen = {0};
+    /// 本线程已应用的s_signal_gen
+    static thread_local uint64_t t_signal_gen = 0;
+
+    /// 由ForwardSignal记下的信号, 第signo-1位
+    static std::atomic<uint64_t> s_forwarded_signals = {0};
+    /// 信号 -> 接管者tickle管道写端+1(静态零初始化即没有接管者)
+    static std::atomic<int> s_forward_fds[NSIG];
+    /// 接管前的处理方式, 释放时恢复
+    static struct sigaction s_old_actions[NSIG];
+
+    /**
+     * @brief 被接管信号的处理函数
+     * @details 信号只在IOManager的线程中被屏蔽, BlockingPool线程、启动调度前的caller线程
+     *          和用户线程仍可能收到它, 没有处理函数时默认动作会终止进程。
+     *          这里只记下信号并写tickle管道唤醒接管者, 由它在idle()中调度处理函数;
+     *          只使用异步信号安全的操作
+     */
+    static void ForwardSignal(int signo) {
+        int err = errno;
+        s_forwarded_signals.fetch_or(1ull << (signo - 1), std::memory_order_release);
+        int fd = s_forward_fds[signo].load(std::memory_order_acquire) - 1;
+        if(fd >= 0) {
+            char c = 'S';
+            syscall(SYS_write, fd, &c, 1);
+        }
+        errno = err;
+    }
+
+    /**
+     * @brief 接管的信号变化后调用, 需持有s_signal_mutex
+     * @details 协程切换时会恢复各自保存的屏蔽字, 因此同时交给Fiber在切入时同步
+     */
+    static void UpdateSignalMaskNoLock() {
+        Fiber::SetSignalMask(s_blocked_signals, s_released_signals);
+        ++s_signal_gen;
+    }
+
+    /**
+     * @brief 归还信号的所有权并恢复原处理方式, 需持有s_signal_mutex
+     */
+    static void ReleaseSignalNoLock(int signo) {
+        s_signal_owners.erase(signo);
+        sigdelset(&s_blocked_signals, signo);
+        sigaddset(&s_released_signals, signo);
+        s_forward_fds[signo].store(0, std::memory_order_release);
+        sigaction(signo, &s_old_actions[signo], nullptr);
+        s_forwarded_signals.fetch_and(~(1ull << (signo - 1)), std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 按当前接管的信号更新调用线程的信号屏蔽字
+     * @return 应用的版本
+     */
+    static uint64_t ApplySignalMask() {
+        sigset_t block;
+        sigset_t unblock;
+        uint64_t gen;
+        {
+            Mutex::Lock lock(s_signal_mutex);
+            block = s_blocked_signals;
+            unblock = s_released_signals;
+            gen = s_signal_gen;
+        }
+        pthread_sigmask(SIG_UNBLOCK, &unblock, nullptr);
+        pthread_sigmask(SIG_BLOCK, &block, nullptr);
+        t_signal_gen = gen;
+        return gen;
+    }
+
+    /**
+     * @brief BUSY状态只持续几条指令, 先忙等, 持有者被抢占时让出CPU
+     */
+    static inline void SpinWait(uint32_t& spins) {
+        if(++spins > 16) {
+            sched_yield();
+        }
+    }
 
     IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::Event event) {
         switch(event) {
@@ -26,29 +148,90 @@ namespace sylar {
         throw std::invalid_argument("getContext invalid event");
     }
 
-    void IOManager::FdContext::resetContext(EventContext& ctx) {
-        ctx.scheduler = nullptr;
-        ctx.fiber.reset();
-        ctx.cb = nullptr;
-    }
-
-    void IOManager::FdContext::triggerEvent(IOManager::Event event) {
-        //__LOG_INFO(g_logger) << "fd=" << fd
-        //    << " triggerEvent event=" << event
-        //    << " events=" << events;
-        __ASSERT(events & event);
-        //if(_UNLIKELY(!(event & event))) {
-        //    return;
-        //}
-        events = (Event)(events & ~event);
-        EventContext& ctx = getContext(event);
-        if(ctx.cb) {
-            ctx.scheduler->schedule(&ctx.cb);
+    std::atomic<uint32_t>& IOManager::FdContext::getState(IOManager::Event event) {
+        switch(event) {
+            case IOManager::READ:
+                return readState;
+            case IOManager::WRITE:
+                return writeState;
+            default:
+                __ASSERT2(false, "getState");
+        }
+        throw std::invalid_argument("getState invalid event");
+    }
+
+    /**
+     * @brief 调度从EventContext中取出的等待者
+     * @param[in] local 是否放入当前线程的本地批次
+     */
+    static void ScheduleWaiter(Scheduler* scheduler, Fiber::ptr& fiber
+                                ,std::function<void()>& cb, bool local = false) {
+        if(local) {
+            if(cb) {
+                scheduler->scheduleLocal(&cb);
+            } else {
+                scheduler->scheduleLocal(&fiber);
+            }
+        } else if(cb) {
+            scheduler->schedule(&cb);
         } else {
-            ctx.scheduler->schedule(&ctx.fiber);
+            scheduler->schedule(&fiber);
+        }
+    }
+
+    bool IOManager::FdContext::triggerEvent(IOManager::Event event) {
+        std::atomic<uint32_t>& state = getState(event);
+        uint32_t spins = 0;
+        while(true) {
+            uint32_t s = state.load(std::memory_order_acquire);
+            if(s == READY) {
+                return false;
+            }
+            if(s == EMPTY) {
+                if(state.compare_exchange_weak(s, READY, std::memory_order_acq_rel)) {
+                    return false;
+                }
+                continue;
+            }
+            if(s == WAITING) {
+                if(takeWaiter(event, true, true)) {
+                    return true;
+                }
+                continue;
+            }
+            SpinWait(spins);
+        }
+    }
+
+    bool IOManager::FdContext::takeWaiter(IOManager::Event event, bool trigger, bool local) {
+        std::atomic<uint32_t>& state = getState(event);
+        uint32_t spins = 0;
+        while(true) {
+            uint32_t s = state.load(std::memory_order_acquire);
+            if(s == EMPTY || s == READY) {
+                return false;
+            }
+            if(s == BUSY) {
+                SpinWait(spins);
+                continue;
+            }
+            if(!state.compare_exchange_weak(s, BUSY, std::memory_order_acquire)) {
+                continue;
+            }
+            EventContext& ctx = getContext(event);
+            Scheduler* scheduler = ctx.scheduler;
+            Fiber::ptr fiber;
+            std::function<void()> cb;
+            fiber.swap(ctx.fiber);
+            cb.swap(ctx.cb);
+            ctx.scheduler = nullptr;
+            state.store(EMPTY, std::memory_order_release);
+
+            if(trigger) {
+                ScheduleWaiter(scheduler, fiber, cb, local);
+            }
+            return true;
         }
-        ctx.scheduler = nullptr;
-        return;
     }
 
     IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
@@ -66,81 +249,193 @@ namespace sylar {
 
         rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
         __ASSERT(!rt);
+        // 写端也在信号处理函数中使用, 不能阻塞
+        rt = fcntl(m_tickleFds[1], F_SETFL, O_NONBLOCK);
+        __ASSERT(!rt);
 
         rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
         __ASSERT(!rt);
 
-        contextResize(32);
+        if(g_iomanager_timerfd->getValue()) {
+            m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if(m_timerFd >= 0) {
+                memset(&event, 0, sizeof(epoll_event));
+                event.events = EPOLLIN | EPOLLET;
+                event.data.fd = m_timerFd;
+                rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_timerFd, &event);
+                __ASSERT(!rt);
+            } else {
+                __LOG_WARN(g_logger) << "timerfd_create errno=" << errno
+                    << " errstr=" << strerror(errno) << ", fall back to ms timeout";
+            }
+        }
+
+        sigemptyset(&m_signalMask);
+        m_signalFd = signalfd(-1, &m_signalMask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if(m_signalFd >= 0) {
+            memset(&event, 0, sizeof(epoll_event));
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = m_signalFd;
+            rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_signalFd, &event);
+            __ASSERT(!rt);
+        } else {
+            __LOG_WARN(g_logger) << "signalfd errno=" << errno
+                << " errstr=" << strerror(errno);
+        }
+
+        getFdContext(0, true);
+        resetLoopStats();
+
+        {
+            RWMutex::WriteLock lock(s_iomanagers_mutex);
+            s_iomanagers.insert(this);
+        }
 
         start();
+        {
+            // 工作线程在首次进入idle()前也可能收到信号, 先登记为未更新,
+            // 使启动后立即接管信号时同样等待它们; 已登记的不覆盖
+            MutexType::Lock lock(m_sigmaskMutex);
+            for(auto& id : m_threadIds) {
+                if(id != m_rootThread) {
+                    m_sigmaskApplied.insert(std::make_pair(id, (uint64_t)0));
+                }
+            }
+        }
     }
 
     IOManager::~IOManager() {
         stop();
+        {
+            RWMutex::WriteLock lock(s_iomanagers_mutex);
+            s_iomanagers.erase(this);
+        }
+        // 随epfd一起关闭的注册不再计数
+        m_fdContexts.foreach([](FdContext& fd_ctx){
+            if(fd_ctx.registered.exchange(false)) {
+                std::atomic<uint32_t>* regs = FdRegistrations().get(fd_ctx.fd);
+                if(regs) {
+                    regs->fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+        });
         close(m_epfd);
         close(m_tickleFds[0]);
         close(m_tickleFds[1]);
-
-        for(size_t i = 0; i < m_fdContexts.size(); ++i) {
-            if(m_fdContexts[i]) {
-                delete m_fdContexts[i];
-            }
+        if(m_timerFd >= 0) {
+            close(m_timerFd);
+        }
+        if(m_signalFd >= 0) {
+            close(m_signalFd);
         }
+        // 工作线程已退出, 只需归还信号的所有权
+        Mutex::Lock lock(s_signal_mutex);
+        for(auto& i : m_signalHandlers) {
+            ReleaseSignalNoLock(i.first);
+        }
+        UpdateSignalMaskNoLock();
     }
 
-    void IOManager::contextResize(size_t size) {
-        m_fdContexts.resize(size);
-
-        for(size_t i = 0; i < m_fdContexts.size(); ++i) {
-            if(!m_fdContexts[i]) {
-                m_fdContexts[i] = new FdContext;
-                m_fdContexts[i]->fd = i;
-            }
+    IOManager::FdContext* IOManager::getFdContext(int fd, bool auto_create) {
+        if(fd < 0) {
+            return nullptr;
         }
+        if(!auto_create) {
+            return m_fdContexts.get(fd);
+        }
+        return m_fdContexts.getOrCreate(fd, [](FdContext& ctx, size_t idx){
+            ctx.fd = idx;
+        });
     }
 
-    int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-        FdContext* fd_ctx = nullptr;
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_fdContexts.size() > fd) {
-            fd_ctx = m_fdContexts[fd];
-            lock.unlock();
-        } else {
-            lock.unlock();
-            RWMutexType::WriteLock lock2(m_mutex);
-            contextResize(fd * 1.5);
-            fd_ctx = m_fdContexts[fd];
+    bool IOManager::registerFd(FdContext* fd_ctx) {
+        if(fd_ctx->registered.load(std::memory_order_acquire)) {
+            return true;
         }
-
-        FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-        if(!(fd_ctx->events & event)) {
-            __LOG_ERROR(g_logger) << "addEvent assert fd=" << fd
-                        << " event=" << event
-                        << " fd_ctx.event=" << fd_ctx->events;
-            __ASSERT(!(fd_ctx->events & event));
+        bool expected = false;
+        if(!fd_ctx->registered.compare_exchange_strong(expected, true)) {
+            return true;
         }
-
-        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        // 上次注销后残留的就绪令牌作废, ADD会重新报告真实状态
+        uint32_t ready = FdContext::READY;
+        fd_ctx->readState.compare_exchange_strong(ready, FdContext::EMPTY);
+        ready = FdContext::READY;
+        fd_ctx->writeState.compare_exchange_strong(ready, FdContext::EMPTY);
+        std::atomic<uint32_t>* regs = FdRegistrations().getOrCreate(fd_ctx->fd
+                ,[](std::atomic<uint32_t>& v, size_t){ v.store(0, std::memory_order_relaxed); });
+        if(regs) {
+            regs->fetch_add(1, std::memory_order_release);
+        }
+        // ADD时若fd已就绪, epoll会立即报告, 不会丢失注册前到达的边沿
         epoll_event epevent;
-        epevent.events = EPOLLET | fd_ctx->events | event;
+        memset(&epevent, 0, sizeof(epevent));
+        epevent.events = EPOLLIN | EPOLLOUT | EPOLLET;
         epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd_ctx->fd, &epevent);
+        if(rt && errno == EEXIST) {
+            rt = epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd_ctx->fd, &epevent);
+        }
         if(rt) {
             __LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                << op << ", " << fd << ", " << epevent.events << "):"
-                << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
-                << fd_ctx->events;
+                << EPOLL_CTL_ADD << ", " << fd_ctx->fd << ", " << epevent.events << "):"
+                << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            fd_ctx->registered = false;
+            if(regs) {
+                regs->fetch_sub(1, std::memory_order_relaxed);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
+        FdContext* fd_ctx = getFdContext(fd, true);
+        if(!fd_ctx) {
+            __LOG_ERROR(g_logger) << "addEvent fd=" << fd << " out of range, capacity="
+                << m_fdContexts.Capacity();
+            return -1;
+        }
+        if(!registerFd(fd_ctx)) {
             return -1;
         }
 
-        ++m_pendingEventCount;
-        fd_ctx->events = (Event)(fd_ctx->events | event);
+        std::atomic<uint32_t>& state = fd_ctx->getState(event);
+        uint32_t spins = 0;
+        while(true) {
+            uint32_t s = state.load(std::memory_order_acquire);
+            if(s == FdContext::READY) {
+                // 事件已先到达, 消费令牌后直接调度
+                if(!state.compare_exchange_weak(s, FdContext::EMPTY, std::memory_order_acq_rel)) {
+                    continue;
+                }
+                Fiber::ptr fiber;
+                if(!cb) {
+                    fiber = Fiber::GetThis();
+                }
+                ScheduleWaiter(Scheduler::GetThis(), fiber, cb);
+                return 0;
+            }
+            if(s == FdContext::EMPTY) {
+                if(!state.compare_exchange_weak(s, FdContext::BUSY, std::memory_order_acquire)) {
+                    continue;
+                }
+                break;
+            }
+            if(__UNLIKELY(s == FdContext::WAITING)) {
+                __LOG_ERROR(g_logger) << "addEvent assert fd=" << fd
+                            << " event=" << event << " already waiting";
+                __ASSERT(s != FdContext::WAITING);
+                return -1;
+            }
+            SpinWait(spins);
+        }
+
         FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
         __ASSERT(!event_ctx.scheduler
                     && !event_ctx.fiber
                     && !event_ctx.cb);
 
+        ++m_pendingEventCount;
         event_ctx.scheduler = Scheduler::GetThis();
         if(cb) {
             event_ctx.cb.swap(cb);
@@ -149,114 +444,239 @@ namespace sylar {
             __ASSERT2(event_ctx.fiber->getState() == Fiber::EXEC
                         ,"state=" << event_ctx.fiber->getState());
         }
+        state.store(FdContext::WAITING, std::memory_order_release);
         return 0;
     }
 
     bool IOManager::delEvent(int fd, Event event) {
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_fdContexts.size() <= fd) {
+        FdContext* fd_ctx = getFdContext(fd);
+        if(!fd_ctx) {
             return false;
         }
-        FdContext* fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-
-        FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-        if(!(fd_ctx->events & event)) {
+        if(!fd_ctx->takeWaiter(event, false)) {
             return false;
         }
-
-        Event new_events = (Event)(fd_ctx->events & ~event);
-        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        epoll_event epevent;
-        epevent.events = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if(rt) {
-            __LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                << op << ", " << fd << ", " << epevent.events << "):"
-                << rt << " (" << errno << ") (" << strerror(errno) << ")";
-            return false;
-        }
-
         --m_pendingEventCount;
-        fd_ctx->events = new_events;
-        FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
-        fd_ctx->resetContext(event_ctx);
         return true;
     }
 
     bool IOManager::cancelEvent(int fd, Event event) {
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_fdContexts.size() <= fd) {
-            return false;
-        }
-        FdContext* fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-
-        FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-        if(!(fd_ctx->events & event)) {
+        FdContext* fd_ctx = getFdContext(fd);
+        if(!fd_ctx) {
             return false;
         }
-
-        Event new_events = (Event)(fd_ctx->events & ~event);
-        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        epoll_event epevent;
-        epevent.events = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if(rt) {
-            __LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                << op << ", " << fd << ", " << epevent.events << "):"
-                << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        if(!fd_ctx->takeWaiter(event, true)) {
             return false;
         }
-
-        fd_ctx->triggerEvent(event);
         --m_pendingEventCount;
         return true;
     }
 
     bool IOManager::cancelAll(int fd) {
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_fdContexts.size() <= fd) {
+        FdContext* fd_ctx = getFdContext(fd);
+        if(!fd_ctx) {
             return false;
         }
-        FdContext* fd_ctx = m_fdContexts[fd];
-        lock.unlock();
 
-        FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-        if(!fd_ctx->events) {
-            return false;
+        bool expected = true;
+        if(fd_ctx->registered.compare_exchange_strong(expected, false)) {
+            epoll_event epevent;
+            memset(&epevent, 0, sizeof(epevent));
+            int rt = epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, &epevent);
+            if(rt && errno != ENOENT && errno != EBADF) {
+                __LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                    << EPOLL_CTL_DEL << ", " << fd << ", 0):"
+                    << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            }
+            std::atomic<uint32_t>* regs = FdRegistrations().get(fd);
+            if(regs) {
+                regs->fetch_sub(1, std::memory_order_relaxed);
+            }
         }
 
-        int op = EPOLL_CTL_DEL;
-        epoll_event epevent;
-        epevent.events = 0;
-        epevent.data.ptr = fd_ctx;
+        bool cancelled = false;
+        if(fd_ctx->takeWaiter(READ, true)) {
+            --m_pendingEventCount;
+            cancelled = true;
+        }
+        if(fd_ctx->takeWaiter(WRITE, true)) {
+            --m_pendingEventCount;
+            cancelled = true;
+        }
+        // 注销后丢弃残留的就绪令牌, 下次注册时epoll会重新报告真实状态
+        uint32_t ready = FdContext::READY;
+        fd_ctx->readState.compare_exchange_strong(ready, FdContext::EMPTY);
+        ready = FdContext::READY;
+        fd_ctx->writeState.compare_exchange_strong(ready, FdContext::EMPTY);
+        return cancelled;
+    }
 
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if(rt) {
-            __LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                << op << ", " << fd << ", " << epevent.events << "):"
-                << rt << " (" << errno << ") (" << strerror(errno) << ")";
-            return false;
+    void IOManager::NotifyFdClosed(int fd) {
+        // 绝大多数close的fd只在一个IOManager中注册过或从未注册(普通文件等), 先无锁判断
+        std::atomic<uint32_t>* regs = FdRegistrations().get(fd);
+        if(!regs || regs->load(std::memory_order_acquire) == 0) {
+            return;
         }
+        RWMutex::ReadLock lock(s_iomanagers_mutex);
+        for(auto& i : s_iomanagers) {
+            FdContext* fd_ctx = i->getFdContext(fd);
+            if(fd_ctx && fd_ctx->registered) {
+                i->cancelAll(fd);
+            }
+        }
+    }
 
-        if(fd_ctx->events & READ) {
-            fd_ctx->triggerEvent(READ);
-            --m_pendingEventCount;
+    bool IOManager::addSignal(int signo, std::function<void(int)> cb) {
+        if(signo <= 0 || signo >= NSIG || signo == SIGKILL || signo == SIGSTOP
+                || !cb || m_signalFd < 0) {
+            __LOG_ERROR(g_logger) << "addSignal invalid signo=" << signo
+                << " signalfd=" << m_signalFd;
+            return false;
         }
-        if(fd_ctx->events & WRITE) {
-            fd_ctx->triggerEvent(WRITE);
-            --m_pendingEventCount;
+        {
+            Mutex::Lock lock(s_signal_mutex);
+            auto it = s_signal_owners.find(signo);
+            if(it != s_signal_owners.end() && it->second != this) {
+                __LOG_ERROR(g_logger) << "addSignal signo=" << signo
+                    << " already owned by " << it->second->getName();
+                return false;
+            }
+            if(it == s_signal_owners.end()) {
+                struct sigaction sa;
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = ForwardSignal;
+                sa.sa_flags = SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+                sigaction(signo, &sa, &s_old_actions[signo]);
+            }
+            s_signal_owners[signo] = this;
+            s_forward_fds[signo].store(m_tickleFds[1] + 1, std::memory_order_release);
+            sigaddset(&s_blocked_signals, signo);
+            sigdelset(&s_released_signals, signo);
+            UpdateSignalMaskNoLock();
+        }
+        {
+            RWMutexType::WriteLock lock(m_signalMutex);
+            m_signalHandlers[signo].swap(cb);
+            sigaddset(&m_signalMask, signo);
+            if(signalfd(m_signalFd, &m_signalMask, 0) < 0) {
+                __LOG_ERROR(g_logger) << "signalfd(" << m_signalFd << ") errno="
+                    << errno << " errstr=" << strerror(errno);
+            }
         }
+        applySignalMask();
+        return true;
+    }
 
-        __ASSERT(fd_ctx->events == 0);
+    bool IOManager::delSignal(int signo) {
+        {
+            RWMutexType::WriteLock lock(m_signalMutex);
+            if(!m_signalHandlers.erase(signo)) {
+                return false;
+            }
+            sigdelset(&m_signalMask, signo);
+            signalfd(m_signalFd, &m_signalMask, 0);
+        }
+        {
+            Mutex::Lock lock(s_signal_mutex);
+            ReleaseSignalNoLock(signo);
+            UpdateSignalMaskNoLock();
+        }
+        applySignalMask();
         return true;
     }
 
+    void IOManager::applySignalMask() {
+        uint64_t gen = ApplySignalMask();
+        // 已运行的工作线程不能从外部修改屏蔽字, 由它们在idle()中各自更新。
+        // 只等待仍在调度中的线程, 已退出调度的线程不会再执行任务, 也不必等待
+        int self = GetThreadId();
+        // 本调度器的任务协程中让出执行权等待, 否则(如caller线程在启动调度前)直接睡眠
+        // (caller线程上之前的调度器退出后, hook开关和当前协程都可能残留, 不能作为判断依据)
+        bool in_fiber = inRun() && Fiber::GetThis().get() != Scheduler::GetMainFiber();
+        while(true) {
+            bool pending = false;
+            {
+                MutexType::Lock lock(m_sigmaskMutex);
+                for(auto& i : m_sigmaskApplied) {
+                    if(i.first != self && i.second < gen) {
+                        pending = true;
+                        break;
+                    }
+                }
+            }
+            if(!pending) {
+                break;
+            }
+            tickle();
+            if(in_fiber) {
+                Fiber::YieldReady();
+            } else {
+                // 不在调度中时hook开关可能残留, 需真正睡眠而不是切到调度协程
+                bool hook = is_hook_enable();
+                set_hook_enable(false);
+                usleep(100);
+                set_hook_enable(hook);
+            }
+        }
+    }
+
+    void IOManager::syncSignalMask(bool enter) {
+        if(enter || t_signal_gen != s_signal_gen.load(std::memory_order_relaxed)) {
+            uint64_t gen = ApplySignalMask();
+            MutexType::Lock lock(m_sigmaskMutex);
+            m_sigmaskApplied[GetThreadId()] = gen;
+        }
+    }
+
+    size_t IOManager::dispatchSignals() {
+        size_t count = 0;
+        // 未屏蔽信号的线程收到后由ForwardSignal转交
+        uint64_t forwarded = s_forwarded_signals.load(std::memory_order_acquire);
+        if(forwarded) {
+            std::vector<std::function<void()> > cbs;
+            {
+                RWMutexType::ReadLock lock(m_signalMutex);
+                for(auto& i : m_signalHandlers) {
+                    uint64_t bit = 1ull << (i.first - 1);
+                    if((forwarded & bit)
+                            && (s_forwarded_signals.fetch_and(~bit, std::memory_order_acq_rel) & bit)) {
+                        cbs.push_back(std::bind(i.second, i.first));
+                    }
+                }
+            }
+            for(auto& cb : cbs) {
+                ++count;
+                scheduleLocal(&cb);
+            }
+        }
+        signalfd_siginfo infos[16];
+        while(true) {
+            ssize_t n = read(m_signalFd, infos, sizeof(infos));
+            if(n <= 0) {
+                break;
+            }
+            for(size_t i = 0; i < n / sizeof(signalfd_siginfo); ++i) {
+                int signo = infos[i].ssi_signo;
+                std::function<void()> cb;
+                {
+                    RWMutexType::ReadLock lock(m_signalMutex);
+                    auto it = m_signalHandlers.find(signo);
+                    if(it != m_signalHandlers.end()) {
+                        cb = std::bind(it->second, signo);
+                    }
+                }
+                ++count;
+                if(cb) {
+                    scheduleLocal(&cb);
+                } else {
+                    __LOG_DEBUG(g_logger) << "signal " << signo << " has no handler";
+                }
+            }
+        }
+        return count;
+    }
+
     IOManager* IOManager::GetThis() {
         return dynamic_cast<IOManager*>(Scheduler::GetThis());
     }
@@ -266,7 +686,8 @@ namespace sylar {
             return;
         }
         int rt = write(m_tickleFds[1], "T", 1);
-        __ASSERT(rt == 1);
+        // 管道写满时读端必然可读, 不会丢失唤醒
+        __ASSERT(rt == 1 || errno == EAGAIN);
     }
 
     bool IOManager::stopping(uint64_t& timeout) {
@@ -283,112 +704,279 @@ namespace sylar {
 
 
 
-    void IOManager::idle() {
-    __LOG_DEBUG(g_logger) << "idle";
-    const uint64_t MAX_EVNETS = 256;
-    epoll_event* events = new epoll_event[MAX_EVNETS]();
-    std::shared_ptr<epoll_event> shared_events(events, [](epoll_event* ptr){
-        delete[] ptr;
-    });
-
-    while(true) {
-        uint64_t next_timeout = 0;
-        if(stopping(next_timeout)) {
-            __LOG_INFO(g_logger) << "name=" << getName()
-                                     << " idle stopping exit";
-            break;
-        }
-
-        int rt = 0;
-        do {
-            static const int MAX_TIMEOUT = 3000;
-            if(next_timeout != ~0ull) {
-                next_timeout = (int)next_timeout > MAX_TIMEOUT
-                                ? MAX_TIMEOUT : next_timeout;
-            } else {
-                next_timeout = MAX_TIMEOUT;
+    /**
+     * @brief 单次唤醒事件数所在的直方图桶
+     */
+    static size_t BatchBucket(uint64_t n) {
+        size_t bucket = 0;
+        while(n && bucket < IOManager::LoopStats::HISTOGRAM_BUCKETS - 1) {
+            n >>= 1;
+            ++bucket;
+        }
+        return bucket;
+    }
+
+    static void UpdateMax(std::atomic<uint64_t>& v, uint64_t n) {
+        uint64_t old = v.load(std::memory_order_relaxed);
+        while(n > old && !v.compare_exchange_weak(old, n, std::memory_order_relaxed));
+    }
+
+    std::string IOManager::LoopStats::toString() const {
+        std::stringstream ss;
+        ss << "wakeups=" << wakeups
+           << " events=" << events
+           << " control_events=" << controlEvents
+           << " avg_batch=" << (wakeups ? (double)(events + controlEvents) / wakeups : 0)
+           << " max_batch=" << maxBatch
+           << " saturated=" << saturated
+           << " timer=" << timerWakeups
+           << " tickle=" << tickleWakeups
+           << " io=" << ioWakeups
+           << " empty=" << emptyWakeups
+           << " wait_us=" << waitUs
+           << " busy_us=" << busyUs
+           << " batch_histogram=[";
+        bool first = true;
+        for(size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            if(!batchHistogram[i]) {
+                continue;
             }
-            //__LOG_INFO(g_logger) << "waitting";
-            rt = epoll_wait(m_epfd, events, MAX_EVNETS, (int)next_timeout);
-            if(rt < 0 && errno == EINTR) {
+            if(!first) {
+                ss << " ";
+            }
+            first = false;
+            if(i == 0) {
+                ss << "0";
+            } else if(i == 1) {
+                ss << "1";
+            } else if(i == HISTOGRAM_BUCKETS - 1) {
+                ss << (1ull << (i - 1)) << "+";
             } else {
+                ss << (1ull << (i - 1)) << "-" << ((1ull << i) - 1);
+            }
+            ss << ":" << batchHistogram[i];
+        }
+        ss << "]";
+        return ss.str();
+    }
+
+    IOManager::LoopStats IOManager::getLoopStats() const {
+        LoopStats stats;
+        stats.wakeups = m_loopStats.wakeups.load(std::memory_order_relaxed);
+        stats.events = m_loopStats.events.load(std::memory_order_relaxed);
+        stats.controlEvents = m_loopStats.controlEvents.load(std::memory_order_relaxed);
+        stats.maxBatch = m_loopStats.maxBatch.load(std::memory_order_relaxed);
+        stats.saturated = m_loopStats.saturated.load(std::memory_order_relaxed);
+        stats.timerWakeups = m_loopStats.timerWakeups.load(std::memory_order_relaxed);
+        stats.tickleWakeups = m_loopStats.tickleWakeups.load(std::memory_order_relaxed);
+        stats.ioWakeups = m_loopStats.ioWakeups.load(std::memory_order_relaxed);
+        stats.emptyWakeups = m_loopStats.emptyWakeups.load(std::memory_order_relaxed);
+        stats.waitUs = m_loopStats.waitUs.load(std::memory_order_relaxed);
+        stats.busyUs = m_loopStats.busyUs.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < LoopStats::HISTOGRAM_BUCKETS; ++i) {
+            stats.batchHistogram[i] = m_loopStats.batchHistogram[i].load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
+    void IOManager::resetLoopStats() {
+        m_loopStats.wakeups = 0;
+        m_loopStats.events = 0;
+        m_loopStats.controlEvents = 0;
+        m_loopStats.maxBatch = 0;
+        m_loopStats.saturated = 0;
+        m_loopStats.timerWakeups = 0;
+        m_loopStats.tickleWakeups = 0;
+        m_loopStats.ioWakeups = 0;
+        m_loopStats.emptyWakeups = 0;
+        m_loopStats.waitUs = 0;
+        m_loopStats.busyUs = 0;
+        for(size_t i = 0; i < LoopStats::HISTOGRAM_BUCKETS; ++i) {
+            m_loopStats.batchHistogram[i] = 0;
+        }
+    }
+
+    void IOManager::idle() {
+        __LOG_DEBUG(g_logger) << "idle";
+        // 批量大小自适应: 填满时翻倍, 连续多轮不足1/4时减半。
+        // 多个线程共享同一个epfd, 批量过大会让一个线程独占大量事件
+        static const uint32_t SHRINK_ROUNDS = 64;
+        size_t min_events = std::max(g_iomanager_epoll_events_min->getValue(), 1u);
+        size_t max_events = std::max((size_t)g_iomanager_epoll_events_max->getValue(), min_events);
+        size_t batch = min_events;
+        uint32_t small_rounds = 0;
+        std::vector<epoll_event> events(batch);
+
+        uint64_t last_wake = 0;
+        syncSignalMask(true);
+        while(true) {
+            syncSignalMask(false);
+            uint64_t next_timeout = 0;
+            if(stopping(next_timeout)) {
+                __LOG_INFO(g_logger) << "name=" << getName()
+                                         << " idle stopping exit";
                 break;
             }
-        } while(true);
 
-        std::vector<std::function<void()> > cbs;
-        listExpiredCb(cbs);
-        if(!cbs.empty()) {
-            //___LOG_DEBUG(g_logger) << "on timer cbs.size=" << cbs.size();
-            //schedule(cbs.begin(), cbs.end());
+            // 毫秒超时向上取整, 亚毫秒精度由timerfd提前唤醒
+            armTimerFd(getNextTimerUS());
+
+            int rt = 0;
+            uint64_t wait_begin = GetCurrentUS();
+            if(last_wake) {
+                m_loopStats.busyUs.fetch_add(wait_begin - last_wake, std::memory_order_relaxed);
+            }
+            do {
+                static const int MAX_TIMEOUT = 3000;
+                if(next_timeout != ~0ull) {
+                    next_timeout = (int)next_timeout > MAX_TIMEOUT
+                                    ? MAX_TIMEOUT : next_timeout;
+                } else {
+                    next_timeout = MAX_TIMEOUT;
+                }
+                rt = epoll_wait(m_epfd, &events[0], (int)batch, (int)next_timeout);
+                if(rt < 0 && errno == EINTR) {
+                } else {
+                    break;
+                }
+            } while(true);
+            last_wake = GetCurrentUS();
+            m_loopStats.waitUs.fetch_add(last_wake - wait_begin, std::memory_order_relaxed);
+
+            // 本轮收割到的定时器回调和就绪协程先放入本线程的本地批次,
+            // 切回run()后优先在本线程执行, 多余部分由flushLocal()一次性移入全局队列
+            std::vector<std::function<void()> > cbs;
+            listExpiredCb(cbs);
+            bool has_timer = !cbs.empty();
             for(auto& i : cbs) {
-                schedule(i);
+                scheduleLocal(&i);
             }
             cbs.clear();
-        }
-
-        //if(SYLAR_UNLIKELY(rt == MAX_EVNETS)) {
-        //    ___LOG_INFO(g_logger) << "epoll wait events=" << rt;
-        //}
 
-        for(int i = 0; i < rt; ++i) {
-            epoll_event& event = events[i];
-            if(event.data.fd == m_tickleFds[0]) {
-                uint8_t dummy[256];
-                while(read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
-                continue;
+            bool has_tickle = false;
+            bool has_signal = false;
+            uint64_t io_events = 0;
+            for(int i = 0; i < rt; ++i) {
+                epoll_event& event = events[i];
+                if(event.data.fd == m_tickleFds[0]) {
+                    uint8_t dummy[256];
+                    while(read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
+                    has_tickle = true;
+                    if(s_forwarded_signals.load(std::memory_order_relaxed)) {
+                        dispatchSignals();
+                        has_signal = true;
+                    }
+                    continue;
+                }
+                if(event.data.fd == m_timerFd) {
+                    uint64_t expirations;
+                    while(read(m_timerFd, &expirations, sizeof(expirations)) > 0);
+                    m_timerFdDeadline = 0;
+                    has_timer = true;
+                    continue;
+                }
+
+                if(event.data.fd == m_signalFd) {
+                    dispatchSignals();
+                    has_signal = true;
+                    continue;
+                }
+
+                ++io_events;
+                FdContext* fd_ctx = (FdContext*)event.data.ptr;
+                uint32_t real_events = event.events;
+                if(real_events & (EPOLLERR | EPOLLHUP)) {
+                    real_events |= EPOLLIN | EPOLLOUT;
+                }
+                if(real_events & EPOLLIN) {
+                    if(fd_ctx->triggerEvent(READ)) {
+                        --m_pendingEventCount;
+                    }
+                }
+                if(real_events & EPOLLOUT) {
+                    if(fd_ctx->triggerEvent(WRITE)) {
+                        --m_pendingEventCount;
+                    }
+                }
             }
 
-            FdContext* fd_ctx = (FdContext*)event.data.ptr;
-            FdContext::MutexType::Lock lock(fd_ctx->mutex);
-            if(event.events & (EPOLLERR | EPOLLHUP)) {
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+            uint64_t n = rt > 0 ? rt : 0;
+            m_loopStats.wakeups.fetch_add(1, std::memory_order_relaxed);
+            m_loopStats.events.fetch_add(io_events, std::memory_order_relaxed);
+            m_loopStats.controlEvents.fetch_add(n - io_events, std::memory_order_relaxed);
+            m_loopStats.batchHistogram[BatchBucket(n)].fetch_add(1, std::memory_order_relaxed);
+            UpdateMax(m_loopStats.maxBatch, n);
+            if(has_timer) {
+                m_loopStats.timerWakeups.fetch_add(1, std::memory_order_relaxed);
             }
-            int real_events = NONE;
-            if(event.events & EPOLLIN) {
-                real_events |= READ;
+            if(has_tickle) {
+                m_loopStats.tickleWakeups.fetch_add(1, std::memory_order_relaxed);
             }
-            if(event.events & EPOLLOUT) {
-                real_events |= WRITE;
+            if(io_events) {
+                m_loopStats.ioWakeups.fetch_add(1, std::memory_order_relaxed);
             }
-
-            if((fd_ctx->events & real_events) == NONE) {
-                continue;
+            if(!has_timer && !has_tickle && !has_signal && !io_events) {
+                m_loopStats.emptyWakeups.fetch_add(1, std::memory_order_relaxed);
             }
 
-            int left_events = (fd_ctx->events & ~real_events);
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | left_events;
-
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if(rt2) {
-                __LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                    << op << ", " << fd_ctx->fd << ", " << event.events << "):"
-                    << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
-                continue;
+            if(n == batch) {
+                m_loopStats.saturated.fetch_add(1, std::memory_order_relaxed);
+                small_rounds = 0;
+                if(batch < max_events) {
+                    batch = std::min(batch * 2, max_events);
+                    events.resize(batch);
+                    __LOG_DEBUG(g_logger) << "name=" << getName()
+                        << " epoll batch grow to " << batch;
+                }
+            } else if(batch > min_events && n < batch / 4) {
+                if(++small_rounds >= SHRINK_ROUNDS) {
+                    batch = std::max(batch / 2, min_events);
+                    small_rounds = 0;
+                    __LOG_DEBUG(g_logger) << "name=" << getName()
+                        << " epoll batch shrink to " << batch;
+                }
+            } else {
+                small_rounds = 0;
             }
 
-            //___LOG_INFO(g_logger) << " fd=" << fd_ctx->fd << " events=" << fd_ctx->events
-            //                         << " real_events=" << real_events;
-            if(real_events & READ) {
-                fd_ctx->triggerEvent(READ);
-                --m_pendingEventCount;
-            }
-            if(real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
-                --m_pendingEventCount;
-            }
-        }
+            flushLocal();
 
-        Fiber::ptr cur = Fiber::GetThis();
-        auto raw_ptr = cur.get();
-        cur.reset();
+            Fiber::ptr cur = Fiber::GetThis();
+            auto raw_ptr = cur.get();
+            cur.reset();
 
-        raw_ptr->swapOut();
+            raw_ptr->swapOut();
         }
+        MutexType::Lock lock(m_sigmaskMutex);
+        m_sigmaskApplied.erase(GetThreadId());
     }
 
     void IOManager::onTimerInsertedAtFront() {
         tickle();
     }
+
+    void IOManager::armTimerFd(uint64_t next_us) {
+        if(m_timerFd < 0 || next_us == ~0ull) {
+            return;
+        }
+        if(next_us == 0) {
+            return;
+        }
+        uint64_t deadline = GetCurrentUS() + next_us;
+        uint64_t old = m_timerFdDeadline;
+        // 已有更早(或相同)的唤醒点, 不必重复设置
+        if(old && old <= deadline && old > GetCurrentUS()) {
+            return;
+        }
+        m_timerFdDeadline = deadline;
+
+        itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = next_us / 1000000;
+        its.it_value.tv_nsec = (next_us % 1000000) * 1000;
+        if(timerfd_settime(m_timerFd, 0, &its, nullptr)) {
+            __LOG_ERROR(g_logger) << "timerfd_settime(" << m_timerFd << ", "
+                << next_us << "us) errno=" << errno << " errstr=" << strerror(errno);
+        }
+    }
 }
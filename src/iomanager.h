@@ -4,6 +4,9 @@
 
 #include "scheduler.h"
 #include "timer.h"
+#include "segment_table.h"
+#include <signal.h>
+#include <map>
 namespace sylar {
 
 /**
@@ -28,9 +31,17 @@ public:
 private:
     /**
      * @brief Socket事件上线文类
+     * @details fd在第一次addEvent时以EPOLLIN|EPOLLOUT|EPOLLET常驻注册到epoll,
+     *          此后等待/唤醒只修改读写两个方向各自的原子状态, 不再调用epoll_ctl, 也不加锁。
+     *          每个方向的状态机:
+     *          EMPTY   --epoll事件-->  READY   (事件先于等待者到达, 留下一个就绪令牌)
+     *          EMPTY   --addEvent-->   WAITING (经BUSY写入等待者)
+     *          READY   --addEvent-->   EMPTY   (消费令牌, 立即调度等待者)
+     *          WAITING --epoll事件/cancelEvent--> EMPTY (经BUSY取出等待者并调度)
+     *          WAITING --delEvent-->   EMPTY   (取出等待者, 不调度)
+     *          BUSY只在读写EventContext的几条指令内存在, 其他线程遇到时短暂自旋。
      */
     struct FdContext {
-        typedef Mutex MutexType;
         /**
          * @brief 事件上线文类
          */
@@ -43,6 +54,20 @@ private:
             std::function<void()> cb;
         };
 
+        /**
+         * @brief 单个方向的等待状态
+         */
+        enum State {
+            /// 无等待者, 无就绪令牌
+            EMPTY   = 0,
+            /// 无等待者, 事件已就绪
+            READY   = 1,
+            /// 有等待者
+            WAITING = 2,
+            /// 正在读写EventContext
+            BUSY    = 3
+        };
+
         /**
          * @brief 获取事件上下文类
          * @param[in] event 事件类型
@@ -51,30 +76,88 @@ private:
         EventContext& getContext(Event event);
 
         /**
-         * @brief 重置事件上下文
-         * @param[in, out] ctx 待重置的上下文类
+         * @brief 获取事件方向的状态
+         * @param[in] event 事件类型
+         */
+        std::atomic<uint32_t>& getState(Event event);
+
+        /**
+         * @brief epoll通知事件就绪: 有等待者则调度, 否则留下就绪令牌
+         * @details 只在idle中调用, 等待者放入当前线程的本地批次
+         * @param[in] event 事件类型
+         * @return 是否调度了等待者
          */
-        void resetContext(EventContext& ctx);
+        bool triggerEvent(Event event);
 
         /**
-         * @brief 触发事件
+         * @brief 取出等待者
          * @param[in] event 事件类型
+         * @param[in] trigger 是否调度取出的等待者
+         * @param[in] local 是否放入当前线程的本地批次
+         * @return 是否存在等待者
          */
-        void triggerEvent(Event event);
+        bool takeWaiter(Event event, bool trigger, bool local = false);
 
         /// 读事件上下文
         EventContext read;
         /// 写事件上下文
         EventContext write;
+        /// 读方向状态
+        std::atomic<uint32_t> readState = {EMPTY};
+        /// 写方向状态
+        std::atomic<uint32_t> writeState = {EMPTY};
+        /// 是否已注册到epoll
+        std::atomic<bool> registered = {false};
         /// 事件关联的句柄
         int fd = 0;
-        /// 当前的事件
-        Event events = NONE;
-        /// 事件的Mutex
-        MutexType mutex;
     };
 
 public:
+    /**
+     * @brief 事件循环统计, 所有工作线程汇总
+     * @details 用于评估工作线程数量和epoll批量大小是否合适
+     */
+    /**
+     * @details 批量相关的字段(avg_batch/maxBatch/saturated/batchHistogram)统计epoll_wait的
+     *          原始返回数, 含tickle/timerfd/signalfd等内部事件, 与批量大小的自适应一致;
+     *          events只统计fd读写事件, 内部事件单独计入controlEvents,
+     *          两者之和等于所有唤醒返回的事件总数
+     */
+    struct LoopStats {
+        /// 批量分布直方图的桶数
+        static const size_t HISTOGRAM_BUCKETS = 16;
+
+        /// epoll_wait返回次数
+        uint64_t wakeups = 0;
+        /// 返回的fd读写事件数(不含tickle/timerfd/signalfd)
+        uint64_t events = 0;
+        /// 返回的tickle/timerfd/signalfd事件数
+        uint64_t controlEvents = 0;
+        /// 单次返回的最大事件数(含内部事件)
+        uint64_t maxBatch = 0;
+        /// 返回事件数等于批量上限的次数
+        uint64_t saturated = 0;
+        /// 含定时器到期的唤醒次数
+        uint64_t timerWakeups = 0;
+        /// 含tickle的唤醒次数
+        uint64_t tickleWakeups = 0;
+        /// 含fd读写事件的唤醒次数
+        uint64_t ioWakeups = 0;
+        /// 超时返回且没有任何事件的唤醒次数
+        uint64_t emptyWakeups = 0;
+        /// 阻塞在epoll_wait中的总时间(微秒)
+        uint64_t waitUs = 0;
+        /// 两次epoll_wait之间处理任务的总时间(微秒)
+        uint64_t busyUs = 0;
+        /// 每次唤醒的事件数分布, 桶0统计0个事件, 桶i统计[2^(i-1), 2^i)个事件
+        uint64_t batchHistogram[HISTOGRAM_BUCKETS] = {0};
+
+        /**
+         * @brief 输出为可读字符串
+         */
+        std::string toString() const;
+    };
+
     /**
      * @brief 构造函数
      * @param[in] threads 线程数量
@@ -123,30 +206,134 @@ public:
      * @brief 返回当前的IOManager
      */
     static IOManager* GetThis();
+
+    /**
+     * @brief fd即将关闭, 在所有IOManager中取消其事件并注销epoll注册
+     * @details fd常驻注册在epoll中, 若在其他线程关闭后被复用, 旧的注册标记会失效,
+     *          因此关闭时需要通知注册过它的IOManager。按fd记录注册计数,
+     *          没有IOManager注册过的fd不加锁直接返回
+     */
+    static void NotifyFdClosed(int fd);
+
+    /**
+     * @brief 通过signalfd接管信号, 信号到达时以协程执行cb
+     * @details 信号在调用线程和所有工作线程中被屏蔽, 不再打断被hook的系统调用,
+     *          由epoll中的signalfd统一读取。进程中其他未屏蔽该信号的线程(BlockingPool线程、
+     *          启动调度前的caller线程、用户线程)仍可能收到它, 由安装的处理函数转交给
+     *          本IOManager, 不会执行默认动作, 但会打断这些线程中的系统调用(SA_RESTART)。
+     *          不希望被打断的用户线程应自行屏蔽这些信号。
+     *          同一信号只能由一个IOManager接管, 释放时恢复原来的处理方式
+     * @param[in] signo 信号值, 不能是SIGKILL/SIGSTOP
+     * @param[in] cb 处理函数, 参数为信号值; 已接管时替换原处理函数
+     * @return 成功返回true
+     */
+    bool addSignal(int signo, std::function<void(int)> cb);
+
+    /**
+     * @brief 释放信号, 所有工作线程解除对它的屏蔽
+     * @return 该信号由本IOManager接管时返回true
+     */
+    bool delSignal(int signo);
+
+    /**
+     * @brief 获取事件循环统计的快照
+     */
+    LoopStats getLoopStats() const;
+
+    /**
+     * @brief 清零事件循环统计
+     */
+    void resetLoopStats();
 protected:
     void tickle() override;
     bool stopping() override;
     bool stopping(uint64_t& timeout);
     void idle() override;
     void onTimerInsertedAtFront() override;
+
+    /**
+     * @brief 按最近定时器的微秒级超时设置timerfd
+     * @param[in] next_us 距离最近定时器的时间(微秒), ~0ull表示没有定时器
+     */
+    void armTimerFd(uint64_t next_us);
+
+    /**
+     * @brief 获取socket句柄上下文
+     * @param[in] fd socket句柄
+     * @param[in] auto_create 上下文所在的段不存在时是否创建
+     */
+    FdContext* getFdContext(int fd, bool auto_create = false);
+
     /**
-     * @brief 重置socket句柄上下文的容器大小
-     * @param[in] size 容量大小
+     * @brief 让调用线程按当前接管的信号更新屏蔽字, 并等待仍在调度中的工作线程完成更新
+     * @details 工作线程在idle()每轮循环开始时自行更新, 已退出调度的线程不再等待
      */
-    void contextResize(size_t size);
+    void applySignalMask();
 
+    /**
+     * @brief 工作线程在idle()中调用, 接管的信号变化后更新本线程的屏蔽字
+     * @param[in] enter 是否刚进入idle(), 是则无条件更新并登记本线程
+     */
+    void syncSignalMask(bool enter);
+
+    /**
+     * @brief 读出signalfd中所有待处理的信号, 调度对应的处理函数
+     * @return 读到的信号数
+     */
+    size_t dispatchSignals();
+
+    /**
+     * @brief 确保fd已常驻注册到epoll
+     * @return 成功返回true
+     */
+    bool registerFd(FdContext* fd_ctx);
+
+private:
+    /**
+     * @brief 事件循环统计的计数器, 各工作线程每次唤醒累加一次
+     */
+    struct LoopCounters {
+        std::atomic<uint64_t> wakeups = {0};
+        std::atomic<uint64_t> events = {0};
+        std::atomic<uint64_t> controlEvents = {0};
+        std::atomic<uint64_t> maxBatch = {0};
+        std::atomic<uint64_t> saturated = {0};
+        std::atomic<uint64_t> timerWakeups = {0};
+        std::atomic<uint64_t> tickleWakeups = {0};
+        std::atomic<uint64_t> ioWakeups = {0};
+        std::atomic<uint64_t> emptyWakeups = {0};
+        std::atomic<uint64_t> waitUs = {0};
+        std::atomic<uint64_t> busyUs = {0};
+        std::atomic<uint64_t> batchHistogram[LoopStats::HISTOGRAM_BUCKETS];
+    };
 
 private:
     /// epoll 文件句柄
     int m_epfd = 0;
     /// pipe 文件句柄
     int m_tickleFds[2];
+    /// timerfd 文件句柄, -1表示未启用(退化为epoll_wait的毫秒精度)
+    int m_timerFd = -1;
+    /// timerfd当前设定的到期时间(微秒时间戳), 0表示未设定
+    std::atomic<uint64_t> m_timerFdDeadline = {0};
+    /// signalfd 文件句柄, -1表示不支持
+    int m_signalFd = -1;
+    /// 保护信号处理函数和掩码
+    RWMutexType m_signalMutex;
+    /// 接管的信号集合, 与signalfd的掩码一致
+    sigset_t m_signalMask;
+    /// 信号处理函数
+    std::map<int, std::function<void(int)> > m_signalHandlers;
+    /// 保护m_sigmaskApplied
+    MutexType m_sigmaskMutex;
+    /// 仍在调度中的工作线程id -> 已应用的信号屏蔽字版本, 线程退出idle()时移除
+    std::map<int, uint64_t> m_sigmaskApplied;
     /// 当前等待执行的事件数量
     std::atomic<size_t> m_pendingEventCount = {0};
-    /// IOManager的Mutex
-    RWMutexType m_mutex;
-    /// socket事件上下文的容器
-    std::vector<FdContext*> m_fdContexts;
+    /// socket事件上下文的容器, 读取无锁, 只在扩容时加锁
+    SegmentTable<FdContext> m_fdContexts;
+    /// 事件循环统计
+    LoopCounters m_loopStats;
 };
 
 }
@@ -0,0 +1,298 @@
+#include "prefork.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include "iomanager.h"
+#include "fdmanager.h"
+#include "mutex.h"
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <map>
+
+namespace sylar {
+
+    static sylar::ConfigVar<uint32_t>::ptr g_prefork_workers =
+        sylar::Config::Lookup("prefork.workers", (uint32_t)0,
+        "prefork worker processes, 0 means cpu count");
+
+    static sylar::ConfigVar<uint32_t>::ptr g_prefork_threads =
+        sylar::Config::Lookup("prefork.threads", (uint32_t)1,
+        "prefork IOManager threads per worker");
+
+    static sylar::ConfigVar<bool>::ptr g_prefork_cpu_affinity =
+        sylar::Config::Lookup("prefork.cpu_affinity", true,
+        "prefork pin each worker to one cpu");
+
+    static sylar::ConfigVar<uint64_t>::ptr g_prefork_restart_delay =
+        sylar::Config::Lookup("prefork.restart_delay", (uint64_t)1000,
+        "prefork delay in ms before restarting a worker that exited within this time");
+
+    static sylar::ConfigVar<uint64_t>::ptr g_prefork_stop_timeout =
+        sylar::Config::Lookup("prefork.stop_timeout", (uint64_t)(40 * 1000),
+        "prefork ms to wait for workers to exit before SIGKILL");
+
+    static sylar::Logger::ptr g_logger = __LOG_NAME("system");
+
+    static int s_worker_index = -1;
+
+    /**
+     * @brief master转发给worker的信号
+     */
+    static const int s_forward_signals[] = {
+        SIGTERM, SIGINT, SIGQUIT, SIGHUP, SIGUSR1, SIGUSR2
+    };
+
+    static bool IsStopSignal(int sig) {
+        return sig == SIGTERM || sig == SIGINT || sig == SIGQUIT;
+    }
+
+    static uint32_t GetCpuCount() {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? n : 1;
+    }
+
+    Prefork::Prefork(uint32_t workers)
+        :m_workers(workers)
+        ,m_threads(std::max(g_prefork_threads->getValue(), (uint32_t)1)) {
+        if(m_workers == 0) {
+            m_workers = g_prefork_workers->getValue();
+        }
+        if(m_workers == 0) {
+            m_workers = GetCpuCount();
+        }
+    }
+
+    void Prefork::addServer(TcpServer::ptr server) {
+        if(server->getSocks().empty()) {
+            server->setAcceptors(m_workers);
+        }
+        m_servers.push_back(server);
+    }
+
+    int Prefork::GetWorkerIndex() {
+        return s_worker_index;
+    }
+
+    int Prefork::run() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        for(int sig : s_forward_signals) {
+            sigaddset(&set, sig);
+        }
+        sigset_t old;
+        // 阻塞后同步等待, 不在信号处理函数里fork; worker继承这个掩码
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+
+        m_slots.assign(m_workers, Slot());
+        for(uint32_t i = 0; i < m_workers; ++i) {
+            spawn(i);
+        }
+        __LOG_INFO(g_logger) << "prefork master pid=" << getpid()
+            << " workers=" << m_workers;
+
+        bool stopping = false;
+        uint64_t stop_deadline = 0;
+        while(true) {
+            uint64_t now = GetCurrentMS();
+            size_t alive = 0;
+            uint64_t next = ~0ull;
+            for(uint32_t i = 0; i < m_workers; ++i) {
+                Slot& slot = m_slots[i];
+                if(slot.pid) {
+                    ++alive;
+                } else if(!stopping) {
+                    if(slot.restartAt <= now) {
+                        spawn(i);
+                        alive += slot.pid != 0;
+                    }
+                    if(!slot.pid) {
+                        next = std::min(next, slot.restartAt);
+                    }
+                }
+            }
+            if(stopping) {
+                if(alive == 0) {
+                    break;
+                }
+                if(now >= stop_deadline) {
+                    __LOG_WARN(g_logger) << "prefork stop timeout, kill " << alive << " worker(s)";
+                    forward(SIGKILL);
+                    stop_deadline = ~0ull;
+                }
+                next = std::min(next, stop_deadline);
+            }
+
+            siginfo_t info;
+            int sig = -1;
+            if(next == ~0ull) {
+                sig = sigwaitinfo(&set, &info);
+            } else {
+                uint64_t ms = next > now ? next - now : 0;
+                timespec ts{(time_t)(ms / 1000), (long)(ms % 1000 * 1000000)};
+                sig = sigtimedwait(&set, &info, &ts);
+            }
+            if(sig == SIGCHLD) {
+                reap(stopping);
+            } else if(sig > 0 && IsStopSignal(sig)) {
+                if(!stopping) {
+                    __LOG_INFO(g_logger) << "prefork master stopping, signal=" << sig;
+                    stopping = true;
+                    stop_deadline = GetCurrentMS() + g_prefork_stop_timeout->getValue();
+                }
+                forward(sig);
+            } else if(sig > 0) {
+                forward(sig);
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
+        __LOG_INFO(g_logger) << "prefork master exit";
+        return 0;
+    }
+
+    void Prefork::spawn(uint32_t idx) {
+        Slot& slot = m_slots[idx];
+        pid_t master = getpid();
+        pid_t pid = fork();
+        if(pid < 0) {
+            __LOG_ERROR(g_logger) << "prefork fork worker " << idx << " errno=" << errno
+                << " errstr=" << strerror(errno);
+            slot.restartAt = GetCurrentMS() + g_prefork_restart_delay->getValue();
+            return;
+        }
+        if(pid == 0) {
+            runWorker(idx, master);
+        }
+        slot.pid = pid;
+        slot.startTime = GetCurrentMS();
+        __LOG_INFO(g_logger) << "prefork worker " << idx << " pid=" << pid << " started";
+    }
+
+    void Prefork::reap(bool stopping) {
+        int status = 0;
+        pid_t pid;
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for(uint32_t i = 0; i < m_workers; ++i) {
+                Slot& slot = m_slots[i];
+                if(slot.pid != pid) {
+                    continue;
+                }
+                uint64_t now = GetCurrentMS();
+                slot.pid = 0;
+                if(WIFSIGNALED(status)) {
+                    __LOG_WARN(g_logger) << "prefork worker " << i << " pid=" << pid
+                        << " killed by signal " << WTERMSIG(status);
+                } else {
+                    __LOG_INFO(g_logger) << "prefork worker " << i << " pid=" << pid
+                        << " exit status=" << WEXITSTATUS(status);
+                }
+                if(!stopping) {
+                    // 启动后很快退出的worker延迟重启, 避免反复fork
+                    uint64_t delay = g_prefork_restart_delay->getValue();
+                    slot.restartAt = now - slot.startTime < delay ? now + delay : now;
+                }
+                break;
+            }
+        }
+    }
+
+    void Prefork::forward(int sig) {
+        for(auto& slot : m_slots) {
+            if(slot.pid) {
+                kill(slot.pid, sig);
+            }
+        }
+    }
+
+    void Prefork::runWorker(uint32_t idx, pid_t master) {
+        s_worker_index = idx;
+        // master异常退出时worker随之退出; master在prctl之前就已退出时直接退出
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if(getppid() != master) {
+            _exit(1);
+        }
+        if(g_prefork_cpu_affinity->getValue()) {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            CPU_SET(idx % GetCpuCount(), &mask);
+            if(sched_setaffinity(0, sizeof(mask), &mask)) {
+                __LOG_WARN(g_logger) << "prefork worker " << idx << " set affinity errno="
+                    << errno << " errstr=" << strerror(errno);
+            }
+        }
+
+        // IOManager的线程在此之后创建, 继承CPU绑定和阻塞的信号掩码, 信号只由本线程sigwait
+        IOManager* iom = new IOManager(m_threads, false, "worker_" + std::to_string(idx));
+        for(auto& server : m_servers) {
+            // 同一地址的socket按worker下标取一个, 其余的在本进程中关闭
+            std::map<std::string, std::vector<Socket::ptr> > groups;
+            std::vector<Socket::ptr> socks = server->getSocks();
+            for(auto& sock : socks) {
+                groups[sock->getLocalAddress()->toString()].push_back(sock);
+            }
+            std::vector<Socket::ptr> mine;
+            for(auto& i : groups) {
+                for(size_t j = 0; j < i.second.size(); ++j) {
+                    if(j == idx % i.second.size()) {
+                        // master在hook之外创建的socket是阻塞的, 登记到FdMgr时设为非阻塞
+                        FdMgr::GetInstance()->get(i.second[j]->getSocket(), true);
+                        mine.push_back(i.second[j]);
+                    } else {
+                        i.second[j]->close();
+                    }
+                }
+            }
+            server->setSocks(mine);
+            server->setWorkers({iom});
+            server->setAcceptWorker(iom);
+        }
+        iom->schedule([this, idx](){
+            if(m_workerInit) {
+                m_workerInit(idx);
+            }
+            for(auto& server : m_servers) {
+                server->start();
+            }
+        });
+
+        sigset_t set;
+        sigemptyset(&set);
+        for(int sig : s_forward_signals) {
+            sigaddset(&set, sig);
+        }
+        int sig = 0;
+        while(true) {
+            if(sigwait(&set, &sig)) {
+                continue;
+            }
+            if(IsStopSignal(sig)) {
+                break;
+            }
+            if(m_onSignal) {
+                iom->schedule(std::bind(m_onSignal, sig));
+            }
+        }
+
+        __LOG_INFO(g_logger) << "prefork worker " << idx << " pid=" << getpid()
+            << " stopping, signal=" << sig;
+        Semaphore sem;
+        iom->schedule([this, &sem](){
+            for(auto& server : m_servers) {
+                server->stop();
+            }
+            for(auto& server : m_servers) {
+                server->drain();
+            }
+            sem.notify();
+        });
+        sem.wait();
+        m_servers.clear();
+        // 等IOManager中剩余的任务和定时器结束
+        delete iom;
+        exit(0);
+    }
+}
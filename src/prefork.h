@@ -0,0 +1,110 @@
+/**
+ * @file prefork.h
+ * @brief 多进程master/worker模式
+ */
+#ifndef __PREFORK_H__
+#define __PREFORK_H__
+
+#include <functional>
+#include <vector>
+#include <sys/types.h>
+#include "tcp_server.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief 预先fork的多进程服务
+ * @details master进程bind好TcpServer后fork出N个worker进程, 每个worker绑定到一个CPU,
+ *          运行自己的IOManager并启动这些服务; 日志、配置和各单例的锁只在进程内竞争。
+ *          同一地址的多个监听socket(SO_REUSEPORT)按worker下标分给各worker,
+ *          socket少于worker时多个worker共享一个。master自己不accept, 但一直持有全部监听socket,
+ *          worker退出时它的socket上的连接留在队列中, 由重启的worker继续accept。
+ *          master阻塞SIGCHLD和转发的信号并用sigtimedwait同步处理:
+ *          worker退出后重启(运行时间过短时延迟重启); SIGTERM/SIGINT/SIGQUIT转发给所有worker,
+ *          worker drain后退出, 超时未退出的被SIGKILL; SIGHUP/SIGUSR1/SIGUSR2转发给worker的信号回调
+ */
+class Prefork : Noncopyable {
+public:
+    /**
+     * @brief 构造函数
+     * @param[in] workers worker进程数, 0表示使用配置 prefork.workers(为0时等于CPU数)
+     */
+    Prefork(uint32_t workers = 0);
+
+    /**
+     * @brief 添加服务, 需在run之前调用
+     * @details 服务未bind时把acceptors设为worker数, 之后bind的每个IP地址为每个worker
+     *          创建一个SO_REUSEPORT socket; 已bind的服务按现有socket分配
+     */
+    void addServer(TcpServer::ptr server);
+
+    /**
+     * @brief 设置worker启动回调, 在worker的IOManager中、服务start之前执行
+     */
+    void setWorkerInit(std::function<void(uint32_t idx)> cb) { m_workerInit = cb;}
+
+    /**
+     * @brief 设置worker收到SIGHUP/SIGUSR1/SIGUSR2时的回调, 在worker的IOManager中执行
+     */
+    void setSignalHandler(std::function<void(int sig)> cb) { m_onSignal = cb;}
+
+    /**
+     * @brief 启动worker并运行master, 直到收到退出信号且所有worker都已退出
+     * @pre 调用前进程中不能有其他线程(包括IOManager), fork只复制调用线程
+     * @return master返回0; worker进程不会从这里返回
+     */
+    int run();
+
+    uint32_t getWorkers() const { return m_workers;}
+
+    /**
+     * @brief 当前进程的worker下标, master和非prefork进程返回-1
+     */
+    static int GetWorkerIndex();
+private:
+    /**
+     * @brief 一个worker位置
+     */
+    struct Slot {
+        /// 进程id, 0表示未运行
+        pid_t pid = 0;
+        /// 启动时间(毫秒)
+        uint64_t startTime = 0;
+        /// 计划重启的时间(毫秒)
+        uint64_t restartAt = 0;
+    };
+
+    /**
+     * @brief fork第idx个worker
+     */
+    void spawn(uint32_t idx);
+
+    /**
+     * @brief 回收退出的worker, 安排重启
+     */
+    void reap(bool stopping);
+
+    /**
+     * @brief 向所有运行中的worker发送信号
+     */
+    void forward(int sig);
+
+    /**
+     * @brief worker进程主体, 不返回
+     * @param[in] master master进程id
+     */
+    void runWorker(uint32_t idx, pid_t master);
+private:
+    uint32_t m_workers;
+    /// 每个worker的IOManager线程数
+    uint32_t m_threads;
+    std::vector<TcpServer::ptr> m_servers;
+    std::vector<Slot> m_slots;
+    std::function<void(uint32_t idx)> m_workerInit;
+    std::function<void(int sig)> m_onSignal;
+};
+
+}
+
+#endif
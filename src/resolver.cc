@@ -0,0 +1,686 @@
+#include "resolver.h"
+#include "socket.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include "hook.h"
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <string.h>
+
+namespace sylar {
+
+static sylar::Logger::ptr g_logger = __LOG_NAME("system");
+
+static ConfigVar<bool>::ptr g_dns_resolver =
+    Config::Lookup<bool>("dns.resolver", true, "resolve hostnames in fibers with the builtin dns resolver");
+
+static ConfigVar<std::string>::ptr g_dns_hosts =
+    Config::Lookup<std::string>("dns.hosts", "/etc/hosts", "hosts file path");
+
+static ConfigVar<std::string>::ptr g_dns_resolv_conf =
+    Config::Lookup<std::string>("dns.resolv_conf", "/etc/resolv.conf", "resolv.conf path");
+
+static ConfigVar<uint64_t>::ptr g_dns_timeout =
+    Config::Lookup<uint64_t>("dns.timeout", 2000, "dns query timeout in ms");
+
+static ConfigVar<uint32_t>::ptr g_dns_attempts =
+    Config::Lookup<uint32_t>("dns.attempts", 2, "dns query attempts per nameserver");
+
+static ConfigVar<uint32_t>::ptr g_dns_max_ttl =
+    Config::Lookup<uint32_t>("dns.cache.max_ttl", 3600, "max seconds a dns answer is cached");
+
+static ConfigVar<uint32_t>::ptr g_dns_negative_ttl =
+    Config::Lookup<uint32_t>("dns.cache.negative_ttl", 30, "seconds a missing name is cached when the answer has no SOA");
+
+static ConfigVar<uint32_t>::ptr g_dns_max_size =
+    Config::Lookup<uint32_t>("dns.cache.max_size", 10000, "max dns cache entries");
+
+static const uint16_t DNS_PORT = 53;
+static const uint16_t TYPE_A = 1;
+static const uint16_t TYPE_SOA = 6;
+static const uint16_t TYPE_AAAA = 28;
+static const uint16_t CLASS_IN = 1;
+static const size_t DNS_HEADER_SIZE = 12;
+static const size_t DNS_MAX_UDP = 1232;
+
+static std::string ToLower(const std::string& str) {
+    std::string rt = str;
+    std::transform(rt.begin(), rt.end(), rt.begin(), ::tolower);
+    return rt;
+}
+
+static uint16_t ReadU16(const uint8_t* p) {
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t ReadU32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+            | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void WriteU16(std::string& buf, uint16_t v) {
+    buf.push_back((char)(v >> 8));
+    buf.push_back((char)(v & 0xff));
+}
+
+/**
+ * @brief 跳过报文中的域名(支持压缩指针)
+ * @return 域名之后的位置, 报文非法时返回0
+ */
+static size_t SkipName(const uint8_t* buf, size_t len, size_t pos) {
+    while(pos < len) {
+        uint8_t l = buf[pos];
+        if(l == 0) {
+            return pos + 1;
+        }
+        if((l & 0xc0) == 0xc0) {
+            return pos + 2 <= len ? pos + 2 : 0;
+        }
+        if(l & 0xc0) {
+            return 0;
+        }
+        pos += l + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 构造查询报文
+ * @return 域名非法时返回false
+ */
+static bool BuildQuery(std::string& buf, uint16_t id, const std::string& fqdn, uint16_t qtype) {
+    buf.clear();
+    WriteU16(buf, id);
+    WriteU16(buf, 0x0100);  // RD
+    WriteU16(buf, 1);       // QDCOUNT
+    WriteU16(buf, 0);
+    WriteU16(buf, 0);
+    WriteU16(buf, 0);
+    if(fqdn.empty() || fqdn.size() > 253) {
+        return false;
+    }
+    size_t begin = 0;
+    while(begin < fqdn.size()) {
+        size_t end = fqdn.find('.', begin);
+        if(end == std::string::npos) {
+            end = fqdn.size();
+        }
+        size_t l = end - begin;
+        if(l == 0 || l > 63) {
+            return false;
+        }
+        buf.push_back((char)l);
+        buf.append(fqdn, begin, l);
+        begin = end + 1;
+    }
+    buf.push_back(0);
+    WriteU16(buf, qtype);
+    WriteU16(buf, CLASS_IN);
+    return true;
+}
+
+static bool IsNumericHost(const std::string& node) {
+    unsigned char buf[sizeof(in6_addr)];
+    return inet_pton(AF_INET, node.c_str(), buf) == 1
+            || inet_pton(AF_INET6, node.c_str(), buf) == 1;
+}
+
+/**
+ * @brief 一个应答报文的解析结果
+ */
+struct DnsAnswer {
+    /// 应答码, 3为NXDOMAIN
+    uint16_t rcode = 0;
+    /// 报文被截断(TC), 需要改用TCP查询
+    bool truncated = false;
+    /// 应答段中的A/AAAA记录
+    std::vector<IPAddress::ptr> addrs;
+    /// 地址记录的最小TTL
+    uint32_t ttl = ~0u;
+    /// 权威段SOA的否定缓存时间
+    uint32_t soaTtl = ~0u;
+};
+
+/**
+ * @brief 解析应答报文, 截断的报文只解析头部
+ * @return 报文非法时返回false
+ */
+static bool ParseResponse(const uint8_t* data, size_t n, DnsAnswer& ans) {
+    if(n < DNS_HEADER_SIZE) {
+        return false;
+    }
+    uint16_t flags = ReadU16(data + 2);
+    ans.rcode = flags & 0x000f;
+    ans.truncated = flags & 0x0200;
+    if(ans.truncated || (ans.rcode != 0 && ans.rcode != 3)) {
+        return true;
+    }
+
+    uint16_t qdcount = ReadU16(data + 4);
+    uint16_t ancount = ReadU16(data + 6);
+    uint16_t nscount = ReadU16(data + 8);
+    size_t pos = DNS_HEADER_SIZE;
+    for(uint16_t i = 0; i < qdcount && pos; ++i) {
+        pos = SkipName(data, n, pos);
+        pos = (pos && pos + 4 <= n) ? pos + 4 : 0;
+    }
+    for(uint32_t i = 0; i < (uint32_t)ancount + nscount && pos; ++i) {
+        pos = SkipName(data, n, pos);
+        if(!pos || pos + 10 > n) {
+            return false;
+        }
+        uint16_t type = ReadU16(data + pos);
+        uint16_t cls = ReadU16(data + pos + 2);
+        uint32_t rttl = ReadU32(data + pos + 4);
+        uint16_t rdlen = ReadU16(data + pos + 8);
+        pos += 10;
+        if(pos + rdlen > n) {
+            return false;
+        }
+        const uint8_t* rdata = data + pos;
+        pos += rdlen;
+        if(cls != CLASS_IN) {
+            continue;
+        }
+        if(i >= ancount) {
+            // 权威段中的SOA, 否定缓存时间取 min(TTL, MINIMUM)
+            if(type == TYPE_SOA) {
+                size_t p = SkipName(data, n, rdata - data);
+                p = p ? SkipName(data, n, p) : 0;
+                if(p && p + 20 <= n) {
+                    ans.soaTtl = std::min(rttl, ReadU32(data + p + 16));
+                }
+            }
+            continue;
+        }
+        // CNAME链的目标记录也在应答段中, 直接收集所有地址记录
+        if(type == TYPE_A && rdlen == 4) {
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            memcpy(&addr.sin_addr, rdata, 4);
+            ans.addrs.push_back(std::make_shared<IPv4Address>(addr));
+            ans.ttl = std::min(ans.ttl, rttl);
+        } else if(type == TYPE_AAAA && rdlen == 16) {
+            ans.addrs.push_back(std::make_shared<IPv6Address>(rdata));
+            ans.ttl = std::min(ans.ttl, rttl);
+        }
+    }
+    return pos != 0;
+}
+
+/**
+ * @brief 在截止时间前读满len字节
+ */
+static bool RecvExact(Socket::ptr sock, void* buf, size_t len, uint64_t deadline) {
+    size_t offset = 0;
+    while(offset < len) {
+        uint64_t now = GetCurrentMS();
+        if(now >= deadline) {
+            return false;
+        }
+        sock->setRecvTimeout(deadline - now);
+        int n = sock->recv((char*)buf + offset, len - offset);
+        if(n <= 0) {
+            return false;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+/**
+ * @brief 通过TCP发送一个查询(报文前加2字节长度), 用于UDP应答被截断时
+ * @param[out] rsp 应答报文, 不含长度前缀
+ */
+static bool QueryTcp(const IPAddress::ptr& server, const std::string& query
+            ,uint64_t deadline, std::string& rsp) {
+    uint64_t now = GetCurrentMS();
+    if(now >= deadline) {
+        return false;
+    }
+    Socket::ptr sock = Socket::CreateTCP(server);
+    if(!sock->connect(server, deadline - now)) {
+        return false;
+    }
+    std::string buf;
+    WriteU16(buf, query.size());
+    buf.append(query);
+    sock->setSendTimeout(deadline - now);
+    size_t offset = 0;
+    while(offset < buf.size()) {
+        int n = sock->send(buf.c_str() + offset, buf.size() - offset);
+        if(n <= 0) {
+            return false;
+        }
+        offset += n;
+    }
+    uint8_t len[2];
+    if(!RecvExact(sock, len, sizeof(len), deadline)) {
+        return false;
+    }
+    rsp.resize(ReadU16(len));
+    return rsp.size() >= DNS_HEADER_SIZE && RecvExact(sock, &rsp[0], rsp.size(), deadline);
+}
+
+/**
+ * @brief 随机的查询ID
+ */
+static uint16_t RandomId() {
+    static thread_local std::mt19937 s_rng(std::random_device{}() ^ (uint32_t)GetCurrentUS());
+    return (uint16_t)s_rng();
+}
+
+Resolver::Resolver()
+    :m_timeout(g_dns_timeout->getValue())
+    ,m_attempts(g_dns_attempts->getValue()) {
+    if(m_attempts == 0) {
+        m_attempts = 1;
+    }
+    loadHosts(g_dns_hosts->getValue());
+    loadResolvConf(g_dns_resolv_conf->getValue());
+}
+
+bool Resolver::CanResolve(const std::string& node) {
+    return !node.empty() && g_dns_resolver->getValue()
+            && is_hook_enable() && !IsNumericHost(node);
+}
+
+bool Resolver::loadHosts(const std::string& path) {
+    std::ifstream ifs(path);
+    if(!ifs) {
+        __LOG_DEBUG(g_logger) << "Resolver::loadHosts open " << path << " fail";
+        return false;
+    }
+    std::map<std::string, std::vector<IPAddress::ptr> > hosts;
+    std::string line;
+    while(std::getline(ifs, line)) {
+        size_t pos = line.find('#');
+        if(pos != std::string::npos) {
+            line.resize(pos);
+        }
+        std::stringstream ss(line);
+        std::string ip;
+        if(!(ss >> ip)) {
+            continue;
+        }
+        IPAddress::ptr addr = IPAddress::Create(ip.c_str());
+        if(!addr) {
+            continue;
+        }
+        std::string name;
+        while(ss >> name) {
+            hosts[ToLower(name)].push_back(addr);
+        }
+    }
+    RWMutexType::WriteLock lock(m_mutex);
+    m_hosts.swap(hosts);
+    return true;
+}
+
+bool Resolver::loadResolvConf(const std::string& path) {
+    std::ifstream ifs(path);
+    if(!ifs) {
+        __LOG_DEBUG(g_logger) << "Resolver::loadResolvConf open " << path << " fail";
+        return false;
+    }
+    std::vector<IPAddress::ptr> servers;
+    std::vector<std::string> search;
+    uint32_t ndots = 1;
+    uint64_t timeout = m_timeout;
+    uint32_t attempts = m_attempts;
+    std::string line;
+    while(std::getline(ifs, line)) {
+        size_t pos = line.find_first_of("#;");
+        if(pos != std::string::npos) {
+            line.resize(pos);
+        }
+        std::stringstream ss(line);
+        std::string key;
+        if(!(ss >> key)) {
+            continue;
+        }
+        std::string value;
+        if(key == "nameserver") {
+            if(ss >> value) {
+                IPAddress::ptr addr = IPAddress::Create(value.c_str(), DNS_PORT);
+                if(addr) {
+                    servers.push_back(addr);
+                }
+            }
+        } else if(key == "search" || key == "domain") {
+            // 后出现的search/domain覆盖前面的
+            search.clear();
+            while(ss >> value) {
+                search.push_back(ToLower(value));
+            }
+        } else if(key == "options") {
+            while(ss >> value) {
+                if(value.compare(0, 6, "ndots:") == 0) {
+                    ndots = atoi(value.c_str() + 6);
+                } else if(value.compare(0, 8, "timeout:") == 0) {
+                    timeout = atoi(value.c_str() + 8) * 1000;
+                } else if(value.compare(0, 9, "attempts:") == 0) {
+                    attempts = atoi(value.c_str() + 9);
+                }
+            }
+        }
+    }
+    RWMutexType::WriteLock lock(m_mutex);
+    m_nameservers.swap(servers);
+    m_search.swap(search);
+    m_ndots = ndots;
+    if(timeout) {
+        m_timeout = timeout;
+    }
+    if(attempts) {
+        m_attempts = attempts;
+    }
+    return true;
+}
+
+void Resolver::setNameservers(const std::vector<IPAddress::ptr>& servers) {
+    std::vector<IPAddress::ptr> tmp;
+    for(auto& i : servers) {
+        IPAddress::ptr addr = std::dynamic_pointer_cast<IPAddress>(
+                Address::Create(i->getAddr(), i->getAddrLen()));
+        if(addr->getPort() == 0) {
+            addr->setPort(DNS_PORT);
+        }
+        tmp.push_back(addr);
+    }
+    RWMutexType::WriteLock lock(m_mutex);
+    m_nameservers.swap(tmp);
+}
+
+std::vector<IPAddress::ptr> Resolver::getNameservers() {
+    RWMutexType::ReadLock lock(m_mutex);
+    return m_nameservers;
+}
+
+void Resolver::clearCache() {
+    MutexType::Lock lock(m_cacheMutex);
+    m_cache.clear();
+}
+
+Resolver::Stats Resolver::getStats() const {
+    Stats stats;
+    stats.hostsHits = m_hostsHits;
+    stats.cacheHits = m_cacheHits;
+    stats.negativeHits = m_negativeHits;
+    stats.queries = m_queries;
+    stats.failures = m_failures;
+    return stats;
+}
+
+bool Resolver::lookupHosts(const std::string& name, int family, std::vector<IPAddress::ptr>& result) {
+    RWMutexType::ReadLock lock(m_mutex);
+    auto it = m_hosts.find(name);
+    if(it == m_hosts.end()) {
+        return false;
+    }
+    size_t size = result.size();
+    for(auto& i : it->second) {
+        if(family == AF_UNSPEC || family == i->getFamily()) {
+            result.push_back(i);
+        }
+    }
+    return result.size() > size;
+}
+
+bool Resolver::lookupCache(const std::string& key, std::vector<IPAddress::ptr>& result) {
+    MutexType::Lock lock(m_cacheMutex);
+    auto it = m_cache.find(key);
+    if(it == m_cache.end()) {
+        return false;
+    }
+    if(it->second.expire <= GetCurrentMS()) {
+        m_cache.erase(it);
+        return false;
+    }
+    result.insert(result.end(), it->second.addrs.begin(), it->second.addrs.end());
+    return true;
+}
+
+void Resolver::insertCache(const std::string& key, const std::vector<IPAddress::ptr>& addrs, uint32_t ttl) {
+    ttl = std::min(ttl, g_dns_max_ttl->getValue());
+    if(ttl == 0) {
+        return;
+    }
+    uint64_t now = GetCurrentMS();
+    size_t max_size = g_dns_max_size->getValue();
+    MutexType::Lock lock(m_cacheMutex);
+    if(m_cache.size() >= max_size) {
+        for(auto it = m_cache.begin(); it != m_cache.end();) {
+            if(it->second.expire <= now) {
+                it = m_cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if(m_cache.size() >= max_size && !m_cache.empty()) {
+            m_cache.erase(m_cache.begin());
+        }
+    }
+    CacheEntry& entry = m_cache[key];
+    entry.addrs = addrs;
+    entry.expire = now + ttl * 1000ull;
+}
+
+std::vector<std::string> Resolver::candidates(const std::string& name) {
+    std::vector<std::string> rt;
+    if(name.back() == '.') {
+        rt.push_back(name.substr(0, name.size() - 1));
+        return rt;
+    }
+    RWMutexType::ReadLock lock(m_mutex);
+    uint32_t dots = std::count(name.begin(), name.end(), '.');
+    if(dots >= m_ndots) {
+        rt.push_back(name);
+    }
+    for(auto& i : m_search) {
+        rt.push_back(name + "." + i);
+    }
+    if(dots < m_ndots) {
+        rt.push_back(name);
+    }
+    return rt;
+}
+
+bool Resolver::resolve(const std::string& name, int family, std::vector<IPAddress::ptr>& result) {
+    if(name.empty()) {
+        return false;
+    }
+    if(IsNumericHost(name)) {
+        IPAddress::ptr numeric = IPAddress::Create(name.c_str());
+        if(!numeric || (family != AF_UNSPEC && family != numeric->getFamily())) {
+            return false;
+        }
+        result.push_back(numeric);
+        return true;
+    }
+
+    std::string lname = ToLower(name);
+    if(lookupHosts(lname, family, result)) {
+        ++m_hostsHits;
+        return true;
+    }
+
+    std::string key = lname + "/" + std::to_string(family);
+    size_t size = result.size();
+    if(lookupCache(key, result)) {
+        ++m_cacheHits;
+        if(result.size() == size) {
+            ++m_negativeHits;
+            return false;
+        }
+        return true;
+    }
+
+    bool failed = false;
+    uint32_t negative_ttl = g_dns_negative_ttl->getValue();
+    for(auto& fqdn : candidates(lname)) {
+        std::vector<IPAddress::ptr> addrs;
+        uint32_t ttl = 0;
+        QueryResult rt = query(fqdn, family, addrs, ttl);
+        if(rt == FAILED) {
+            failed = true;
+            continue;
+        }
+        if(!addrs.empty()) {
+            insertCache(key, addrs, ttl);
+            result.insert(result.end(), addrs.begin(), addrs.end());
+            return true;
+        }
+        negative_ttl = std::min(negative_ttl, ttl);
+    }
+    // 有服务器没有应答时不做否定缓存, 下次重新查询
+    if(!failed) {
+        insertCache(key, std::vector<IPAddress::ptr>(), negative_ttl);
+    }
+    return false;
+}
+
+Resolver::QueryResult Resolver::query(const std::string& fqdn, int family
+            ,std::vector<IPAddress::ptr>& result, uint32_t& ttl) {
+    std::vector<IPAddress::ptr> servers;
+    uint64_t timeout;
+    uint32_t attempts;
+    {
+        RWMutexType::ReadLock lock(m_mutex);
+        servers = m_nameservers;
+        timeout = m_timeout;
+        attempts = m_attempts;
+    }
+    if(servers.empty()) {
+        servers.push_back(IPv4Address::Create("127.0.0.1", DNS_PORT));
+    }
+    for(uint32_t i = 0; i < attempts; ++i) {
+        for(auto& server : servers) {
+            ++m_queries;
+            QueryResult rt = queryServer(server, fqdn, family, timeout, result, ttl);
+            if(rt != FAILED) {
+                return rt;
+            }
+            ++m_failures;
+        }
+    }
+    __LOG_WARN(g_logger) << "Resolver::query " << fqdn << " no nameserver answered";
+    return FAILED;
+}
+
+Resolver::QueryResult Resolver::queryServer(const IPAddress::ptr& server, const std::string& fqdn
+            ,int family, uint64_t timeout, std::vector<IPAddress::ptr>& result, uint32_t& ttl) {
+    Socket::ptr sock = Socket::CreateUDP(server);
+    if(!sock->isValid() || !sock->connect(server)) {
+        return FAILED;
+    }
+
+    std::vector<uint16_t> qtypes;
+    if(family != AF_INET6) {
+        qtypes.push_back(TYPE_A);
+    }
+    if(family != AF_INET) {
+        qtypes.push_back(TYPE_AAAA);
+    }
+    std::vector<uint16_t> ids;
+    std::vector<std::string> queries;
+    for(auto qtype : qtypes) {
+        uint16_t id = RandomId();
+        std::string buf;
+        if(!BuildQuery(buf, id, fqdn, qtype)) {
+            __LOG_DEBUG(g_logger) << "Resolver invalid name " << fqdn;
+            return NXDOMAIN;
+        }
+        if(sock->send(buf.c_str(), buf.size()) != (int)buf.size()) {
+            return FAILED;
+        }
+        ids.push_back(id);
+        queries.push_back(buf);
+    }
+
+    // 地址先收集到本地, 成功后才合并到result, 失败重试时不会重复
+    std::vector<IPAddress::ptr> addrs;
+    size_t failed = 0;
+    bool nxdomain = false;
+    uint32_t min_ttl = ~0u;
+    uint32_t soa_ttl = ~0u;
+    uint8_t data[DNS_MAX_UDP];
+    uint64_t deadline = GetCurrentMS() + timeout;
+    while(!ids.empty()) {
+        uint64_t now = GetCurrentMS();
+        if(now >= deadline) {
+            break;
+        }
+        sock->setRecvTimeout(deadline - now);
+        int n = sock->recv(data, sizeof(data));
+        if(n < 0) {
+            break;
+        }
+        if(n < (int)DNS_HEADER_SIZE) {
+            continue;
+        }
+        auto it = std::find(ids.begin(), ids.end(), ReadU16(data));
+        if(it == ids.end() || !(ReadU16(data + 2) & 0x8000)) {
+            continue;
+        }
+        size_t idx = it - ids.begin();
+        std::string query = queries[idx];
+        ids.erase(it);
+        queries.erase(queries.begin() + idx);
+
+        DnsAnswer ans;
+        bool ok = ParseResponse(data, n, ans);
+        std::string tcp_rsp;
+        if(ok && ans.truncated) {
+            // 应答超过UDP报文大小, 通过TCP重新查询这一种记录
+            ans = DnsAnswer();
+            ok = QueryTcp(server, query, deadline, tcp_rsp)
+                    && ReadU16((const uint8_t*)tcp_rsp.c_str()) == ReadU16((const uint8_t*)query.c_str())
+                    && ParseResponse((const uint8_t*)tcp_rsp.c_str(), tcp_rsp.size(), ans)
+                    && !ans.truncated;
+        }
+        if(!ok) {
+            __LOG_DEBUG(g_logger) << "Resolver " << fqdn << " server=" << server->toString()
+                << " malformed or truncated response";
+            ++failed;
+            continue;
+        }
+        if(ans.rcode == 3) {
+            nxdomain = true;
+        } else if(ans.rcode != 0) {
+            __LOG_DEBUG(g_logger) << "Resolver " << fqdn << " server=" << server->toString()
+                << " rcode=" << ans.rcode;
+            ++failed;
+            continue;
+        }
+        addrs.insert(addrs.end(), ans.addrs.begin(), ans.addrs.end());
+        min_ttl = std::min(min_ttl, ans.ttl);
+        soa_ttl = std::min(soa_ttl, ans.soaTtl);
+    }
+    // 超时未应答的查询
+    failed += ids.size();
+
+    if(!addrs.empty()) {
+        ttl = min_ttl;
+        if(failed) {
+            // AF_UNSPEC时另一族失败, 先使用已应答的地址, 按否定缓存时间缓存以便尽快补查
+            __LOG_DEBUG(g_logger) << "Resolver " << fqdn << " server=" << server->toString()
+                << " partial answer, " << failed << " query failed";
+            ttl = std::min(ttl, g_dns_negative_ttl->getValue());
+        }
+        result.insert(result.end(), addrs.begin(), addrs.end());
+        return ANSWER;
+    }
+    if(failed) {
+        return FAILED;
+    }
+    ttl = soa_ttl;
+    return nxdomain ? NXDOMAIN : ANSWER;
+}
+
+}
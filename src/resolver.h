@@ -0,0 +1,202 @@
+/**
+ * @file resolver.h
+ * @brief 协程化的DNS解析器
+ */
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include "address.h"
+#include "mutex.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief DNS解析器
+ * @details getaddrinfo不经过hook, 在协程中解析域名会阻塞整个调度线程。
+ *          Resolver直接通过(被hook的)UDP socket向resolv.conf中的nameserver发送查询,
+ *          等待应答时只挂起当前协程。解析顺序为: 数字地址 -> hosts文件 -> 缓存 -> DNS查询。
+ *          缓存遵循应答中的TTL, 不存在的域名按SOA的最小TTL做否定缓存
+ */
+class Resolver : Noncopyable {
+public:
+    typedef std::shared_ptr<Resolver> ptr;
+    typedef RWMutex RWMutexType;
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 统计信息
+     */
+    struct Stats {
+        /// 命中hosts文件的次数
+        uint64_t hostsHits = 0;
+        /// 命中缓存的次数(含否定缓存)
+        uint64_t cacheHits = 0;
+        /// 命中否定缓存的次数
+        uint64_t negativeHits = 0;
+        /// 发往nameserver的查询次数
+        uint64_t queries = 0;
+        /// 查询超时或失败的次数
+        uint64_t failures = 0;
+    };
+
+    /**
+     * @brief 构造函数, 按配置加载hosts文件和resolv.conf
+     */
+    Resolver();
+
+    /**
+     * @brief 解析主机名
+     * @param[in] name 主机名, 不含端口
+     * @param[in] family AF_INET, AF_INET6 或 AF_UNSPEC
+     * @param[out] result 解析到的地址, 端口为0
+     * @return 是否解析到地址
+     */
+    bool resolve(const std::string& name, int family, std::vector<IPAddress::ptr>& result);
+
+    /**
+     * @brief 加载hosts文件, 替换已加载的内容
+     */
+    bool loadHosts(const std::string& path);
+
+    /**
+     * @brief 加载resolv.conf中的nameserver, search/domain 和 options
+     */
+    bool loadResolvConf(const std::string& path);
+
+    /**
+     * @brief 设置nameserver, 端口为0时使用53
+     */
+    void setNameservers(const std::vector<IPAddress::ptr>& servers);
+
+    /**
+     * @brief 获取nameserver
+     */
+    std::vector<IPAddress::ptr> getNameservers();
+
+    /**
+     * @brief 设置单次查询的超时时间(毫秒)
+     */
+    void setTimeout(uint64_t v) {
+        RWMutexType::WriteLock lock(m_mutex);
+        m_timeout = v;
+    }
+
+    /**
+     * @brief 设置每个nameserver的尝试轮数
+     */
+    void setAttempts(uint32_t v) {
+        RWMutexType::WriteLock lock(m_mutex);
+        m_attempts = v ? v : 1;
+    }
+
+    /**
+     * @brief 清空缓存
+     */
+    void clearCache();
+
+    /**
+     * @brief 获取统计信息
+     */
+    Stats getStats() const;
+
+    /**
+     * @brief 当前环境是否应当使用Resolver代替getaddrinfo
+     * @details 配置dns.resolver开启、处于开启hook的协程线程, 且node不是数字地址
+     */
+    static bool CanResolve(const std::string& node);
+private:
+    /**
+     * @brief 缓存项, addrs为空表示否定缓存
+     */
+    struct CacheEntry {
+        std::vector<IPAddress::ptr> addrs;
+        /// 过期时间(毫秒时间戳)
+        uint64_t expire = 0;
+    };
+
+    /**
+     * @brief 查询结果
+     */
+    enum QueryResult {
+        /// 有应答, 可能没有地址(NODATA)
+        ANSWER = 0,
+        /// 域名不存在(NXDOMAIN)
+        NXDOMAIN = 1,
+        /// 超时或服务器错误
+        FAILED = -1
+    };
+
+    /**
+     * @brief 依次向所有nameserver查询一个完整域名
+     */
+    QueryResult query(const std::string& fqdn, int family
+                ,std::vector<IPAddress::ptr>& result, uint32_t& ttl);
+
+    /**
+     * @brief 向一个nameserver查询, AF_UNSPEC时同时发送A和AAAA查询
+     * @details 应答被截断(TC)时改用TCP重新查询; 成功时才把地址追加到result。
+     *          AF_UNSPEC时一族有地址而另一族失败, 返回已有的地址, ttl不超过否定缓存时间
+     */
+    QueryResult queryServer(const IPAddress::ptr& server, const std::string& fqdn
+                ,int family, uint64_t timeout, std::vector<IPAddress::ptr>& result, uint32_t& ttl);
+
+    /**
+     * @brief 查hosts文件
+     */
+    bool lookupHosts(const std::string& name, int family, std::vector<IPAddress::ptr>& result);
+
+    /**
+     * @brief 查缓存
+     * @return 命中返回true, 否定缓存命中时result为空
+     */
+    bool lookupCache(const std::string& key, std::vector<IPAddress::ptr>& result);
+
+    /**
+     * @brief 写缓存
+     * @param[in] ttl 秒
+     */
+    void insertCache(const std::string& key, const std::vector<IPAddress::ptr>& addrs, uint32_t ttl);
+
+    /**
+     * @brief 按search列表和ndots生成待查询的完整域名
+     */
+    std::vector<std::string> candidates(const std::string& name);
+private:
+    mutable RWMutexType m_mutex;
+    /// hosts文件, 小写主机名 -> 地址
+    std::map<std::string, std::vector<IPAddress::ptr> > m_hosts;
+    /// nameserver列表
+    std::vector<IPAddress::ptr> m_nameservers;
+    /// search域
+    std::vector<std::string> m_search;
+    /// 名字中点的个数少于ndots时先尝试search域
+    uint32_t m_ndots = 1;
+    /// 单次查询超时(毫秒)
+    uint64_t m_timeout;
+    /// 每个nameserver的尝试轮数
+    uint32_t m_attempts;
+
+    mutable MutexType m_cacheMutex;
+    /// 缓存, key为 小写主机名/family
+    std::unordered_map<std::string, CacheEntry> m_cache;
+
+    std::atomic<uint64_t> m_hostsHits = {0};
+    std::atomic<uint64_t> m_cacheHits = {0};
+    std::atomic<uint64_t> m_negativeHits = {0};
+    std::atomic<uint64_t> m_queries = {0};
+    std::atomic<uint64_t> m_failures = {0};
+};
+
+typedef Singleton<Resolver> ResolverMgr;
+
+}
+
+#endif
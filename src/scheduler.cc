@@ -10,6 +10,8 @@ namespace sylar {
 
     static thread_local Fiber* t_scheduler_fiber = nullptr; // 主协程
 
+    static thread_local int t_local_index = -1; // 当前线程在本地批次表中的序号
+
 
     Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name) 
         :m_name(name) {
@@ -38,6 +40,7 @@ namespace sylar {
         }
 
         m_threadCount = threads;    //记录线程数量
+        m_localFibers.resize(m_threadCount + 1);    // 工作线程加上可能的caller线程
     }
 
     Scheduler::~Scheduler() {
@@ -142,18 +145,58 @@ namespace sylar {
         for(auto& i : thrs) {
             i->join();
         }
+        // 所有线程都已退出run(), 重新start时本地批次的序号和线程id从头分配
+        MutexType::Lock lock(m_mutex);
+        m_workerSeq = 0;
+        m_threadIds.clear();
+        if(m_rootThread != -1) {
+            m_threadIds.push_back(m_rootThread);
+        }
     }
     
     void Scheduler::setThis() {
         t_scheduler = this;
     }
 
+    std::list<Scheduler::Assign>* Scheduler::localQueue() {
+        if(t_scheduler != this || t_local_index < 0) {
+            return nullptr;
+        }
+        return &m_localFibers[t_local_index];
+    }
+
+    void Scheduler::flushLocal() {
+        std::list<Assign>* local = localQueue();
+        if(!local || local->size() <= 1) {
+            return;
+        }
+        // 在idle协程中调用, 空闲线程计数中包含了自己
+        size_t others = m_idleThreadCount;
+        others = others > 0 ? others - 1 : 0;
+        if(others == 0) {
+            return;
+        }
+        size_t keep = (local->size() + others) / (others + 1);
+        size_t moved = local->size() - keep;
+        auto it = local->begin();
+        std::advance(it, keep);
+        {
+            MutexType::Lock lock(m_mutex);
+            m_fibers.splice(m_fibers.end(), *local, it, local->end());
+        }
+        m_localCount -= moved;
+        tickle();
+    }
+
     void Scheduler::run(){
         // 1号及以后的协程执行的操作
         __LOG_INFO(g_logger) << "run";
 
         set_hook_enable(true);
         setThis();  // 先把主调度器设为自身
+        t_local_index = m_workerSeq++;
+        __ASSERT(t_local_index < (int)m_localFibers.size());
+        std::list<Assign>& local = m_localFibers[t_local_index];
         if(sylar::GetThreadId() != m_rootThread) {    // 如果线程ID不为主线程ID，也就是说子线程
             t_scheduler_fiber = Fiber::GetThis().get();   // 当前协程就设为Fiber的主协程
         }
@@ -165,7 +208,19 @@ namespace sylar {
             ft.reset();
             bool is_active = false;
             bool tickle_me = false;
-            {
+            if(!local.empty()) {
+                // 本线程idle中收割到的任务优先在本线程执行, 不加锁
+                ft = local.front();
+                local.pop_front();
+                --m_localCount;
+                if(ft.fiber && ft.fiber->getState() == Fiber::EXEC) {
+                    // 协程还未在其他线程上完成切出, 交由全局队列处理
+                    schedule(ft.fiber);
+                    continue;
+                }
+                ++m_activeThreadCount;
+                is_active = true;
+            } else {
                 MutexType::Lock lock(m_mutex);
                 // 从协程队列中取出协程
                 auto it = m_fibers.begin();     // it 指向 消息队列头部
@@ -258,6 +313,7 @@ namespace sylar {
                 }        
             }
         }
+        t_local_index = -1;
     }
     void Scheduler::tickle() {
         __LOG_INFO(g_logger) << "tickle";
@@ -265,7 +321,8 @@ namespace sylar {
     bool Scheduler::stopping() {
         MutexType::Lock lock(m_mutex);
         // 判断调度器可停止条件：自动停止位为1, stopping状态位为1, 协程队列为空, 活跃状态的线程为0
-        return m_autoStop && m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+        return m_autoStop && m_stopping && m_fibers.empty()
+                && m_localCount == 0 && m_activeThreadCount == 0;
     }
     void Scheduler::idle() {
         __LOG_INFO(g_logger) << "idle";
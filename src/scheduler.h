@@ -62,6 +62,27 @@ namespace sylar {
                     tickle();
                 }
             }
+
+            /**
+             *  @brief 放入当前工作线程的本地批次, 不加锁
+             *  @details 本地批次由当前线程在run()中优先执行, 避免协程被其他线程取走造成迁移;
+             *           多余部分在flushLocal()中一次性加锁移入全局队列。
+             *           调用线程不是本调度器的工作线程时退化为schedule()
+             *  @param fc 协程或者回调方法
+             */
+            template<class FiberOrCallback>
+            void scheduleLocal(FiberOrCallback fc) {
+                std::list<Assign>* local = localQueue();
+                if(!local) {
+                    schedule(fc);
+                    return;
+                }
+                Assign task(fc, -1);
+                if(task.fiber || task.cb) {
+                    local->push_back(task);
+                    ++m_localCount;
+                }
+            }
             
         protected:
             virtual void tickle();
@@ -71,7 +92,17 @@ namespace sylar {
 
             void setThis();
             bool hasIdleThreads() { return m_idleThreadCount > 0;}
+            // 调用线程是否正在执行本调度器的run()
+            bool inRun() { return localQueue() != nullptr;}
+
+            /**
+             *  @brief 提交当前线程的本地批次
+             *  @details 有其他空闲线程时, 本线程只保留均分后的一份,
+             *           其余部分一次加锁移入全局队列并唤醒其他线程
+             */
+            void flushLocal();
         private:
+
             template<class FiberOrCallback>
             bool scheduleNoLock(FiberOrCallback fc, int thread = -1) {
                 // 这里的意思是，若出现某个协程需要执行
@@ -125,11 +156,19 @@ namespace sylar {
                 }
             };
         private:
+            /**
+             *  @brief 当前线程的本地批次, 不是本调度器工作线程时返回nullptr
+             */
+            std::list<Assign>* localQueue();
+        private:
             
             mutable MutexType m_mutex;  
             
             std::vector<Thread::ptr> m_threads; // 线程池
             std::list<Assign> m_fibers; // 保存将要执行的协程(及其指定的线程)
+            std::vector<std::list<Assign> > m_localFibers; // 各工作线程的本地批次, 只由所属线程访问
+            std::atomic<size_t> m_localCount = {0}; // 所有本地批次中的任务总数
+            std::atomic<int> m_workerSeq = {0}; // 工作线程序号分配
             Fiber::ptr m_rootFiber; //主协程
             std::string m_name;
         protected:
@@ -0,0 +1,121 @@
+/**
+ * @file segment_table.h
+ * @brief 分段式下标表, 用于按fd索引的上下文
+ */
+#ifndef __SEGMENT_TABLE_H__
+#define __SEGMENT_TABLE_H__
+
+#include <atomic>
+#include <stddef.h>
+#include "mutex.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief 分段式下标表
+ * @details 表被切成若干固定大小的段, 段一旦分配就不再移动或释放(直到表析构),
+ *          因此返回的元素指针始终有效。读操作只做一次原子load, 不加锁(wait-free);
+ *          只有在需要分配新段时才加锁。
+ *          T 元素类型, 需可默认构造
+ *          SegmentBits 每段元素个数为 2^SegmentBits
+ *          MaxSegments 最大段数, 下标上限为 MaxSegments << SegmentBits
+ */
+template<class T, size_t SegmentBits = 10, size_t MaxSegments = 1024>
+class SegmentTable : Noncopyable {
+public:
+    typedef Mutex MutexType;
+    static const size_t SEGMENT_SIZE = (size_t)1 << SegmentBits;
+
+    SegmentTable() {
+        for(size_t i = 0; i < MaxSegments; ++i) {
+            m_segments[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~SegmentTable() {
+        for(size_t i = 0; i < MaxSegments; ++i) {
+            delete[] m_segments[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief 下标容量上限
+     */
+    static size_t Capacity() { return MaxSegments << SegmentBits;}
+
+    /**
+     * @brief 获取下标对应的元素(不分配)
+     * @return 所在段尚未分配或越界时返回nullptr
+     */
+    T* get(size_t idx) const {
+        size_t seg = idx >> SegmentBits;
+        if(seg >= MaxSegments) {
+            return nullptr;
+        }
+        T* s = m_segments[seg].load(std::memory_order_acquire);
+        if(!s) {
+            return nullptr;
+        }
+        return &s[idx & (SEGMENT_SIZE - 1)];
+    }
+
+    /**
+     * @brief 获取下标对应的元素, 所在段不存在时分配该段
+     * @param[in] idx 下标
+     * @param[in] init 新段中每个元素的初始化方法 void(T&, size_t idx)
+     * @return 越界时返回nullptr
+     */
+    template<class Init>
+    T* getOrCreate(size_t idx, Init init) {
+        T* v = get(idx);
+        if(v) {
+            return v;
+        }
+        size_t seg = idx >> SegmentBits;
+        if(seg >= MaxSegments) {
+            return nullptr;
+        }
+        MutexType::Lock lock(m_mutex);
+        T* s = m_segments[seg].load(std::memory_order_relaxed);
+        if(!s) {
+            s = new T[SEGMENT_SIZE];
+            size_t base = seg << SegmentBits;
+            for(size_t i = 0; i < SEGMENT_SIZE; ++i) {
+                init(s[i], base + i);
+            }
+            m_segments[seg].store(s, std::memory_order_release);
+        }
+        return &s[idx & (SEGMENT_SIZE - 1)];
+    }
+
+    T* getOrCreate(size_t idx) {
+        return getOrCreate(idx, [](T&, size_t){});
+    }
+
+    /**
+     * @brief 遍历所有已分配的元素
+     * @param[in] cb void(T&)
+     */
+    template<class Callback>
+    void foreach(Callback cb) {
+        for(size_t i = 0; i < MaxSegments; ++i) {
+            T* s = m_segments[i].load(std::memory_order_acquire);
+            if(!s) {
+                continue;
+            }
+            for(size_t j = 0; j < SEGMENT_SIZE; ++j) {
+                cb(s[j]);
+            }
+        }
+    }
+private:
+    /// 分配新段时使用的锁
+    MutexType m_mutex;
+    /// 各段首地址
+    std::atomic<T*> m_segments[MaxSegments];
+};
+
+}
+
+#endif
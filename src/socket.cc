@@ -4,12 +4,59 @@
 #include "log.h"
 #include "macro.h"
 #include "hook.h"
+#include "config.h"
+#include "util.h"
 #include <limits.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <atomic>
 
 namespace sylar {
 
 static sylar::Logger::ptr g_logger = __LOG_NAME("system");
 
+static sylar::ConfigVar<uint32_t>::ptr g_socket_zerocopy_threshold =
+    sylar::Config::Lookup("socket.zerocopy.threshold", (uint32_t)(64 * 1024),
+    "min bytes per send to use MSG_ZEROCOPY");
+
+static sylar::ConfigVar<uint32_t>::ptr g_socket_zerocopy_close_wait =
+    sylar::Config::Lookup("socket.zerocopy.close_wait", (uint32_t)1000,
+    "max ms to wait for zerocopy completions before close");
+
+static sylar::ConfigVar<uint64_t>::ptr g_socket_zerocopy_max_pending =
+    sylar::Config::Lookup("socket.zerocopy.max_pending", (uint64_t)(8 * 1024 * 1024),
+    "max bytes per socket waiting for zerocopy completions, more sends are copied");
+
+static sylar::ConfigVar<uint32_t>::ptr g_socket_zerocopy_reap_interval =
+    sylar::Config::Lookup("socket.zerocopy.reap_interval", (uint32_t)10,
+    "ms between zerocopy completion reaps on the owning iomanager");
+
+static sylar::ConfigVar<uint32_t>::ptr g_ssl_session_cache_size =
+    sylar::Config::Lookup("ssl.session_cache_size", (uint32_t)20480,
+    "ssl server session cache size");
+
+static sylar::ConfigVar<uint32_t>::ptr g_ssl_session_timeout =
+    sylar::Config::Lookup("ssl.session_timeout", (uint32_t)300,
+    "ssl session timeout in seconds");
+
+static sylar::ConfigVar<bool>::ptr g_ssl_session_ticket =
+    sylar::Config::Lookup("ssl.session_ticket", true,
+    "ssl server issue session tickets");
+
+static sylar::ConfigVar<bool>::ptr g_ssl_ktls =
+    sylar::Config::Lookup("ssl.ktls", true,
+    "hand ssl record layer to kernel tls when supported");
+
+static sylar::ConfigVar<bool>::ptr g_ssl_client_verify =
+    sylar::Config::Lookup("ssl.client.verify", true,
+    "default ssl client context verifies server certificates, false accepts any certificate");
+
+static sylar::ConfigVar<std::string>::ptr g_ssl_client_ca_file =
+    sylar::Config::Lookup("ssl.client.ca_file", std::string(""),
+    "ca file for the default ssl client context, empty uses the system default paths");
+
 Socket::ptr Socket::CreateTCP(sylar::Address::ptr address) {
     Socket::ptr sock(new Socket(address->getFamily(), TCP, 0));
     return sock;
@@ -115,8 +162,12 @@ bool Socket::setOption(int level, int option, const void* result, socklen_t len)
     return true;
 }
 
+Socket::ptr Socket::createAccepted() const {
+    return Socket::ptr(new Socket(m_family, m_type, m_protocol));
+}
+
 Socket::ptr Socket::accept() {
-    Socket::ptr sock(new Socket(m_family, m_type, m_protocol));
+    Socket::ptr sock = createAccepted();
     int newsock = ::accept(m_sock, nullptr, nullptr);
     if(newsock == -1) {
         __LOG_ERROR(g_logger) << "accept(" << m_sock << ") errno="
@@ -129,11 +180,59 @@ Socket::ptr Socket::accept() {
     return nullptr;
 }
 
+size_t Socket::acceptBatch(std::vector<Socket::ptr>& socks, size_t max) {
+    sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    // hook总是以系统非阻塞方式创建socket, 这里传入SOCK_NONBLOCK会被当作用户要求的非阻塞
+    int newsock = ::accept4(m_sock, (sockaddr*)&addr, &addrlen, SOCK_CLOEXEC);
+    if(newsock == -1) {
+        // 由调用者根据errno决定是否记录, 主动关闭监听socket时的EBADF属于正常退出
+        return 0;
+    }
+    size_t count = 0;
+    size_t tries = 0;
+    while(true) {
+        Socket::ptr sock = createAccepted();
+        if(sock->initAccepted(newsock, (const sockaddr*)&addr, addrlen)) {
+            socks.push_back(sock);
+            ++count;
+        } else {
+            ::close(newsock);
+        }
+        if(++tries >= max) {
+            break;
+        }
+        // 队列已空时返回EAGAIN, 不再挂起等待
+        addrlen = sizeof(addr);
+        newsock = accept4_f(m_sock, (sockaddr*)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(newsock == -1) {
+            break;
+        }
+    }
+    return count;
+}
+
+bool Socket::initAccepted(int sock, const sockaddr* addr, socklen_t addrlen) {
+    FdCtx::ptr ctx = FdMgr::GetInstance()->addSocket(sock);
+    if(!ctx || ctx->isClosed()) {
+        return false;
+    }
+    m_sock = sock;
+    m_isConnected = true;
+    touch();
+    // 未命名的Unix域对端地址交给getRemoteAddress按需获取
+    if(m_family != AF_UNIX && addrlen <= sizeof(sockaddr_storage)) {
+        m_remoteAddress = Address::Create(addr, addrlen);
+    }
+    return true;
+}
+
 bool Socket::init(int sock) {
     FdCtx::ptr ctx = FdMgr::GetInstance()->get(sock);
     if(ctx && ctx->isSocket() && !ctx->isClosed()) {
         m_sock = sock;
         m_isConnected = true;
+        touch();
         initSock();
         getLocalAddress();
         getRemoteAddress();
@@ -142,6 +241,17 @@ bool Socket::init(int sock) {
     return false;
 }
 
+bool Socket::setReusePort(bool v) {
+    if(!isValid()) {
+        newSock();
+        if(__UNLIKELY(!isValid())) {
+            return false;
+        }
+    }
+    int val = v ? 1 : 0;
+    return setOption(SOL_SOCKET, SO_REUSEPORT, val);
+}
+
 bool Socket::bind(const Address::ptr addr) {
     //m_localAddress = addr;
     if(!isValid()) {
@@ -219,6 +329,7 @@ bool Socket::connect(const Address::ptr addr, uint64_t timeout_ms) {
         }
     }
     m_isConnected = true;
+    touch();
     getRemoteAddress();
     getLocalAddress();
     return true;
@@ -237,11 +348,74 @@ bool Socket::listen(int backlog) {
     return true;
 }
 
+bool Socket::adoptListener(int sock) {
+    int accept_conn = 0;
+    int domain = 0;
+    int type = 0;
+    socklen_t len = sizeof(int);
+    if(getsockopt(sock, SOL_SOCKET, SO_ACCEPTCONN, &accept_conn, &len) || !accept_conn
+            || getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &domain, &len)
+            || getsockopt(sock, SOL_SOCKET, SO_TYPE, &type, &len)
+            || domain != m_family || type != m_type) {
+        __LOG_ERROR(g_logger) << "adopt listener sock=" << sock << " listening="
+            << accept_conn << " family=" << domain << " type=" << type
+            << " errno=" << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+    // 登记时会设置O_NONBLOCK, 该标志在与上一代进程共享的文件描述上, 两边本来就一致
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(sock, true);
+    if(!ctx || !ctx->isSocket()) {
+        return false;
+    }
+    close();
+    m_sock = sock;
+    m_localAddress.reset();
+    getLocalAddress();
+    return true;
+}
+
 bool Socket::close() {
     if(!m_isConnected && m_sock == -1) {
         return true;
     }
+    if(m_zeroCopy) {
+        {
+            Mutex::Lock lock(m_zeroCopyMutex);
+            if(m_zeroCopyTimer) {
+                m_zeroCopyTimer->cancel();
+                m_zeroCopyTimer.reset();
+            }
+        }
+        reapZeroCopy();
+    }
+    // 关闭后无法再读取完成通知, 内核释放对缓冲区的引用之前不能关闭fd
+    if(m_zeroCopy && m_sock != -1 && getZeroCopyPending()) {
+        IOManager* iom = IOManager::GetThis();
+        if(iom) {
+            // 不阻塞调用者: 先shutdown发出FIN, 由定时器继续回收, 全部完成或超时后再close
+            std::shared_ptr<std::deque<ZeroCopyPending> > pending(new std::deque<ZeroCopyPending>);
+            {
+                Mutex::Lock lock(m_zeroCopyMutex);
+                pending->swap(m_zeroCopyPending);
+                m_zeroCopyPendingBytes = 0;
+            }
+            m_isConnected = false;
+            Mutex::Lock lock(m_closeMutex);
+            if(m_sock != -1) {
+                ::shutdown(m_sock, SHUT_RDWR);
+                ReapClosed(iom, m_sock, pending
+                        ,GetCurrentMS() + g_socket_zerocopy_close_wait->getValue());
+                m_sock = -1;
+            }
+            return false;
+        }
+        if(!waitZeroCopy(g_socket_zerocopy_close_wait->getValue())) {
+            __LOG_WARN(g_logger) << "close sock=" << m_sock << " with "
+                << getZeroCopyPending() << " zerocopy sends pending";
+        }
+    }
     m_isConnected = false;
+    Mutex::Lock lock(m_closeMutex);
     if(m_sock != -1) {
         ::close(m_sock);
         m_sock = -1;
@@ -251,18 +425,268 @@ bool Socket::close() {
 
 int Socket::send(const void* buffer, size_t length, int flags) {
     if(isConnected()) {
-        return ::send(m_sock, buffer, length, flags);
+        int rt = ::send(m_sock, buffer, length, flags);
+        if(rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
 
+bool Socket::setZeroCopy(bool v) {
+    if(!isValid()) {
+        newSock();
+        if(__UNLIKELY(!isValid())) {
+            return false;
+        }
+    }
+#ifdef SO_ZEROCOPY
+    int val = v ? 1 : 0;
+    if(!setOption(SOL_SOCKET, SO_ZEROCOPY, val)) {
+        m_zeroCopy = false;
+        return false;
+    }
+    m_zeroCopy = v;
+    return true;
+#else
+    m_zeroCopy = false;
+    return !v;
+#endif
+}
+
+int Socket::sendZeroCopy(const iovec* buffers, size_t length, std::shared_ptr<void> owner, int flags) {
+    if(!isConnected()) {
+        return -1;
+    }
+    size_t total = 0;
+    for(size_t i = 0; i < length; ++i) {
+        total += buffers[i].iov_len;
+    }
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (iovec*)buffers;
+    msg.msg_iovlen = length;
+#ifdef MSG_ZEROCOPY
+    bool zerocopy = m_zeroCopy && total >= g_socket_zerocopy_threshold->getValue();
+    if(zerocopy) {
+        reapZeroCopy();
+        // 等待完成的数据过多(如对端接收慢)时改为普通发送, 不再继续锁定内存
+        zerocopy = getZeroCopyPendingBytes() + total <= g_socket_zerocopy_max_pending->getValue();
+    }
+    if(zerocopy) {
+        int rt = ::sendmsg(m_sock, &msg, flags | MSG_ZEROCOPY);
+        if(rt > 0) {
+            touch();
+            {
+                Mutex::Lock lock(m_zeroCopyMutex);
+                ++m_zeroCopyStats.sends;
+                m_zeroCopyPending.push_back(ZeroCopyPending{m_zeroCopySeq++, (size_t)rt, owner});
+                m_zeroCopyPendingBytes += rt;
+            }
+            armZeroCopyReaper();
+            return rt;
+        }
+        // ENOBUFS: 超过锁定内存限制, 本次改为普通发送
+        if(rt == 0 || errno != ENOBUFS) {
+            return rt;
+        }
+    }
+#endif
+    {
+        Mutex::Lock lock(m_zeroCopyMutex);
+        ++m_zeroCopyStats.fallbacks;
+    }
+    int rt = ::sendmsg(m_sock, &msg, flags);
+    if(rt > 0) {
+        touch();
+    }
+    return rt;
+}
+
+/**
+ * @brief 从错误队列读取一条零拷贝完成通知, 不等待
+ * @param[out] lo 已完成的第一个序号
+ * @param[out] hi 已完成的最后一个序号, [lo, hi]可能回绕
+ * @param[out] copied 内核是否实际做了拷贝
+ * @return 没有更多通知时返回false
+ */
+static bool ReadZeroCopyCompletion(int fd, uint32_t& lo, uint32_t& hi, bool& copied) {
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    while(fd != -1) {
+        char control[128];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        // 错误队列不会阻塞, 直接调用原始函数
+        if(recvmsg_f(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return false;
+        }
+        for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            sock_extended_err* serr = (sock_extended_err*)CMSG_DATA(cm);
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            lo = serr->ee_info;
+            hi = serr->ee_data;
+            copied = serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+/**
+ * @brief 序号在[lo, hi]内(可能回绕)的发送已完成
+ */
+static bool ZeroCopyDone(uint32_t seq, uint32_t lo, uint32_t hi) {
+    return (int32_t)(seq - lo) >= 0 && (int32_t)(hi - seq) >= 0;
+}
+
+size_t Socket::reapZeroCopy() {
+    size_t released = 0;
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    bool copied = false;
+    while(ReadZeroCopyCompletion(m_sock, lo, hi, copied)) {
+        Mutex::Lock lock(m_zeroCopyMutex);
+        uint64_t n = hi - lo + 1;
+        m_zeroCopyStats.completions += n;
+        if(copied) {
+            m_zeroCopyStats.copied += n;
+        }
+        for(auto it = m_zeroCopyPending.begin(); it != m_zeroCopyPending.end();) {
+            if(ZeroCopyDone(it->seq, lo, hi)) {
+                m_zeroCopyPendingBytes -= it->size;
+                it = m_zeroCopyPending.erase(it);
+                ++released;
+            } else {
+                ++it;
+            }
+        }
+    }
+    return released;
+}
+
+void Socket::armZeroCopyReaper() {
+    IOManager* iom = IOManager::GetThis();
+    if(!iom) {
+        return;
+    }
+    std::weak_ptr<Socket> weak = shared_from_this();
+    Mutex::Lock lock(m_zeroCopyMutex);
+    if(m_zeroCopyTimer || m_zeroCopyPending.empty()) {
+        return;
+    }
+    m_zeroCopyTimer = iom->addTimer(g_socket_zerocopy_reap_interval->getValue(), [weak](){
+        Socket::ptr sock = weak.lock();
+        if(!sock) {
+            return;
+        }
+        {
+            Mutex::Lock lock(sock->m_zeroCopyMutex);
+            sock->m_zeroCopyTimer.reset();
+        }
+        sock->reapZeroCopy();
+        sock->armZeroCopyReaper();
+    });
+}
+
+void Socket::ReapClosed(IOManager* iom, int fd
+            ,std::shared_ptr<std::deque<ZeroCopyPending> > pending, uint64_t deadline) {
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    bool copied = false;
+    while(ReadZeroCopyCompletion(fd, lo, hi, copied)) {
+        for(auto it = pending->begin(); it != pending->end();) {
+            if(ZeroCopyDone(it->seq, lo, hi)) {
+                it = pending->erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    if(pending->empty() || GetCurrentMS() >= deadline) {
+        if(!pending->empty()) {
+            __LOG_WARN(g_logger) << "close sock=" << fd << " with "
+                << pending->size() << " zerocopy sends pending";
+        }
+        ::close(fd);
+        return;
+    }
+    iom->addTimer(g_socket_zerocopy_reap_interval->getValue()
+            ,std::bind(&Socket::ReapClosed, iom, fd, pending, deadline));
+}
+
+bool Socket::waitZeroCopy(uint64_t timeout_ms) {
+    uint64_t deadline = GetCurrentMS() + timeout_ms;
+    uint64_t interval_us = 100;
+    while(true) {
+        reapZeroCopy();
+        if(getZeroCopyPending() == 0) {
+            return true;
+        }
+        if(m_sock == -1 || GetCurrentMS() >= deadline) {
+            return false;
+        }
+        // 协程中usleep由IOManager定时器唤醒, 不阻塞线程
+        usleep(interval_us);
+        interval_us = std::min(interval_us * 2, (uint64_t)10 * 1000);
+    }
+}
+
+size_t Socket::getZeroCopyPending() {
+    Mutex::Lock lock(m_zeroCopyMutex);
+    return m_zeroCopyPending.size();
+}
+
+uint64_t Socket::getZeroCopyPendingBytes() {
+    Mutex::Lock lock(m_zeroCopyMutex);
+    return m_zeroCopyPendingBytes;
+}
+
+Socket::ZeroCopyStats Socket::getZeroCopyStats() {
+    Mutex::Lock lock(m_zeroCopyMutex);
+    return m_zeroCopyStats;
+}
+
+int64_t Socket::sendFile(int fd, off_t offset, size_t length) {
+    if(!isConnected()) {
+        return -1;
+    }
+    int64_t total = 0;
+    while(length > 0) {
+        ssize_t rt = ::sendfile(m_sock, fd, &offset, length);
+        if(rt > 0) {
+            touch();
+            total += rt;
+            length -= rt;
+        } else if(rt == 0) {
+            break;
+        } else {
+            return total > 0 ? total : rt;
+        }
+    }
+    return total;
+}
+
 int Socket::send(const iovec* buffers, size_t length, int flags) {
     if(isConnected()) {
         msghdr msg;
         memset(&msg, 0, sizeof(msg));
         msg.msg_iov = (iovec*)buffers;
         msg.msg_iovlen = length;
-        return ::sendmsg(m_sock, &msg, flags);
+        int rt = ::sendmsg(m_sock, &msg, flags);
+        if(rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
@@ -287,9 +711,90 @@ int Socket::sendTo(const iovec* buffers, size_t length, const Address::ptr to, i
     return -1;
 }
 
+int Socket::sendBatch(mmsghdr* msgs, size_t length, int flags) {
+    if(!isConnected()) {
+        return -1;
+    }
+    size_t sent = 0;
+    while(sent < length) {
+        int rt = ::sendmmsg(m_sock, msgs + sent, length - sent, flags);
+        if(rt <= 0) {
+            return sent ? (int)sent : -1;
+        }
+        sent += rt;
+    }
+    return sent;
+}
+
+int Socket::sendSegments(const void* buffer, size_t length, uint16_t segment_size
+                    ,const Address::ptr to, int flags) {
+    if(!isConnected() || segment_size == 0) {
+        return -1;
+    }
+#ifdef UDP_SEGMENT
+    if(!m_noGso && length > segment_size) {
+        iovec iov;
+        iov.iov_base = (void*)buffer;
+        iov.iov_len = length;
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        memset(control, 0, sizeof(control));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if(to) {
+            msg.msg_name = to->getAddr();
+            msg.msg_namelen = to->getAddrLen();
+        }
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &segment_size, sizeof(segment_size));
+        int rt = ::sendmsg(m_sock, &msg, flags);
+        if(rt >= 0 || (errno != EINVAL && errno != EIO && errno != ENOPROTOOPT)) {
+            return rt;
+        }
+        // EIO: 网卡不支持校验和卸载; EINVAL: 内核不支持或超出段数限制
+        if(errno != EINVAL) {
+            m_noGso = true;
+        }
+    }
+#endif
+    std::vector<iovec> iovs((length + segment_size - 1) / segment_size);
+    std::vector<mmsghdr> msgs(iovs.size());
+    memset(&msgs[0], 0, sizeof(mmsghdr) * msgs.size());
+    for(size_t i = 0; i < iovs.size(); ++i) {
+        size_t offset = i * segment_size;
+        iovs[i].iov_base = (char*)buffer + offset;
+        iovs[i].iov_len = std::min((size_t)segment_size, length - offset);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if(to) {
+            msgs[i].msg_hdr.msg_name = to->getAddr();
+            msgs[i].msg_hdr.msg_namelen = to->getAddrLen();
+        }
+    }
+    int rt = sendBatch(&msgs[0], msgs.size(), flags);
+    if(rt <= 0) {
+        return rt;
+    }
+    size_t bytes = 0;
+    for(int i = 0; i < rt; ++i) {
+        bytes += msgs[i].msg_len;
+    }
+    return bytes;
+}
+
 int Socket::recv(void* buffer, size_t length, int flags) {
     if(isConnected()) {
-        return ::recv(m_sock, buffer, length, flags);
+        int rt = ::recv(m_sock, buffer, length, flags);
+        if(rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
@@ -300,7 +805,11 @@ int Socket::recv(iovec* buffers, size_t length, int flags) {
         memset(&msg, 0, sizeof(msg));
         msg.msg_iov = (iovec*)buffers;
         msg.msg_iovlen = length;
-        return ::recvmsg(m_sock, &msg, flags);
+        int rt = ::recvmsg(m_sock, &msg, flags);
+        if(rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
@@ -326,6 +835,28 @@ int Socket::recvFrom(iovec* buffers, size_t length, Address::ptr from, int flags
     return -1;
 }
 
+int Socket::recvBatch(mmsghdr* msgs, size_t length, int flags) {
+    if(isConnected()) {
+        return ::recvmmsg(m_sock, msgs, length, flags, nullptr);
+    }
+    return -1;
+}
+
+bool Socket::setGro(bool v) {
+    if(!isValid()) {
+        newSock();
+        if(__UNLIKELY(!isValid())) {
+            return false;
+        }
+    }
+#ifdef UDP_GRO
+    int val = v ? 1 : 0;
+    return setOption(SOL_UDP, UDP_GRO, val);
+#else
+    return !v;
+#endif
+}
+
 Address::ptr Socket::getRemoteAddress() {
     if(m_remoteAddress) {
         return m_remoteAddress;
@@ -394,6 +925,10 @@ Address::ptr Socket::getLocalAddress() {
     return m_localAddress;
 }
 
+void Socket::touch() {
+    m_lastActive.store(GetCoarseMS(), std::memory_order_relaxed);
+}
+
 bool Socket::isValid() const {
     return m_sock != -1;
 }
@@ -445,6 +980,19 @@ bool Socket::cancelAll() {
     return IOManager::GetThis()->cancelAll(m_sock);
 }
 
+bool Socket::shutdown(IOManager* iom, int how) {
+    // 持锁期间fd不会被关闭, 也就不会被其他连接复用
+    Mutex::Lock lock(m_closeMutex);
+    if(m_sock == -1) {
+        return false;
+    }
+    ::shutdown(m_sock, how);
+    if(iom) {
+        iom->cancelAll(m_sock);
+    }
+    return true;
+}
+
 void Socket::initSock() {
     int val = 1;
     setOption(SOL_SOCKET, SO_REUSEADDR, val);
@@ -463,38 +1011,83 @@ void Socket::newSock() {
             << errno << " errstr=" << strerror(errno);
     }
 }
-/*
 namespace {
 
 struct _SSLInit {
     _SSLInit() {
-        SSL_library_init();
-        SSL_load_error_strings();
-        OpenSSL_add_all_algorithms();
+        OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS
+                | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, nullptr);
     }
 };
 
 static _SSLInit s_init;
 
+/**
+ * @brief 作用域内关闭hook
+ * @details OpenSSL内部的read/write会走hook, 这里让它们直接返回EAGAIN,
+ *          由doSSL根据WANT_READ/WANT_WRITE等待
+ */
+struct HookDisabler {
+    HookDisabler()
+        :enable(sylar::is_hook_enable()) {
+        sylar::set_hook_enable(false);
+    }
+    ~HookDisabler() {
+        sylar::set_hook_enable(enable);
+    }
+    bool enable;
+};
+
+/**
+ * @brief 取出OpenSSL错误队列中的错误描述
+ */
+static std::string GetSSLError() {
+    std::string rt;
+    char buf[256];
+    unsigned long err;
+    while((err = ERR_get_error()) != 0) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        if(!rt.empty()) {
+            rt.append("; ");
+        }
+        rt.append(buf);
+    }
+    return rt;
+}
+
+/**
+ * @brief 创建SSL_CTX并设置服务端和客户端共用的选项
+ */
+static std::shared_ptr<SSL_CTX> NewContext(const SSL_METHOD* method) {
+    SSL_CTX* ctx = SSL_CTX_new(method);
+    if(!ctx) {
+        __LOG_ERROR(g_logger) << "SSL_CTX_new error " << GetSSLError();
+        return nullptr;
+    }
+    // WANT_WRITE后重试时缓冲区可能已被移动(如send(iovec)中的临时拷贝)
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // 对端不发close_notify直接关闭连接时按正常关闭处理
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    if(g_ssl_ktls->getValue()) {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+    return std::shared_ptr<SSL_CTX>(ctx, SSL_CTX_free);
+}
+
 }
 
 SSLSocket::SSLSocket(int family, int type, int protocol)
     :Socket(family, type, protocol) {
 }
 
-Socket::ptr SSLSocket::accept() {
+Socket::ptr SSLSocket::createAccepted() const {
     SSLSocket::ptr sock(new SSLSocket(m_family, m_type, m_protocol));
-    int newsock = ::accept(m_sock, nullptr, nullptr);
-    if(newsock == -1) {
-        __LOG_ERROR(g_logger) << "accept(" << m_sock << ") errno="
-            << errno << " errstr=" << strerror(errno);
-        return nullptr;
-    }
     sock->m_ctx = m_ctx;
-    if(sock->init(newsock)) {
-        return sock;
-    }
-    return nullptr;
+    return sock;
 }
 
 bool SSLSocket::bind(const Address::ptr addr) {
@@ -502,14 +1095,22 @@ bool SSLSocket::bind(const Address::ptr addr) {
 }
 
 bool SSLSocket::connect(const Address::ptr addr, uint64_t timeout_ms) {
-    bool v = Socket::connect(addr, timeout_ms);
-    if(v) {
-        m_ctx.reset(SSL_CTX_new(SSLv23_client_method()), SSL_CTX_free);
-        m_ssl.reset(SSL_new(m_ctx.get()),  SSL_free);
-        SSL_set_fd(m_ssl.get(), m_sock);
-        v = (SSL_connect(m_ssl.get()) == 1);
+    if(!Socket::connect(addr, timeout_ms)) {
+        return false;
+    }
+    if(!m_ctx) {
+        m_ctx = GetDefaultClientContext();
+    }
+    if(!newSSL(false) || !handshake(timeout_ms)) {
+        if(m_ssl && SSL_get_verify_result(m_ssl.get()) != X509_V_OK) {
+            __LOG_ERROR(g_logger) << "SSL verify " << addr->toString() << " host=" << m_hostname
+                << " fail: " << X509_verify_cert_error_string(SSL_get_verify_result(m_ssl.get()));
+        }
+        m_ssl.reset();
+        Socket::close();
+        return false;
     }
-    return v;
+    return true;
 }
 
 bool SSLSocket::listen(int backlog) {
@@ -517,32 +1118,213 @@ bool SSLSocket::listen(int backlog) {
 }
 
 bool SSLSocket::close() {
+    if(m_ssl) {
+        if(m_sock != -1 && SSL_is_init_finished(m_ssl.get())) {
+            // 只尝试发送close_notify, 不等待对端的close_notify
+            HookDisabler guard;
+            SSL_shutdown(m_ssl.get());
+        }
+        ERR_clear_error();
+        m_ssl.reset();
+    }
     return Socket::close();
 }
 
-int SSLSocket::send(const void* buffer, size_t length, int flags) {
-    if(m_ssl) {
-        return SSL_write(m_ssl.get(), buffer, length);
+bool SSLSocket::newSSL(bool server) {
+    if(!m_ctx) {
+        __LOG_ERROR(g_logger) << "SSLSocket sock=" << m_sock << " without SSL_CTX";
+        return false;
     }
-    return -1;
+    // OpenSSL的socket BIO用write(2)发送, 带不上MSG_NOSIGNAL, 对端重置连接后的写入会产生SIGPIPE;
+    // 不替换BIO, 内核TLS需要socket BIO
+    IgnoreSigPipe();
+    SSL* ssl = SSL_new(m_ctx.get());
+    if(!ssl) {
+        __LOG_ERROR(g_logger) << "SSL_new error " << GetSSLError();
+        return false;
+    }
+    m_ssl.reset(ssl, SSL_free);
+    SSL_set_fd(ssl, m_sock);
+    if(server) {
+        SSL_set_accept_state(ssl);
+    } else {
+        SSL_set_connect_state(ssl);
+        if(m_session) {
+            SSL_set_session(ssl, m_session.get());
+        }
+        if(!m_hostname.empty()) {
+            unsigned char buf[sizeof(in6_addr)];
+            bool is_ip = inet_pton(AF_INET, m_hostname.c_str(), buf) == 1
+                    || inet_pton(AF_INET6, m_hostname.c_str(), buf) == 1;
+            // SNI不能是IP地址; 校验证书时同时核对名字(或IP)
+            if(!is_ip) {
+                SSL_set_tlsext_host_name(ssl, m_hostname.c_str());
+            }
+            if(SSL_get_verify_mode(ssl) & SSL_VERIFY_PEER) {
+                int rt = is_ip ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), m_hostname.c_str())
+                                : SSL_set1_host(ssl, m_hostname.c_str());
+                if(rt != 1) {
+                    __LOG_ERROR(g_logger) << "SSL set host " << m_hostname << " error " << GetSSLError();
+                    m_ssl.reset();
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
 }
 
-int SSLSocket::send(const iovec* buffers, size_t length, int flags) {
-    if(!m_ssl) {
-        return -1;
+bool SSLSocket::handshake(uint64_t timeout_ms) {
+    if(!isConnected()) {
+        return false;
     }
-    int total = 0;
-    for(size_t i = 0; i < length; ++i) {
-        int tmp = SSL_write(m_ssl.get(), buffers[i].iov_base, buffers[i].iov_len);
-        if(tmp <= 0) {
-            return tmp;
+    // 客户端在connect中创建SSL对象, 此时还没有的是accept得到的连接
+    if(!m_ssl && !newSSL(true)) {
+        return false;
+    }
+    SSL* ssl = m_ssl.get();
+    if(__LIKELY(SSL_is_init_finished(ssl))) {
+        return true;
+    }
+    int rt = doSSL([ssl](){
+        return SSL_do_handshake(ssl);
+    }, timeout_ms);
+    if(rt <= 0) {
+        __LOG_DEBUG(g_logger) << "SSL handshake fail sock=" << m_sock
+            << " errno=" << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+template<class Fun>
+int SSLSocket::doSSL(Fun fun, uint64_t timeout_ms) {
+    SSL* ssl = m_ssl.get();
+    while(true) {
+        ERR_clear_error();
+        errno = 0;
+        int rt;
+        {
+            HookDisabler guard;
+            rt = fun();
         }
-        total += tmp;
-        if(tmp != (int)buffers[i].iov_len) {
-            break;
+        if(rt > 0) {
+            return rt;
+        }
+        int event;
+        uint64_t to = timeout_ms;
+        int err = SSL_get_error(ssl, rt);
+        switch(err) {
+            case SSL_ERROR_WANT_READ:
+                event = IOManager::READ;
+                if(to == (uint64_t)-1) {
+                    to = getRecvTimeout();
+                }
+                break;
+            case SSL_ERROR_WANT_WRITE:
+                event = IOManager::WRITE;
+                if(to == (uint64_t)-1) {
+                    to = getSendTimeout();
+                }
+                break;
+            case SSL_ERROR_ZERO_RETURN:
+                return 0;
+            case SSL_ERROR_SYSCALL:
+                if(errno == 0 && ERR_peek_error() == 0) {
+                    return 0;
+                }
+                return -1;
+            default:
+                __LOG_DEBUG(g_logger) << "SSL error=" << err << " sock=" << m_sock
+                    << " " << GetSSLError();
+                errno = EPROTO;
+                return -1;
+        }
+        if(!waitEvent(event, to)) {
+            return -1;
         }
     }
-    return total;
+}
+
+bool SSLSocket::waitEvent(int event, uint64_t timeout_ms) {
+    IOManager* iom = IOManager::GetThis();
+    if(!iom || !is_hook_enable()) {
+        pollfd pfd;
+        memset(&pfd, 0, sizeof(pfd));
+        pfd.fd = m_sock;
+        pfd.events = event == IOManager::READ ? POLLIN : POLLOUT;
+        int rt = ::poll(&pfd, 1, timeout_ms == (uint64_t)-1 ? -1 : (int)timeout_ms);
+        if(rt == 0) {
+            errno = ETIMEDOUT;
+        }
+        return rt > 0;
+    }
+
+    std::shared_ptr<std::atomic<bool> > timedout(new std::atomic<bool>(false));
+    Timer::ptr timer;
+    if(timeout_ms != (uint64_t)-1) {
+        std::weak_ptr<std::atomic<bool> > wtimedout(timedout);
+        int fd = m_sock;
+        timer = iom->addConditionTimer(timeout_ms, [wtimedout, iom, fd, event](){
+            std::shared_ptr<std::atomic<bool> > t = wtimedout.lock();
+            if(!t) {
+                return;
+            }
+            *t = true;
+            iom->cancelEvent(fd, (IOManager::Event)event);
+        }, wtimedout);
+    }
+    if(iom->addEvent(m_sock, (IOManager::Event)event)) {
+        if(timer) {
+            timer->cancel();
+        }
+        return false;
+    }
+    Fiber::YieldToHold();
+    if(timer) {
+        timer->cancel();
+    }
+    if(*timedout) {
+        errno = ETIMEDOUT;
+        return false;
+    }
+    return true;
+}
+
+int SSLSocket::send(const void* buffer, size_t length, int flags) {
+    if(!handshake()) {
+        return -1;
+    }
+    if(length == 0) {
+        return 0;
+    }
+    SSL* ssl = m_ssl.get();
+    int len = std::min(length, (size_t)INT_MAX);
+    int rt = doSSL([ssl, buffer, len](){
+        return SSL_write(ssl, buffer, len);
+    });
+    if(rt > 0) {
+        touch();
+    }
+    return rt;
+}
+
+int SSLSocket::send(const iovec* buffers, size_t length, int flags) {
+    if(length == 1) {
+        return send(buffers[0].iov_base, buffers[0].iov_len, flags);
+    }
+    static const size_t s_max_write = 64 * 1024;
+    size_t total = 0;
+    for(size_t i = 0; i < length && total < s_max_write; ++i) {
+        total += buffers[i].iov_len;
+    }
+    std::string buf;
+    buf.reserve(std::min(total, s_max_write));
+    for(size_t i = 0; i < length && buf.size() < s_max_write; ++i) {
+        size_t n = std::min(buffers[i].iov_len, s_max_write - buf.size());
+        buf.append((const char*)buffers[i].iov_base, n);
+    }
+    return send(buf.data(), buf.size(), flags);
 }
 
 int SSLSocket::sendTo(const void* buffer, size_t length, const Address::ptr to, int flags) {
@@ -555,25 +1337,103 @@ int SSLSocket::sendTo(const iovec* buffers, size_t length, const Address::ptr to
     return -1;
 }
 
-int SSLSocket::recv(void* buffer, size_t length, int flags) {
-    if(m_ssl) {
-        return SSL_read(m_ssl.get(), buffer, length);
+bool SSLSocket::setZeroCopy(bool v) {
+    m_zeroCopy = false;
+    return !v;
+}
+
+int SSLSocket::sendZeroCopy(const iovec* buffers, size_t length, std::shared_ptr<void> owner, int flags) {
+    return send(buffers, length, flags);
+}
+
+int64_t SSLSocket::sendFile(int fd, off_t offset, size_t length) {
+    if(!handshake()) {
+        return -1;
     }
-    return -1;
+    int64_t total = 0;
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    if(isKtlsSend()) {
+        SSL* ssl = m_ssl.get();
+        while(length > 0) {
+            size_t n = std::min(length, (size_t)INT_MAX);
+            int rt = doSSL([ssl, fd, offset, n](){
+                return (int)SSL_sendfile(ssl, fd, offset, n, 0);
+            });
+            if(rt <= 0) {
+                return total > 0 ? total : rt;
+            }
+            touch();
+            total += rt;
+            offset += rt;
+            length -= rt;
+        }
+        return total;
+    }
+#endif
+    // 没有内核TLS时数据必须在用户空间加密
+    std::vector<char> buf(std::min(length, (size_t)(64 * 1024)));
+    while(length > 0) {
+        ssize_t n = ::pread(fd, &buf[0], std::min(length, buf.size()), offset);
+        if(n <= 0) {
+            if(n < 0 && total == 0) {
+                return -1;
+            }
+            break;
+        }
+        ssize_t sent = 0;
+        while(sent < n) {
+            int rt = send(&buf[sent], n - sent);
+            if(rt <= 0) {
+                return total > 0 ? total : rt;
+            }
+            sent += rt;
+            total += rt;
+        }
+        offset += n;
+        length -= n;
+    }
+    return total;
 }
 
-int SSLSocket::recv(iovec* buffers, size_t length, int flags) {
-    if(!m_ssl) {
+int SSLSocket::recv(void* buffer, size_t length, int flags) {
+    if(!handshake()) {
         return -1;
     }
+    if(length == 0) {
+        return 0;
+    }
+    SSL* ssl = m_ssl.get();
+    int len = std::min(length, (size_t)INT_MAX);
+    if(flags & MSG_PEEK) {
+        return doSSL([ssl, buffer, len](){
+            return SSL_peek(ssl, buffer, len);
+        });
+    }
+    int rt = doSSL([ssl, buffer, len](){
+        return SSL_read(ssl, buffer, len);
+    });
+    if(rt > 0) {
+        touch();
+    }
+    return rt;
+}
+
+int SSLSocket::recv(iovec* buffers, size_t length, int flags) {
     int total = 0;
     for(size_t i = 0; i < length; ++i) {
-        int tmp = SSL_read(m_ssl.get(), buffers[i].iov_base, buffers[i].iov_len);
-        if(tmp <= 0) {
-            return tmp;
+        if(buffers[i].iov_len == 0) {
+            continue;
         }
-        total += tmp;
-        if(tmp != (int)buffers[i].iov_len) {
+        // 已经读到数据后, 只取SSL中已解密的部分, 不再等待socket
+        if(total > 0 && ((flags & MSG_PEEK) || SSL_pending(m_ssl.get()) <= 0)) {
+            break;
+        }
+        int rt = recv(buffers[i].iov_base, buffers[i].iov_len, flags);
+        if(rt <= 0) {
+            return total > 0 ? total : rt;
+        }
+        total += rt;
+        if((size_t)rt < buffers[i].iov_len) {
             break;
         }
     }
@@ -590,34 +1450,109 @@ int SSLSocket::recvFrom(iovec* buffers, size_t length, Address::ptr from, int fl
     return -1;
 }
 
-bool SSLSocket::init(int sock) {
-    bool v = Socket::init(sock);
-    if(v) {
-        m_ssl.reset(SSL_new(m_ctx.get()),  SSL_free);
-        SSL_set_fd(m_ssl.get(), m_sock);
-        v = (SSL_accept(m_ssl.get()) == 1);
+bool SSLSocket::loadCertificates(const std::string& cert_file, const std::string& key_file) {
+    std::shared_ptr<SSL_CTX> ctx = CreateServerContext(cert_file, key_file);
+    if(!ctx) {
+        return false;
     }
-    return v;
+    m_ctx = ctx;
+    return true;
 }
 
-bool SSLSocket::loadCertificates(const std::string& cert_file, const std::string& key_file) {
-    m_ctx.reset(SSL_CTX_new(SSLv23_server_method()), SSL_CTX_free);
-    if(SSL_CTX_use_certificate_chain_file(m_ctx.get(), cert_file.c_str()) != 1) {
+std::shared_ptr<SSL_CTX> SSLSocket::CreateServerContext(const std::string& cert_file
+                                                        ,const std::string& key_file) {
+    std::shared_ptr<SSL_CTX> ctx = NewContext(TLS_server_method());
+    if(!ctx) {
+        return nullptr;
+    }
+    if(SSL_CTX_use_certificate_chain_file(ctx.get(), cert_file.c_str()) != 1) {
         __LOG_ERROR(g_logger) << "SSL_CTX_use_certificate_chain_file("
-            << cert_file << ") error";
-        return false;
+            << cert_file << ") error " << GetSSLError();
+        return nullptr;
     }
-    if(SSL_CTX_use_PrivateKey_file(m_ctx.get(), key_file.c_str(), SSL_FILETYPE_PEM) != 1) {
+    if(SSL_CTX_use_PrivateKey_file(ctx.get(), key_file.c_str(), SSL_FILETYPE_PEM) != 1) {
         __LOG_ERROR(g_logger) << "SSL_CTX_use_PrivateKey_file("
-            << key_file << ") error";
-        return false;
+            << key_file << ") error " << GetSSLError();
+        return nullptr;
     }
-    if(SSL_CTX_check_private_key(m_ctx.get()) != 1) {
+    if(SSL_CTX_check_private_key(ctx.get()) != 1) {
         __LOG_ERROR(g_logger) << "SSL_CTX_check_private_key cert_file="
             << cert_file << " key_file=" << key_file;
-        return false;
+        return nullptr;
     }
-    return true;
+    // 有状态的会话缓存(TLS1.2 session id, 以及关闭ticket时的TLS1.3)
+    static const unsigned char s_session_id_context[] = "sylar";
+    SSL_CTX_set_session_id_context(ctx.get(), s_session_id_context
+            ,sizeof(s_session_id_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx.get(), SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx.get(), g_ssl_session_cache_size->getValue());
+    SSL_CTX_set_timeout(ctx.get(), g_ssl_session_timeout->getValue());
+    if(!g_ssl_session_ticket->getValue()) {
+        SSL_CTX_set_options(ctx.get(), SSL_OP_NO_TICKET);
+    }
+    return ctx;
+}
+
+std::shared_ptr<SSL_CTX> SSLSocket::CreateClientContext(bool verify, const std::string& ca_file) {
+    std::shared_ptr<SSL_CTX> ctx = NewContext(TLS_client_method());
+    if(!ctx) {
+        return nullptr;
+    }
+    if(!verify) {
+        __LOG_WARN(g_logger) << "SSL client context without certificate verification";
+        SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_NONE, nullptr);
+        return ctx;
+    }
+    SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_PEER, nullptr);
+    int rt = ca_file.empty() ? SSL_CTX_set_default_verify_paths(ctx.get())
+                            : SSL_CTX_load_verify_locations(ctx.get(), ca_file.c_str(), nullptr);
+    if(rt != 1) {
+        __LOG_ERROR(g_logger) << "SSL load verify locations ca_file=" << ca_file
+            << " error " << GetSSLError();
+        return nullptr;
+    }
+    return ctx;
+}
+
+std::shared_ptr<SSL_CTX> SSLSocket::GetDefaultClientContext() {
+    static std::shared_ptr<SSL_CTX> s_ctx = CreateClientContext(g_ssl_client_verify->getValue()
+                                                        ,g_ssl_client_ca_file->getValue());
+    return s_ctx;
+}
+
+std::shared_ptr<SSL_SESSION> SSLSocket::getSession() const {
+    if(!m_ssl) {
+        return nullptr;
+    }
+    SSL_SESSION* session = SSL_get1_session(m_ssl.get());
+    if(!session) {
+        return nullptr;
+    }
+    if(!SSL_SESSION_is_resumable(session)) {
+        SSL_SESSION_free(session);
+        return nullptr;
+    }
+    return std::shared_ptr<SSL_SESSION>(session, SSL_SESSION_free);
+}
+
+bool SSLSocket::isSessionReused() const {
+    return m_ssl && SSL_session_reused(m_ssl.get());
+}
+
+bool SSLSocket::isKtlsSend() const {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return m_ssl && BIO_get_ktls_send(SSL_get_wbio(m_ssl.get()));
+#else
+    return false;
+#endif
+}
+
+bool SSLSocket::isKtlsRecv() const {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return m_ssl && BIO_get_ktls_recv(SSL_get_rbio(m_ssl.get()));
+#else
+    return false;
+#endif
 }
 
 SSLSocket::ptr SSLSocket::CreateTCP(sylar::Address::ptr address) {
@@ -647,10 +1582,16 @@ std::ostream& SSLSocket::dump(std::ostream& os) const {
     if(m_remoteAddress) {
         os << " remote_address=" << m_remoteAddress->toString();
     }
+    if(m_ssl && SSL_is_init_finished(m_ssl.get())) {
+        os << " version=" << SSL_get_version(m_ssl.get())
+           << " reused=" << isSessionReused()
+           << " ktls_send=" << isKtlsSend()
+           << " ktls_recv=" << isKtlsRecv();
+    }
     os << "]";
     return os;
 }
-*/
+
 std::ostream& operator<<(std::ostream& os, const Socket& sock) {
     return sock.dump(os);
 }
@@ -10,6 +10,9 @@
 #define __SYLAR_SOCKET_H__
 
 #include <memory>
+#include <vector>
+#include <deque>
+#include <atomic>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -17,9 +20,13 @@
 #include <openssl/ssl.h>
 #include "address.h"
 #include "noncopyable.h"
+#include "mutex.h"
 
 namespace sylar {
 
+class IOManager;
+class Timer;
+
 /**
  * @brief Socket封装类
  */
@@ -159,6 +166,17 @@ public:
      */
     virtual Socket::ptr accept();
 
+    /**
+     * @brief 批量接收连接
+     * @details 第一个连接经hook等待, 之后不再等待, 直接取出队列中已完成握手的连接,
+     *          最多max个。使用accept4(SOCK_NONBLOCK|SOCK_CLOEXEC), 新socket继承监听socket
+     *          的选项(TCP_NODELAY等), 不再逐个fcntl/setsockopt; 对端地址取自accept4的返回值
+     * @param[out] socks 新连接追加到末尾
+     * @param[in] max 最多接收的连接数
+     * @return 本次接收的连接数, 0表示出错, 错误码见errno, 本函数不记录日志
+     */
+    virtual size_t acceptBatch(std::vector<Socket::ptr>& socks, size_t max);
+
     /**
      * @brief 绑定地址
      * @param[in] addr 地址
@@ -166,6 +184,12 @@ public:
      */
     virtual bool bind(const Address::ptr addr);
 
+    /**
+     * @brief 开启SO_REUSEPORT, 需在bind之前调用
+     * @details 多个socket可以绑定并监听同一地址, 内核在它们之间分配新连接
+     */
+    bool setReusePort(bool v = true);
+
     /**
      * @brief 连接地址
      * @param[in] addr 目标地址
@@ -183,8 +207,17 @@ public:
      */
     virtual bool listen(int backlog = SOMAXCONN);
 
+    /**
+     * @brief 接管一个已在监听的socket, 如从上一代进程继承的fd
+     * @details fd的协议簇和类型需与本对象一致, 成功后由本对象负责关闭
+     * @return 是否接管成功, 失败时fd不被关闭
+     */
+    bool adoptListener(int sock);
+
     /**
      * @brief 关闭socket
+     * @details 仍有零拷贝发送未完成时, 在IOManager中先shutdown, fd由定时器在全部完成或超过
+     *          socket.zerocopy.close_wait 毫秒后关闭, 不阻塞调用者; 不在IOManager中时最多等待这么久
      */
     virtual bool close();
 
@@ -238,6 +271,116 @@ public:
      */
     virtual int sendTo(const iovec* buffers, size_t length, const Address::ptr to, int flags = 0);
 
+    /**
+     * @brief 批量发送数据报(sendmmsg)
+     * @details 内核只发出一部分时继续发送剩余的消息, 发送缓冲区满时挂起当前协程;
+     *          每条消息实际发送的字节数写入msg_len
+     * @param[in,out] msgs 消息数组, msg_name为空时发往已连接的对端
+     * @param[in] length 消息个数
+     * @param[in] flags 标志字
+     * @return
+     *      @retval >0 发送成功的消息个数
+     *      @retval <0 第一条消息就发送失败
+     */
+    virtual int sendBatch(mmsghdr* msgs, size_t length, int flags = 0);
+
+    /**
+     * @brief 以UDP GSO发送一段按segment_size切分的数据
+     * @details 一次系统调用发出length/segment_size个数据报, 最后一个可以较短。
+     *          内核不支持UDP_SEGMENT, 或段数/长度超出内核限制时, 改为用sendBatch逐段发送
+     * @param[in] buffer 待发送数据
+     * @param[in] length 数据总长度
+     * @param[in] segment_size 每个数据报的长度
+     * @param[in] to 目标地址, 为空时发往已连接的对端
+     * @param[in] flags 标志字
+     * @return 同sendTo
+     */
+    int sendSegments(const void* buffer, size_t length, uint16_t segment_size
+                    ,const Address::ptr to = nullptr, int flags = 0);
+
+    /**
+     * @brief 零拷贝发送的统计
+     */
+    struct ZeroCopyStats {
+        /// 以MSG_ZEROCOPY发出的send次数
+        uint64_t sends = 0;
+        /// 低于阈值或不支持时退化为普通send的次数
+        uint64_t fallbacks = 0;
+        /// 已完成(内核不再引用缓冲区)的send次数
+        uint64_t completions = 0;
+        /// 完成时报告内核实际做了拷贝的send次数(如回环地址)
+        uint64_t copied = 0;
+    };
+
+    /**
+     * @brief 开启/关闭零拷贝发送(SO_ZEROCOPY)
+     * @return 内核不支持时返回false, 此后sendZeroCopy总是普通发送
+     */
+    virtual bool setZeroCopy(bool v);
+
+    /**
+     * @brief 是否开启了零拷贝发送
+     */
+    bool isZeroCopy() const { return m_zeroCopy;}
+
+    /**
+     * @brief 零拷贝发送
+     * @details 开启零拷贝且总长度不低于配置 socket.zerocopy.threshold 时使用MSG_ZEROCOPY,
+     *          内核直接引用用户内存; owner在内核报告完成之前一直被持有, 调用者也不能修改
+     *          这段内存。完成通知从错误队列中读取, 每次发送时和IOManager上的定时器
+     *          (socket.zerocopy.reap_interval)回收, 也可调用reapZeroCopy/waitZeroCopy。
+     *          等待完成的数据超过 socket.zerocopy.max_pending 字节或不满足条件时
+     *          退化为普通send, 返回时缓冲区即可复用
+     * @param[in] buffers 待发送数据的内存(iovec数组)
+     * @param[in] length iovec长度
+     * @param[in] owner 缓冲区的所有者, 内核完成后释放
+     * @param[in] flags 标志字
+     * @return 同send
+     */
+    virtual int sendZeroCopy(const iovec* buffers, size_t length, std::shared_ptr<void> owner, int flags = 0);
+
+    /**
+     * @brief 读取错误队列中的零拷贝完成通知, 释放已完成的缓冲区, 不等待
+     * @return 本次释放的缓冲区数
+     */
+    size_t reapZeroCopy();
+
+    /**
+     * @brief 等待所有零拷贝发送完成
+     * @details 完成通知以EPOLLERR形式到达, 在协程中按IOManager定时器间隔检查错误队列
+     * @param[in] timeout_ms 最长等待时间(毫秒)
+     * @return 是否全部完成
+     */
+    bool waitZeroCopy(uint64_t timeout_ms);
+
+    /**
+     * @brief 等待内核完成的零拷贝发送数
+     */
+    size_t getZeroCopyPending();
+
+    /**
+     * @brief 等待内核完成的零拷贝发送字节数
+     */
+    uint64_t getZeroCopyPendingBytes();
+
+    /**
+     * @brief 零拷贝发送统计
+     */
+    ZeroCopyStats getZeroCopyStats();
+
+    /**
+     * @brief 零拷贝发送文件内容
+     * @details 使用sendfile直接在内核中把文件数据写入socket, 循环直到发送完length字节
+     * @param[in] fd 文件描述符, 需支持mmap(普通文件)
+     * @param[in] offset 文件中的起始偏移, 不改变fd的文件偏移
+     * @param[in] length 发送的长度
+     * @return
+     *      @retval >0 发送的字节数, 文件提前结束时小于length
+     *      @retval =0 没有数据可发送
+     *      @retval <0 socket出错且未发送任何数据
+     */
+    virtual int64_t sendFile(int fd, off_t offset, size_t length);
+
     /**
      * @brief 接受数据
      * @param[out] buffer 接收数据的内存
@@ -288,6 +431,28 @@ public:
      */
     virtual int recvFrom(iovec* buffers, size_t length, Address::ptr from, int flags = 0);
 
+    /**
+     * @brief 批量接收数据报(recvmmsg)
+     * @details 没有数据时挂起当前协程, 有数据后一次取走已到达的(最多length条)数据报,
+     *          不再等待后续数据报; 每条数据报的长度写入msg_len。
+     *          调用前需重置每条消息的msg_namelen和msg_controllen
+     * @param[in,out] msgs 消息数组
+     * @param[in] length 消息个数
+     * @param[in] flags 标志字
+     * @return
+     *      @retval >0 接收到的消息个数
+     *      @retval <0 socket出错
+     */
+    virtual int recvBatch(mmsghdr* msgs, size_t length, int flags = 0);
+
+    /**
+     * @brief 开启/关闭UDP GRO
+     * @details 开启后内核可能把同一来源连续的数据报合并成一条消息交付,
+     *          控制消息(SOL_UDP, UDP_GRO)中给出每个数据报的长度
+     * @return 内核不支持时返回false
+     */
+    bool setGro(bool v);
+
     /**
      * @brief 获取远端地址
      */
@@ -340,6 +505,18 @@ public:
      */
     int getSocket() const { return m_sock;}
 
+    /**
+     * @brief 记录一次收发活动
+     * @details 连接建立和每次成功收发时自动记录, 使用粗粒度时钟(GetCoarseMS);
+     *          绕过Socket直接读写fd(如splice)时由调用者调用
+     */
+    void touch();
+
+    /**
+     * @brief 最后一次收发活动的时间(GetCoarseMS)
+     */
+    uint64_t getLastActive() const { return m_lastActive;}
+
     /**
      * @brief 取消读
      */
@@ -359,6 +536,16 @@ public:
      * @brief 取消所有事件
      */
     bool cancelAll();
+
+    /**
+     * @brief 从其他协程或线程中断连接
+     * @details shutdown后重试的读写立即返回, 再在iom上取消该fd的所有事件唤醒已挂起的等待者。
+     *          与close互斥, socket已关闭时不做任何操作, 不会作用到复用了该fd号的新连接上
+     * @param[in] iom 等待者所在的IOManager
+     * @param[in] how 同::shutdown
+     * @return socket已关闭时返回false
+     */
+    bool shutdown(IOManager* iom, int how = SHUT_RDWR);
 protected:
     /**
      * @brief 初始化socket
@@ -374,6 +561,17 @@ protected:
      * @brief 初始化sock
      */
     virtual bool init(int sock);
+
+    /**
+     * @brief 创建accept得到的连接对应的Socket对象, 子类返回自己的类型
+     */
+    virtual Socket::ptr createAccepted() const;
+
+    /**
+     * @brief 初始化由accept4(SOCK_NONBLOCK)得到的sock
+     * @param[in] addr accept4返回的对端地址
+     */
+    bool initAccepted(int sock, const sockaddr* addr, socklen_t addrlen);
 protected:
     /// socket句柄
     int m_sock;
@@ -389,9 +587,60 @@ protected:
     Address::ptr m_localAddress;
     /// 远端地址
     Address::ptr m_remoteAddress;
+
+    /**
+     * @brief 等待内核完成的零拷贝发送
+     */
+    struct ZeroCopyPending {
+        /// 内核为每次成功的MSG_ZEROCOPY发送分配的递增序号
+        uint32_t seq;
+        /// 发送的字节数
+        size_t size;
+        /// 缓冲区所有者
+        std::shared_ptr<void> owner;
+    };
+
+    /**
+     * @brief 有等待完成的零拷贝发送时, 在当前IOManager上启动回收定时器
+     */
+    void armZeroCopyReaper();
+
+    /**
+     * @brief 关闭时仍有零拷贝发送未完成, 由定时器继续回收, 全部完成或超时后关闭fd
+     */
+    static void ReapClosed(IOManager* iom, int fd
+                ,std::shared_ptr<std::deque<ZeroCopyPending> > pending, uint64_t deadline);
+    /// 内核不支持UDP_SEGMENT, sendSegments总是逐段发送
+    bool m_noGso = false;
+    /// 是否开启零拷贝发送
+    bool m_zeroCopy = false;
+    Mutex m_zeroCopyMutex;
+    /// 保护close和shutdown对m_sock的访问
+    Mutex m_closeMutex;
+    /// 下一次零拷贝发送的序号
+    uint32_t m_zeroCopySeq = 0;
+    /// 按序号递增排列
+    std::deque<ZeroCopyPending> m_zeroCopyPending;
+    /// m_zeroCopyPending的总字节数
+    uint64_t m_zeroCopyPendingBytes = 0;
+    /// 回收完成通知的定时器
+    std::shared_ptr<Timer> m_zeroCopyTimer;
+    ZeroCopyStats m_zeroCopyStats;
+    /// 最后一次收发活动的时间
+    std::atomic<uint64_t> m_lastActive = {0};
 };
 
-/*class SSLSocket : public Socket {
+/**
+ * @brief TLS Socket
+ * @details 基于OpenSSL, 握手和读写都以非阻塞方式进行: SSL返回WANT_READ/WANT_WRITE时
+ *          在IOManager上等待socket可读/可写后重试, 只挂起当前协程, 超时取自socket的收发超时。
+ *          服务端在第一次读写时才握手, 不占用accept协程; 客户端在connect中完成握手。
+ *          服务端开启会话缓存和session ticket, 客户端可用getSession/setSession复用会话。
+ *          配置 ssl.ktls 开启且内核和OpenSSL都支持时, 握手后把加解密交给内核TLS,
+ *          之后sendFile使用SSL_sendfile, 文件数据不再经过用户空间。
+ *          OpenSSL的写入不能带MSG_NOSIGNAL, 第一次创建SSL连接时进程忽略SIGPIPE(未设置处理函数时)
+ */
+class SSLSocket : public Socket {
 public:
     typedef std::shared_ptr<SSLSocket> ptr;
 
@@ -400,29 +649,173 @@ public:
     static SSLSocket::ptr CreateTCPSocket6();
 
     SSLSocket(int family, int type, int protocol = 0);
-    virtual Socket::ptr accept() override;
     virtual bool bind(const Address::ptr addr) override;
+
+    /**
+     * @brief 建立连接并完成TLS握手
+     * @details 未设置SSL_CTX时使用默认的客户端上下文(校验证书);
+     *          设置了hostname时发送SNI并核对证书中的名字
+     * @param[in] timeout_ms 连接和握手各自的超时时间(毫秒)
+     */
     virtual bool connect(const Address::ptr addr, uint64_t timeout_ms = -1) override;
     virtual bool listen(int backlog = SOMAXCONN) override;
+
+    /**
+     * @brief 发送close_notify(不等待)后关闭连接
+     */
     virtual bool close() override;
     virtual int send(const void* buffer, size_t length, int flags = 0) override;
+
+    /**
+     * @brief 发送数据
+     * @details 多个小块先拷贝到一起, 合成一个TLS记录发送, 一次最多发送64K
+     */
     virtual int send(const iovec* buffers, size_t length, int flags = 0) override;
     virtual int sendTo(const void* buffer, size_t length, const Address::ptr to, int flags = 0) override;
     virtual int sendTo(const iovec* buffers, size_t length, const Address::ptr to, int flags = 0) override;
+
+    /**
+     * @brief TLS记录需要加密, 不支持MSG_ZEROCOPY
+     * @return 开启时返回false
+     */
+    virtual bool setZeroCopy(bool v) override;
+
+    /**
+     * @brief 等同send
+     */
+    virtual int sendZeroCopy(const iovec* buffers, size_t length, std::shared_ptr<void> owner, int flags = 0) override;
+
+    /**
+     * @brief 发送文件内容
+     * @details 开启内核TLS发送时使用SSL_sendfile, 否则分块读出后SSL_write
+     */
+    virtual int64_t sendFile(int fd, off_t offset, size_t length) override;
+
+    /**
+     * @brief 接收数据
+     * @details flags含MSG_PEEK时使用SSL_peek, 其他标志忽略
+     */
     virtual int recv(void* buffer, size_t length, int flags = 0) override;
+
+    /**
+     * @brief 接收数据
+     * @details 只在已解密的数据填满前一块内存时才继续填下一块, 不会为后面的内存再等待
+     */
     virtual int recv(iovec* buffers, size_t length, int flags = 0) override;
     virtual int recvFrom(void* buffer, size_t length, Address::ptr from, int flags = 0) override;
     virtual int recvFrom(iovec* buffers, size_t length, Address::ptr from, int flags = 0) override;
 
+    /**
+     * @brief 完成TLS握手, 已完成时直接返回
+     * @param[in] timeout_ms 超时时间(毫秒), -1表示使用socket的收发超时
+     */
+    bool handshake(uint64_t timeout_ms = -1);
+
+    /**
+     * @brief 加载证书和私钥, 创建服务端SSL_CTX
+     * @see CreateServerContext
+     */
     bool loadCertificates(const std::string& cert_file, const std::string& key_file);
+
+    /**
+     * @brief 设置SSL_CTX, 需在connect或accept之前调用
+     * @details 多个连接共享同一个SSL_CTX, 服务端的会话缓存就保存在其中
+     */
+    void setContext(std::shared_ptr<SSL_CTX> ctx) { m_ctx = ctx;}
+    std::shared_ptr<SSL_CTX> getContext() const { return m_ctx;}
+
+    /**
+     * @brief 设置客户端要连接的主机名, 需在connect之前调用
+     * @details 用于SNI, 上下文校验证书时还要求证书与该名字(或IP)匹配;
+     *          不设置时只校验证书链, 不核对名字
+     */
+    void setHostname(const std::string& v) { m_hostname = v;}
+    const std::string& getHostname() const { return m_hostname;}
+
+    /**
+     * @brief 获取可用于恢复的会话
+     * @details TLS1.3的session ticket在握手之后才到达, 通常要在读到对端数据后才能拿到
+     * @return 没有可恢复的会话时返回nullptr
+     */
+    std::shared_ptr<SSL_SESSION> getSession() const;
+
+    /**
+     * @brief 设置客户端握手时尝试恢复的会话, 需在connect之前调用
+     */
+    void setSession(std::shared_ptr<SSL_SESSION> session) { m_session = session;}
+
+    /**
+     * @brief 本次握手是否恢复了会话
+     */
+    bool isSessionReused() const;
+
+    /**
+     * @brief 发送方向是否由内核TLS加密
+     */
+    bool isKtlsSend() const;
+
+    /**
+     * @brief 接收方向是否由内核TLS解密
+     */
+    bool isKtlsRecv() const;
+
     virtual std::ostream& dump(std::ostream& os) const override;
+
+    /**
+     * @brief 加载证书和私钥, 创建服务端SSL_CTX
+     * @details 会话缓存大小、会话超时、是否发放session ticket、是否尝试内核TLS
+     *          取自配置 ssl.session_cache_size / ssl.session_timeout / ssl.session_ticket / ssl.ktls
+     * @return 失败返回nullptr
+     */
+    static std::shared_ptr<SSL_CTX> CreateServerContext(const std::string& cert_file
+                                                        ,const std::string& key_file);
+
+    /**
+     * @brief 创建客户端SSL_CTX
+     * @param[in] verify 是否校验服务端证书, false时接受任何证书(仅用于测试等明确不需要校验的场合)
+     * @param[in] ca_file 信任的CA证书文件, 为空时使用系统默认路径
+     * @return 失败返回nullptr
+     */
+    static std::shared_ptr<SSL_CTX> CreateClientContext(bool verify = true
+                                                        ,const std::string& ca_file = "");
+
+    /**
+     * @brief 默认的客户端SSL_CTX
+     * @details 默认校验服务端证书, 信任系统默认路径中的CA;
+     *          配置 ssl.client.verify 为false时不校验, ssl.client.ca_file 指定CA文件
+     */
+    static std::shared_ptr<SSL_CTX> GetDefaultClientContext();
 protected:
-    virtual bool init(int sock) override;
+    virtual Socket::ptr createAccepted() const override;
+private:
+    /**
+     * @brief 创建SSL对象
+     * @param[in] server 是否作为服务端
+     */
+    bool newSSL(bool server);
+
+    /**
+     * @brief 执行一次SSL操作, WANT_READ/WANT_WRITE时在IOManager上等待后重试
+     * @param[in] fun 返回值>0表示成功的SSL操作
+     * @param[in] timeout_ms 每次等待的超时时间, -1表示使用socket的收发超时
+     * @return 成功时为fun的返回值, 对端关闭返回0, 出错或超时返回-1
+     */
+    template<class Fun>
+    int doSSL(Fun fun, uint64_t timeout_ms = -1);
+
+    /**
+     * @brief 等待socket可读/可写
+     * @param[in] event IOManager::READ 或 IOManager::WRITE
+     * @return 超时或出错返回false
+     */
+    bool waitEvent(int event, uint64_t timeout_ms);
 private:
     std::shared_ptr<SSL_CTX> m_ctx;
     std::shared_ptr<SSL> m_ssl;
+    std::shared_ptr<SSL_SESSION> m_session;
+    /// 客户端要连接的主机名
+    std::string m_hostname;
 };
-*/
 /**
  * @brief 流式输出socket
  * @param[in, out] os 输出流
@@ -0,0 +1,284 @@
+#include "socket_pool.h"
+#include "iomanager.h"
+#include "config.h"
+#include "hook.h"
+#include "log.h"
+#include "macro.h"
+#include "util.h"
+#include <sstream>
+
+namespace sylar {
+
+static sylar::Logger::ptr g_logger = __LOG_NAME("system");
+
+static sylar::ConfigVar<uint32_t>::ptr g_socket_pool_max_active =
+    sylar::Config::Lookup("socket_pool.max_active", (uint32_t)64,
+    "socket pool max active connections per address, 0 means unlimited");
+
+static sylar::ConfigVar<uint32_t>::ptr g_socket_pool_max_idle =
+    sylar::Config::Lookup("socket_pool.max_idle", (uint32_t)16,
+    "socket pool max idle connections per address");
+
+static sylar::ConfigVar<uint64_t>::ptr g_socket_pool_idle_timeout =
+    sylar::Config::Lookup("socket_pool.idle_timeout", (uint64_t)(60 * 1000),
+    "socket pool idle connection timeout in ms");
+
+static sylar::ConfigVar<uint64_t>::ptr g_socket_pool_connect_timeout =
+    sylar::Config::Lookup("socket_pool.connect_timeout", (uint64_t)(3 * 1000),
+    "socket pool connect timeout in ms");
+
+struct SocketPool::Lease {
+    std::weak_ptr<SocketPool> pool;
+    std::string key;
+    Socket::ptr sock;
+
+    ~Lease() {
+        SocketPool::ptr p = pool.lock();
+        if(p) {
+            p->release(key, sock);
+        } else {
+            sock->close();
+        }
+    }
+};
+
+std::string SocketPool::Stats::toString() const {
+    std::stringstream ss;
+    ss << "created=" << created
+       << " reused=" << reused
+       << " connect_failures=" << connectFailures
+       << " unhealthy=" << unhealthy
+       << " reaped=" << reaped
+       << " waits=" << waits
+       << " timeouts=" << timeouts
+       << " active=" << active
+       << " idle=" << idle;
+    return ss.str();
+}
+
+SocketPool::SocketPool(IOManager* iom)
+    :m_iom(iom)
+    ,m_maxActive(g_socket_pool_max_active->getValue())
+    ,m_maxIdle(g_socket_pool_max_idle->getValue())
+    ,m_idleTimeout(g_socket_pool_idle_timeout->getValue())
+    ,m_connectTimeout(g_socket_pool_connect_timeout->getValue()) {
+}
+
+SocketPool::~SocketPool() {
+    if(m_reaper) {
+        m_reaper->cancel();
+    }
+    for(auto& i : m_hosts) {
+        __ASSERT(i.second.waiters.empty());
+        for(auto& c : i.second.idle) {
+            c.sock->close();
+        }
+    }
+}
+
+bool SocketPool::IsHealthy(Socket::ptr sock) {
+    if(!sock->isConnected()) {
+        return false;
+    }
+    // 空闲连接上不应有任何数据: 可读到0表示对端已关闭, 有数据说明上一次请求有残留
+    char c;
+    ssize_t rt = recv_f(sock->getSocket(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return rt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+Socket::ptr SocketPool::lease(const std::string& key, Socket::ptr sock) {
+    std::shared_ptr<Lease> l(new Lease);
+    l->pool = shared_from_this();
+    l->key = key;
+    l->sock = sock;
+    // 与Lease共享引用计数, 最后一个引用释放时Lease析构并归还连接
+    return Socket::ptr(l, sock.get());
+}
+
+Socket::ptr SocketPool::get(Address::ptr addr, uint64_t timeout_ms) {
+    std::string key = addr->toString();
+    uint64_t deadline = timeout_ms == (uint64_t)-1 ? (uint64_t)-1
+                            : GetCurrentMS() + timeout_ms;
+    while(true) {
+        MutexType::Lock lock(m_mutex);
+        if(!m_reaper) {
+            startReaperNoLock();
+        }
+        Host& host = m_hosts[key];
+        while(!host.idle.empty()) {
+            Socket::ptr sock = host.idle.back().sock;
+            host.idle.pop_back();
+            ++host.active;
+            lock.unlock();
+            if(IsHealthy(sock)) {
+                lock.lock();
+                ++m_stats.reused;
+                return lease(key, sock);
+            }
+            sock->close();
+            lock.lock();
+            --host.active;
+            ++m_stats.unhealthy;
+        }
+
+        if(m_maxActive == 0 || host.active < m_maxActive) {
+            ++host.active;
+            lock.unlock();
+            Socket::ptr sock = Socket::CreateTCP(addr);
+            if(sock->connect(addr, m_connectTimeout)) {
+                lock.lock();
+                ++m_stats.created;
+                return lease(key, sock);
+            }
+            int err = errno;
+            __LOG_DEBUG(g_logger) << "SocketPool connect " << key << " fail errno="
+                << err << " errstr=" << strerror(err);
+            lock.lock();
+            ++m_stats.connectFailures;
+            --host.active;
+            notifyOneNoLock(host);
+            errno = err;
+            return nullptr;
+        }
+
+        uint64_t now = GetCurrentMS();
+        Scheduler* scheduler = Scheduler::GetThis();
+        if(!scheduler || now >= deadline) {
+            ++m_stats.timeouts;
+            errno = ETIMEDOUT;
+            return nullptr;
+        }
+        std::shared_ptr<Waiter> waiter(new Waiter);
+        waiter->fiber = Fiber::GetThis();
+        waiter->scheduler = scheduler;
+        host.waiters.push_back(waiter);
+        ++m_stats.waits;
+
+        Timer::ptr timer;
+        if(deadline != (uint64_t)-1) {
+            std::weak_ptr<Waiter> wwaiter(waiter);
+            IOManager* iom = IOManager::GetThis();
+            __ASSERT(iom);
+            timer = iom->addConditionTimer(deadline - now, [this, key, wwaiter](){
+                std::shared_ptr<Waiter> w = wwaiter.lock();
+                if(!w) {
+                    return;
+                }
+                MutexType::Lock lock(m_mutex);
+                Host& host = m_hosts[key];
+                for(auto it = host.waiters.begin(); it != host.waiters.end(); ++it) {
+                    if(*it == w) {
+                        host.waiters.erase(it);
+                        w->timedout = true;
+                        w->scheduler->schedule(&w->fiber);
+                        break;
+                    }
+                }
+            }, shared_from_this());
+        }
+        lock.unlock();
+        // 唤醒可能在切出之前就已发生, 调度器会等到协程切出后再执行它
+        Fiber::YieldToHold();
+        if(timer) {
+            timer->cancel();
+        }
+        if(waiter->timedout) {
+            MutexType::Lock lock(m_mutex);
+            ++m_stats.timeouts;
+            errno = ETIMEDOUT;
+            return nullptr;
+        }
+    }
+}
+
+void SocketPool::notifyOneNoLock(Host& host) {
+    if(host.waiters.empty()) {
+        return;
+    }
+    std::shared_ptr<Waiter> w = host.waiters.front();
+    host.waiters.pop_front();
+    w->scheduler->schedule(&w->fiber);
+}
+
+void SocketPool::release(const std::string& key, Socket::ptr sock) {
+    bool keep = sock->isConnected();
+    {
+        MutexType::Lock lock(m_mutex);
+        Host& host = m_hosts[key];
+        --host.active;
+        if(keep && host.idle.size() < m_maxIdle) {
+            host.idle.push_back(IdleConn{sock, GetCurrentMS()});
+        } else {
+            keep = false;
+        }
+        notifyOneNoLock(host);
+    }
+    if(!keep) {
+        sock->close();
+    }
+}
+
+void SocketPool::startReaperNoLock() {
+    if(!m_iom) {
+        m_iom = IOManager::GetThis();
+    }
+    if(!m_iom || m_idleTimeout == 0) {
+        return;
+    }
+    // 空闲连接最多比超时多存活半个周期
+    uint64_t interval = std::max(m_idleTimeout / 2, (uint64_t)100);
+    m_reaper = m_iom->addConditionTimer(interval, std::bind(&SocketPool::reap, this)
+                        ,shared_from_this(), true);
+}
+
+void SocketPool::reap() {
+    std::vector<Socket::ptr> expired;
+    uint64_t now = GetCurrentMS();
+    {
+        MutexType::Lock lock(m_mutex);
+        for(auto it = m_hosts.begin(); it != m_hosts.end();) {
+            Host& host = it->second;
+            while(!host.idle.empty() && now - host.idle.front().since >= m_idleTimeout) {
+                expired.push_back(host.idle.front().sock);
+                host.idle.pop_front();
+            }
+            if(host.idle.empty() && host.active == 0 && host.waiters.empty()) {
+                it = m_hosts.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        m_stats.reaped += expired.size();
+    }
+    for(auto& i : expired) {
+        i->close();
+    }
+}
+
+void SocketPool::clear() {
+    std::vector<Socket::ptr> idle;
+    {
+        MutexType::Lock lock(m_mutex);
+        for(auto& i : m_hosts) {
+            for(auto& c : i.second.idle) {
+                idle.push_back(c.sock);
+            }
+            i.second.idle.clear();
+        }
+    }
+    for(auto& i : idle) {
+        i->close();
+    }
+}
+
+SocketPool::Stats SocketPool::getStats() {
+    MutexType::Lock lock(m_mutex);
+    Stats stats = m_stats;
+    for(auto& i : m_hosts) {
+        stats.active += i.second.active;
+        stats.idle += i.second.idle.size();
+    }
+    return stats;
+}
+
+}
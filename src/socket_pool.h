@@ -0,0 +1,198 @@
+/**
+ * @file socket_pool.h
+ * @brief 出站TCP连接池
+ */
+#ifndef __SOCKET_POOL_H__
+#define __SOCKET_POOL_H__
+
+#include <memory>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include "socket.h"
+#include "fiber.h"
+#include "timer.h"
+#include "mutex.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+class Scheduler;
+class IOManager;
+
+/**
+ * @brief 出站TCP连接池
+ * @details 按目标地址分组复用连接。get返回的Socket::ptr最后一个引用释放时连接自动归还,
+ *          仍处于连接状态的回到空闲列表, 调用者close过的直接丢弃。
+ *          每个地址的活跃连接数(借出+正在连接)达到上限时, 调用协程挂起等待归还;
+ *          取出空闲连接时用MSG_PEEK探测对端是否已关闭或有残留数据, 不健康的连接被丢弃;
+ *          空闲超时的连接由IOManager定时器定期关闭。
+ *          必须通过SocketPool::ptr管理, 已借出的连接不会延长连接池的生命周期
+ */
+class SocketPool : public std::enable_shared_from_this<SocketPool>
+                    , Noncopyable {
+public:
+    typedef std::shared_ptr<SocketPool> ptr;
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 统计信息
+     */
+    struct Stats {
+        /// 新建的连接数
+        uint64_t created = 0;
+        /// 复用空闲连接的次数
+        uint64_t reused = 0;
+        /// 新建连接失败的次数
+        uint64_t connectFailures = 0;
+        /// 取出时探测失败被丢弃的连接数
+        uint64_t unhealthy = 0;
+        /// 空闲超时被关闭的连接数
+        uint64_t reaped = 0;
+        /// 因达到活跃上限而挂起等待的次数
+        uint64_t waits = 0;
+        /// 等待超时的次数
+        uint64_t timeouts = 0;
+        /// 当前借出和正在连接的连接数
+        uint64_t active = 0;
+        /// 当前空闲连接数
+        uint64_t idle = 0;
+
+        std::string toString() const;
+    };
+
+    /**
+     * @brief 构造函数, 上限和超时取自配置 socket_pool.*
+     * @param[in] iom 执行空闲回收定时器的IOManager, 为空时使用第一次get所在的IOManager
+     */
+    SocketPool(IOManager* iom = nullptr);
+    ~SocketPool();
+
+    /**
+     * @brief 借出一个到addr的连接
+     * @details 优先使用最近归还的空闲连接; 没有空闲连接且未达到上限时新建连接;
+     *          否则挂起当前协程直到有连接归还或超时
+     * @param[in] addr 目标地址
+     * @param[in] timeout_ms 等待空闲名额的最长时间(毫秒), 不含建立连接的时间
+     * @return 失败或超时返回nullptr, 超时时errno为ETIMEDOUT
+     */
+    Socket::ptr get(Address::ptr addr, uint64_t timeout_ms = -1);
+
+    /**
+     * @brief 关闭所有空闲连接
+     */
+    void clear();
+
+    /**
+     * @brief 获取统计信息
+     */
+    Stats getStats();
+
+    /**
+     * @brief 设置每个地址的最大活跃连接数, 0表示不限制
+     */
+    void setMaxActive(uint32_t v) { m_maxActive = v;}
+    uint32_t getMaxActive() const { return m_maxActive;}
+
+    /**
+     * @brief 设置每个地址的最大空闲连接数, 超出的连接归还时直接关闭
+     */
+    void setMaxIdle(uint32_t v) { m_maxIdle = v;}
+    uint32_t getMaxIdle() const { return m_maxIdle;}
+
+    /**
+     * @brief 设置空闲超时(毫秒), 需在第一次get之前调用
+     */
+    void setIdleTimeout(uint64_t v) { m_idleTimeout = v;}
+    uint64_t getIdleTimeout() const { return m_idleTimeout;}
+
+    /**
+     * @brief 设置新建连接的超时(毫秒)
+     */
+    void setConnectTimeout(uint64_t v) { m_connectTimeout = v;}
+    uint64_t getConnectTimeout() const { return m_connectTimeout;}
+private:
+    /**
+     * @brief 空闲连接
+     */
+    struct IdleConn {
+        Socket::ptr sock;
+        /// 归还时间(毫秒)
+        uint64_t since;
+    };
+
+    /**
+     * @brief 等待名额的协程
+     */
+    struct Waiter {
+        Fiber::ptr fiber;
+        Scheduler* scheduler = nullptr;
+        /// 是否因超时被唤醒
+        bool timedout = false;
+    };
+
+    /**
+     * @brief 同一目标地址的连接
+     */
+    struct Host {
+        /// 空闲连接, 按归还时间排列, 尾部最新
+        std::list<IdleConn> idle;
+        /// 借出和正在连接的连接数
+        uint32_t active = 0;
+        /// 等待名额的协程, 先进先出
+        std::list<std::shared_ptr<Waiter> > waiters;
+    };
+
+    /**
+     * @brief 借出的连接, 析构时归还
+     */
+    struct Lease;
+
+    /**
+     * @brief 归还连接
+     */
+    void release(const std::string& key, Socket::ptr sock);
+
+    /**
+     * @brief 唤醒一个等待者, 调用前需持有m_mutex
+     */
+    void notifyOneNoLock(Host& host);
+
+    /**
+     * @brief 把连接包装成归还用的Socket::ptr
+     */
+    Socket::ptr lease(const std::string& key, Socket::ptr sock);
+
+    /**
+     * @brief 探测空闲连接是否可用
+     */
+    static bool IsHealthy(Socket::ptr sock);
+
+    /**
+     * @brief 关闭空闲超时的连接
+     */
+    void reap();
+
+    /**
+     * @brief 第一次使用时启动回收定时器, 调用前需持有m_mutex
+     */
+    void startReaperNoLock();
+private:
+    MutexType m_mutex;
+    /// 目标地址字符串 -> 连接
+    std::unordered_map<std::string, Host> m_hosts;
+    IOManager* m_iom;
+    Timer::ptr m_reaper;
+    uint32_t m_maxActive;
+    uint32_t m_maxIdle;
+    uint64_t m_idleTimeout;
+    uint64_t m_connectTimeout;
+    Stats m_stats;
+};
+
+typedef SingletonPtr<SocketPool> SocketPoolMgr;
+
+}
+
+#endif
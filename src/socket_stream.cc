@@ -1,12 +1,23 @@
 #include "socket_stream.h"
+#include "config.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
 
 namespace sylar {
+    static sylar::ConfigVar<uint32_t>::ptr g_socket_stream_write_buffer_size =
+        sylar::Config::Lookup("socket_stream.write_buffer_size", (uint32_t)(16 * 1024),
+        "socket stream write coalescing threshold");
+
     SocketStream::SocketStream(Socket::ptr sock, bool owner) 
         :m_socket(sock)
-        ,m_owner(owner){
+        ,m_owner(owner)
+        ,m_writeBufferSize(g_socket_stream_write_buffer_size->getValue()) {
 
     }
     SocketStream::~SocketStream() {
+        flush();
         if(m_owner && m_socket) {
             m_socket->close();
         }
@@ -18,10 +29,14 @@ namespace sylar {
         if(!isConnected()) {
             return -1;
         }
+        // 等待对端之前把已合并的数据发出去
+        if(flush() < 0) {
+            return -1;
+        }
         return m_socket->recv(buffer, length);
     }
     int SocketStream::read(ByteArray::ptr ba, size_t length) {
-        if(!isConnected()) {
+        if(!isConnected() || flush() < 0) {
             return -1;
         }
         std::vector<iovec> iovs;
@@ -37,12 +52,31 @@ namespace sylar {
         if(!isConnected()) {
             return -1;
         }
-        return m_socket->send(buffer, length);
+        if(!m_writeBuffered) {
+            return m_socket->send(buffer, length);
+        }
+        if(m_writeBuffer.size() + length < m_writeBufferSize) {
+            m_writeBuffer.append((const char*)buffer, length);
+            return length;
+        }
+        return writeThrough(buffer, length);
     }
     int SocketStream::write(ByteArray::ptr ba, size_t length) {
         if(!isConnected()) {
             return -1;
         }
+        if(m_writeBuffered) {
+            length = std::min(length, ba->getReadSize());
+            if(m_writeBuffer.size() + length < m_writeBufferSize) {
+                size_t offset = m_writeBuffer.size();
+                m_writeBuffer.resize(offset + length);
+                ba->read(&m_writeBuffer[offset], length);
+                return length;
+            }
+            if(flush() < 0) {
+                return -1;
+            }
+        }
         std::vector<iovec> iovs;
         ba->getReadBuffers(iovs, length);
         int rt = m_socket->send(&iovs[0], iovs.size());
@@ -52,7 +86,171 @@ namespace sylar {
         return rt;
     }
 
+    int SocketStream::writeZeroCopy(ByteArray::ptr ba, size_t length) {
+        if(!isConnected()) {
+            return -1;
+        }
+        if(flush() < 0) {
+            return -1;
+        }
+        std::vector<iovec> iovs;
+        ba->getReadBuffers(iovs, length);
+        int rt = m_socket->sendZeroCopy(&iovs[0], iovs.size(), ba);
+        if(rt > 0) {
+            ba->setPosition(ba->getPosition() + rt);
+        }
+        return rt;
+    }
+
+    int64_t SocketStream::sendFile(int fd, off_t offset, size_t length) {
+        if(!isConnected() || flush() < 0) {
+            return -1;
+        }
+        return m_socket->sendFile(fd, offset, length);
+    }
+
+    int64_t SocketStream::sendFile(const std::string& path, off_t offset, size_t length) {
+        if(!isConnected() || flush() < 0) {
+            return -1;
+        }
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            return -1;
+        }
+        struct stat st;
+        int64_t rt = -1;
+        if(::fstat(fd, &st) == 0 && offset <= st.st_size) {
+            length = std::min(length, (size_t)(st.st_size - offset));
+            rt = length ? m_socket->sendFile(fd, offset, length) : 0;
+        }
+        ::close(fd);
+        return rt;
+    }
+
+    int64_t SocketStream::spliceTo(Socket::ptr out, size_t length) {
+        if(!isConnected() || !out || !out->isConnected() || flush() < 0) {
+            return -1;
+        }
+        static const size_t s_chunk = 64 * 1024;
+        if(std::dynamic_pointer_cast<SSLSocket>(m_socket)
+                || std::dynamic_pointer_cast<SSLSocket>(out)) {
+            // TLS数据需要在用户空间加解密, 只能逐块拷贝
+            std::vector<char> buf(std::min(length, s_chunk));
+            int64_t total = 0;
+            while(length > 0) {
+                int n = m_socket->recv(&buf[0], std::min(length, buf.size()));
+                if(n <= 0) {
+                    return (total == 0 && n < 0) ? -1 : total;
+                }
+                int sent = 0;
+                while(sent < n) {
+                    int m = out->send(&buf[sent], n - sent, MSG_NOSIGNAL);
+                    if(m <= 0) {
+                        return total > 0 ? total : -1;
+                    }
+                    sent += m;
+                    total += m;
+                }
+                length -= n;
+            }
+            return total;
+        }
+        int pipefd[2];
+        if(::pipe2(pipefd, O_NONBLOCK | O_CLOEXEC)) {
+            return -1;
+        }
+        int64_t total = 0;
+        int64_t err = 0;
+        while(length > 0) {
+            // socket -> 管道, 管道在每轮中都会被取空, 不会因管道满而误等socket可读
+            ssize_t n = ::splice(m_socket->getSocket(), nullptr, pipefd[1], nullptr
+                            ,std::min(length, s_chunk), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(n <= 0) {
+                err = n;
+                break;
+            }
+            // 管道 -> socket
+            ssize_t left = n;
+            while(left > 0) {
+                ssize_t m = ::splice(pipefd[0], nullptr, out->getSocket(), nullptr
+                                ,left, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if(m <= 0) {
+                    err = -1;
+                    break;
+                }
+                left -= m;
+                total += m;
+            }
+            if(left > 0) {
+                break;
+            }
+            m_socket->touch();
+            out->touch();
+            length -= n;
+        }
+        ::close(pipefd[0]);
+        ::close(pipefd[1]);
+        return (total == 0 && err < 0) ? -1 : total;
+    }
+
+    void SocketStream::setWriteBuffer(bool v) {
+        if(!v) {
+            flush();
+        }
+        m_writeBuffered = v;
+    }
+
+    int SocketStream::writeThrough(const void* buffer, size_t length) {
+        // 对端已关闭时不产生SIGPIPE, 由返回值报告错误
+        static const int s_flags = MSG_NOSIGNAL;
+        size_t offset = 0;
+        while(true) {
+            iovec iovs[2];
+            size_t n = 0;
+            size_t left = m_writeBuffer.size() - offset;
+            if(left) {
+                iovs[n].iov_base = &m_writeBuffer[offset];
+                iovs[n].iov_len = left;
+                ++n;
+            }
+            if(length) {
+                iovs[n].iov_base = (void*)buffer;
+                iovs[n].iov_len = length;
+                ++n;
+            }
+            if(n == 0) {
+                return 0;
+            }
+            int rt = m_socket->send(iovs, n, s_flags);
+            if(rt <= 0) {
+                m_writeBuffer.erase(0, offset);
+                return rt < 0 ? rt : -1;
+            }
+            if((size_t)rt < left) {
+                offset += rt;
+                continue;
+            }
+            m_writeBuffer.clear();
+            offset = 0;
+            if((size_t)rt > left || length == 0) {
+                return rt - left;
+            }
+        }
+    }
+
+    int SocketStream::flush() {
+        if(m_writeBuffer.empty()) {
+            return 0;
+        }
+        if(!isConnected()) {
+            m_writeBuffer.clear();
+            return -1;
+        }
+        return writeThrough(nullptr, 0);
+    }
+
     void SocketStream::close() {
+        flush();
         if(m_socket) {
             m_socket->close();
         }
@@ -15,12 +15,85 @@ namespace sylar {
             virtual int write(const void* buffer, size_t length) override;
             virtual int write(ByteArray::ptr ba, size_t length) override;
 
+            /**
+             * @brief 以MSG_ZEROCOPY写入ByteArray中的数据
+             * @details ba在内核完成发送前被socket持有, 调用者不能再修改其中的数据;
+             *          未开启零拷贝或数据低于阈值时等同于write
+             * @see Socket::sendZeroCopy
+             */
+            int writeZeroCopy(ByteArray::ptr ba, size_t length);
+
+            /**
+             * @brief 零拷贝发送文件的一部分
+             * @see Socket::sendFile
+             */
+            int64_t sendFile(int fd, off_t offset, size_t length);
+
+            /**
+             * @brief 零拷贝发送文件
+             * @param[in] path 文件路径
+             * @param[in] offset 起始偏移
+             * @param[in] length 发送长度, 超过文件剩余长度时发送到文件末尾
+             * @return 发送的字节数, 打开文件失败或出错返回-1
+             */
+            int64_t sendFile(const std::string& path, off_t offset = 0, size_t length = (size_t)-1);
+
+            /**
+             * @brief 经由管道把本socket收到的数据零拷贝转发到另一个socket
+             * @details 数据不经过用户空间, 对端关闭或转发完length字节后返回;
+             *          任一端是SSLSocket时退化为用户空间的读写拷贝
+             * @param[in] out 目标socket
+             * @param[in] length 最多转发的字节数
+             * @return 转发的字节数, 出错且未转发任何数据时返回-1
+             */
+            int64_t spliceTo(Socket::ptr out, size_t length = (size_t)-1);
+
+            /**
+             * @brief 开启/关闭写合并
+             * @details 开启后小块写入先拷贝到写缓冲区, 在显式flush、缓冲超过阈值、
+             *          读之前(等待对端之前)以及关闭时用一次writev写出;
+             *          超过阈值的那次写入和缓冲区一起writev, 不再拷贝。
+             *          sendFile/spliceTo/writeZeroCopy之前也会先flush, 保证数据顺序。
+             *          关闭时先flush
+             */
+            void setWriteBuffer(bool v);
+            bool isWriteBuffer() const { return m_writeBuffered;}
+
+            /**
+             * @brief 设置写合并的阈值, 默认为配置 socket_stream.write_buffer_size
+             */
+            void setWriteBufferSize(size_t v) { m_writeBufferSize = v;}
+            size_t getWriteBufferSize() const { return m_writeBufferSize;}
+
+            /**
+             * @brief 写缓冲区中尚未写出的字节数
+             */
+            size_t getPendingWriteSize() const { return m_writeBuffer.size();}
+
+            /**
+             * @brief 写出写缓冲区中的数据
+             * @return 成功返回0, 出错返回<0, 未写出的数据留在缓冲区中
+             */
+            int flush();
+
             virtual void close() override;
             Socket::ptr getSocket() const { return m_socket;}
             bool isConnected() const;
+        private:
+            /**
+             * @brief 用一次writev写出写缓冲区和buffer, 直到写缓冲区写完且buffer至少写出一部分
+             * @return buffer中写出的字节数, length为0时返回0; 出错返回<0
+             */
+            int writeThrough(const void* buffer, size_t length);
         protected:
             Socket::ptr m_socket;
             bool m_owner;
+            /// 是否开启写合并
+            bool m_writeBuffered = false;
+            /// 写合并阈值
+            size_t m_writeBufferSize;
+            /// 待写出的数据
+            std::string m_writeBuffer;
     };
 }
 
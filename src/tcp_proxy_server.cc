@@ -0,0 +1,224 @@
+#include "tcp_proxy_server.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sstream>
+
+namespace sylar {
+
+    static sylar::ConfigVar<std::vector<std::string> >::ptr g_tcp_proxy_upstreams =
+        sylar::Config::Lookup("tcp_proxy.upstreams", std::vector<std::string>(),
+        "tcp proxy upstream addresses, host:port");
+
+    static sylar::ConfigVar<uint64_t>::ptr g_tcp_proxy_connect_timeout =
+        sylar::Config::Lookup("tcp_proxy.connect_timeout", (uint64_t)(3 * 1000),
+        "tcp proxy upstream connect timeout in ms");
+
+    static sylar::ConfigVar<uint32_t>::ptr g_tcp_proxy_pipe_size =
+        sylar::Config::Lookup("tcp_proxy.pipe_size", (uint32_t)0,
+        "tcp proxy pipe capacity per direction, 0 means system default");
+
+    static sylar::Logger::ptr g_logger = __LOG_NAME("system");
+
+    std::string TcpProxyServer::RelayStats::toString() const {
+        std::stringstream ss;
+        ss << "relays=" << relays
+           << " connect_failures=" << connectFailures
+           << " errors=" << errors
+           << " active=" << active
+           << " client_to_upstream=" << clientToUpstream
+           << " upstream_to_client=" << upstreamToClient;
+        return ss.str();
+    }
+
+    TcpProxyServer::TcpProxyServer(sylar::IOManager* worker, sylar::IOManager* accept_worker)
+        :TcpProxyServer(std::vector<sylar::IOManager*>{worker}, accept_worker) {
+    }
+
+    TcpProxyServer::TcpProxyServer(const std::vector<sylar::IOManager*>& workers
+                                    ,sylar::IOManager* accept_worker)
+        :TcpServer(workers, accept_worker)
+        ,m_connectTimeout(g_tcp_proxy_connect_timeout->getValue())
+        ,m_pipeSize(g_tcp_proxy_pipe_size->getValue()) {
+        setName("tcp_proxy");
+    }
+
+    void TcpProxyServer::addUpstream(Address::ptr addr) {
+        m_upstreams.push_back(addr);
+    }
+
+    bool TcpProxyServer::start() {
+        if(m_upstreams.empty()) {
+            for(auto& i : g_tcp_proxy_upstreams->getValue()) {
+                Address::ptr addr = Address::LookupAny(i);
+                if(!addr) {
+                    __LOG_ERROR(g_logger) << "tcp proxy invalid upstream " << i;
+                    continue;
+                }
+                m_upstreams.push_back(addr);
+            }
+        }
+        if(m_upstreams.empty()) {
+            __LOG_ERROR(g_logger) << "tcp proxy " << getName() << " without upstream";
+            return false;
+        }
+        IgnoreSigPipe();
+        return TcpServer::start();
+    }
+
+    TcpProxyServer::RelayStats TcpProxyServer::getRelayStats() const {
+        RelayStats stats;
+        stats.relays = m_relays;
+        stats.connectFailures = m_connectFailures;
+        stats.errors = m_errors;
+        stats.active = m_active;
+        stats.clientToUpstream = m_clientToUpstream;
+        stats.upstreamToClient = m_upstreamToClient;
+        return stats;
+    }
+
+    Socket::ptr TcpProxyServer::connectUpstream() {
+        size_t n = m_upstreams.size();
+        size_t start = m_next++;
+        for(size_t i = 0; i < n; ++i) {
+            Address::ptr addr = m_upstreams[(start + i) % n];
+            Socket::ptr sock = Socket::CreateTCP(addr);
+            if(sock->connect(addr, m_connectTimeout)) {
+                return sock;
+            }
+            __LOG_WARN(g_logger) << "tcp proxy connect upstream " << addr->toString()
+                << " fail errno=" << errno << " errstr=" << strerror(errno);
+        }
+        return nullptr;
+    }
+
+    bool TcpProxyServer::pump(Relay::ptr relay, Socket::ptr in, Socket::ptr out
+                              ,std::atomic<uint64_t>& counter, std::atomic<uint64_t>& total) {
+        int pipefd[2];
+        if(::pipe2(pipefd, O_NONBLOCK | O_CLOEXEC)) {
+            __LOG_ERROR(g_logger) << "tcp proxy pipe2 errno=" << errno
+                << " errstr=" << strerror(errno);
+            return false;
+        }
+        if(m_pipeSize) {
+            fcntl(pipefd[1], F_SETPIPE_SZ, m_pipeSize);
+        }
+        int pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+        size_t chunk = pipe_size > 0 ? pipe_size : 64 * 1024;
+        bool eof = false;
+        while(true) {
+            // socket -> 管道, socket不可读时挂起; 管道每轮都被取空, 不会因管道满而误等
+            ssize_t n = ::splice(in->getSocket(), nullptr, pipefd[1], nullptr
+                            ,chunk, SPLICE_F_MOVE);
+            if(n == 0) {
+                eof = true;
+                break;
+            }
+            if(n < 0) {
+                break;
+            }
+            // 管道 -> socket, 目标写不动时挂起, 期间不再从源端读取
+            ssize_t left = n;
+            while(left > 0) {
+                ssize_t m = ::splice(pipefd[0], nullptr, out->getSocket(), nullptr
+                                ,left, SPLICE_F_MOVE);
+                if(m <= 0) {
+                    break;
+                }
+                left -= m;
+            }
+            counter += n - left;
+            total += n - left;
+            if(left > 0) {
+                break;
+            }
+            // splice绕过了Socket的收发, 由这里记录活动, 避免被空闲回收
+            relay->client->touch();
+        }
+        ::close(pipefd[0]);
+        ::close(pipefd[1]);
+        return eof;
+    }
+
+    void TcpProxyServer::handleClient(Socket::ptr client) {
+        Socket::ptr upstream = connectUpstream();
+        if(!upstream) {
+            ++m_connectFailures;
+            client->close();
+            return;
+        }
+        Relay::ptr relay(new Relay);
+        relay->client = client;
+        relay->upstream = upstream;
+        relay->startTime = GetCurrentMS();
+        ++m_relays;
+        ++m_active;
+
+        /**
+         * @brief 上游到客户端方向的完成状态
+         */
+        struct Done {
+            Mutex mutex;
+            bool done = false;
+            bool ok = true;
+            Fiber::ptr waiter;
+            Scheduler* scheduler = nullptr;
+        };
+        std::shared_ptr<Done> down(new Done);
+        auto self = std::static_pointer_cast<TcpProxyServer>(shared_from_this());
+        IOManager::GetThis()->schedule([self, relay, down](){
+            bool ok = self->pump(relay, relay->upstream, relay->client
+                            ,relay->upstreamToClient, self->m_upstreamToClient);
+            if(ok) {
+                ::shutdown(relay->client->getSocket(), SHUT_WR);
+            } else {
+                // 唤醒另一个方向
+                ::shutdown(relay->client->getSocket(), SHUT_RDWR);
+                ::shutdown(relay->upstream->getSocket(), SHUT_RDWR);
+            }
+            Mutex::Lock lock(down->mutex);
+            down->done = true;
+            down->ok = ok;
+            if(down->waiter) {
+                down->scheduler->schedule(&down->waiter);
+            }
+        });
+
+        bool ok = pump(relay, client, upstream, relay->clientToUpstream, m_clientToUpstream);
+        if(ok) {
+            ::shutdown(upstream->getSocket(), SHUT_WR);
+        } else {
+            ::shutdown(client->getSocket(), SHUT_RDWR);
+            ::shutdown(upstream->getSocket(), SHUT_RDWR);
+        }
+        Mutex::Lock lock(down->mutex);
+        if(!down->done) {
+            down->waiter = Fiber::GetThis();
+            down->scheduler = Scheduler::GetThis();
+            lock.unlock();
+            // 唤醒可能在切出之前就已发生, 调度器会等到协程切出后再执行它
+            Fiber::YieldToHold();
+            lock.lock();
+        }
+        ok = ok && down->ok;
+        lock.unlock();
+
+        if(!ok) {
+            ++m_errors;
+        }
+        upstream->close();
+        client->close();
+        --m_active;
+        onRelayClose(relay);
+    }
+
+    void TcpProxyServer::onRelayClose(Relay::ptr relay) {
+        __LOG_DEBUG(g_logger) << "tcp proxy relay close client="
+            << (relay->client->getRemoteAddress() ? relay->client->getRemoteAddress()->toString() : "")
+            << " client_to_upstream=" << relay->clientToUpstream
+            << " upstream_to_client=" << relay->upstreamToClient
+            << " cost=" << GetCurrentMS() - relay->startTime << "ms";
+    }
+}
@@ -0,0 +1,137 @@
+/**
+ * @file tcp_proxy_server.h
+ * @brief 基于splice的TCP转发(四层代理)
+ */
+#ifndef __TCP_PROXY_SERVER_H__
+#define __TCP_PROXY_SERVER_H__
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "tcp_server.h"
+
+namespace sylar {
+    /**
+     * @brief TCP转发服务
+     * @details 每个客户端连接按轮询选择一个上游建立连接(失败时依次尝试下一个),
+     *          两个方向各用一个协程和一个管道, 通过splice在内核中搬运数据, 不经过用户空间。
+     *          socket不可读/不可写时由hook在IOManager上挂起协程。
+     *          管道中的数据全部写出后才继续读取, 目标端写不动时不再从源端读取(背压),
+     *          每个方向在途的数据不超过一个管道的容量。
+     *          一个方向读到EOF时对目标端shutdown(SHUT_WR)把半关闭传递过去,
+     *          另一个方向继续转发; 任一方向出错时两端都被shutdown, 两个方向都结束后关闭连接
+     */
+    class TcpProxyServer : public TcpServer {
+        public:
+            typedef std::shared_ptr<TcpProxyServer> ptr;
+
+            /**
+             * @brief 一个被转发的连接
+             */
+            struct Relay {
+                typedef std::shared_ptr<Relay> ptr;
+                Socket::ptr client;
+                Socket::ptr upstream;
+                /// 客户端到上游转发的字节数
+                std::atomic<uint64_t> clientToUpstream = {0};
+                /// 上游到客户端转发的字节数
+                std::atomic<uint64_t> upstreamToClient = {0};
+                /// 开始转发的时间(毫秒)
+                uint64_t startTime = 0;
+            };
+
+            /**
+             * @brief 转发统计
+             */
+            struct RelayStats {
+                /// 建立过的转发数
+                uint64_t relays = 0;
+                /// 所有上游都连接失败的客户端数
+                uint64_t connectFailures = 0;
+                /// 出错结束的转发数
+                uint64_t errors = 0;
+                /// 正在转发的连接数
+                uint64_t active = 0;
+                /// 客户端到上游的总字节数
+                uint64_t clientToUpstream = 0;
+                /// 上游到客户端的总字节数
+                uint64_t upstreamToClient = 0;
+
+                std::string toString() const;
+            };
+
+            /**
+             * @brief 构造函数, 上游取自配置 tcp_proxy.upstreams
+             */
+            TcpProxyServer(sylar::IOManager* worker = sylar::IOManager::GetThis(),
+                           sylar::IOManager* accept_worker = sylar::IOManager::GetThis());
+            TcpProxyServer(const std::vector<sylar::IOManager*>& workers,
+                           sylar::IOManager* accept_worker = sylar::IOManager::GetThis());
+
+            /**
+             * @brief 添加上游, 需在start之前调用
+             */
+            void addUpstream(Address::ptr addr);
+
+            /**
+             * @brief 设置上游, 需在start之前调用
+             */
+            void setUpstreams(const std::vector<Address::ptr>& addrs) { m_upstreams = addrs;}
+            const std::vector<Address::ptr>& getUpstreams() const { return m_upstreams;}
+
+            /**
+             * @brief 设置连接上游的超时(毫秒)
+             */
+            void setConnectTimeout(uint64_t v) { m_connectTimeout = v;}
+            uint64_t getConnectTimeout() const { return m_connectTimeout;}
+
+            /**
+             * @brief 启动, 没有设置上游时解析配置 tcp_proxy.upstreams
+             * @details 转发时写已关闭的连接会产生SIGPIPE, 启动时忽略该信号(已设置了处理函数的不覆盖)
+             */
+            virtual bool start() override;
+
+            /**
+             * @brief 获取转发统计
+             */
+            RelayStats getRelayStats() const;
+        protected:
+            virtual void handleClient(Socket::ptr client) override;
+
+            /**
+             * @brief 转发结束, 两个socket都已关闭
+             * @details 可重写以记录每个连接的流量
+             */
+            virtual void onRelayClose(Relay::ptr relay);
+        private:
+            /**
+             * @brief 按轮询顺序连接上游, 失败时尝试下一个
+             * @return 全部失败返回nullptr
+             */
+            Socket::ptr connectUpstream();
+
+            /**
+             * @brief 单向转发, 直到in读到EOF或出错
+             * @param[out] counter 本连接该方向转发的字节数
+             * @param[out] total 所有连接该方向转发的字节数
+             * @return 读到EOF返回true, 出错返回false
+             */
+            bool pump(Relay::ptr relay, Socket::ptr in, Socket::ptr out
+                      ,std::atomic<uint64_t>& counter, std::atomic<uint64_t>& total);
+        private:
+            std::vector<Address::ptr> m_upstreams;
+            /// 轮询位置
+            std::atomic<uint32_t> m_next = {0};
+            uint64_t m_connectTimeout;
+            /// 管道容量, 0表示系统默认
+            uint32_t m_pipeSize;
+            std::atomic<uint64_t> m_relays = {0};
+            std::atomic<uint64_t> m_connectFailures = {0};
+            std::atomic<uint64_t> m_errors = {0};
+            std::atomic<uint64_t> m_active = {0};
+            std::atomic<uint64_t> m_clientToUpstream = {0};
+            std::atomic<uint64_t> m_upstreamToClient = {0};
+    };
+}
+
+#endif
@@ -1,22 +1,170 @@
 #include "tcp_server.h"
 #include "config.h"
 #include "log.h"
+#include "util.h"
+#include "macro.h"
+#include "hot_restart.h"
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <cmath>
 namespace sylar {
 
     static sylar::ConfigVar<uint64_t>::ptr g_tcp_server_read_timeout =
         sylar::Config::Lookup("tcp_server.read_timeout", (uint64_t)(60 * 1000 *2),
         "tcp server read timeout");
 
+    static sylar::ConfigVar<uint64_t>::ptr g_tcp_server_idle_tick =
+        sylar::Config::Lookup("tcp_server.idle_tick", (uint64_t)1000,
+        "tcp server idle timing wheel granularity in ms");
+
+    static sylar::ConfigVar<uint64_t>::ptr g_tcp_server_drain_timeout =
+        sylar::Config::Lookup("tcp_server.drain_timeout", (uint64_t)(30 * 1000),
+        "tcp server drain timeout");
+
+    static sylar::ConfigVar<uint32_t>::ptr g_tcp_server_acceptors =
+        sylar::Config::Lookup("tcp_server.acceptors", (uint32_t)1,
+        "tcp server accept fibers (SO_REUSEPORT sockets) per address");
+
+    static sylar::ConfigVar<uint32_t>::ptr g_tcp_server_accept_batch =
+        sylar::Config::Lookup("tcp_server.accept_batch", (uint32_t)64,
+        "tcp server max connections accepted per readiness event");
+
+    static sylar::ConfigVar<std::string>::ptr g_tcp_server_balance =
+        sylar::Config::Lookup("tcp_server.balance", std::string("round_robin"),
+        "tcp server worker balance: round_robin, least_connections");
+
+    static sylar::ConfigVar<uint32_t>::ptr g_tcp_server_max_connections =
+        sylar::Config::Lookup("tcp_server.max_connections", (uint32_t)0,
+        "tcp server max connections, 0 means unlimited");
+
+    static sylar::ConfigVar<uint32_t>::ptr g_tcp_server_max_connections_per_ip =
+        sylar::Config::Lookup("tcp_server.max_connections_per_ip", (uint32_t)0,
+        "tcp server max connections per source ip, 0 means unlimited");
+
+    static sylar::ConfigVar<uint64_t>::ptr g_tcp_server_codel_target =
+        sylar::Config::Lookup("tcp_server.codel.target", (uint64_t)0,
+        "tcp server target scheduling delay in ms before shedding, 0 disables");
+
+    static sylar::ConfigVar<uint64_t>::ptr g_tcp_server_codel_interval =
+        sylar::Config::Lookup("tcp_server.codel.interval", (uint64_t)100,
+        "tcp server codel interval in ms");
+
     static sylar::Logger::ptr g_logger = __LOG_NAME("system");
+
+    static TcpServer::Balance BalanceFromString(const std::string& v) {
+        if(v == "least_connections" || v == "least_conn") {
+            return TcpServer::LEAST_CONNECTIONS;
+        }
+        if(v != "round_robin") {
+            __LOG_WARN(g_logger) << "invalid tcp_server.balance=" << v
+                << ", use round_robin";
+        }
+        return TcpServer::ROUND_ROBIN;
+    }
+
     TcpServer::TcpServer(sylar::IOManager* worker, sylar::IOManager* accept_worker) 
-        :m_worker(worker)
-        ,m_acceptWorker(accept_worker)
+        :TcpServer(std::vector<sylar::IOManager*>{worker}, accept_worker) {
+    }
+
+    TcpServer::TcpServer(const std::vector<sylar::IOManager*>& workers, sylar::IOManager* accept_worker)
+        :m_acceptWorker(accept_worker)
+        ,m_acceptors(std::max(g_tcp_server_acceptors->getValue(), (uint32_t)1))
+        ,m_acceptBatch(std::max(g_tcp_server_accept_batch->getValue(), (uint32_t)1))
+        ,m_balance(BalanceFromString(g_tcp_server_balance->getValue()))
         ,m_readTimeout(g_tcp_server_read_timeout->getValue())
         ,m_name("sylar/1.0.0")
-        ,m_isStop(true){
+        ,m_isStop(true)
+        ,m_maxConnections(g_tcp_server_max_connections->getValue())
+        ,m_maxPerIp(g_tcp_server_max_connections_per_ip->getValue())
+        ,m_idleTick(std::max(g_tcp_server_idle_tick->getValue(), (uint64_t)1)) {
+        setWorkers(workers);
+        setQueueDelayTarget(g_tcp_server_codel_target->getValue()
+                    ,g_tcp_server_codel_interval->getValue());
+    }
+
+    void TcpServer::setQueueDelayTarget(uint64_t target_ms, uint64_t interval_ms) {
+        MutexType::Lock lock(m_mutex);
+        m_codel = CoDel();
+        m_codel.target = target_ms * 1000;
+        m_codel.interval = std::max(interval_ms, (uint64_t)1) * 1000;
+    }
+
+    uint64_t TcpServer::CoDel::controlLaw(uint64_t t) const {
+        return t + (uint64_t)(interval / std::sqrt((double)count));
+    }
+
+    bool TcpServer::CoDel::shouldDrop(uint64_t now, uint64_t sojourn) {
+        bool ok_to_drop = false;
+        if(sojourn < target) {
+            firstAboveTime = 0;
+        } else if(firstAboveTime == 0) {
+            firstAboveTime = now + interval;
+        } else if(now >= firstAboveTime) {
+            ok_to_drop = true;
+        }
+
+        if(dropping) {
+            if(!ok_to_drop) {
+                dropping = false;
+                return false;
+            }
+            if(now >= dropNext) {
+                ++count;
+                dropNext = controlLaw(dropNext);
+                return true;
+            }
+            return false;
+        }
+        if(ok_to_drop) {
+            dropping = true;
+            // 刚退出丢弃状态不久, 沿用接近上次的丢弃频率
+            if(count > 2 && now - dropNext < 8 * interval) {
+                count -= 2;
+            } else {
+                count = 1;
+            }
+            dropNext = controlLaw(now);
+            return true;
+        }
+        return false;
+    }
 
+    std::string TcpServer::Stats::toString() const {
+        std::stringstream ss;
+        ss << "accepted=" << accepted
+           << " active=" << active
+           << " shed_max_connections=" << shedMaxConnections
+           << " shed_per_ip=" << shedPerIp
+           << " shed_queue_delay=" << shedQueueDelay
+           << " idle_closed=" << idleClosed;
+        return ss.str();
     }
+
+    TcpServer::Stats TcpServer::getStats() {
+        Stats stats;
+        stats.accepted = m_accepted;
+        stats.shedMaxConnections = m_shedMaxConnections;
+        stats.shedPerIp = m_shedPerIp;
+        stats.shedQueueDelay = m_shedQueueDelay;
+        stats.idleClosed = m_idleClosed;
+        stats.active = getClientCount();
+        return stats;
+    }
+
+    void TcpServer::setWorkers(const std::vector<sylar::IOManager*>& workers) {
+        __ASSERT(!workers.empty());
+        MutexType::Lock lock(m_mutex);
+        __ASSERT(m_clients.empty());
+        m_workers = workers;
+        m_workerClients.assign(m_workers.size(), 0);
+        m_nextWorker = 0;
+    }
+
     TcpServer::~TcpServer() {
+        if(m_idleTimer) {
+            m_idleTimer->cancel();
+        }
         for(auto& i : m_socks) {
             i->close();
         }
@@ -31,22 +179,54 @@ namespace sylar {
     }
     bool TcpServer::bind(const std::vector<Address::ptr>& addrs, std::vector<Address::ptr>& fails) {
         for(auto& addr : addrs) {
-            Socket::ptr sock = Socket::CreateTCP(addr);
-            if(!sock->bind(addr)) {
-                __LOG_ERROR(g_logger) << "bind fail errno="
-                    << errno <<" errstr=" << strerror(errno)
-                    << " addr=[" << addr->toString() << "]";
-                fails.push_back(addr);
-                continue;
+            uint32_t count = 1;
+            if(m_acceptors > 1 && (addr->getFamily() == AF_INET
+                        || addr->getFamily() == AF_INET6)) {
+                count = m_acceptors;
             }
-            if(!sock->listen()) {
-                __LOG_ERROR(g_logger) << "listen fail errno="
-                    << errno <<" errstr=" << strerror(errno)
-                    << " addr=[" << addr->toString() << "]";
-                fails.push_back(addr);
-                continue;
+            for(uint32_t i = 0; i < count; ++i) {
+                Socket::ptr sock;
+                if(m_sslCtx) {
+                    SSLSocket::ptr ssock = SSLSocket::CreateTCP(addr);
+                    ssock->setContext(m_sslCtx);
+                    sock = ssock;
+                } else {
+                    sock = Socket::CreateTCP(addr);
+                }
+                // 热重启时直接使用上一代进程交接过来的监听socket
+                int fd = HotRestartMgr::GetInstance()->take(addr);
+                if(fd != -1) {
+                    if(!sock->adoptListener(fd)) {
+                        ::close(fd);
+                        fails.push_back(addr);
+                        break;
+                    }
+                    m_socks.push_back(sock);
+                    continue;
+                }
+                if(count > 1 && !sock->setReusePort()) {
+                    __LOG_ERROR(g_logger) << "set SO_REUSEPORT fail errno="
+                        << errno << " errstr=" << strerror(errno)
+                        << " addr=[" << addr->toString() << "]";
+                    fails.push_back(addr);
+                    break;
+                }
+                if(!sock->bind(addr)) {
+                    __LOG_ERROR(g_logger) << "bind fail errno="
+                        << errno <<" errstr=" << strerror(errno)
+                        << " addr=[" << addr->toString() << "]";
+                    fails.push_back(addr);
+                    break;
+                }
+                if(!sock->listen()) {
+                    __LOG_ERROR(g_logger) << "listen fail errno="
+                        << errno <<" errstr=" << strerror(errno)
+                        << " addr=[" << addr->toString() << "]";
+                    fails.push_back(addr);
+                    break;
+                }
+                m_socks.push_back(sock);
             }
-            m_socks.push_back(sock);
         }
         if(!fails.empty()) {
             m_socks.clear();
@@ -57,16 +237,58 @@ namespace sylar {
         }
         return true;
     }
+    bool TcpServer::loadCertificates(const std::string& cert_file, const std::string& key_file) {
+        m_sslCtx = SSLSocket::CreateServerContext(cert_file, key_file);
+        return m_sslCtx != nullptr;
+    }
+
+    /// accept因fd或内存耗尽失败后的退避时间
+    static const uint64_t s_accept_backoff_us = 100 * 1000;
+
     void TcpServer::startAccept(Socket::ptr sock) {
+        std::vector<Socket::ptr> clients;
+        std::vector<std::vector<std::function<void()> > > tasks(m_workers.size());
+        auto self = shared_from_this();
         while(!m_isStop) {
-            Socket::ptr client = sock->accept();
-            if(client) {
-                m_worker->schedule(std::bind(&TcpServer::handleClient
-                                ,shared_from_this(), client));
+            clients.clear();
+            size_t n = sock->acceptBatch(clients, m_acceptBatch);
+            if(n == 0) {
+                int err = errno;
+                if(m_isStop || !sock->isValid()) {
+                    // stop()关闭了监听socket, 得到的EBADF是正常退出
+                    break;
+                }
+                __LOG_ERROR(g_logger) << "accept errno=" << err
+                    << " errstr=" << strerror(err);
+                if(err == EBADF) {
+                    break;
+                }
+                if(err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+                    // accept4在检查队列之前分配fd, 资源耗尽时立即重试只会空转刷日志;
+                    // 在协程中usleep只挂起当前协程
+                    usleep(s_accept_backoff_us);
+                }
+                continue;
+            }
+            m_accepted += n;
+            uint64_t now = GetCurrentUS();
+            for(auto& client : clients) {
+                size_t idx = 0;
+                if(!addClient(client, idx)) {
+                    client->close();
+                    continue;
+                }
+                tasks[idx].push_back(std::bind(&TcpServer::runClient, self, client, now));
+            }
+            for(size_t i = 0; i < tasks.size(); ++i) {
+                if(!tasks[i].empty()) {
+                    m_workers[i]->schedule(tasks[i].begin(), tasks[i].end());
+                    tasks[i].clear();
+                }
             }
-            else {
-                __LOG_ERROR(g_logger) << "accept errno=" << errno
-                    << " errstr=" << strerror(errno);
+            if(n >= m_acceptBatch) {
+                // 额度用满, 队列中可能还有连接, 先让同线程的其他协程执行
+                Fiber::YieldReady();
             }
         }
     }
@@ -75,6 +297,18 @@ namespace sylar {
             return true;
         }
         m_isStop = false;
+        if(m_readTimeout && !m_idleTimer) {
+            MutexType::Lock lock(m_mutex);
+            // 到期时间最多在一个超时之后, 多留一格给节拍的延迟
+            m_wheel.resize(m_readTimeout / m_idleTick + 2);
+            m_wheelTick = GetCoarseMS() / m_idleTick;
+            for(auto& i : m_clients) {
+                wheelAddNoLock(i.first, i.second, i.first->getLastActive() + m_readTimeout);
+            }
+            lock.unlock();
+            m_idleTimer = m_acceptWorker->addConditionTimer(m_idleTick
+                        ,std::bind(&TcpServer::onIdleTick, this), shared_from_this(), true);
+        }
         for(auto& sock : m_socks) {
             m_acceptWorker->schedule(std::bind(&TcpServer::startAccept
                             ,shared_from_this(), sock));
@@ -92,6 +326,198 @@ namespace sylar {
             m_socks.clear();
         });
     }
+    /**
+     * @brief 来源IP的原始字节, 用作单IP连接计数的key
+     */
+    static std::string SourceKey(Socket::ptr client) {
+        Address::ptr addr = client->getRemoteAddress();
+        if(!addr) {
+            return "";
+        }
+        const sockaddr* sa = addr->getAddr();
+        if(sa->sa_family == AF_INET) {
+            const sockaddr_in* sin = (const sockaddr_in*)sa;
+            return std::string((const char*)&sin->sin_addr, sizeof(sin->sin_addr));
+        }
+        if(sa->sa_family == AF_INET6) {
+            const sockaddr_in6* sin6 = (const sockaddr_in6*)sa;
+            return std::string((const char*)&sin6->sin6_addr, sizeof(sin6->sin6_addr));
+        }
+        return "";
+    }
+
+    bool TcpServer::addClient(Socket::ptr client, size_t& worker) {
+        std::string source;
+        if(m_maxPerIp) {
+            source = SourceKey(client);
+        }
+
+        MutexType::Lock lock(m_mutex);
+        if(m_maxConnections && m_clients.size() >= m_maxConnections) {
+            ++m_shedMaxConnections;
+            return false;
+        }
+        if(!source.empty()) {
+            uint32_t& count = m_sourceClients[source];
+            if(count >= m_maxPerIp) {
+                ++m_shedPerIp;
+                return false;
+            }
+            ++count;
+        }
+
+        size_t idx = 0;
+        if(m_balance == LEAST_CONNECTIONS) {
+            // 从轮询位置开始找, 连接数相同时也能分散到各worker
+            size_t n = m_workers.size();
+            size_t start = m_nextWorker++ % n;
+            idx = start;
+            for(size_t i = 1; i < n; ++i) {
+                size_t j = (start + i) % n;
+                if(m_workerClients[j] < m_workerClients[idx]) {
+                    idx = j;
+                }
+            }
+        } else {
+            idx = m_nextWorker++ % m_workers.size();
+        }
+        ++m_workerClients[idx];
+        ClientInfo& info = m_clients[client];
+        info.worker = idx;
+        info.source.swap(source);
+        if(!m_wheel.empty()) {
+            wheelAddNoLock(client, info, client->getLastActive() + m_readTimeout);
+        }
+        worker = idx;
+        return true;
+    }
+
+    void TcpServer::removeClient(Socket::ptr client) {
+        MutexType::Lock lock(m_mutex);
+        auto it = m_clients.find(client);
+        if(it == m_clients.end()) {
+            return;
+        }
+        --m_workerClients[it->second.worker];
+        if(it->second.inWheel) {
+            m_wheel[it->second.slot].erase(it->second.pos);
+        }
+        if(!it->second.source.empty()) {
+            auto sit = m_sourceClients.find(it->second.source);
+            if(sit != m_sourceClients.end() && --sit->second == 0) {
+                m_sourceClients.erase(sit);
+            }
+        }
+        m_clients.erase(it);
+    }
+
+    void TcpServer::wheelAddNoLock(Socket::ptr client, ClientInfo& info, uint64_t deadline) {
+        // 向上取整: 检查到这一格时一定已经到期
+        uint64_t tick = (deadline + m_idleTick - 1) / m_idleTick;
+        tick = std::max(tick, m_wheelTick);
+        // 节拍落后太多时提前检查, 届时按最新活动时间重新挂入
+        tick = std::min(tick, m_wheelTick + m_wheel.size() - 1);
+        info.slot = tick % m_wheel.size();
+        info.pos = m_wheel[info.slot].insert(m_wheel[info.slot].end(), client);
+        info.inWheel = true;
+    }
+
+    void TcpServer::onIdleTick() {
+        uint64_t now = GetCoarseMS();
+        uint64_t cur = now / m_idleTick;
+        std::vector<std::pair<Socket::ptr, size_t> > expired;
+        std::list<Socket::ptr> due;
+        MutexType::Lock lock(m_mutex);
+        for(size_t n = 0; m_wheelTick <= cur && n < m_wheel.size(); ++n) {
+            due.splice(due.end(), m_wheel[m_wheelTick % m_wheel.size()]);
+            ++m_wheelTick;
+            for(auto& client : due) {
+                auto it = m_clients.find(client);
+                if(it == m_clients.end()) {
+                    continue;
+                }
+                uint64_t deadline = client->getLastActive() + m_readTimeout;
+                if(now >= deadline) {
+                    it->second.inWheel = false;
+                    expired.push_back(std::make_pair(client, it->second.worker));
+                } else {
+                    wheelAddNoLock(client, it->second, deadline);
+                }
+            }
+            due.clear();
+        }
+        // 格数有限, 落后超过一圈时剩下的节拍已经在上面的一圈中检查过
+        m_wheelTick = std::max(m_wheelTick, cur + 1);
+        lock.unlock();
+
+        for(auto& i : expired) {
+            // 处理协程可能同时关闭连接, 由Socket保证不会shutdown复用了该fd号的新连接
+            i.first->shutdown(m_workers[i.second]);
+        }
+        if(!expired.empty()) {
+            m_idleClosed += expired.size();
+            __LOG_DEBUG(g_logger) << "server " << m_name << " close "
+                << expired.size() << " idle clients";
+        }
+    }
+
+    void TcpServer::runClient(Socket::ptr client, uint64_t enqueue_us) {
+        bool drop = false;
+        {
+            // m_codel可能被setQueueDelayTarget同时修改, target也要在锁内读取
+            MutexType::Lock lock(m_mutex);
+            if(m_codel.target) {
+                uint64_t now = GetCurrentUS();
+                drop = m_codel.shouldDrop(now, now > enqueue_us ? now - enqueue_us : 0);
+            }
+        }
+        if(drop) {
+            ++m_shedQueueDelay;
+            client->close();
+        } else {
+            handleClient(client);
+        }
+        removeClient(client);
+    }
+
+    size_t TcpServer::getClientCount() {
+        MutexType::Lock lock(m_mutex);
+        return m_clients.size();
+    }
+
+    size_t TcpServer::drain() {
+        return drain(g_tcp_server_drain_timeout->getValue());
+    }
+
+    size_t TcpServer::drain(uint64_t timeout_ms) {
+        stop();
+        // 连接结束时不会主动通知, 按固定间隔检查; 在协程中usleep只挂起当前协程
+        static const uint64_t s_interval_us = 10 * 1000;
+        uint64_t deadline = GetCurrentMS() + timeout_ms;
+        while(getClientCount() > 0 && GetCurrentMS() < deadline) {
+            usleep(s_interval_us);
+        }
+
+        std::map<Socket::ptr, ClientInfo> clients;
+        {
+            MutexType::Lock lock(m_mutex);
+            clients = m_clients;
+        }
+        for(auto& i : clients) {
+            // 处理协程可能同时关闭连接, 由Socket保证不会shutdown复用了该fd号的新连接
+            i.first->shutdown(m_workers[i.second.worker]);
+        }
+        if(!clients.empty()) {
+            __LOG_WARN(g_logger) << "server " << m_name << " drain timeout, cancel "
+                << clients.size() << " clients";
+        }
+        if(m_idleTimer) {
+            m_idleTimer->cancel();
+            m_idleTimer.reset();
+        }
+        return clients.size();
+    }
+
     void TcpServer::handleClient(Socket::ptr client) {
         __LOG_INFO(g_logger) << "handleClient: " << *client;
     }
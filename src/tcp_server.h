@@ -3,37 +3,298 @@
 
 #include <memory>
 #include <functional>
+#include <map>
+#include <list>
+#include <vector>
+#include <atomic>
 #include "iomanager.h"
 #include "socket.h"
+#include "mutex.h"
 namespace sylar {
     class TcpServer : public std::enable_shared_from_this<TcpServer> {
         public:
             typedef std::shared_ptr<TcpServer> ptr;
+            typedef Mutex MutexType;
+
+            /**
+             * @brief 新连接在多个worker之间的分配策略
+             */
+            enum Balance {
+                /// 轮询
+                ROUND_ROBIN = 0,
+                /// 当前连接数最少的worker
+                LEAST_CONNECTIONS = 1
+            };
+
+            /**
+             * @brief 连接统计
+             */
+            struct Stats {
+                /// accept到的连接数(含被拒绝的)
+                uint64_t accepted = 0;
+                /// 超过最大连接数被拒绝的连接数
+                uint64_t shedMaxConnections = 0;
+                /// 超过单个来源IP连接数被拒绝的连接数
+                uint64_t shedPerIp = 0;
+                /// 调度延迟持续超标被丢弃的连接数
+                uint64_t shedQueueDelay = 0;
+                /// 空闲超时被关闭的连接数
+                uint64_t idleClosed = 0;
+                /// 当前连接数
+                uint64_t active = 0;
+
+                std::string toString() const;
+            };
+
             TcpServer(sylar::IOManager* worker = sylar::IOManager::GetThis(),
                       sylar::IOManager* accept_worker = sylar::IOManager::GetThis());
+
+            /**
+             * @brief 使用多个worker处理连接
+             * @param[in] workers 处理连接的IOManager, 不能为空
+             * @param[in] accept_worker 执行accept的IOManager
+             */
+            TcpServer(const std::vector<sylar::IOManager*>& workers,
+                      sylar::IOManager* accept_worker = sylar::IOManager::GetThis());
             virtual ~TcpServer();
 
+            /**
+             * @brief 绑定并监听地址
+             * @details 从上一代进程继承了该地址的监听socket(见HotRestart)时直接接管, 不再bind/listen
+             */
             virtual bool bind(sylar::Address::ptr addr);
             virtual bool bind(const std::vector<Address::ptr>& addrs
                                 , std::vector<Address::ptr>& fails);
             std::string getName() const { return m_name;}
+
+            /**
+             * @brief 获取监听socket
+             */
+            std::vector<Socket::ptr> getSocks() const { return m_socks;}
+
+            /**
+             * @brief 替换监听socket, 需在start之前调用
+             * @details 用于多进程时每个worker进程只保留分给自己的socket
+             */
+            void setSocks(const std::vector<Socket::ptr>& socks) { m_socks = socks;}
+
+            /**
+             * @brief 设置空闲超时(毫秒), 0表示不限制, 需在start之前调用
+             * @details 连接上超过该时间没有任何收发即被关闭。不使用逐次IO的超时定时器:
+             *          Socket在每次收发时记录时间戳, 连接按到期时间挂在一个粗粒度的时间轮上,
+             *          每个节拍(配置 tcp_server.idle_tick)检查一格, 期间有过活动的连接
+             *          按新的到期时间重新挂入, 到期的连接成批shutdown并唤醒其上的等待者。
+             *          实际关闭时间在超时之后的一个节拍内
+             */
             void setReadTimeout(uint64_t v) { m_readTimeout = v;}
+            uint64_t getReadTimeout() const { return m_readTimeout;}
             void setName(const std::string& v) { m_name = v;}
 
+            /**
+             * @brief 设置处理连接的worker, 需在start之前调用
+             */
+            void setWorkers(const std::vector<sylar::IOManager*>& workers);
+            const std::vector<sylar::IOManager*>& getWorkers() const { return m_workers;}
+
+            /**
+             * @brief 设置执行accept和空闲检查的IOManager, 需在start之前调用
+             */
+            void setAcceptWorker(sylar::IOManager* v) { m_acceptWorker = v;}
+            sylar::IOManager* getAcceptWorker() const { return m_acceptWorker;}
+
+            /**
+             * @brief 设置每个地址的accept协程数, 需在bind之前调用
+             * @details 大于1时对IP地址以SO_REUSEPORT创建同样数量的监听socket, 每个socket
+             *          有独立的accept队列和accept协程, 由内核分配新连接。
+             *          同一fd上只能有一个等待读事件的协程, 因此不在同一个socket上并发accept;
+             *          Unix域地址不支持SO_REUSEPORT, 始终只有一个
+             */
+            void setAcceptors(uint32_t v) { m_acceptors = v ? v : 1;}
+            uint32_t getAcceptors() const { return m_acceptors;}
+
+            /**
+             * @brief 加载证书和私钥, 之后bind的地址使用TLS, 需在bind之前调用
+             * @details 所有监听socket共享一个SSL_CTX, 会话缓存和session ticket密钥跨acceptor有效
+             */
+            bool loadCertificates(const std::string& cert_file, const std::string& key_file);
+
+            /**
+             * @brief 是否使用TLS
+             */
+            bool isSSL() const { return m_sslCtx != nullptr;}
+
+            /**
+             * @brief 设置每次可读事件最多接收的连接数, 需在start之前调用
+             * @details 一批连接按worker分组, 每个worker只加一次锁入队;
+             *          用满额度后accept协程让出执行权, 避免占满accept线程
+             */
+            void setAcceptBatch(uint32_t v) { m_acceptBatch = v ? v : 1;}
+            uint32_t getAcceptBatch() const { return m_acceptBatch;}
+
+            /**
+             * @brief 设置最大连接数, 0表示不限制
+             * @details 达到上限后新连接被直接关闭
+             */
+            void setMaxConnections(uint32_t v) { m_maxConnections = v;}
+            uint32_t getMaxConnections() const { return m_maxConnections;}
+
+            /**
+             * @brief 设置单个来源IP的最大连接数, 0表示不限制
+             */
+            void setMaxConnectionsPerIp(uint32_t v) { m_maxPerIp = v;}
+            uint32_t getMaxConnectionsPerIp() const { return m_maxPerIp;}
+
+            /**
+             * @brief 设置基于调度延迟的丢弃(CoDel)
+             * @details 调度延迟为连接被分配到worker到handleClient开始执行的时间。
+             *          延迟在interval内持续高于target时进入丢弃状态, 按CoDel控制律
+             *          (间隔interval/sqrt(count))丢弃新开始处理的连接, 延迟回落后退出
+             * @param[in] target_ms 目标延迟(毫秒), 0表示关闭
+             * @param[in] interval_ms 观察窗口(毫秒)
+             */
+            void setQueueDelayTarget(uint64_t target_ms, uint64_t interval_ms);
+
+            /**
+             * @brief 获取连接统计
+             */
+            Stats getStats();
+
+            void setBalance(Balance v) { m_balance = v;}
+            Balance getBalance() const { return m_balance;}
+
             bool isStop() const { return m_isStop;}
             virtual bool start();
             virtual void stop();
 
+            /**
+             * @brief 优雅停止: 停止accept, 等待正在处理的连接结束
+             * @details 超过timeout_ms仍未结束的连接被shutdown并通过IOManager::cancelAll
+             *          唤醒其上等待的协程, 之后不再等待。
+             *          在协程中调用时只挂起当前协程。结束时取消空闲检查定时器, 不再阻止IOManager退出
+             * @param[in] timeout_ms 等待连接结束的最长时间(毫秒)
+             * @return 被强制取消的连接数
+             */
+            size_t drain(uint64_t timeout_ms);
+
+            /**
+             * @brief 使用配置 tcp_server.drain_timeout 作为超时的优雅停止
+             */
+            size_t drain();
+
+            /**
+             * @brief 当前正在处理的连接数
+             */
+            size_t getClientCount();
+
         protected:
             virtual void handleClient(Socket::ptr client);
             virtual void startAccept(Socket::ptr sock);
+        private:
+            /**
+             * @brief 已登记的连接
+             */
+            struct ClientInfo {
+                /// 所在worker下标
+                size_t worker = 0;
+                /// 来源IP(地址的原始字节), Unix域为空
+                std::string source;
+                /// 是否挂在空闲时间轮上
+                bool inWheel = false;
+                /// 所在时间轮的格
+                size_t slot = 0;
+                /// 在该格中的位置
+                std::list<Socket::ptr>::iterator pos;
+            };
+
+            /**
+             * @brief CoDel丢弃控制, 在连接开始处理时按调度延迟判断
+             */
+            struct CoDel {
+                /// 目标延迟(微秒), 0表示关闭
+                uint64_t target = 0;
+                /// 观察窗口(微秒)
+                uint64_t interval = 0;
+                /// 延迟持续超标到此时刻后允许丢弃, 0表示延迟未超标
+                uint64_t firstAboveTime = 0;
+                /// 下一次丢弃的时刻
+                uint64_t dropNext = 0;
+                /// 本轮丢弃状态中的丢弃次数
+                uint32_t count = 0;
+                /// 是否处于丢弃状态
+                bool dropping = false;
+
+                /**
+                 * @param[in] now 当前时间(微秒)
+                 * @param[in] sojourn 调度延迟(微秒)
+                 * @return 是否丢弃该连接
+                 */
+                bool shouldDrop(uint64_t now, uint64_t sojourn);
+                uint64_t controlLaw(uint64_t t) const;
+            };
+
+            /**
+             * @brief 准入检查, 通过后按分配策略为新连接选择worker并登记连接
+             * @param[out] worker worker下标
+             * @return 是否接受该连接
+             */
+            bool addClient(Socket::ptr client, size_t& worker);
+
+            /**
+             * @brief 注销连接
+             */
+            void removeClient(Socket::ptr client);
+
+            /**
+             * @brief 执行handleClient, 返回后注销; 调度延迟超标时直接关闭连接
+             * @param[in] enqueue_us 分配到worker的时间
+             */
+            void runClient(Socket::ptr client, uint64_t enqueue_us);
+
+            /**
+             * @brief 按到期时间把连接挂到时间轮上, 调用前需持有m_mutex
+             * @param[in] deadline 到期时间(GetCoarseMS)
+             */
+            void wheelAddNoLock(Socket::ptr client, ClientInfo& info, uint64_t deadline);
+
+            /**
+             * @brief 时间轮节拍: 检查到期的格, 关闭空闲超时的连接
+             */
+            void onIdleTick();
         private:
             std::vector<Socket::ptr> m_socks;
-            IOManager* m_worker;
+            std::vector<IOManager*> m_workers;
             IOManager* m_acceptWorker;
+            uint32_t m_acceptors;
+            uint32_t m_acceptBatch;
+            Balance m_balance;
             uint64_t m_readTimeout;
             std::string m_name;
-            bool m_isStop;
+            std::atomic<bool> m_isStop;
+            std::shared_ptr<SSL_CTX> m_sslCtx;
+            MutexType m_mutex;
+            /// 正在处理的连接
+            std::map<Socket::ptr, ClientInfo> m_clients;
+            /// 各来源IP的连接数
+            std::map<std::string, uint32_t> m_sourceClients;
+            uint32_t m_maxConnections;
+            uint32_t m_maxPerIp;
+            CoDel m_codel;
+            std::atomic<uint64_t> m_accepted = {0};
+            std::atomic<uint64_t> m_shedMaxConnections = {0};
+            std::atomic<uint64_t> m_shedPerIp = {0};
+            std::atomic<uint64_t> m_shedQueueDelay = {0};
+            /// 各worker正在处理的连接数
+            std::vector<size_t> m_workerClients;
+            /// 轮询位置
+            size_t m_nextWorker = 0;
+            /// 空闲时间轮, 第t个节拍到期的连接在第t % size格
+            std::vector<std::list<Socket::ptr> > m_wheel;
+            /// 下一个待检查的节拍
+            uint64_t m_wheelTick = 0;
+            /// 节拍长度(毫秒)
+            uint64_t m_idleTick;
+            Timer::ptr m_idleTimer;
+            std::atomic<uint64_t> m_idleClosed = {0};
     };
 }
 
@@ -24,13 +24,13 @@ bool Timer::Comparetor::operator()(const Timer::ptr& lhs
 }
 
 
-Timer::Timer(uint64_t ms, std::function<void()> cb,
+Timer::Timer(uint64_t us, std::function<void()> cb,
              bool recurring, TimerManager* manager)
     :m_recurring(recurring)
-    ,m_ms(ms)
+    ,m_us(us)
     ,m_cb(cb)
     ,m_manager(manager) {
-    m_next = sylar::GetCurrentMS() + m_ms;
+    m_next = sylar::GetCurrentUS() + m_us;
 }
 
 Timer::Timer(uint64_t next)
@@ -58,13 +58,18 @@ bool Timer::refresh() {
         return false;
     }
     m_manager->m_timers.erase(it);
-    m_next = sylar::GetCurrentMS() + m_ms;
+    m_next = sylar::GetCurrentUS() + m_us;
     m_manager->m_timers.insert(shared_from_this());
     return true;
 }
 
 bool Timer::reset(uint64_t ms, bool from_now) {
-    if(ms == m_ms && !from_now) {
+    return reset(std::chrono::microseconds(ms * 1000), from_now);
+}
+
+bool Timer::reset(std::chrono::microseconds us_duration, bool from_now) {
+    uint64_t us = us_duration.count();
+    if(us == m_us && !from_now) {
         return true;
     }
     TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
@@ -78,19 +83,19 @@ bool Timer::reset(uint64_t ms, bool from_now) {
     m_manager->m_timers.erase(it);
     uint64_t start = 0;
     if(from_now) {
-        start = sylar::GetCurrentMS();
+        start = sylar::GetCurrentUS();
     } else {
-        start = m_next - m_ms;
+        start = m_next - m_us;
     }
-    m_ms = ms;
-    m_next = start + m_ms;
+    m_us = us;
+    m_next = start + m_us;
     m_manager->addTimer(shared_from_this(), lock);
     return true;
 
 }
 
 TimerManager::TimerManager() {
-    m_previousTime = sylar::GetCurrentMS();
+    m_previousTime = sylar::GetCurrentUS();
 }
 
 TimerManager::~TimerManager() {
@@ -98,7 +103,12 @@ TimerManager::~TimerManager() {
 
 Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb
                                   ,bool recurring) {
-    Timer::ptr timer(new Timer(ms, cb, recurring, this));
+    return addTimer(std::chrono::microseconds(ms * 1000), cb, recurring);
+}
+
+Timer::ptr TimerManager::addTimer(std::chrono::microseconds us, std::function<void()> cb
+                                  ,bool recurring) {
+    Timer::ptr timer(new Timer(us.count(), cb, recurring, this));
     RWMutexType::WriteLock lock(m_mutex);
     addTimer(timer, lock);
     return timer;
@@ -117,7 +127,22 @@ Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb
     return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
 }
 
+Timer::ptr TimerManager::addConditionTimer(std::chrono::microseconds us, std::function<void()> cb
+                                    ,std::weak_ptr<void> weak_cond
+                                    ,bool recurring) {
+    return addTimer(us, std::bind(&OnTimer, weak_cond, cb), recurring);
+}
+
 uint64_t TimerManager::getNextTimer() {
+    uint64_t us = getNextTimerUS();
+    if(us == ~0ull) {
+        return ~0ull;
+    }
+    // 向上取整, 避免epoll_wait在定时器到期前提前返回而空转
+    return (us + 999) / 1000;
+}
+
+uint64_t TimerManager::getNextTimerUS() {
     RWMutexType::ReadLock lock(m_mutex);
     m_tickled = false;
     if(m_timers.empty()) {
@@ -125,16 +150,16 @@ uint64_t TimerManager::getNextTimer() {
     }
 
     const Timer::ptr& next = *m_timers.begin();
-    uint64_t now_ms = sylar::GetCurrentMS();
-    if(now_ms >= next->m_next) {
+    uint64_t now_us = sylar::GetCurrentUS();
+    if(now_us >= next->m_next) {
         return 0;
     } else {
-        return next->m_next - now_ms;
+        return next->m_next - now_us;
     }
 }
 
 void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
-    uint64_t now_ms = sylar::GetCurrentMS();
+    uint64_t now_us = sylar::GetCurrentUS();
     std::vector<Timer::ptr> expired;
     {
         RWMutexType::ReadLock lock(m_mutex);
@@ -146,14 +171,14 @@ void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
     if(m_timers.empty()) {
         return;
     }
-    bool rollover = detectClockRollover(now_ms);
-    if(!rollover && ((*m_timers.begin())->m_next > now_ms)) {
+    bool rollover = detectClockRollover(now_us);
+    if(!rollover && ((*m_timers.begin())->m_next > now_us)) {
         return;
     }
 
-    Timer::ptr now_timer(new Timer(now_ms));
+    Timer::ptr now_timer(new Timer(now_us));
     auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-    while(it != m_timers.end() && (*it)->m_next == now_ms) {
+    while(it != m_timers.end() && (*it)->m_next == now_us) {
         ++it;
     }
     expired.insert(expired.begin(), m_timers.begin(), it);
@@ -163,7 +188,7 @@ void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
     for(auto& timer : expired) {
         cbs.push_back(timer->m_cb);
         if(timer->m_recurring) {
-            timer->m_next = now_ms + timer->m_ms;
+            timer->m_next = now_us + timer->m_us;
             m_timers.insert(timer);
         } else {
             timer->m_cb = nullptr;
@@ -184,13 +209,13 @@ void TimerManager::addTimer(Timer::ptr timer, RWMutexType::WriteLock& lock) {
     }
 }
 
-bool TimerManager::detectClockRollover(uint64_t now_ms) {
+bool TimerManager::detectClockRollover(uint64_t now_us) {
     bool rollover = false;
-    if(now_ms < m_previousTime &&
-            now_ms < (m_previousTime - 60 * 60 * 1000)) {
+    if(now_us < m_previousTime &&
+            now_us < (m_previousTime - 60 * 60 * 1000 * 1000ull)) {
         rollover = true;
     }
-    m_previousTime = now_ms;
+    m_previousTime = now_us;
     return rollover;
 }
 
@@ -12,10 +12,23 @@
 #include <memory>
 #include <vector>
 #include <set>
+#include <chrono>
 #include "thread.h"
 
 namespace sylar {
 
+/**
+ * @brief 将任意精度的时间间隔转换为微秒(不足1微秒的部分向上取整)
+ */
+template<class Rep, class Period>
+std::chrono::microseconds ToMicroseconds(const std::chrono::duration<Rep, Period>& d) {
+    std::chrono::microseconds us = std::chrono::duration_cast<std::chrono::microseconds>(d);
+    if(us < d) {
+        ++us;
+    }
+    return us;
+}
+
 class TimerManager;
 /**
  * @brief 定时器
@@ -42,27 +55,42 @@ public:
      * @param[in] from_now 是否从当前时间开始计算
      */
     bool reset(uint64_t ms, bool from_now);
+
+    /**
+     * @brief 重置定时器时间
+     * @param[in] us 定时器执行间隔时间(微秒)
+     * @param[in] from_now 是否从当前时间开始计算
+     */
+    bool reset(std::chrono::microseconds us, bool from_now);
+
+    /**
+     * @brief 重置定时器时间(任意std::chrono精度)
+     */
+    template<class Rep, class Period>
+    bool reset(const std::chrono::duration<Rep, Period>& d, bool from_now) {
+        return reset(ToMicroseconds(d), from_now);
+    }
 private:
     /**
      * @brief 构造函数
-     * @param[in] ms 定时器执行间隔时间
+     * @param[in] us 定时器执行间隔时间(微秒)
      * @param[in] cb 回调函数
      * @param[in] recurring 是否循环
      * @param[in] manager 定时器管理器
      */
-    Timer(uint64_t ms, std::function<void()> cb,
+    Timer(uint64_t us, std::function<void()> cb,
           bool recurring, TimerManager* manager);
     /**
      * @brief 构造函数
-     * @param[in] next 执行的时间戳(毫秒)
+     * @param[in] next 执行的时间戳(微秒)
      */
     Timer(uint64_t next);
 private:
     /// 是否循环定时器
     bool m_recurring = false;
-    /// 执行周期
-    uint64_t m_ms = 0;
-    /// 精确的执行时间
+    /// 执行周期(微秒)
+    uint64_t m_us = 0;
+    /// 精确的执行时间(微秒)
     uint64_t m_next = 0;
     /// 回调函数
     std::function<void()> m_cb;
@@ -103,16 +131,34 @@ public:
 
     /**
      * @brief 添加定时器
-     * @param[in] ms 定时器执行间隔时间
+     * @param[in] ms 定时器执行间隔时间(毫秒)
      * @param[in] cb 定时器回调函数
      * @param[in] recurring 是否循环定时器
      */
     Timer::ptr addTimer(uint64_t ms, std::function<void()> cb
                         ,bool recurring = false);
 
+    /**
+     * @brief 添加定时器
+     * @param[in] us 定时器执行间隔时间(微秒)
+     * @param[in] cb 定时器回调函数
+     * @param[in] recurring 是否循环定时器
+     */
+    Timer::ptr addTimer(std::chrono::microseconds us, std::function<void()> cb
+                        ,bool recurring = false);
+
+    /**
+     * @brief 添加定时器(任意std::chrono精度, 不足1微秒向上取整)
+     */
+    template<class Rep, class Period>
+    Timer::ptr addTimer(const std::chrono::duration<Rep, Period>& d
+                        ,std::function<void()> cb, bool recurring = false) {
+        return addTimer(ToMicroseconds(d), cb, recurring);
+    }
+
     /**
      * @brief 添加条件定时器
-     * @param[in] ms 定时器执行间隔时间
+     * @param[in] ms 定时器执行间隔时间(毫秒)
      * @param[in] cb 定时器回调函数
      * @param[in] weak_cond 条件
      * @param[in] recurring 是否循环
@@ -122,10 +168,38 @@ public:
                         ,bool recurring = false);
 
     /**
-     * @brief 到最近一个定时器执行的时间间隔(毫秒)
+     * @brief 添加条件定时器
+     * @param[in] us 定时器执行间隔时间(微秒)
+     * @param[in] cb 定时器回调函数
+     * @param[in] weak_cond 条件
+     * @param[in] recurring 是否循环
+     */
+    Timer::ptr addConditionTimer(std::chrono::microseconds us, std::function<void()> cb
+                        ,std::weak_ptr<void> weak_cond
+                        ,bool recurring = false);
+
+    /**
+     * @brief 添加条件定时器(任意std::chrono精度, 不足1微秒向上取整)
+     */
+    template<class Rep, class Period>
+    Timer::ptr addConditionTimer(const std::chrono::duration<Rep, Period>& d
+                        ,std::function<void()> cb
+                        ,std::weak_ptr<void> weak_cond
+                        ,bool recurring = false) {
+        return addConditionTimer(ToMicroseconds(d), cb, weak_cond, recurring);
+    }
+
+    /**
+     * @brief 到最近一个定时器执行的时间间隔(毫秒, 向上取整)
      */
     uint64_t getNextTimer();
 
+    /**
+     * @brief 到最近一个定时器执行的时间间隔(微秒)
+     * @return 没有定时器时返回~0ull
+     */
+    uint64_t getNextTimerUS();
+
     /**
      * @brief 获取需要执行的定时器的回调函数列表
      * @param[out] cbs 回调函数数组
@@ -151,7 +225,7 @@ private:
     /**
      * @brief 检测服务器时间是否被调后了
      */
-    bool detectClockRollover(uint64_t now_ms);
+    bool detectClockRollover(uint64_t now_us);
 private:
     /// Mutex
     RWMutexType m_mutex;
@@ -159,7 +233,7 @@ private:
     std::set<Timer::ptr, Timer::Comparetor> m_timers;
     /// 是否触发onTimerInsertedAtFront
     bool m_tickled = false;
-    /// 上次执行时间
+    /// 上次执行时间(微秒)
     uint64_t m_previousTime = 0;
 };
 
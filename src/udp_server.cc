@@ -0,0 +1,249 @@
+#include "udp_server.h"
+#include "config.h"
+#include "log.h"
+#include "macro.h"
+#include <netinet/udp.h>
+#include <string.h>
+#include <sstream>
+
+namespace sylar {
+
+    static sylar::ConfigVar<uint32_t>::ptr g_udp_server_shards =
+        sylar::Config::Lookup("udp_server.shards", (uint32_t)0,
+        "udp server SO_REUSEPORT sockets per address, 0 means one per worker");
+
+    static sylar::ConfigVar<uint32_t>::ptr g_udp_server_batch =
+        sylar::Config::Lookup("udp_server.batch", (uint32_t)64,
+        "udp server max datagrams per recvmmsg");
+
+    static sylar::ConfigVar<uint32_t>::ptr g_udp_server_buffer_size =
+        sylar::Config::Lookup("udp_server.buffer_size", (uint32_t)2048,
+        "udp server receive buffer size per datagram");
+
+    static sylar::ConfigVar<bool>::ptr g_udp_server_gro =
+        sylar::Config::Lookup("udp_server.gro", false,
+        "udp server enable UDP GRO");
+
+    static sylar::Logger::ptr g_logger = __LOG_NAME("system");
+
+    /// GRO合并后的消息最大长度
+    static const uint32_t s_gro_buffer_size = 65536;
+
+    std::string UdpServer::Stats::toString() const {
+        std::stringstream ss;
+        ss << "batches=" << batches
+           << " datagrams=" << datagrams
+           << " bytes=" << bytes
+           << " truncated=" << truncated;
+        return ss.str();
+    }
+
+    UdpServer::UdpServer(sylar::IOManager* worker)
+        :UdpServer(std::vector<sylar::IOManager*>{worker}) {
+    }
+
+    UdpServer::UdpServer(const std::vector<sylar::IOManager*>& workers)
+        :m_workers(workers)
+        ,m_shards(g_udp_server_shards->getValue())
+        ,m_batch(std::max(g_udp_server_batch->getValue(), (uint32_t)1))
+        ,m_bufferSize(g_udp_server_buffer_size->getValue())
+        ,m_gro(g_udp_server_gro->getValue())
+        ,m_name("sylar/1.0.0")
+        ,m_isStop(true) {
+        __ASSERT(!m_workers.empty());
+    }
+
+    UdpServer::~UdpServer() {
+        for(auto& i : m_socks) {
+            i->close();
+        }
+        m_socks.clear();
+    }
+
+    bool UdpServer::bind(sylar::Address::ptr addr) {
+        std::vector<Address::ptr> addrs;
+        std::vector<Address::ptr> fails;
+        addrs.push_back(addr);
+        return bind(addrs, fails);
+    }
+
+    bool UdpServer::bind(const std::vector<Address::ptr>& addrs, std::vector<Address::ptr>& fails) {
+        uint32_t shards = m_shards ? m_shards : m_workers.size();
+        for(auto& addr : addrs) {
+            uint32_t count = 1;
+            if(shards > 1 && (addr->getFamily() == AF_INET
+                        || addr->getFamily() == AF_INET6)) {
+                count = shards;
+            }
+            for(uint32_t i = 0; i < count; ++i) {
+                Socket::ptr sock = Socket::CreateUDP(addr);
+                if(count > 1 && !sock->setReusePort()) {
+                    __LOG_ERROR(g_logger) << "set SO_REUSEPORT fail errno="
+                        << errno << " errstr=" << strerror(errno)
+                        << " addr=[" << addr->toString() << "]";
+                    fails.push_back(addr);
+                    break;
+                }
+                if(m_gro && addr->getFamily() != AF_UNIX && !sock->setGro(true)) {
+                    __LOG_WARN(g_logger) << "set UDP_GRO fail errno="
+                        << errno << " errstr=" << strerror(errno)
+                        << " addr=[" << addr->toString() << "]";
+                }
+                if(!sock->bind(addr)) {
+                    __LOG_ERROR(g_logger) << "bind fail errno="
+                        << errno << " errstr=" << strerror(errno)
+                        << " addr=[" << addr->toString() << "]";
+                    fails.push_back(addr);
+                    break;
+                }
+                m_socks.push_back(sock);
+            }
+        }
+        if(!fails.empty()) {
+            m_socks.clear();
+            return false;
+        }
+        for(auto& i : m_socks) {
+            __LOG_INFO(g_logger) << "udp server bind success: " << *i;
+        }
+        return true;
+    }
+
+    /**
+     * @brief 取出GRO控制消息中的段长度, 没有时返回0
+     */
+    static size_t GroSegmentSize(msghdr& msg) {
+#ifdef UDP_GRO
+        for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int size = 0;
+                memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                return size > 0 ? size : 0;
+            }
+        }
+#endif
+        return 0;
+    }
+
+    void UdpServer::startReceive(Socket::ptr sock) {
+        static const size_t s_control_size = CMSG_SPACE(sizeof(int));
+        size_t buffer_size = m_gro ? std::max(m_bufferSize, s_gro_buffer_size) : m_bufferSize;
+        std::vector<char> buffers(buffer_size * m_batch);
+        std::vector<char> controls(s_control_size * m_batch);
+        std::vector<sockaddr_storage> addrs(m_batch);
+        std::vector<iovec> iovs(m_batch);
+        std::vector<mmsghdr> msgs(m_batch);
+        std::vector<Datagram> dgrams;
+        dgrams.reserve(m_batch);
+        for(size_t i = 0; i < m_batch; ++i) {
+            iovs[i].iov_base = &buffers[i * buffer_size];
+            iovs[i].iov_len = buffer_size;
+        }
+
+        while(!m_isStop) {
+            memset(&msgs[0], 0, sizeof(mmsghdr) * msgs.size());
+            for(size_t i = 0; i < m_batch; ++i) {
+                msghdr& hdr = msgs[i].msg_hdr;
+                hdr.msg_iov = &iovs[i];
+                hdr.msg_iovlen = 1;
+                hdr.msg_name = &addrs[i];
+                hdr.msg_namelen = sizeof(sockaddr_storage);
+                if(m_gro) {
+                    hdr.msg_control = &controls[i * s_control_size];
+                    hdr.msg_controllen = s_control_size;
+                }
+            }
+            int n = sock->recvBatch(&msgs[0], m_batch);
+            if(n <= 0) {
+                if(m_isStop || !sock->isValid()) {
+                    break;
+                }
+                __LOG_ERROR(g_logger) << "recvmmsg errno=" << errno
+                    << " errstr=" << strerror(errno);
+                continue;
+            }
+            ++m_batches;
+
+            dgrams.clear();
+            uint64_t bytes = 0;
+            for(int i = 0; i < n; ++i) {
+                msghdr& hdr = msgs[i].msg_hdr;
+                if(hdr.msg_flags & MSG_TRUNC) {
+                    ++m_truncated;
+                    continue;
+                }
+                const char* data = (const char*)iovs[i].iov_base;
+                size_t length = msgs[i].msg_len;
+                size_t segment = m_gro ? GroSegmentSize(hdr) : 0;
+                if(segment == 0) {
+                    segment = length;
+                }
+                // GRO合并的消息由若干等长的数据报组成, 最后一个可以较短
+                for(size_t offset = 0; offset < length || length == 0; offset += segment) {
+                    Datagram dgram;
+                    dgram.data = data + offset;
+                    dgram.length = std::min(segment, length - offset);
+                    dgram.from = (const sockaddr*)hdr.msg_name;
+                    dgram.fromLen = hdr.msg_namelen;
+                    dgrams.push_back(dgram);
+                    if(length == 0) {
+                        break;
+                    }
+                }
+                bytes += length;
+            }
+            m_datagrams += dgrams.size();
+            m_bytes += bytes;
+            if(!dgrams.empty()) {
+                handleBatch(sock, dgrams);
+            }
+        }
+    }
+
+    bool UdpServer::start() {
+        if(!m_isStop) {
+            return true;
+        }
+        m_isStop = false;
+        for(size_t i = 0; i < m_socks.size(); ++i) {
+            m_workers[i % m_workers.size()]->schedule(std::bind(&UdpServer::startReceive
+                            ,shared_from_this(), m_socks[i]));
+        }
+        return true;
+    }
+
+    void UdpServer::stop() {
+        m_isStop = true;
+        auto self = shared_from_this();
+        // 接收协程等待在各自worker的epoll上, 需在对应的IOManager中取消
+        for(size_t i = 0; i < m_socks.size(); ++i) {
+            Socket::ptr sock = m_socks[i];
+            m_workers[i % m_workers.size()]->schedule([self, sock](){
+                sock->cancelAll();
+                sock->close();
+            });
+        }
+        m_socks.clear();
+    }
+
+    UdpServer::Stats UdpServer::getStats() const {
+        Stats stats;
+        stats.batches = m_batches;
+        stats.datagrams = m_datagrams;
+        stats.bytes = m_bytes;
+        stats.truncated = m_truncated;
+        return stats;
+    }
+
+    void UdpServer::handleBatch(Socket::ptr sock, const std::vector<Datagram>& dgrams) {
+        for(auto& i : dgrams) {
+            handleDatagram(sock, i);
+        }
+    }
+
+    void UdpServer::handleDatagram(Socket::ptr sock, const Datagram& dgram) {
+        __LOG_DEBUG(g_logger) << "handleDatagram: " << *sock
+            << " length=" << dgram.length;
+    }
+
+}
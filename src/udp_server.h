@@ -0,0 +1,154 @@
+/**
+ * @file udp_server.h
+ * @brief 基于recvmmsg的UDP服务器
+ */
+#ifndef __UDP_SERVER_H__
+#define __UDP_SERVER_H__
+
+#include <memory>
+#include <functional>
+#include <vector>
+#include <atomic>
+#include "iomanager.h"
+#include "socket.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief UDP服务器
+ * @details 每个监听socket有一个接收协程, 用recvmmsg一次取走一批数据报, 在同一个协程里
+ *          交给handleBatch处理, 不再转发到其他线程。
+ *          多个worker时对IP地址以SO_REUSEPORT创建多个socket(shard), 由内核按来源四元组
+ *          分配数据报, 每个shard固定在一个worker上接收。
+ *          开启GRO时内核合并的数据报会按段长度拆开, handleBatch看到的仍是单个数据报
+ */
+class UdpServer : public std::enable_shared_from_this<UdpServer>
+                    , Noncopyable {
+public:
+    typedef std::shared_ptr<UdpServer> ptr;
+
+    /**
+     * @brief 收到的一个数据报, 内存只在handleBatch/handleDatagram调用期间有效
+     */
+    struct Datagram {
+        /// 数据
+        const char* data = nullptr;
+        /// 数据长度
+        size_t length = 0;
+        /// 发送端地址
+        const sockaddr* from = nullptr;
+        /// 发送端地址长度
+        socklen_t fromLen = 0;
+
+        /**
+         * @brief 构造发送端地址对象
+         */
+        Address::ptr getFrom() const { return Address::Create(from, fromLen);}
+    };
+
+    /**
+     * @brief 接收统计
+     */
+    struct Stats {
+        /// recvmmsg调用次数
+        uint64_t batches = 0;
+        /// 收到的数据报数(GRO拆分后)
+        uint64_t datagrams = 0;
+        /// 收到的字节数
+        uint64_t bytes = 0;
+        /// 因缓冲区不足被截断而丢弃的消息数
+        uint64_t truncated = 0;
+
+        std::string toString() const;
+    };
+
+    UdpServer(sylar::IOManager* worker = sylar::IOManager::GetThis());
+
+    /**
+     * @brief 使用多个worker接收
+     * @param[in] workers 执行接收协程的IOManager, 不能为空
+     */
+    UdpServer(const std::vector<sylar::IOManager*>& workers);
+    virtual ~UdpServer();
+
+    virtual bool bind(sylar::Address::ptr addr);
+    virtual bool bind(const std::vector<Address::ptr>& addrs
+                        , std::vector<Address::ptr>& fails);
+
+    std::string getName() const { return m_name;}
+    void setName(const std::string& v) { m_name = v;}
+
+    /**
+     * @brief 设置每个IP地址的socket数, 需在bind之前调用
+     * @details 0表示与worker数相同; Unix域地址始终只有一个
+     */
+    void setShards(uint32_t v) { m_shards = v;}
+    uint32_t getShards() const { return m_shards;}
+
+    /**
+     * @brief 设置每次recvmmsg最多接收的消息数, 需在start之前调用
+     */
+    void setBatch(uint32_t v) { m_batch = v ? v : 1;}
+    uint32_t getBatch() const { return m_batch;}
+
+    /**
+     * @brief 设置每条消息的接收缓冲区大小, 需在start之前调用
+     * @details 超过缓冲区的数据报被截断并丢弃; 开启GRO时至少为64K
+     */
+    void setBufferSize(uint32_t v) { m_bufferSize = v;}
+    uint32_t getBufferSize() const { return m_bufferSize;}
+
+    /**
+     * @brief 设置是否开启UDP GRO, 需在bind之前调用
+     */
+    void setGro(bool v) { m_gro = v;}
+    bool isGro() const { return m_gro;}
+
+    /**
+     * @brief 获取监听socket
+     */
+    const std::vector<Socket::ptr>& getSocks() const { return m_socks;}
+
+    /**
+     * @brief 获取接收统计
+     */
+    Stats getStats() const;
+
+    bool isStop() const { return m_isStop;}
+    virtual bool start();
+    virtual void stop();
+protected:
+    /**
+     * @brief 处理一次recvmmsg收到的数据报, 默认逐个调用handleDatagram
+     * @param[in] sock 收到数据报的socket, 可用来回复
+     */
+    virtual void handleBatch(Socket::ptr sock, const std::vector<Datagram>& dgrams);
+
+    /**
+     * @brief 处理一个数据报
+     */
+    virtual void handleDatagram(Socket::ptr sock, const Datagram& dgram);
+
+    /**
+     * @brief 接收协程
+     */
+    virtual void startReceive(Socket::ptr sock);
+private:
+    std::vector<Socket::ptr> m_socks;
+    std::vector<IOManager*> m_workers;
+    uint32_t m_shards;
+    uint32_t m_batch;
+    uint32_t m_bufferSize;
+    bool m_gro;
+    std::string m_name;
+    std::atomic<bool> m_isStop;
+    std::atomic<uint64_t> m_batches = {0};
+    std::atomic<uint64_t> m_datagrams = {0};
+    std::atomic<uint64_t> m_bytes = {0};
+    std::atomic<uint64_t> m_truncated = {0};
+};
+
+}
+
+#endif
@@ -11,6 +11,8 @@
 #include <sstream>
 #include <iostream>
 #include <sys/time.h>
+#include <time.h>
+#include <signal.h>
 namespace sylar {
     
     Logger::ptr g_logger = __LOG_NAME("system");
@@ -35,6 +37,23 @@ namespace sylar {
         return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
     }
 
+    uint64_t GetCoarseMS() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+    }
+
+    void IgnoreSigPipe() {
+        static bool s_ignored = [](){
+            struct sigaction sa;
+            if(sigaction(SIGPIPE, nullptr, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+                signal(SIGPIPE, SIG_IGN);
+            }
+            return true;
+        }();
+        (void)s_ignored;
+    }
+
     void Backtrace(std::vector<std::string>& bt, int size, int skip) {
         void **array = (void**) malloc((sizeof(void*) * size));
         // backtrace用来追踪堆栈上的函数调用地址，并将地址保存在array中。
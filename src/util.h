@@ -35,6 +35,20 @@ namespace sylar {
 
     uint64_t GetCurrentUS();
 
+    /**
+     * @brief 粗粒度单调时钟(毫秒)
+     * @details CLOCK_MONOTONIC_COARSE, 精度为一个时钟节拍(通常1~4ms), 读取开销远小于
+     *          GetCurrentMS, 适合在每次IO时记录时间戳
+     */
+    uint64_t GetCoarseMS();
+
+    /**
+     * @brief 进程忽略SIGPIPE(只生效一次)
+     * @details 写已关闭的连接会产生SIGPIPE杀死进程, 忽略后写入返回EPIPE, 由返回值报告。
+     *          已设置了处理函数的不覆盖
+     */
+    void IgnoreSigPipe();
+
     void Backtrace(std::vector<std::string>& bt, int size, int skip);
 
     std::string BacktraceToString(int size = 64, int skip = 2, const std::string& prefix = "");
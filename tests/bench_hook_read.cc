@@ -0,0 +1,56 @@
+#include "../src/hook.h"
+#include "../src/iomanager.h"
+#include "../src/fdmanager.h"
+#include "../src/sylar.h"
+#include <sys/socket.h>
+#include <stdlib.h>
+
+sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+static const int s_loops = 1000000;
+
+/**
+ * @brief 在已就绪的socket上循环读取，返回每次调用的平均耗时(纳秒)
+ * @param[in] hooked true调用被hook的read, false直接调用read_f
+ */
+static double bench_read(int rfd, int wfd, bool hooked) {
+    char c = 'x';
+    char buf[1];
+    uint64_t begin = sylar::GetCurrentUS();
+    for(int i = 0; i < s_loops; ++i) {
+        write_f(wfd, &c, 1);
+        ssize_t n = hooked ? read(rfd, buf, 1) : read_f(rfd, buf, 1);
+        if(n != 1) {
+            __LOG_ERROR(g_logger) << "read rt=" << n << " errno=" << errno;
+            break;
+        }
+    }
+    uint64_t cost = sylar::GetCurrentUS() - begin;
+    return cost * 1000.0 / s_loops;
+}
+
+void run() {
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        __LOG_ERROR(g_logger) << "socketpair errno=" << errno;
+        return;
+    }
+    // 通过hook的socket创建路径登记FdCtx(设置系统非阻塞)
+    sylar::FdMgr::GetInstance()->get(fds[0], true);
+    sylar::FdMgr::GetInstance()->get(fds[1], true);
+
+    double raw = bench_read(fds[0], fds[1], false);
+    double hooked = bench_read(fds[0], fds[1], true);
+    __LOG_INFO(g_logger) << "loops=" << s_loops
+        << " read_f=" << raw << "ns/op"
+        << " hooked read=" << hooked << "ns/op"
+        << " overhead=" << (hooked - raw) << "ns/op";
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(int argc, char** argv) {
+    sylar::IOManager iom(1, false);
+    iom.schedule(run);
+    return 0;
+}
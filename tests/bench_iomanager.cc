@@ -0,0 +1,85 @@
+#include "../src/hook.h"
+#include "../src/iomanager.h"
+#include "../src/fdmanager.h"
+#include "../src/sylar.h"
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <atomic>
+
+sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+static int s_conns = 1000;
+static int s_rounds = 200;
+static std::atomic<int> s_done = {0};
+static uint64_t s_begin = 0;
+
+/**
+ * @brief 每条连接一对socketpair, 两个协程互相乒乓, 每一轮两次阻塞等待/唤醒
+ */
+static void pinger(int fd) {
+    char c = 'p';
+    for(int i = 0; i < s_rounds; ++i) {
+        if(write(fd, &c, 1) != 1 || read(fd, &c, 1) != 1) {
+            __LOG_ERROR(g_logger) << "pinger fd=" << fd << " errno=" << errno;
+            break;
+        }
+    }
+    close(fd);
+    if(++s_done == s_conns) {
+        uint64_t cost = sylar::GetCurrentUS() - s_begin;
+        uint64_t wakeups = (uint64_t)s_conns * s_rounds * 2;
+        __LOG_INFO(g_logger) << "conns=" << s_conns << " rounds=" << s_rounds
+            << " cost=" << cost / 1000 << "ms"
+            << " wakeups/s=" << (uint64_t)(wakeups * 1000000.0 / cost);
+        __LOG_INFO(g_logger) << "loop stats: "
+            << sylar::IOManager::GetThis()->getLoopStats().toString();
+    }
+}
+
+static void ponger(int fd) {
+    char c;
+    while(read(fd, &c, 1) == 1) {
+        if(write(fd, &c, 1) != 1) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+void run() {
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    std::vector<int> fds;
+    for(int i = 0; i < s_conns; ++i) {
+        int sv[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+            __LOG_ERROR(g_logger) << "socketpair errno=" << errno;
+            return;
+        }
+        sylar::FdMgr::GetInstance()->get(sv[0], true);
+        sylar::FdMgr::GetInstance()->get(sv[1], true);
+        fds.push_back(sv[0]);
+        fds.push_back(sv[1]);
+    }
+    s_begin = sylar::GetCurrentUS();
+    for(int i = 0; i < s_conns; ++i) {
+        iom->schedule(std::bind(ponger, fds[i * 2 + 1]));
+        iom->schedule(std::bind(pinger, fds[i * 2]));
+    }
+}
+
+int main(int argc, char** argv) {
+    sylar::LoggerMgr::GetInstance()->getLogger("system")->setLevel(sylar::LogLevel::WARN);
+    int threads = 4;
+    if(argc > 1) {
+        s_conns = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        s_rounds = atoi(argv[2]);
+    }
+    if(argc > 3) {
+        threads = atoi(argv[3]);
+    }
+    sylar::IOManager iom(threads, false);
+    iom.schedule(run);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include "../src/socket_pool.h"
+#include "../src/tcp_server.h"
+#include "../src/iomanager.h"
+#include "../src/sylar.h"
+#include <stdlib.h>
+#include <atomic>
+
+sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+static int s_clients = 64;
+static int s_calls = 500;
+static std::atomic<int> s_done = {0};
+static std::atomic<int> s_fails = {0};
+static uint64_t s_begin = 0;
+static sylar::TcpServer::ptr s_server;
+
+/**
+ * @brief 回显服务, 每个请求8字节
+ */
+class EchoServer : public sylar::TcpServer {
+public:
+    EchoServer(sylar::IOManager* iom)
+        :sylar::TcpServer(iom, iom) {
+    }
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        char buff[8];
+        while(client->recv(buff, sizeof(buff), MSG_WAITALL) == sizeof(buff)) {
+            if(client->send(buff, sizeof(buff)) != sizeof(buff)) {
+                break;
+            }
+        }
+        client->close();
+    }
+};
+
+static bool call(sylar::Socket::ptr sock) {
+    char buff[8] = "request";
+    return sock->send(buff, sizeof(buff)) == sizeof(buff)
+        && sock->recv(buff, sizeof(buff), MSG_WAITALL) == sizeof(buff);
+}
+
+static void report(const char* name, sylar::SocketPool::ptr pool) {
+    uint64_t cost = sylar::GetCurrentUS() - s_begin;
+    uint64_t calls = (uint64_t)s_clients * s_calls;
+    __LOG_INFO(g_logger) << name << ": clients=" << s_clients << " calls=" << calls
+        << " fails=" << s_fails << " cost=" << cost / 1000 << "ms"
+        << " calls/s=" << (uint64_t)(calls * 1000000.0 / cost);
+    if(pool) {
+        __LOG_INFO(g_logger) << name << " pool: " << pool->getStats().toString();
+    }
+}
+
+/**
+ * @brief 每次调用新建连接
+ */
+static void connect_per_call(sylar::Address::ptr addr, std::function<void()> next) {
+    for(int i = 0; i < s_calls; ++i) {
+        sylar::Socket::ptr sock = sylar::Socket::CreateTCP(addr);
+        if(!sock->connect(addr) || !call(sock)) {
+            ++s_fails;
+        }
+        sock->close();
+    }
+    if(++s_done == s_clients) {
+        report("connect_per_call", nullptr);
+        next();
+    }
+}
+
+/**
+ * @brief 从连接池借出连接, 客户端数多于max_active时挂起等待
+ */
+static void pooled(sylar::Address::ptr addr, sylar::SocketPool::ptr pool) {
+    for(int i = 0; i < s_calls; ++i) {
+        sylar::Socket::ptr sock = pool->get(addr);
+        if(!sock || !call(sock)) {
+            ++s_fails;
+            if(sock) {
+                sock->close();
+            }
+        }
+    }
+    if(++s_done == s_clients) {
+        report("socket_pool", pool);
+        // 关闭空闲连接和监听socket后, 所有协程结束, IOManager退出
+        pool->clear();
+        s_server->stop();
+        s_server.reset();
+    }
+}
+
+void run() {
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    sylar::Address::ptr addr = sylar::IPAddress::LookupAny("127.0.0.1:8085");
+    s_server.reset(new EchoServer(iom));
+    if(!s_server->bind(addr)) {
+        return;
+    }
+    s_server->start();
+
+    sylar::SocketPool::ptr pool(new sylar::SocketPool);
+    pool->setMaxActive(s_clients / 2 ? s_clients / 2 : 1);
+    auto start_pooled = [addr, pool, iom](){
+        s_done = 0;
+        s_fails = 0;
+        s_begin = sylar::GetCurrentUS();
+        for(int i = 0; i < s_clients; ++i) {
+            iom->schedule(std::bind(pooled, addr, pool));
+        }
+    };
+    s_begin = sylar::GetCurrentUS();
+    for(int i = 0; i < s_clients; ++i) {
+        iom->schedule(std::bind(connect_per_call, addr, start_pooled));
+    }
+}
+
+int main(int argc, char** argv) {
+    sylar::LoggerMgr::GetInstance()->getLogger("system")->setLevel(sylar::LogLevel::WARN);
+    int threads = 2;
+    if(argc > 1) {
+        s_clients = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        s_calls = atoi(argv[2]);
+    }
+    if(argc > 3) {
+        threads = atoi(argv[3]);
+    }
+    sylar::IOManager iom(threads, false);
+    iom.schedule(run);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "../src/buffered_stream.h"
+#include "../src/socket_stream.h"
+#include "../src/iomanager.h"
+#include "../src/log.h"
+#include "../src/macro.h"
+sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+/**
+ * @brief 统计底层read次数的流
+ */
+class CountingStream : public sylar::SocketStream {
+public:
+    CountingStream(sylar::Socket::ptr sock)
+        :sylar::SocketStream(sock) {
+    }
+    int read(void* buffer, size_t length) override {
+        ++reads;
+        return sylar::SocketStream::read(buffer, length);
+    }
+    size_t reads = 0;
+};
+
+void run() {
+    sylar::Socket::ptr listener = sylar::Socket::CreateTCPSocket();
+    sylar::IPAddress::ptr addr = sylar::IPv4Address::Create("127.0.0.1", 0);
+    if(!listener->bind(addr) || !listener->listen()) {
+        __LOG_ERROR(g_logger) << "listen fail";
+        return;
+    }
+    addr = std::dynamic_pointer_cast<sylar::IPAddress>(listener->getLocalAddress());
+
+    // 发送1000条 "长度\r\n" + 消息体
+    const size_t count = 1000;
+    sylar::IOManager::GetThis()->schedule([addr, count](){
+        sylar::Socket::ptr sock = sylar::Socket::CreateTCP(addr);
+        if(!sock->connect(addr)) {
+            return;
+        }
+        sylar::SocketStream stream(sock);
+        std::string data;
+        for(size_t i = 0; i < count; ++i) {
+            std::string body(i % 100 + 1, 'a' + i % 26);
+            data += std::to_string(body.size()) + "\r\n" + body;
+        }
+        stream.writeFixSize(data.c_str(), data.size());
+    });
+
+    sylar::Socket::ptr client = listener->accept();
+    std::shared_ptr<CountingStream> raw(new CountingStream(client));
+    sylar::BufferedStream::ptr stream(new sylar::BufferedStream(raw));
+    size_t n = 0;
+    std::string line;
+    while(stream->readUntil("\r\n", line) > 0) {
+        size_t length = std::stoul(line);
+        // 消息体在缓冲区中直接查看, 不拷贝
+        if(stream->ensure(length) <= 0) {
+            break;
+        }
+        __ASSERT(length == n % 100 + 1);
+        __ASSERT(stream->data()[0] == (char)('a' + n % 26));
+        __ASSERT(stream->data()[length - 1] == (char)('a' + n % 26));
+        stream->consume(length);
+        ++n;
+    }
+    __LOG_INFO(g_logger) << "messages=" << n << " reads=" << raw->reads;
+}
+
+int main(int argc, char** argv) {
+    sylar::IOManager iom;
+    iom.schedule(run);
+    return 0;
+}
@@ -1,7 +1,9 @@
 #include "../src/hook.h"
 #include "../src/iomanager.h"
 #include "../src/sylar.h"
+#include "../src/fdmanager.h"
 #include <arpa/inet.h>
+#include <sys/sendfile.h>
 sylar::Logger::ptr g_logger = __LOG_ROOT;
 
 void test_sleep() {
@@ -57,10 +59,92 @@ void test_sock() {
     __LOG_INFO(g_logger) << buff;
 }
 
+void test_file() {
+    // 文件IO在阻塞IO线程池中执行, 期间定时器仍能在本线程上触发
+    sylar::Timer::ptr timer = sylar::IOManager::GetThis()->addTimer(1, [](){
+        __LOG_INFO(g_logger) << "tick";
+    }, true);
+
+    const char* path = "/tmp/sylar_test_hook_file";
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if(fd < 0) {
+        __LOG_ERROR(g_logger) << "open errno=" << errno << " " << strerror(errno);
+        timer->cancel();
+        return;
+    }
+    std::string data(1024 * 1024, 'x');
+    ssize_t rt = write(fd, data.c_str(), data.size());
+    __LOG_INFO(g_logger) << "write rt=" << rt;
+    __LOG_INFO(g_logger) << "fsync rt=" << fsync(fd);
+
+    std::string buff(data.size(), 0);
+    rt = pread(fd, &buff[0], buff.size(), 0);
+    __LOG_INFO(g_logger) << "pread rt=" << rt << " same=" << (buff == data);
+
+    struct stat st;
+    rt = stat(path, &st);
+    __LOG_INFO(g_logger) << "stat rt=" << rt << " size=" << st.st_size;
+    close(fd);
+    unlink(path);
+    timer->cancel();
+}
+
+void test_sendfile() {
+    // 4M的文件经sendfile写入socketpair, 远大于socket缓冲区, 发送方会多次等待可写
+    const char* path = "/tmp/sylar_test_hook_sendfile";
+    std::string data(4 * 1024 * 1024, 0);
+    for(size_t i = 0; i < data.size(); ++i) {
+        data[i] = 'a' + i % 26;
+    }
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if(fd < 0 || write(fd, data.c_str(), data.size()) != (ssize_t)data.size()) {
+        __LOG_ERROR(g_logger) << "prepare file errno=" << errno << " " << strerror(errno);
+        return;
+    }
+
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        __LOG_ERROR(g_logger) << "socketpair errno=" << errno;
+        close(fd);
+        return;
+    }
+    sylar::FdMgr::GetInstance()->get(sv[0], true);
+    sylar::FdMgr::GetInstance()->get(sv[1], true);
+
+    sylar::IOManager::GetThis()->schedule([sv, data](){
+        std::string buff(data.size(), 0);
+        size_t offset = 0;
+        while(offset < buff.size()) {
+            ssize_t rt = recv(sv[1], &buff[offset], buff.size() - offset, 0);
+            if(rt <= 0) {
+                break;
+            }
+            offset += rt;
+        }
+        __LOG_INFO(g_logger) << "recv " << offset << " same=" << (buff == data);
+        close(sv[1]);
+    });
+
+    off_t offset = 0;
+    while(offset < (off_t)data.size()) {
+        ssize_t rt = sendfile(sv[0], fd, &offset, data.size() - offset);
+        if(rt <= 0) {
+            __LOG_ERROR(g_logger) << "sendfile rt=" << rt << " errno=" << errno;
+            break;
+        }
+    }
+    __LOG_INFO(g_logger) << "sendfile " << offset;
+    close(sv[0]);
+    close(fd);
+    unlink(path);
+}
+
 int main() {
     //test_sleep();
     //test_sock();
     sylar::IOManager iom;
     iom.schedule(test_sock);
+    iom.schedule(test_file);
+    iom.schedule(test_sendfile);
     return 0;
 }
\ No newline at end of file
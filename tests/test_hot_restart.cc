@@ -0,0 +1,130 @@
+#include "../src/hot_restart.h"
+#include "../src/tcp_server.h"
+#include "../src/iomanager.h"
+#include "../src/log.h"
+#include "../src/util.h"
+#include <sys/wait.h>
+#include <unistd.h>
+#include <iostream>
+#include <map>
+sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+static const char* s_path = "/tmp/test_hot_restart.sock";
+static const char* s_addr = "127.0.0.1:8090";
+
+/**
+ * @brief 回复本进程的pid, 用来区分连接由哪一代进程处理
+ */
+class PidServer : public sylar::TcpServer {
+public:
+    PidServer(sylar::IOManager* worker)
+        :sylar::TcpServer(worker) {
+    }
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        char buf[16];
+        if(client->recv(buf, sizeof(buf)) > 0) {
+            // 模拟处理耗时, 交接时旧进程上有正在处理的连接
+            usleep(20 * 1000);
+            std::string pid = std::to_string(getpid());
+            client->send(pid.c_str(), pid.size());
+        }
+        client->close();
+    }
+};
+
+/**
+ * @brief 一代服务进程
+ * @param[in] first 是否第一代, 之后的进程从上一代继承监听socket
+ */
+void generation(bool first) {
+    sylar::IOManager iom(2, true, first ? "gen1" : "gen2");
+    iom.schedule([first](){
+        if(!first && !sylar::HotRestartMgr::GetInstance()->inherit(s_path)) {
+            __LOG_ERROR(g_logger) << "inherit fail";
+        }
+        sylar::TcpServer::ptr server(new PidServer(sylar::IOManager::GetThis()));
+        if(!server->bind(sylar::IPAddress::LookupAny(s_addr))) {
+            _exit(1);
+        }
+        server->start();
+        if(first) {
+            sylar::HotRestartMgr::GetInstance()->serve({server}, [](){
+                __LOG_INFO(g_logger) << "gen1 pid=" << getpid() << " exit";
+                std::cout.flush();
+                _exit(0);
+            }, s_path);
+        } else {
+            sylar::HotRestartMgr::GetInstance()->ready();
+            __LOG_INFO(g_logger) << "gen2 pid=" << getpid() << " ready";
+            sleep(3);
+            server->drain();
+            std::cout.flush();
+            _exit(0);
+        }
+    });
+}
+
+static std::map<std::string, int> s_served;
+static int s_fails = 0;
+
+/**
+ * @brief 客户端: 交接前后持续建立短连接, 统计各代进程处理的连接数和失败数
+ */
+void client_loop(uint64_t end) {
+    auto addr = sylar::IPAddress::LookupAny(s_addr);
+    while(sylar::GetCurrentMS() < end) {
+        sylar::Socket::ptr sock = sylar::Socket::CreateTCP(addr);
+        char buf[16] = {0};
+        if(!sock->connect(addr, 1000) || sock->send("x", 1) != 1
+                || sock->recv(buf, sizeof(buf) - 1) <= 0) {
+            ++s_fails;
+        } else {
+            ++s_served[buf];
+        }
+        sock->close();
+    }
+}
+
+void client() {
+    uint64_t end = sylar::GetCurrentMS() + 3000;
+    for(int i = 0; i < 16; ++i) {
+        sylar::IOManager::GetThis()->schedule(std::bind(client_loop, end));
+    }
+    sleep(4);
+    for(auto& i : s_served) {
+        __LOG_INFO(g_logger) << "pid=" << i.first << " served=" << i.second;
+    }
+    __LOG_INFO(g_logger) << "fails=" << s_fails;
+}
+
+int main(int argc, char** argv) {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    __LOG_NAME("system")->setLevel(sylar::LogLevel::INFO);
+    pid_t gen1 = fork();
+    if(gen1 == 0) {
+        generation(true);
+        return 0;
+    }
+    usleep(300 * 1000);
+
+    pid_t cli = fork();
+    if(cli == 0) {
+        sylar::IOManager iom(1, true, "client");
+        iom.schedule(client);
+        return 0;
+    }
+
+    // 客户端运行期间启动第二代
+    usleep(1000 * 1000);
+    pid_t gen2 = fork();
+    if(gen2 == 0) {
+        generation(false);
+        return 0;
+    }
+    waitpid(cli, nullptr, 0);
+    waitpid(gen1, nullptr, 0);
+    waitpid(gen2, nullptr, 0);
+    unlink(s_path);
+    return 0;
+}
@@ -58,6 +58,46 @@ void test_timer() {
     }, true);
 }
 
+void test_timer_us() {
+    sylar::IOManager iom(2);
+    static uint64_t s_last = sylar::GetCurrentUS();
+    static int s_count = 0;
+    s_timer = iom.addTimer(std::chrono::microseconds(250), [](){
+        uint64_t now = sylar::GetCurrentUS();
+        __LOG_INFO(g_logger) << "us timer interval=" << (now - s_last) << "us";
+        s_last = now;
+        if(++s_count == 10) {
+            s_timer->cancel();
+        }
+    }, true);
+    iom.schedule([](){
+        uint64_t begin = sylar::GetCurrentUS();
+        usleep(300);
+        __LOG_INFO(g_logger) << "usleep(300) cost=" << (sylar::GetCurrentUS() - begin) << "us";
+    });
+}
+
+void test_signal() {
+    // 先在主线程接管信号, 工作线程随后也会屏蔽它, 信号只经signalfd送达
+    sylar::IOManager iom(2);
+    static int s_count = 0;
+    iom.addSignal(SIGUSR1, [](int signo){
+        __LOG_INFO(g_logger) << "signal " << signo << " count=" << ++s_count;
+    });
+    iom.addSignal(SIGHUP, [](int signo){
+        __LOG_INFO(g_logger) << "SIGHUP reload";
+        sylar::IOManager::GetThis()->delSignal(SIGUSR1);
+        sylar::IOManager::GetThis()->delSignal(SIGHUP);
+    });
+    iom.schedule([](){
+        for(int i = 0; i < 3; ++i) {
+            kill(getpid(), SIGUSR1);
+            usleep(10 * 1000);
+        }
+        kill(getpid(), SIGHUP);
+    });
+}
+
 void test1() {
     std::cout << "EPOLLIN=" << EPOLLIN
               << " EPOLLOUT=" << EPOLLOUT << std::endl;
@@ -67,6 +107,8 @@ void test1() {
 
 int main(int argc, char** argv) {
     //test1();
+    test_timer_us();
+    test_signal();
     test_timer();
     return 0;
 }
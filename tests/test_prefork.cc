@@ -0,0 +1,107 @@
+#include "../src/prefork.h"
+#include "../src/tcp_server.h"
+#include "../src/iomanager.h"
+#include "../src/log.h"
+#include "../src/util.h"
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <map>
+sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+static const char* s_addr = "127.0.0.1:8092";
+
+/**
+ * @brief 回复处理连接的worker进程pid
+ */
+class PidServer : public sylar::TcpServer {
+public:
+    PidServer()
+        :sylar::TcpServer(nullptr, nullptr) {
+    }
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        char buf[16];
+        if(client->recv(buf, sizeof(buf)) > 0) {
+            std::string pid = std::to_string(getpid());
+            client->send(pid.c_str(), pid.size());
+        }
+        client->close();
+    }
+};
+
+/**
+ * @brief master: bind后fork 4个worker
+ */
+void master() {
+    sylar::Prefork prefork(4);
+    sylar::TcpServer::ptr server(new PidServer);
+    prefork.addServer(server);
+    if(!server->bind(sylar::IPAddress::LookupAny(s_addr))) {
+        _exit(1);
+    }
+    prefork.setSignalHandler([](int sig){
+        __LOG_INFO(g_logger) << "worker " << sylar::Prefork::GetWorkerIndex()
+            << " pid=" << getpid() << " got signal " << sig;
+    });
+    prefork.run();
+}
+
+/**
+ * @brief 建立count个短连接, 统计各worker处理的连接数
+ */
+std::map<std::string, int> requests(int count, int& fails) {
+    std::map<std::string, int> served;
+    auto addr = sylar::IPAddress::LookupAny(s_addr);
+    for(int i = 0; i < count; ++i) {
+        sylar::Socket::ptr sock = sylar::Socket::CreateTCP(addr);
+        char buf[16] = {0};
+        if(!sock->connect(addr, 1000) || sock->send("x", 1) != 1
+                || sock->recv(buf, sizeof(buf) - 1) <= 0) {
+            ++fails;
+        } else {
+            ++served[buf];
+        }
+        sock->close();
+    }
+    for(auto& i : served) {
+        __LOG_INFO(g_logger) << "pid=" << i.first << " served=" << i.second;
+    }
+    return served;
+}
+
+void client(pid_t master_pid) {
+    int fails = 0;
+    auto served = requests(400, fails);
+    __LOG_INFO(g_logger) << "workers=" << served.size() << " fails=" << fails;
+
+    // 杀掉一个worker, 连接排队等到重启的worker接手
+    pid_t victim = atoi(served.begin()->first.c_str());
+    kill(victim, SIGKILL);
+    __LOG_INFO(g_logger) << "killed worker pid=" << victim;
+    fails = 0;
+    served = requests(400, fails);
+    __LOG_INFO(g_logger) << "after kill workers=" << served.size() << " fails=" << fails
+        << " victim_served=" << served.count(std::to_string(victim));
+
+    kill(master_pid, SIGUSR1);
+    usleep(100 * 1000);
+    kill(master_pid, SIGTERM);
+    int status = 0;
+    waitpid(master_pid, &status, 0);
+    __LOG_INFO(g_logger) << "master exit status=" << WEXITSTATUS(status);
+}
+
+int main(int argc, char** argv) {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    __LOG_NAME("system")->setLevel(sylar::LogLevel::INFO);
+    pid_t pid = fork();
+    if(pid == 0) {
+        master();
+        return 0;
+    }
+    usleep(300 * 1000);
+    sylar::IOManager iom(1, true, "client");
+    iom.schedule(std::bind(client, pid));
+    return 0;
+}
@@ -0,0 +1,207 @@
+#include "../src/sylar.h"
+#include "../src/iomanager.h"
+#include "../src/resolver.h"
+#include "../src/socket.h"
+#include <fstream>
+#include <map>
+#include <string.h>
+
+static sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+/// 替身DNS服务器收到的查询次数, key为 域名/类型
+static std::map<std::string, int> s_queries;
+
+/**
+ * @brief 构造替身DNS服务器的应答
+ * @details www.sylar.test 的A记录为10.0.0.1(TTL 1秒), 没有AAAA记录;
+ *          v4.sylar.test 只应答A查询(10.0.0.2), AAAA查询不应答;
+ *          tc.sylar.test 的UDP应答被截断, TCP应答A记录10.0.0.3;
+ *          nx.sylar.test 返回NXDOMAIN, 权威段带SOA(MINIMUM 1秒); 其余名字不应答
+ * @return 不应答时返回false
+ */
+static bool make_response(const uint8_t* buf, int n, bool tcp, std::string& rsp) {
+    std::string name;
+    size_t pos = 12;
+    while(pos < (size_t)n && buf[pos]) {
+        if(!name.empty()) {
+            name += ".";
+        }
+        name.append((const char*)buf + pos + 1, buf[pos]);
+        pos += buf[pos] + 1;
+    }
+    size_t qend = pos + 5;
+    uint16_t qtype = (buf[pos + 1] << 8) | buf[pos + 2];
+    ++s_queries[name + "/" + std::to_string(qtype) + (tcp ? "/tcp" : "")];
+
+    rsp.assign((const char*)buf, qend);
+    rsp[2] = (char)0x81;
+    rsp[3] = (char)0x80;
+    const uint8_t ans[] = {0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0, 1, 0, 4, 10, 0, 0, 1};
+    if(name == "www.sylar.test") {
+        if(qtype == 1) {
+            rsp[7] = 1;
+            rsp.append((const char*)ans, sizeof(ans));
+        }
+    } else if(name == "v4.sylar.test") {
+        if(qtype != 1) {
+            return false;
+        }
+        rsp[7] = 1;
+        rsp.append((const char*)ans, sizeof(ans));
+        rsp[rsp.size() - 1] = 2;
+    } else if(name == "tc.sylar.test") {
+        if(!tcp) {
+            rsp[2] = (char)0x83;
+        } else if(qtype == 1) {
+            rsp[7] = 1;
+            rsp.append((const char*)ans, sizeof(ans));
+            rsp[rsp.size() - 1] = 3;
+        }
+    } else if(name == "nx.sylar.test") {
+        rsp[3] = (char)0x83;
+        rsp[9] = 1;
+        const uint8_t soa[] = {0xc0, 0x0c, 0, 6, 0, 1, 0, 0, 0, 60, 0, 22
+            , 0, 0             // mname, rname
+            , 0, 0, 0, 1       // serial
+            , 0, 0, 0, 60, 0, 0, 0, 60, 0, 0, 0, 60
+            , 0, 0, 0, 1};     // minimum
+        rsp.append((const char*)soa, sizeof(soa));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief 本地替身DNS服务器(UDP)
+ */
+static void dns_server(sylar::Socket::ptr sock) {
+    uint8_t buf[512];
+    std::string rsp;
+    while(true) {
+        sylar::Address::ptr from(new sylar::IPv4Address);
+        int n = sock->recvFrom(buf, sizeof(buf), from);
+        if(n <= 12) {
+            break;
+        }
+        if(make_response(buf, n, false, rsp)) {
+            sock->sendTo(rsp.c_str(), rsp.size(), from);
+        }
+    }
+}
+
+/**
+ * @brief 本地替身DNS服务器(TCP), 每个连接处理一个查询
+ */
+static void dns_tcp_server(sylar::Socket::ptr sock) {
+    while(true) {
+        sylar::Socket::ptr client = sock->accept();
+        if(!client) {
+            break;
+        }
+        uint8_t buf[514];
+        int n = client->recv(buf, sizeof(buf));
+        std::string rsp;
+        if(n <= 14 || !make_response(buf + 2, n - 2, true, rsp)) {
+            continue;
+        }
+        std::string out;
+        out.push_back((char)(rsp.size() >> 8));
+        out.push_back((char)(rsp.size() & 0xff));
+        out.append(rsp);
+        client->send(out.c_str(), out.size());
+    }
+}
+
+void test_resolver() {
+    sylar::IPAddress::ptr addr = sylar::IPv4Address::Create("127.0.0.1", 0);
+    sylar::Socket::ptr server = sylar::Socket::CreateUDP(addr);
+    __ASSERT(server->bind(addr));
+    sylar::IPAddress::ptr server_addr =
+        std::dynamic_pointer_cast<sylar::IPAddress>(server->getLocalAddress());
+    sylar::IOManager::GetThis()->schedule(std::bind(dns_server, server));
+    sylar::Socket::ptr tcp_server = sylar::Socket::CreateTCP(server_addr);
+    __ASSERT(tcp_server->bind(server_addr) && tcp_server->listen());
+    sylar::IOManager::GetThis()->schedule(std::bind(dns_tcp_server, tcp_server));
+
+    sylar::Resolver resolver;
+    resolver.setNameservers({server_addr});
+    resolver.setTimeout(200);
+    resolver.setAttempts(1);
+
+    std::vector<sylar::IPAddress::ptr> result;
+    __ASSERT(resolver.resolve("www.sylar.test", AF_INET, result));
+    __LOG_INFO(g_logger) << "www.sylar.test -> " << result[0]->toString();
+    __ASSERT(result[0]->toString() == "10.0.0.1:0");
+
+    // 缓存命中, 不再查询
+    result.clear();
+    __ASSERT(resolver.resolve("WWW.sylar.test", AF_INET, result));
+    __ASSERT(s_queries["www.sylar.test/1"] == 1);
+
+    // NXDOMAIN 否定缓存
+    result.clear();
+    __ASSERT(!resolver.resolve("nx.sylar.test", AF_UNSPEC, result));
+    __ASSERT(!resolver.resolve("nx.sylar.test", AF_UNSPEC, result));
+    __ASSERT(s_queries["nx.sylar.test/1"] == 1);
+
+    // TTL过期后重新查询
+    usleep(1100 * 1000);
+    __ASSERT(resolver.resolve("www.sylar.test", AF_UNSPEC, result));
+    __ASSERT(s_queries["www.sylar.test/1"] == 2);
+    __ASSERT(s_queries["www.sylar.test/28"] == 1);
+    __ASSERT(!resolver.resolve("nx.sylar.test", AF_UNSPEC, result));
+    __ASSERT(s_queries["nx.sylar.test/1"] == 2);
+
+    // 不应答的名字超时失败, 且不做否定缓存
+    uint64_t begin = sylar::GetCurrentMS();
+    __ASSERT(!resolver.resolve("slow.sylar.test", AF_INET, result));
+    __LOG_INFO(g_logger) << "slow.sylar.test timeout after " << sylar::GetCurrentMS() - begin << "ms";
+    __ASSERT(!resolver.resolve("slow.sylar.test", AF_INET, result));
+    __ASSERT(s_queries["slow.sylar.test/1"] == 2);
+
+    // AF_UNSPEC时AAAA没有应答, 使用A记录的地址
+    result.clear();
+    __ASSERT(resolver.resolve("v4.sylar.test", AF_UNSPEC, result));
+    __ASSERT(result.size() == 1 && result[0]->toString() == "10.0.0.2:0");
+    result.clear();
+    __ASSERT(resolver.resolve("v4.sylar.test", AF_UNSPEC, result));
+    __ASSERT(result.size() == 1);
+    __ASSERT(s_queries["v4.sylar.test/1"] == 1);
+
+    // UDP应答被截断时改用TCP
+    result.clear();
+    __ASSERT(resolver.resolve("tc.sylar.test", AF_INET, result));
+    __ASSERT(result.size() == 1 && result[0]->toString() == "10.0.0.3:0");
+    __ASSERT(s_queries["tc.sylar.test/1"] == 1);
+    __ASSERT(s_queries["tc.sylar.test/1/tcp"] == 1);
+
+    // hosts文件优先于DNS
+    const char* hosts = "/tmp/sylar_test_resolver_hosts";
+    std::ofstream(hosts) << "# test\n10.9.9.9 myhost.sylar.test myhost\n";
+    __ASSERT(resolver.loadHosts(hosts));
+    result.clear();
+    __ASSERT(resolver.resolve("myhost", AF_INET, result));
+    __ASSERT(result[0]->toString() == "10.9.9.9:0");
+    __ASSERT(!s_queries.count("myhost/1"));
+    unlink(hosts);
+
+    sylar::Resolver::Stats stats = resolver.getStats();
+    __LOG_INFO(g_logger) << "hosts=" << stats.hostsHits << " cache=" << stats.cacheHits
+        << " negative=" << stats.negativeHits << " queries=" << stats.queries
+        << " failures=" << stats.failures;
+
+    // Address::Lookup在协程中透明地使用Resolver
+    sylar::ResolverMgr::GetInstance()->setNameservers({server_addr});
+    sylar::Address::ptr any = sylar::Address::LookupAny("www.sylar.test:80", AF_INET);
+    __ASSERT(any);
+    __LOG_INFO(g_logger) << "LookupAny www.sylar.test:80 -> " << any->toString();
+    server->close();
+    tcp_server->close();
+}
+
+int main(int argc, char** argv) {
+    sylar::IOManager iom(2);
+    iom.schedule(test_resolver);
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "../src/socket.h"
 #include "../src/sylar.h"
 #include "../src/iomanager.h"
+#include "../src/socket_stream.h"
 static sylar::Logger::ptr g_logger = __LOG_ROOT;
 
 
@@ -37,9 +38,82 @@ void test1() {
     __LOG_INFO(g_logger) << buffs;
 
 }
+void test_zerocopy() {
+    // 回环地址上内核总是拷贝, 但完成通知照常到达, 可以验证缓冲区的释放流程
+    sylar::Socket::ptr listener = sylar::Socket::CreateTCPSocket();
+    sylar::IPAddress::ptr addr = sylar::IPv4Address::Create("127.0.0.1", 0);
+    if(!listener->bind(addr) || !listener->listen()) {
+        __LOG_ERROR(g_logger) << "listen fail";
+        return;
+    }
+    addr = std::dynamic_pointer_cast<sylar::IPAddress>(listener->getLocalAddress());
+    const size_t total = 8 * 1024 * 1024;
+    sylar::IOManager::GetThis()->schedule([listener, total](){
+        sylar::Socket::ptr client = listener->accept();
+        if(!client) {
+            return;
+        }
+        std::string buff(64 * 1024, 0);
+        size_t offset = 0;
+        bool same = true;
+        while(offset < total) {
+            int rt = client->recv(&buff[0], buff.size());
+            if(rt <= 0) {
+                break;
+            }
+            for(int i = 0; i < rt; ++i) {
+                same = same && buff[i] == (char)('a' + (offset + i) % 26);
+            }
+            offset += rt;
+        }
+        __LOG_INFO(g_logger) << "recv " << offset << " same=" << same;
+    });
+
+    sylar::Socket::ptr sock = sylar::Socket::CreateTCP(addr);
+    __LOG_INFO(g_logger) << "setZeroCopy " << sock->setZeroCopy(true);
+    if(!sock->connect(addr)) {
+        __LOG_ERROR(g_logger) << "connect " << addr->toString() << " fail";
+        return;
+    }
+    sylar::SocketStream::ptr stream(new sylar::SocketStream(sock));
+    size_t sent = 0;
+    while(sent < total) {
+        // 每次写一个新的ByteArray, 发送后不再修改, 由socket持有到内核完成
+        sylar::ByteArray::ptr ba(new sylar::ByteArray);
+        std::string data(256 * 1024, 0);
+        for(size_t i = 0; i < data.size(); ++i) {
+            data[i] = 'a' + (sent + i) % 26;
+        }
+        ba->write(data.c_str(), data.size());
+        ba->setPosition(0);
+        while(ba->getReadSize()) {
+            int rt = stream->writeZeroCopy(ba, ba->getReadSize());
+            if(rt <= 0) {
+                __LOG_ERROR(g_logger) << "writeZeroCopy rt=" << rt << " errno=" << errno;
+                return;
+            }
+            sent += rt;
+        }
+    }
+    // 不主动回收, 完成通知由IOManager上的定时器读取
+    uint64_t deadline = sylar::GetCurrentMS() + 3000;
+    while(sock->getZeroCopyPending() && sylar::GetCurrentMS() < deadline) {
+        usleep(10 * 1000);
+    }
+    bool done = sock->getZeroCopyPending() == 0;
+    sylar::Socket::ZeroCopyStats stats = sock->getZeroCopyStats();
+    __LOG_INFO(g_logger) << "sent " << sent << " done=" << done
+        << " sends=" << stats.sends << " fallbacks=" << stats.fallbacks
+        << " completions=" << stats.completions << " copied=" << stats.copied;
+    uint64_t begin = sylar::GetCurrentMS();
+    sock->close();
+    __LOG_INFO(g_logger) << "close cost " << sylar::GetCurrentMS() - begin << "ms";
+}
+
 void test_socket(){
     sylar::IOManager iom;
     iom.schedule(&test1);
+    iom.schedule(&test_zerocopy);
 }
 int main() {
     test_socket();
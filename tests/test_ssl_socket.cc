@@ -0,0 +1,241 @@
+#include "../src/socket.h"
+#include "../src/socket_stream.h"
+#include "../src/tcp_server.h"
+#include "../src/iomanager.h"
+#include "../src/log.h"
+#include "../src/util.h"
+#include "../src/macro.h"
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <string.h>
+sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+static const char* s_cert_file = "/tmp/test_ssl_socket.crt";
+static const char* s_key_file = "/tmp/test_ssl_socket.key";
+static const char* s_data_file = "/tmp/test_ssl_socket.dat";
+
+/**
+ * @brief 生成自签名证书
+ */
+bool gen_cert() {
+    EVP_PKEY* pkey = EVP_EC_gen("P-256");
+    X509* x509 = X509_new();
+    if(!pkey || !x509) {
+        return false;
+    }
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 24 * 3600);
+    X509_set_pubkey(x509, pkey);
+    X509_NAME* name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+    bool rt = X509_sign(x509, pkey, EVP_sha256()) > 0;
+
+    FILE* fp = fopen(s_cert_file, "w");
+    rt = rt && fp && PEM_write_X509(fp, x509);
+    if(fp) {
+        fclose(fp);
+    }
+    fp = fopen(s_key_file, "w");
+    rt = rt && fp && PEM_write_PrivateKey(fp, pkey, nullptr, nullptr, 0, nullptr, nullptr);
+    if(fp) {
+        fclose(fp);
+    }
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    return rt;
+}
+
+/**
+ * @brief TLS回显服务
+ */
+class EchoServer : public sylar::TcpServer {
+public:
+    EchoServer(sylar::IOManager* worker)
+        :sylar::TcpServer(worker) {
+    }
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        std::vector<char> buf(64 * 1024);
+        while(true) {
+            int rt = client->recv(&buf[0], buf.size());
+            if(rt <= 0) {
+                break;
+            }
+            int sent = 0;
+            while(sent < rt) {
+                int n = client->send(&buf[sent], rt - sent);
+                if(n <= 0) {
+                    break;
+                }
+                sent += n;
+            }
+        }
+        client->close();
+    }
+};
+
+/**
+ * @brief 连接建立后持续发送大块数据, 直到发送失败
+ */
+class BlastServer : public sylar::TcpServer {
+public:
+    BlastServer(sylar::IOManager* worker)
+        :sylar::TcpServer(worker) {
+    }
+    bool done = false;
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        std::string buf(1024 * 1024, 'x');
+        int64_t total = 0;
+        int rt = 0;
+        while((rt = client->send(&buf[0], buf.size())) > 0) {
+            total += rt;
+        }
+        __LOG_INFO(g_logger) << "peer closed during write, sent=" << total
+            << " rt=" << rt << " errno=" << errno << " errstr=" << strerror(errno);
+        client->close();
+        done = true;
+    }
+};
+
+/// 信任测试自签名证书的客户端上下文
+static std::shared_ptr<SSL_CTX> s_client_ctx;
+
+sylar::SSLSocket::ptr connect(sylar::Address::ptr addr, std::shared_ptr<SSL_SESSION> session
+                            ,const std::string& hostname = "localhost") {
+    sylar::SSLSocket::ptr sock = sylar::SSLSocket::CreateTCP(addr);
+    sock->setContext(s_client_ctx);
+    sock->setHostname(hostname);
+    sock->setSession(session);
+    if(!sock->connect(addr, 3000)) {
+        __LOG_ERROR(g_logger) << "connect " << addr->toString() << " fail";
+        return nullptr;
+    }
+    sock->setRecvTimeout(3000);
+    return sock;
+}
+
+bool echo(sylar::SSLSocket::ptr sock, const std::string& msg) {
+    sylar::SocketStream ss(sock, false);
+    if(ss.writeFixSize(msg.c_str(), msg.size()) <= 0) {
+        return false;
+    }
+    std::string rsp(msg.size(), 0);
+    if(ss.readFixSize(&rsp[0], rsp.size()) <= 0) {
+        return false;
+    }
+    return rsp == msg;
+}
+
+/**
+ * @brief 服务端大量写入时客户端重置连接, 服务端发送失败返回而不是被SIGPIPE杀死
+ */
+void test_peer_close() {
+    auto addr = sylar::IPAddress::LookupAny("127.0.0.1:8044");
+    std::shared_ptr<BlastServer> server(new BlastServer(sylar::IOManager::GetThis()));
+    if(!server->loadCertificates(s_cert_file, s_key_file) || !server->bind(addr)) {
+        return;
+    }
+    server->start();
+    sylar::SSLSocket::ptr sock = connect(addr, nullptr);
+    if(!sock) {
+        return;
+    }
+    char buf[16 * 1024];
+    int rt = sock->recv(buf, sizeof(buf));
+    // 先半关闭, 服务端进入CLOSE_WAIT, 之后的RST使服务端写入得到EPIPE
+    ::shutdown(sock->getSocket(), SHUT_WR);
+    usleep(10 * 1000);
+    struct linger lg = {1, 0};
+    sock->setOption(SOL_SOCKET, SO_LINGER, lg);
+    sock->close();
+    uint64_t deadline = sylar::GetCurrentMS() + 3000;
+    while(!server->done && sylar::GetCurrentMS() < deadline) {
+        usleep(10 * 1000);
+    }
+    __LOG_INFO(g_logger) << "peer close recv=" << rt << " server_done=" << server->done;
+    server->stop();
+}
+
+void run() {
+    if(!gen_cert()) {
+        __LOG_ERROR(g_logger) << "gen cert fail";
+        return;
+    }
+    auto addr = sylar::IPAddress::LookupAny("127.0.0.1:8043");
+    sylar::TcpServer::ptr server(new EchoServer(sylar::IOManager::GetThis()));
+    if(!server->loadCertificates(s_cert_file, s_key_file) || !server->bind(addr)) {
+        return;
+    }
+    server->start();
+
+    // 默认上下文校验证书, 不信任自签名证书; 名字不匹配时同样失败
+    sylar::SSLSocket::ptr sock = sylar::SSLSocket::CreateTCP(addr);
+    __ASSERT(!sock->connect(addr, 3000));
+    s_client_ctx = sylar::SSLSocket::CreateClientContext(true, s_cert_file);
+    __ASSERT(s_client_ctx);
+    __ASSERT(!connect(addr, nullptr, "example.com"));
+
+    // 第一次完整握手, 读到回显后session ticket也已到达
+    sock = connect(addr, nullptr);
+    if(!sock) {
+        return;
+    }
+    __LOG_INFO(g_logger) << "full handshake echo=" << echo(sock, "hello") << " " << *sock;
+    std::shared_ptr<SSL_SESSION> session = sock->getSession();
+    sock->close();
+
+    // 用上一次的会话恢复
+    sock = connect(addr, session);
+    if(!sock) {
+        return;
+    }
+    __LOG_INFO(g_logger) << "resumed=" << sock->isSessionReused()
+        << " echo=" << echo(sock, "world") << " " << *sock;
+
+    // sendFile: 有内核TLS时走SSL_sendfile, 否则在用户空间加密
+    std::string data(4 * 1024 * 1024, 0);
+    for(size_t i = 0; i < data.size(); ++i) {
+        data[i] = 'a' + i % 26;
+    }
+    int fd = open(s_data_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || write(fd, &data[0], data.size()) != (ssize_t)data.size()) {
+        __LOG_ERROR(g_logger) << "write " << s_data_file << " fail";
+        return;
+    }
+    // 服务端边收边回显, 回显数据在另一个协程中读取, 避免双方都阻塞在发送上
+    std::string echoed(data.size(), 0);
+    int64_t received = 0;
+    sylar::IOManager::GetThis()->schedule([sock, &echoed, &received](){
+        sylar::SocketStream ss(sock, false);
+        received = ss.readFixSize(&echoed[0], echoed.size());
+    });
+    int64_t sent = sock->sendFile(fd, 0, data.size());
+    close(fd);
+    while(received == 0) {
+        usleep(10 * 1000);
+    }
+    __LOG_INFO(g_logger) << "sendFile ktls_send=" << sock->isKtlsSend()
+        << " sent=" << sent << " received=" << received
+        << " match=" << (echoed == data);
+    sock->close();
+    server->stop();
+
+    test_peer_close();
+    unlink(s_cert_file);
+    unlink(s_key_file);
+    unlink(s_data_file);
+}
+
+int main(int argc, char** argv) {
+    // 同一个SSL对象上的读写协程不能在不同线程中同时执行
+    sylar::IOManager iom(1, true, "main");
+    iom.schedule(run);
+    return 0;
+}
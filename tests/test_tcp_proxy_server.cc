@@ -0,0 +1,97 @@
+#include "../src/tcp_proxy_server.h"
+#include "../src/iomanager.h"
+#include "../src/log.h"
+#include "../src/util.h"
+#include <sys/socket.h>
+sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+/**
+ * @brief 上游服务: 读到EOF为止, 再回复收到的字节数后关闭
+ * @details 只有半关闭被正确转发时客户端才能收到回复
+ */
+class CountServer : public sylar::TcpServer {
+public:
+    CountServer(sylar::IOManager* worker)
+        :sylar::TcpServer(worker) {
+    }
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        std::vector<char> buf(64 * 1024);
+        uint64_t total = 0;
+        while(true) {
+            int rt = client->recv(&buf[0], buf.size());
+            if(rt <= 0) {
+                break;
+            }
+            total += rt;
+        }
+        std::string rsp = std::to_string(total);
+        client->send(rsp.c_str(), rsp.size());
+        client->close();
+    }
+};
+
+void run() {
+    auto upstream_addr = sylar::IPAddress::LookupAny("127.0.0.1:8085");
+    auto proxy_addr = sylar::IPAddress::LookupAny("127.0.0.1:8086");
+    sylar::TcpServer::ptr upstream(new CountServer(sylar::IOManager::GetThis()));
+    sylar::TcpProxyServer::ptr proxy(new sylar::TcpProxyServer);
+    proxy->addUpstream(upstream_addr);
+    if(!upstream->bind(upstream_addr) || !proxy->bind(proxy_addr)) {
+        return;
+    }
+    upstream->start();
+    proxy->start();
+
+    // 经代理发送64MB后半关闭, 等待上游回复字节数
+    const size_t total = 64 * 1024 * 1024;
+    std::string data(64 * 1024, 'x');
+    sylar::Socket::ptr sock = sylar::Socket::CreateTCP(proxy_addr);
+    if(!sock->connect(proxy_addr)) {
+        return;
+    }
+    uint64_t start = sylar::GetCurrentMS();
+    size_t sent = 0;
+    while(sent < total) {
+        int rt = sock->send(&data[0], std::min(data.size(), total - sent));
+        if(rt <= 0) {
+            break;
+        }
+        sent += rt;
+    }
+    ::shutdown(sock->getSocket(), SHUT_WR);
+    char buf[64] = {0};
+    int rt = sock->recv(buf, sizeof(buf) - 1);
+    uint64_t cost = std::max(sylar::GetCurrentMS() - start, (uint64_t)1);
+    __LOG_INFO(g_logger) << "sent=" << sent << " upstream received="
+        << (rt > 0 ? buf : "") << " cost=" << cost << "ms "
+        << sent / 1024 / 1024 * 1000 / cost << "MB/s";
+    rt = sock->recv(buf, sizeof(buf));
+    __LOG_INFO(g_logger) << "after reply recv=" << rt;
+    sock->close();
+
+    // 上游不可用
+    sylar::TcpProxyServer::ptr bad(new sylar::TcpProxyServer);
+    bad->addUpstream(sylar::IPAddress::LookupAny("127.0.0.1:1"));
+    auto bad_addr = sylar::IPAddress::LookupAny("127.0.0.1:8087");
+    if(bad->bind(bad_addr) && bad->start()) {
+        sock = sylar::Socket::CreateTCP(bad_addr);
+        if(sock->connect(bad_addr)) {
+            rt = sock->recv(buf, sizeof(buf));
+            __LOG_INFO(g_logger) << "bad upstream recv=" << rt;
+        }
+        bad->stop();
+    }
+
+    usleep(100 * 1000);
+    __LOG_INFO(g_logger) << "proxy " << proxy->getRelayStats().toString();
+    __LOG_INFO(g_logger) << "bad " << bad->getRelayStats().toString();
+    proxy->stop();
+    upstream->stop();
+}
+
+int main(int argc, char** argv) {
+    sylar::IOManager iom(2, true, "main");
+    iom.schedule(run);
+    return 0;
+}
@@ -1,8 +1,121 @@
 #include "../src/tcp_server.h"
 #include "../src/iomanager.h"
 #include "../src/log.h"
+#include "../src/macro.h"
+#include "../src/util.h"
 sylar::Logger::ptr g_logger = __LOG_ROOT;
 
+/**
+ * @brief 保持连接直到客户端关闭
+ */
+class HoldServer : public sylar::TcpServer {
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        char buf[64];
+        while(client->recv(buf, sizeof(buf)) > 0);
+        client->close();
+    }
+};
+
+/**
+ * @brief 在127.0.0.1的随机端口上启动服务, 返回监听地址
+ */
+sylar::Address::ptr start_server(sylar::TcpServer::ptr server) {
+    if(!server->bind(sylar::IPv4Address::Create("127.0.0.1", 0))) {
+        return nullptr;
+    }
+    server->start();
+    return server->getSocks()[0]->getLocalAddress();
+}
+
+/**
+ * @brief 从指定的本地IP建立count个连接
+ */
+std::vector<sylar::Socket::ptr> connect_from(sylar::Address::ptr addr
+                                , const char* local_ip, int count) {
+    std::vector<sylar::Socket::ptr> socks;
+    for(int i = 0; i < count; ++i) {
+        sylar::Socket::ptr sock = sylar::Socket::CreateTCPSocket();
+        if(!sock->bind(sylar::IPv4Address::Create(local_ip, 0)) || !sock->connect(addr)) {
+            __LOG_ERROR(g_logger) << "connect from " << local_ip << " fail";
+            continue;
+        }
+        socks.push_back(sock);
+    }
+    return socks;
+}
+
+/**
+ * @brief 等待服务处理完count个accept到的连接
+ */
+void wait_accepted(sylar::TcpServer::ptr server, uint64_t count) {
+    uint64_t deadline = sylar::GetCurrentMS() + 2000;
+    while(server->getStats().accepted < count && sylar::GetCurrentMS() < deadline) {
+        usleep(10 * 1000);
+    }
+    // 被拒绝的连接在accept之后才计数
+    usleep(50 * 1000);
+}
+
+void test_admission() {
+    // 最大连接数: 6个连接中2个被拒绝
+    sylar::TcpServer::ptr server(new HoldServer);
+    server->setMaxConnections(4);
+    sylar::Address::ptr addr = start_server(server);
+    __ASSERT(addr);
+    auto socks = connect_from(addr, "127.0.0.1", 6);
+    wait_accepted(server, 6);
+    sylar::TcpServer::Stats stats = server->getStats();
+    __LOG_INFO(g_logger) << "max_connections=4 " << stats.toString();
+    __ASSERT(stats.shedMaxConnections == 2);
+    __ASSERT(stats.active == 4);
+    socks.clear();
+    server->drain(1000);
+
+    // 单IP连接数: 127.0.0.1超出的2个被拒绝, 127.0.0.2单独计数
+    server.reset(new HoldServer);
+    server->setMaxConnectionsPerIp(3);
+    addr = start_server(server);
+    __ASSERT(addr);
+    socks = connect_from(addr, "127.0.0.1", 5);
+    auto others = connect_from(addr, "127.0.0.2", 2);
+    wait_accepted(server, 7);
+    stats = server->getStats();
+    __LOG_INFO(g_logger) << "max_connections_per_ip=3 " << stats.toString();
+    __ASSERT(stats.shedPerIp == 2);
+    __ASSERT(stats.shedMaxConnections == 0);
+    __ASSERT(stats.active == 5);
+    socks.clear();
+    others.clear();
+    server->drain(1000);
+}
+
+void test_idle_reaper() {
+    // 空闲超时1秒: 空闲的连接在超时后一个节拍内被关闭, 持续收发的连接保留
+    sylar::TcpServer::ptr server(new HoldServer);
+    server->setReadTimeout(1000);
+    sylar::Address::ptr addr = start_server(server);
+    __ASSERT(addr);
+    auto idle = connect_from(addr, "127.0.0.1", 1);
+    auto active = connect_from(addr, "127.0.0.1", 1);
+    __ASSERT(idle.size() == 1 && active.size() == 1);
+    for(int i = 0; i < 15; ++i) {
+        __ASSERT(active[0]->send("x", 1) == 1);
+        usleep(200 * 1000);
+    }
+    idle[0]->setRecvTimeout(1000);
+    char buf[16];
+    int rt = idle[0]->recv(buf, sizeof(buf));
+    sylar::TcpServer::Stats stats = server->getStats();
+    __LOG_INFO(g_logger) << "idle reaper idle_recv=" << rt << " " << stats.toString();
+    __ASSERT(rt == 0);
+    __ASSERT(stats.idleClosed == 1);
+    __ASSERT(stats.active == 1);
+    idle.clear();
+    active.clear();
+    server->drain(1000);
+}
+
 void run() {
     auto addr = sylar::IPAddress::LookupAny("0.0.0.0:8083");
     auto addr2 = sylar::UnixAddress::ptr (new sylar::UnixAddress("/tmp/unix_addr"));
@@ -17,11 +130,21 @@ void run() {
         sleep(2);
     }
     tcp_server->start();
+    // kill -TERM 后停止accept, 等待已有连接处理完再退出
+    sylar::IOManager::GetThis()->addSignal(SIGTERM, [tcp_server](int){
+        size_t n = tcp_server->drain();
+        __LOG_INFO(g_logger) << "drained, cancelled=" << n;
+        sylar::IOManager::GetThis()->delSignal(SIGTERM);
+    });
 }
 
 int main(int argc, char** argv) {
     
     sylar::IOManager iom(2);
-    iom.schedule(run);
+    iom.schedule([](){
+        test_admission();
+        test_idle_reaper();
+        run();
+    });
     return 0;
 }
\ No newline at end of file
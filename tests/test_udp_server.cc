@@ -0,0 +1,106 @@
+#include "../src/udp_server.h"
+#include "../src/iomanager.h"
+#include "../src/log.h"
+#include "../src/macro.h"
+#include <string.h>
+sylar::Logger::ptr g_logger = __LOG_ROOT;
+
+/**
+ * @brief 把收到的一批数据报原样批量发回
+ */
+class EchoServer : public sylar::UdpServer {
+public:
+    EchoServer(const std::vector<sylar::IOManager*>& workers)
+        :sylar::UdpServer(workers) {
+    }
+protected:
+    void handleBatch(sylar::Socket::ptr sock, const std::vector<Datagram>& dgrams) override {
+        std::vector<iovec> iovs(dgrams.size());
+        std::vector<mmsghdr> msgs(dgrams.size());
+        memset(&msgs[0], 0, sizeof(mmsghdr) * msgs.size());
+        for(size_t i = 0; i < dgrams.size(); ++i) {
+            iovs[i].iov_base = (void*)dgrams[i].data;
+            iovs[i].iov_len = dgrams[i].length;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = (void*)dgrams[i].from;
+            msgs[i].msg_hdr.msg_namelen = dgrams[i].fromLen;
+        }
+        sock->sendBatch(&msgs[0], msgs.size());
+    }
+};
+
+void run(std::vector<sylar::IOManager*> workers) {
+    auto addr = sylar::IPAddress::LookupAny("127.0.0.1:8084");
+    sylar::UdpServer::ptr server(new EchoServer(workers));
+    server->setGro(true);
+    if(!server->bind(addr)) {
+        return;
+    }
+    server->start();
+
+    // 一次sendSegments发出64个100字节的数据报, 共发送100轮
+    const size_t segment = 100;
+    const size_t count = 64;
+    const size_t rounds = 100;
+    sylar::Socket::ptr client = sylar::Socket::CreateUDP(addr);
+    std::string data(segment * count, 0);
+    for(size_t i = 0; i < data.size(); ++i) {
+        data[i] = 'a' + i / segment % 26;
+    }
+    std::vector<char> buffers(count * segment);
+    std::vector<iovec> iovs(count);
+    std::vector<mmsghdr> msgs(count);
+    size_t received = 0;
+    size_t batches = 0;
+    client->setRecvTimeout(1000);
+    for(size_t r = 0; r < rounds; ++r) {
+        int rt = client->sendSegments(&data[0], data.size(), segment, addr);
+        if(rt != (int)data.size()) {
+            __LOG_ERROR(g_logger) << "sendSegments rt=" << rt << " errno=" << errno;
+            break;
+        }
+        // 每轮收完回显再发下一轮, 避免超出接收缓冲区
+        size_t expect = (r + 1) * count;
+        while(received < expect) {
+            memset(&msgs[0], 0, sizeof(mmsghdr) * msgs.size());
+            for(size_t i = 0; i < count; ++i) {
+                iovs[i].iov_base = &buffers[i * segment];
+                iovs[i].iov_len = segment;
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int n = client->recvBatch(&msgs[0], count);
+            if(n <= 0) {
+                // 某个分片没有回显时不再继续, 由下面的断言报告
+                __LOG_ERROR(g_logger) << "recvBatch rt=" << n << " errno=" << errno
+                    << " round=" << r;
+                break;
+            }
+            for(int i = 0; i < n; ++i) {
+                if(msgs[i].msg_len != segment || buffers[i * segment] != data[(received + i) % count * segment]) {
+                    __LOG_ERROR(g_logger) << "bad echo len=" << msgs[i].msg_len;
+                }
+            }
+            received += n;
+            ++batches;
+        }
+        if(received < expect) {
+            break;
+        }
+    }
+    __LOG_INFO(g_logger) << "sent=" << count * rounds << " echoed=" << received
+        << " client_batches=" << batches;
+    __LOG_INFO(g_logger) << "server " << server->getStats().toString();
+    server->stop();
+    __ASSERT(received == count * rounds);
+}
+
+int main(int argc, char** argv) {
+    // run在iom析构时才执行, worker需要比iom后析构, 否则一部分分片在已停止的worker上接收
+    sylar::IOManager worker(2, false, "worker");
+    sylar::IOManager iom(1, true, "main");
+    std::vector<sylar::IOManager*> workers{&worker, &iom};
+    iom.schedule(std::bind(run, workers));
+    return 0;
+}